@@ -24,17 +24,33 @@
 
 #import <Foundation/Foundation.h>
 
+/* All methods are thread-safe. */
+
 @interface PDFileCatalog : NSObject
 
 - (id)init;
+
+/* Maps the catalog stored in 'path', or imports it if it was written
+   in the older JSON format. Returns nil if the file doesn't exist or
+   can't be parsed. */
+
 - (id)initWithContentsOfFile:(NSString *)path;
 
+/* Replays the journal belonging to the catalog file 'path' (i.e.
+   changes made since it was last written), then records all further
+   changes in the journal as they're made. Once the journal is open,
+   synchronizing to 'path' only needs to flush it, and it's folded
+   back into 'path' in the background when it grows too large. */
+
+- (void)openJournalForFile:(NSString *)path;
+
 - (void)invalidate;
 
 /* Writes the current contents of the catalog to 'path'. If the
    receiver was initialized from the contents of a file, 'path' should
    be the same file (i.e. no data will be written if the receiver
-   believes that it has not changed since being initialized). */
+   believes that it has not changed since being initialized). The
+   file is always written in the binary format. */
 
 - (void)synchronizeWithContentsOfFile:(NSString *)path;
 
@@ -50,6 +66,16 @@
 
 @property(nonatomic, strong, readonly) NSIndexSet *allFileIds;
 
+/* The most recently allocated id. Ids are allocated in increasing
+   order and never reused while the catalog persists. */
+
+@property(nonatomic, readonly) uint32_t lastFileId;
+
+/* The files stored directly under directory 'path' (the empty string
+   for the top level), as a map from file name to id. */
+
+- (NSDictionary *)fileIdsInDirectory:(NSString *)path;
+
 /* Calling these methods is preferred but optional. If files are moved
    around and these methods are not called, new ids will be created for
    files when they are next seen. */
@@ -58,4 +84,8 @@
 - (void)renameFile:(NSString *)oldName to:(NSString *)newName;
 - (void)removeFileWithPath:(NSString *)path;
 
+/* Removes every file under directory 'path'. */
+
+- (void)removeDirectory:(NSString *)path;
+
 @end
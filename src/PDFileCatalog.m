@@ -24,12 +24,138 @@
 
 #import "PDFileCatalog.h"
 
+#import "PDMacros.h"
+
+#import <fcntl.h>
+#import <pthread.h>
+#import <stdatomic.h>
+#import <stdlib.h>
+#import <string.h>
+#import <sys/stat.h>
+#import <unistd.h>
+
+/* Binary catalog format. All fields are native-endian uint32_t.
+
+     struct catalog_header header;
+     uint32_t path_offset[header.count];
+     uint32_t file_id[header.count];
+     char strings[header.string_size];
+
+   Entries are sorted by the UTF-8 bytes of their paths (i.e. strcmp()
+   order), each path_offset[] indexes a NUL-terminated string in the
+   pool. The file is mapped read-only and searched in place, nothing is
+   copied out of it until a path is queried.
+
+   Note that the catalog is only ever read on the machine that wrote
+   it, so there's no attempt at byte-swapping. */
+
+#define CATALOG_MAGIC 0x43464450	/* 'PDFC' */
+#define CATALOG_VERSION 1
+
+struct catalog_header
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t count;
+  uint32_t last_file_id;
+  uint32_t string_size;
+  uint32_t generation;
+};
+
+/* Journal format. A header followed by a sequence of records, each
+   holding up to two NUL-terminated path strings, and a checksum of
+   everything before it. A journal is only replayed if its generation
+   is not older than that of the catalog file, i.e. it was started
+   after the catalog was last written. Replay stops at the first
+   truncated or corrupt record (e.g. after a crash mid-write). */
+
+#define JOURNAL_MAGIC 0x4a464450	/* 'PDFJ' */
+#define JOURNAL_VERSION 1
+
+/* Once the journal grows past this size it's folded into the catalog
+   file in the background. */
+
+#define JOURNAL_COMPACT_SIZE (1024*1024)
+
+struct journal_header
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t generation;
+  uint32_t reserved;
+};
+
+enum journal_op
+{
+  JOURNAL_ADD = 1,
+  JOURNAL_RENAME_FILE,
+  JOURNAL_RENAME_DIRECTORY,
+  JOURNAL_REMOVE,
+  JOURNAL_REMOVE_DIRECTORY,
+};
+
+struct journal_record
+{
+  uint32_t op;
+  uint32_t file_id;
+  uint32_t length[2];
+  /* char string[2][length[i]]; uint32_t checksum; */
+};
+
+struct catalog_entry
+{
+  const char *path;
+  uint32_t file_id;
+};
+
+/* The current state of the catalog is a tree keyed by path component,
+   so that renaming a directory only has to relink its subtree. Nodes
+   may have both a file id and children, zero means no id. */
+
+@interface PDFileCatalogNode : NSObject
+{
+@public
+  NSMutableDictionary *_children;
+  uint32_t _fileId;
+}
+@end
+
+/* Lookups of known paths only take the lock for reading, so scanner
+   threads don't serialize on each other. Anything that modifies the
+   tree or allocates ids takes it for writing. Entries found in the
+   mapped file are marked as seen atomically rather than being moved
+   into the tree, so that doesn't need the write lock either. */
+
 @implementation PDFileCatalog
 {
-  dispatch_queue_t _queue;
-  NSMutableDictionary *_dict[2];
+  pthread_rwlock_t _lock;
+  BOOL _valid;
+
+  /* The mapped contents of the file we were initialized from. Entries
+     are marked dead once they've been moved into the tree, and seen
+     once they've been looked up. */
+
+  NSData *_map;
+  const struct catalog_header *_mapHeader;
+  const uint32_t *_mapOffsets;
+  const uint32_t *_mapIds;
+  const char *_mapStrings;
+  uint8_t *_mapDead;
+  _Atomic(uint8_t) *_mapSeen;
+  uint32_t _mapLive;
+  _Atomic(uint32_t) _mapUnseen;
+
+  PDFileCatalogNode *_root;
+  size_t _treeCount;
   uint32_t _lastFileId;
+  uint32_t _generation;
   BOOL _dirty;
+  BOOL _needsRewrite;
+
+  NSString *_path;
+  int _journalFd;
+  size_t _journalSize;
+  dispatch_group_t _compactGroup;
 }
 
 - (id)init
@@ -37,233 +163,1349 @@
   self = [super init];
   if (self != nil)
     {
-      _queue = dispatch_queue_create("PDFileCatalog", DISPATCH_QUEUE_SERIAL);
-      _dict[1] = [[NSMutableDictionary alloc] init];
+      pthread_rwlock_init(&_lock, NULL);
+      _valid = YES;
+      _root = [[PDFileCatalogNode alloc] init];
+      _journalFd = -1;
+      _compactGroup = dispatch_group_create();
     }
   return self;
 }
 
-- (id)initWithContentsOfFile:(NSString *)path
+static BOOL
+set_catalog_data(PDFileCatalog *self, NSData *data)
 {
-  self = [self init];
-  if (self != nil)
+  size_t size = data.length;
+  if (size < sizeof(struct catalog_header))
+    return NO;
+
+  const struct catalog_header *h = data.bytes;
+
+  if (h->magic != CATALOG_MAGIC || h->version != CATALOG_VERSION
+      || (size - sizeof(*h)) / 8 < h->count
+      || size != sizeof(*h) + (size_t)h->count * 8 + h->string_size
+      || (h->string_size != 0 && ((const char *)h)[size - 1] != 0))
+    return NO;
+
+  const uint32_t *offsets = (const uint32_t *)(h + 1);
+
+  for (uint32_t i = 0; i < h->count; i++)
+    {
+      if (offsets[i] >= h->string_size)
+	return NO;
+    }
+
+  self->_map = data;
+  self->_mapHeader = h;
+  self->_mapOffsets = offsets;
+  self->_mapIds = offsets + h->count;
+  self->_mapStrings = (const char *)(self->_mapIds + h->count);
+  self->_mapDead = calloc((h->count + 7) / 8, 1);
+  self->_mapSeen = calloc((h->count + 7) / 8, 1);
+  self->_mapLive = h->count;
+  atomic_store(&self->_mapUnseen, h->count);
+  self->_lastFileId = h->last_file_id;
+  self->_generation = h->generation;
+
+  return YES;
+}
+
+static void
+clear_catalog_data(PDFileCatalog *self)
+{
+  if (self->_map != nil)
+    {
+      free(self->_mapDead);
+      free((void *)self->_mapSeen);
+      self->_map = nil;
+      self->_mapHeader = NULL;
+      self->_mapOffsets = NULL;
+      self->_mapIds = NULL;
+      self->_mapStrings = NULL;
+      self->_mapDead = NULL;
+      self->_mapSeen = NULL;
+      self->_mapLive = 0;
+      atomic_store(&self->_mapUnseen, 0);
+    }
+}
+
+static inline BOOL
+map_entry_dead(PDFileCatalog *self, uint32_t i)
+{
+  return (self->_mapDead[i >> 3] >> (i & 7)) & 1;
+}
+
+static inline BOOL
+map_entry_seen(PDFileCatalog *self, uint32_t i)
+{
+  return (atomic_load_explicit(&self->_mapSeen[i >> 3],
+			       memory_order_relaxed) >> (i & 7)) & 1;
+}
+
+/* May be called with the lock held only for reading. */
+
+static inline void
+see_map_entry(PDFileCatalog *self, uint32_t i)
+{
+  uint8_t bit = 1 << (i & 7);
+
+  if (!(atomic_fetch_or_explicit(&self->_mapSeen[i >> 3], bit,
+				 memory_order_relaxed) & bit))
+    atomic_fetch_sub_explicit(&self->_mapUnseen, 1, memory_order_relaxed);
+}
+
+static inline void
+kill_map_entry(PDFileCatalog *self, uint32_t i)
+{
+  see_map_entry(self, i);
+  self->_mapDead[i >> 3] |= 1 << (i & 7);
+  self->_mapLive--;
+}
+
+/* Returns the index of the first entry whose path is not less than
+   'str', using the first 'len' bytes of each path. */
+
+static uint32_t
+map_lower_bound(PDFileCatalog *self, const char *str, size_t len)
+{
+  uint32_t lo = 0, hi = self->_mapHeader->count;
+
+  while (lo < hi)
+    {
+      uint32_t mid = lo + (hi - lo) / 2;
+      if (strncmp(self->_mapStrings + self->_mapOffsets[mid], str, len) < 0)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+
+  return lo;
+}
+
+/* Returns the index of the live entry whose path is 'str', or -1. */
+
+static int64_t
+map_find(PDFileCatalog *self, const char *str)
+{
+  if (self->_map == nil || str == NULL)
+    return -1;
+
+  uint32_t i = map_lower_bound(self, str, strlen(str) + 1);
+
+  if (i < self->_mapHeader->count
+      && strcmp(self->_mapStrings + self->_mapOffsets[i], str) == 0
+      && !map_entry_dead(self, i))
+    return i;
+  else
+    return -1;
+}
+
+static inline NSArray *
+path_components(NSString *path)
+{
+  return [path componentsSeparatedByString:@"/"];
+}
+
+/* Returns the node for 'path', creating it and its parents if 'create'
+   is true, otherwise returning nil if it doesn't exist. If 'parents' is
+   non-nil each node from the root down to the parent of the returned
+   node is appended to it. */
+
+static PDFileCatalogNode *
+tree_node(PDFileCatalog *self, NSString *path, BOOL create,
+	  NSMutableArray *parents)
+{
+  PDFileCatalogNode *node = self->_root;
+
+  for (NSString *name in path_components(path))
     {
-      NSData *data = [[NSData alloc] initWithContentsOfFile:path];
-      if (data != nil)
+      PDFileCatalogNode *child = node->_children[name];
+
+      if (child == nil)
 	{
-	  id obj = [NSJSONSerialization JSONObjectWithData:data
-		    options:0 error:nil];
-	  if ([obj isKindOfClass:[NSDictionary class]])
-	    {
-	      _dict[0] = [obj[@"catalog"] mutableCopy];
-	      _lastFileId = [obj[@"lastFileId"] unsignedIntValue];
-	    }
+	  if (!create)
+	    return nil;
+
+	  child = [[PDFileCatalogNode alloc] init];
+	  if (node->_children == nil)
+	    node->_children = [[NSMutableDictionary alloc] init];
+	  node->_children[name] = child;
 	}
+
+      [parents addObject:node];
+      node = child;
     }
-  return self;
+
+  return node;
 }
 
-- (void)invalidate
+/* Removes empty nodes along 'path', given the list of its parents. */
+
+static void
+tree_prune(NSString *path, PDFileCatalogNode *node, NSArray *parents)
 {
-  if (_queue != nil)
+  NSArray *components = path_components(path);
+
+  for (NSInteger i = parents.count - 1; i >= 0; i--)
     {
-      dispatch_sync(_queue, ^{});
-      _queue = nil;
+      if (node->_fileId != 0 || node->_children.count != 0)
+	break;
+
+      PDFileCatalogNode *parent = parents[i];
+      [parent->_children removeObjectForKey:components[i]];
+      node = parent;
     }
+}
 
-  _dict[0] = nil;
-  _dict[1] = nil;
+static inline uint32_t
+tree_get(PDFileCatalog *self, NSString *path)
+{
+  PDFileCatalogNode *node = tree_node(self, path, NO, nil);
+
+  return node != nil ? node->_fileId : 0;
 }
 
-- (void)dealloc
+static void
+tree_set(PDFileCatalog *self, NSString *path, uint32_t fid)
 {
-  [self invalidate];
+  PDFileCatalogNode *node = tree_node(self, path, YES, nil);
+
+  if (node->_fileId == 0)
+    self->_treeCount++;
+
+  node->_fileId = fid;
 }
 
-- (void)synchronizeWithContentsOfFile:(NSString *)path
+/* Removes the id of 'path' from the tree and returns it. */
+
+static uint32_t
+tree_remove(PDFileCatalog *self, NSString *path)
 {
-  if (_queue == nil)
-    return;
+  NSMutableArray *parents = [NSMutableArray array];
+  PDFileCatalogNode *node = tree_node(self, path, NO, parents);
 
-  /* _dirty is only set when files are renamed or new ids are added to
-     _dict[1]. So we also check if _dict[0] is non-empty, in that case
-     the current state is different to what was read from the file
-     system. */
+  if (node == nil || node->_fileId == 0)
+    return 0;
+
+  uint32_t fid = node->_fileId;
+  node->_fileId = 0;
+  self->_treeCount--;
+
+  tree_prune(path, node, parents);
+
+  return fid;
+}
 
-  dispatch_sync(_queue, ^
+/* Moves the children of 'src' into 'dst'. Where both have a child of
+   the same name, the ids from 'src' replace those in 'dst'. */
+
+static void
+tree_merge(PDFileCatalog *self, PDFileCatalogNode *dst,
+	   PDFileCatalogNode *src)
+{
+  if (dst->_children.count == 0)
     {
-      if (_dirty || _dict[0].count != 0)
-	{
-	  NSDictionary *obj = @{
-	    @"catalog": _dict[1],
-	    @"lastFileId": @(_lastFileId)
-	  };
+      dst->_children = src->_children;
+      src->_children = nil;
+      return;
+    }
 
-	  NSData *data = [NSJSONSerialization
-			  dataWithJSONObject:obj options:0 error:nil];
+  for (NSString *name in src->_children)
+    {
+      PDFileCatalogNode *child = src->_children[name];
+      PDFileCatalogNode *existing = dst->_children[name];
 
-	  if ([data writeToFile:path atomically:YES])
+      if (existing == nil)
+	dst->_children[name] = child;
+      else
+	{
+	  if (child->_fileId != 0)
 	    {
-	      _dirty = NO;
-	      _dict[0] = nil;
+	      if (existing->_fileId != 0)
+		self->_treeCount--;
+	      existing->_fileId = child->_fileId;
 	    }
-	  else
-	    [[NSFileManager defaultManager] removeItemAtPath:path error:nil];
+	  tree_merge(self, existing, child);
 	}
-    });
+    }
+
+  src->_children = nil;
 }
 
-- (void)renameDirectory:(NSString *)oldName to:(NSString *)newName
-{
-  if (_queue == NULL)
-    return;
+/* Calls 'block' with the path and id of each file under 'node', whose
+   own path is 'path' (nil for the root node). */
 
-  /* Calling this method is preferred but optional. If directories are
-     renamed without doing so we'd just recreate the caches under the
-     new names and purge the old state after relaunching a couple of
-     times. */
+static void
+tree_foreach(PDFileCatalogNode *node, NSString *path,
+	     void (^block)(NSString *path, uint32_t fid))
+{
+  if (node->_fileId != 0)
+    block(path, node->_fileId);
 
-  dispatch_async(_queue, ^
+  for (NSString *name in node->_children)
     {
-      NSInteger old_len = oldName.length;
+      NSString *child_path = (path != nil
+			      ? [path stringByAppendingFormat:@"/%@", name]
+			      : name);
+      tree_foreach(node->_children[name], child_path, block);
+    }
+}
 
-      for (int pass = 0; pass < 2; pass++)
-	{
-	  NSMutableDictionary *catalog = _dict[pass];
+static void
+tree_add_ids(PDFileCatalogNode *node, NSMutableIndexSet *set)
+{
+  if (node->_fileId != 0)
+    [set addIndex:node->_fileId];
 
-	  /* Cons up the list of known files under the moved directory
-	     (can't modify the dictionary while iterating over its keys). */
+  for (NSString *name in node->_children)
+    tree_add_ids(node->_children[name], set);
+}
 
-	  NSMutableArray *matches = [[NSMutableArray alloc] init];
+static NSDictionary *
+read_json_catalog(NSString *path, uint32_t *last_id_ptr)
+{
+  NSData *data = [[NSData alloc] initWithContentsOfFile:path];
+  if (data == nil)
+    return nil;
 
-	  NSString *oldDir = [oldName stringByAppendingString:@"/"];
+  id obj = [NSJSONSerialization JSONObjectWithData:data options:0 error:nil];
+  if (![obj isKindOfClass:[NSDictionary class]])
+    return nil;
 
-	  for (NSString *key in catalog)
-	    {
-	      if ([key hasPrefix:oldDir])
-		[matches addObject:key];
-	    }
+  NSDictionary *catalog = obj[@"catalog"];
+  if (![catalog isKindOfClass:[NSDictionary class]])
+    return nil;
 
-	  if (matches.count != 0)
-	    {
-	      for (NSString *key in matches)
-		{
-		  NSString *new_key = [newName stringByAppendingPathComponent:
-				       [key substringFromIndex:old_len + 1]];
-		  catalog[new_key] = catalog[key];
-		  [catalog removeObjectForKey:key];
-		}
+  *last_id_ptr = [obj[@"lastFileId"] unsignedIntValue];
+  return catalog;
+}
 
-	      _dirty = YES;
-	    }
-	}
+/* Fills in 'entries' (which must have room for 'dict.count' items)
+   from a dictionary mapping paths to ids, returns the number added.
+   Strings are autoreleased, the caller must hold a pool. */
+
+static size_t
+dict_entries(NSDictionary *dict, struct catalog_entry *entries)
+{
+  size_t count = 0;
+
+  for (NSString *key in dict)
+    {
+      entries[count].path = key.UTF8String;
+      entries[count].file_id = [dict[key] unsignedIntValue];
+      count++;
+    }
+
+  return count;
+}
+
+/* Sorts 'entries' in place and returns the serialized catalog. */
+
+static NSData *
+create_catalog_data(struct catalog_entry *entries, size_t count,
+		    uint32_t last_id, uint32_t generation)
+{
+  qsort_b(entries, count, sizeof(entries[0]),
+	  ^int (const void *a, const void *b)
+    {
+      return strcmp(((const struct catalog_entry *)a)->path,
+		    ((const struct catalog_entry *)b)->path);
     });
+
+  size_t string_size = 0;
+  for (size_t i = 0; i < count; i++)
+    string_size += strlen(entries[i].path) + 1;
+
+  size_t size = sizeof(struct catalog_header) + count * 8 + string_size;
+  NSMutableData *data = [NSMutableData dataWithLength:size];
+
+  struct catalog_header *h = data.mutableBytes;
+  h->magic = CATALOG_MAGIC;
+  h->version = CATALOG_VERSION;
+  h->count = (uint32_t)count;
+  h->last_file_id = last_id;
+  h->string_size = (uint32_t)string_size;
+  h->generation = generation;
+
+  uint32_t *offsets = (uint32_t *)(h + 1);
+  uint32_t *ids = offsets + count;
+  char *strings = (char *)(ids + count);
+
+  size_t offset = 0;
+  for (size_t i = 0; i < count; i++)
+    {
+      size_t len = strlen(entries[i].path) + 1;
+      memcpy(strings + offset, entries[i].path, len);
+      offsets[i] = (uint32_t)offset;
+      ids[i] = entries[i].file_id;
+      offset += len;
+    }
+
+  return data;
 }
 
-- (void)renameFile:(NSString *)oldName to:(NSString *)newName
+/* Serializes the current state. If 'all' is true entries in the
+   mapped file that haven't been queried yet are preserved, otherwise
+   they're dropped. */
+
+static NSData *
+copy_current_data(PDFileCatalog *self, BOOL all, uint32_t generation)
 {
-  if (_queue == NULL)
-    return;
+  size_t count = self->_treeCount + self->_mapLive;
+  struct catalog_entry *entries = malloc(sizeof(entries[0]) * MAX(count, 1));
 
-  dispatch_async(_queue, ^
+  NSData *data;
+
+  @autoreleasepool
     {
-      for (int pass = 0; pass < 2; pass++)
+      __block size_t n = 0;
+
+      tree_foreach(self->_root, nil, ^(NSString *path, uint32_t fid)
 	{
-	  NSMutableDictionary *catalog = _dict[pass];
+	  entries[n].path = path.UTF8String;
+	  entries[n].file_id = fid;
+	  n++;
+	});
 
-	  id value = catalog[oldName];
-	  if (value != nil)
+      if (self->_map != nil)
+	{
+	  for (uint32_t i = 0; i < self->_mapHeader->count; i++)
 	    {
-	      catalog[newName] = value;
-	      [catalog removeObjectForKey:oldName];
+	      if (!map_entry_dead(self, i)
+		  && (all || map_entry_seen(self, i)))
+		{
+		  entries[n].path = self->_mapStrings + self->_mapOffsets[i];
+		  entries[n].file_id = self->_mapIds[i];
+		  n++;
+		}
 	    }
 	}
-    });
+
+      data = create_catalog_data(entries, n, self->_lastFileId, generation);
+    }
+
+  free(entries);
+  return data;
 }
 
-- (void)removeFileWithPath:(NSString *)path
+- (id)initWithContentsOfFile:(NSString *)path
 {
-  if (_queue == NULL)
-    return;
-
-  dispatch_async(_queue, ^
+  self = [self init];
+  if (self != nil)
     {
-      for (int pass = 0; pass < 2; pass++)
+      /* The binary format is preferred, but catalogs written by older
+	 versions of the app are JSON dictionaries. We import those by
+	 treating them as the initial set of unqueried entries. They
+	 will be written out as binary the next time we synchronize. */
+
+      NSData *data = [NSData dataWithContentsOfFile:path
+		      options:NSDataReadingMappedAlways error:nil];
+
+      if (!set_catalog_data(self, data))
 	{
-	  NSMutableDictionary *catalog = _dict[pass];
+	  uint32_t last_id = 0;
+	  NSDictionary *catalog = read_json_catalog(path, &last_id);
+	  if (catalog == nil)
+	    return nil;
 
-	  if (!_dirty && catalog[path] != nil)
-	    _dirty = YES;
+	  struct catalog_entry *entries
+	    = malloc(sizeof(entries[0]) * MAX(catalog.count, 1));
+	  size_t count = dict_entries(catalog, entries);
+	  data = create_catalog_data(entries, count, last_id, 0);
+	  free(entries);
 
-	  [catalog removeObjectForKey:path];
+	  if (!set_catalog_data(self, data))
+	    return nil;
 
-	  /* FIXME: also remove anything in the cache for these ids? */
+	  _dirty = YES;
+	  _needsRewrite = YES;
 	}
-    });
+    }
+  return self;
 }
 
-- (uint32_t)fileIdForPath:(NSString *)path
+/* Sets the id of 'path' in the tree, replacing any entry for it in
+   the mapped file, so it's only written once. */
+
+static void
+catalog_set_file(PDFileCatalog *self, NSString *path, uint32_t fid)
 {
-  if (_queue == NULL)
-    return 0;
+  int64_t i = map_find(self, path.UTF8String);
+  if (i >= 0)
+    kill_map_entry(self, (uint32_t)i);
+
+  tree_set(self, path, fid);
+}
+
+static void
+catalog_add_file(PDFileCatalog *self, NSString *path, uint32_t fid)
+{
+  catalog_set_file(self, path, fid);
+
+  if (self->_lastFileId < fid)
+    self->_lastFileId = fid;
+}
+
+static BOOL
+catalog_rename_directory(PDFileCatalog *self, NSString *oldName,
+			 NSString *newName)
+{
+  BOOL changed = NO;
+
+  NSString *oldDir = [oldName stringByAppendingString:@"/"];
 
-  __block uint32_t fid = 0;
+  if ([oldName isEqualToString:newName] || [newName hasPrefix:oldDir])
+    return NO;
 
-  dispatch_sync(_queue, ^
+  /* Entries in the mapped file that files are about to be moved onto
+     are replaced, as they are in the tree. Those being moved are left
+     for the loop below. */
+
+  if (self->_map != nil)
     {
-      NSNumber *obj = _dict[1][path];
+      NSString *newDir = [newName stringByAppendingString:@"/"];
+      const char *prefix = newDir.UTF8String;
+      size_t prefix_len = strlen(prefix);
+      const char *old_prefix = oldDir.UTF8String;
+      size_t old_prefix_len = strlen(old_prefix);
+
+      for (uint32_t i = map_lower_bound(self, prefix, prefix_len);
+	   i < self->_mapHeader->count; i++)
+	{
+	  const char *str = self->_mapStrings + self->_mapOffsets[i];
+	  if (strncmp(str, prefix, prefix_len) != 0)
+	    break;
+	  if (map_entry_dead(self, i)
+	      || strncmp(str, old_prefix, old_prefix_len) == 0)
+	    continue;
+
+	  NSString *src_path = [oldDir stringByAppendingString:
+				[NSString stringWithUTF8String:
+				 str + prefix_len]];
+	  if (tree_get(self, src_path) != 0
+	      || map_find(self, src_path.UTF8String) >= 0)
+	    kill_map_entry(self, i);
+	}
+    }
 
-      if (obj == nil)
+  /* Move the subtree first, so that entries from the mapped file
+     replace any existing ones, as they would if each file had been
+     renamed individually. */
+
+  NSMutableArray *parents = [NSMutableArray array];
+  PDFileCatalogNode *src = tree_node(self, oldName, NO, parents);
+
+  if (src != nil && src->_children.count != 0)
+    {
+      if (![oldName hasPrefix:[newName stringByAppendingString:@"/"]])
+	{
+	  PDFileCatalogNode *dst = tree_node(self, newName, YES, nil);
+	  tree_merge(self, dst, src);
+	  tree_prune(oldName, src, parents);
+	}
+      else
 	{
-	  obj = _dict[0][path];
+	  /* Moving into an ancestor directory, the subtrees may overlap
+	     so move each file individually. */
+
+	  NSMutableDictionary *moved = [NSMutableDictionary dictionary];
+
+	  for (NSString *name in src->_children)
+	    {
+	      tree_foreach(src->_children[name], name,
+			   ^(NSString *path, uint32_t fid)
+		{
+		  moved[path] = @(fid);
+		});
+	    }
 
-	  /* We place the deserialized dictionary in _dict[0], and the
-	     current dictionary in _dict[1]. We know that all extant
-	     files will have their ids queried at least once when the
-	     library is scanned on startup, so by moving entries from
-	     the old to new dictionaries we effectively remove stale
-	     entries from the current version. */
+	  for (NSString *path in moved)
+	    tree_remove(self, [oldDir stringByAppendingString:path]);
 
-	  if (obj != nil)
+	  for (NSString *path in moved)
 	    {
-	      _dict[1][path] = obj;
-	      [_dict[0] removeObjectForKey:path];
+	      tree_set(self, [newName stringByAppendingFormat:@"/%@", path],
+		       [moved[path] unsignedIntValue]);
 	    }
 	}
 
-      if (obj != nil)
-	fid = [obj unsignedIntValue];
-      else
+      changed = YES;
+    }
+
+  /* Entries in the mapped file sharing the directory prefix are
+     contiguous, so there's no need to look at any others. They're
+     moved into the tree under their new names. */
+
+  if (self->_map != nil)
+    {
+      const char *prefix = oldDir.UTF8String;
+      size_t prefix_len = strlen(prefix);
+
+      for (uint32_t i = map_lower_bound(self, prefix, prefix_len);
+	   i < self->_mapHeader->count; i++)
 	{
-	  fid = ++_lastFileId;
+	  const char *str = self->_mapStrings + self->_mapOffsets[i];
+	  if (strncmp(str, prefix, prefix_len) != 0)
+	    break;
+	  if (map_entry_dead(self, i))
+	    continue;
 
-	  [_dict[1] setObject:@(fid) forKey:path];
-	  _dirty = YES;
+	  NSString *new_key = [newName stringByAppendingFormat:@"/%@",
+			       [NSString stringWithUTF8String:
+				str + prefix_len]];
+	  tree_set(self, new_key, self->_mapIds[i]);
+	  kill_map_entry(self, i);
+	  changed = YES;
 	}
-    });
+    }
 
-  return fid;
+  return changed;
 }
 
-- (NSIndexSet *)allFileIds
+static BOOL
+catalog_rename_file(PDFileCatalog *self, NSString *oldName, NSString *newName)
 {
-  if (_queue == NULL)
-    return nil;
-
-  __block NSIndexSet *ret = nil;
+  uint32_t fid = tree_remove(self, oldName);
 
-  dispatch_sync(_queue, ^
+  if (fid == 0)
     {
-      NSMutableIndexSet *catalog = [NSMutableIndexSet indexSet];
+      int64_t i = map_find(self, oldName.UTF8String);
+      if (i < 0)
+	return NO;
 
-      for (int i = 0; i < 2; i++)
-	for (NSString *key in _dict[i])
-	  [catalog addIndex:[_dict[i][key] unsignedIntValue]];
+      fid = self->_mapIds[i];
+      kill_map_entry(self, (uint32_t)i);
+    }
 
-      ret = catalog;
-    });
+  catalog_set_file(self, newName, fid);
+  return YES;
+}
+
+static BOOL
+catalog_remove_file(PDFileCatalog *self, NSString *path)
+{
+  if (tree_remove(self, path) != 0)
+    return YES;
+
+  int64_t i = map_find(self, path.UTF8String);
+  if (i >= 0)
+    {
+      kill_map_entry(self, (uint32_t)i);
+      return YES;
+    }
 
-  return ret;
+  return NO;
 }
 
+static BOOL
+catalog_remove_directory(PDFileCatalog *self, NSString *path)
+{
+  BOOL changed = NO;
+
+  NSMutableArray *parents = [NSMutableArray array];
+  PDFileCatalogNode *node = tree_node(self, path, NO, parents);
+
+  if (node != nil && node->_children.count != 0)
+    {
+      __block size_t count = 0;
+
+      for (NSString *name in node->_children)
+	{
+	  tree_foreach(node->_children[name], name,
+		       ^(NSString *sub_path, uint32_t fid)
+	    {
+	      count++;
+	    });
+	}
+
+      self->_treeCount -= count;
+      node->_children = nil;
+      tree_prune(path, node, parents);
+
+      changed = YES;
+    }
+
+  if (self->_map != nil)
+    {
+      NSString *dir = [path stringByAppendingString:@"/"];
+      const char *prefix = dir.UTF8String;
+      size_t prefix_len = strlen(prefix);
+
+      for (uint32_t i = map_lower_bound(self, prefix, prefix_len);
+	   i < self->_mapHeader->count; i++)
+	{
+	  const char *str = self->_mapStrings + self->_mapOffsets[i];
+	  if (strncmp(str, prefix, prefix_len) != 0)
+	    break;
+	  if (map_entry_dead(self, i))
+	    continue;
+
+	  kill_map_entry(self, i);
+	  changed = YES;
+	}
+    }
+
+  return changed;
+}
+
+static uint32_t
+journal_checksum(const uint8_t *ptr, size_t len)
+{
+  /* FNV-1a. */
+
+  uint32_t h = 2166136261U;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ ptr[i]) * 16777619U;
+  return h;
+}
+
+static NSString *
+journal_path(NSString *path)
+{
+  return [path stringByAppendingString:@"-journal"];
+}
+
+static NSString *
+old_journal_path(NSString *path)
+{
+  return [path stringByAppendingString:@"-journal.old"];
+}
+
+/* Applies each valid record in the journal at 'path'. Returns the
+   length of the valid prefix of the file, or zero if the journal was
+   ignored. Updates '*generation_ptr' to the latest generation seen. */
+
+static size_t
+replay_journal(PDFileCatalog *self, NSString *path, uint32_t *generation_ptr)
+{
+  NSData *data = [NSData dataWithContentsOfFile:path
+		  options:NSDataReadingMappedIfSafe error:nil];
+  if (data.length < sizeof(struct journal_header))
+    return 0;
+
+  const uint8_t *base = data.bytes;
+  size_t size = data.length;
+
+  const struct journal_header *h = (const void *)base;
+  if (h->magic != JOURNAL_MAGIC || h->version != JOURNAL_VERSION
+      || h->generation < self->_generation)
+    return 0;
+
+  size_t offset = sizeof(*h);
+
+  while (size - offset >= sizeof(struct journal_record))
+    {
+      struct journal_record r;
+      memcpy(&r, base + offset, sizeof(r));
+
+      size_t len = sizeof(r) + (size_t)r.length[0] + r.length[1];
+      if (r.length[0] == 0 || size - offset < len + sizeof(uint32_t))
+	break;
+
+      uint32_t checksum;
+      memcpy(&checksum, base + offset + len, sizeof(checksum));
+      if (checksum != journal_checksum(base + offset, len))
+	break;
+
+      const char *str0 = (const char *)base + offset + sizeof(r);
+      const char *str1 = str0 + r.length[0];
+      if (str0[r.length[0] - 1] != 0
+	  || (r.length[1] != 0 && str1[r.length[1] - 1] != 0))
+	break;
+
+      @autoreleasepool
+	{
+	  NSString *path0 = [NSString stringWithUTF8String:str0];
+	  NSString *path1 = (r.length[1] != 0
+			     ? [NSString stringWithUTF8String:str1] : nil);
+
+	  switch (r.op)
+	    {
+	    case JOURNAL_ADD:
+	      catalog_add_file(self, path0, r.file_id);
+	      break;
+	    case JOURNAL_RENAME_FILE:
+	      if (path1 != nil)
+		catalog_rename_file(self, path0, path1);
+	      break;
+	    case JOURNAL_RENAME_DIRECTORY:
+	      if (path1 != nil)
+		catalog_rename_directory(self, path0, path1);
+	      break;
+	    case JOURNAL_REMOVE:
+	      catalog_remove_file(self, path0);
+	      break;
+	    case JOURNAL_REMOVE_DIRECTORY:
+	      catalog_remove_directory(self, path0);
+	      break;
+	    }
+	}
+
+      offset += len + sizeof(uint32_t);
+    }
+
+  *generation_ptr = MAX(*generation_ptr, h->generation);
+
+  return offset;
+}
+
+/* Starts a new empty journal at 'path' for the current generation,
+   replacing anything already there. */
+
+static BOOL
+create_journal(PDFileCatalog *self, NSString *path)
+{
+  if (self->_journalFd >= 0)
+    close(self->_journalFd);
+
+  self->_journalFd = open(path.fileSystemRepresentation,
+			  O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  self->_journalSize = 0;
+
+  if (self->_journalFd < 0)
+    return NO;
+
+  struct journal_header h = {0};
+  h.magic = JOURNAL_MAGIC;
+  h.version = JOURNAL_VERSION;
+  h.generation = self->_generation;
+
+  if (write(self->_journalFd, &h, sizeof(h)) != sizeof(h))
+    {
+      close(self->_journalFd);
+      self->_journalFd = -1;
+      return NO;
+    }
+
+  self->_journalSize = sizeof(h);
+  return YES;
+}
+
+static void
+compact_journal(PDFileCatalog *self);
+
+static void
+append_journal(PDFileCatalog *self, enum journal_op op, uint32_t fid,
+	       NSString *path0, NSString *path1)
+{
+  if (self->_journalFd < 0)
+    return;
+
+  const char *str0 = path0.UTF8String;
+  const char *str1 = path1 != nil ? path1.UTF8String : NULL;
+
+  struct journal_record r;
+  r.op = op;
+  r.file_id = fid;
+  r.length[0] = (uint32_t)strlen(str0) + 1;
+  r.length[1] = str1 != NULL ? (uint32_t)strlen(str1) + 1 : 0;
+
+  size_t len = sizeof(r) + r.length[0] + r.length[1];
+  uint8_t *buf = STACK_ALLOC(uint8_t, len + sizeof(uint32_t));
+
+  memcpy(buf, &r, sizeof(r));
+  memcpy(buf + sizeof(r), str0, r.length[0]);
+  if (str1 != NULL)
+    memcpy(buf + sizeof(r) + r.length[0], str1, r.length[1]);
+
+  uint32_t checksum = journal_checksum(buf, len);
+  memcpy(buf + len, &checksum, sizeof(checksum));
+
+  /* If the write fails we stop journaling, the next synchronize will
+     rewrite the whole catalog. */
+
+  ssize_t ret = write(self->_journalFd, buf, len + sizeof(uint32_t));
+
+  STACK_FREE(uint8_t, len + sizeof(uint32_t), buf);
+
+  if (ret != (ssize_t)(len + sizeof(uint32_t)))
+    {
+      close(self->_journalFd);
+      self->_journalFd = -1;
+      return;
+    }
+
+  self->_journalSize += ret;
+
+  if (self->_journalSize > JOURNAL_COMPACT_SIZE)
+    compact_journal(self);
+}
+
+/* Folds the journal into the catalog file in the background, called
+   with the lock held for writing. The current state is serialized as
+   the next generation, the journal is moved aside and a new one
+   started, then the file is written. Until that finishes the old
+   journal is still replayed on launch, and isn't moved aside again. */
+
+static void
+compact_journal_1(PDFileCatalog *self)
+{
+  /* Serialize holding only the read lock, so lookups carry on. If the
+     catalog changed before the write lock could be taken, serialize
+     again with it held. */
+
+  pthread_rwlock_rdlock(&self->_lock);
+
+  if (self->_journalFd < 0)
+    {
+      pthread_rwlock_unlock(&self->_lock);
+      return;
+    }
+
+  size_t journal_size = self->_journalSize;
+  uint32_t generation = self->_generation + 1;
+  NSData *data = copy_current_data(self, YES, generation);
+
+  pthread_rwlock_unlock(&self->_lock);
+
+  pthread_rwlock_wrlock(&self->_lock);
+
+  if (self->_journalFd < 0)
+    {
+      pthread_rwlock_unlock(&self->_lock);
+      return;
+    }
+
+  if (self->_journalSize != journal_size
+      || self->_generation + 1 != generation)
+    {
+      generation = self->_generation + 1;
+      data = copy_current_data(self, YES, generation);
+    }
+
+  NSString *path = self->_path;
+  NSString *old_path = old_journal_path(path);
+
+  if (access(old_path.fileSystemRepresentation, F_OK) == 0)
+    {
+      /* The last compaction couldn't write the catalog, so the old
+	 journal is still needed and mustn't be replaced by the current
+	 one. Write the catalog first, with the lock held, and only
+	 start a new journal once it has every record of both. */
+
+      if ([data writeToFile:path atomically:YES])
+	{
+	  self->_generation = generation;
+	  unlink(old_path.fileSystemRepresentation);
+	  create_journal(self, journal_path(path));
+	}
+
+      pthread_rwlock_unlock(&self->_lock);
+      return;
+    }
+
+  close(self->_journalFd);
+  self->_journalFd = -1;
+
+  BOOL ok = NO;
+
+  if (rename(journal_path(path).fileSystemRepresentation,
+	     old_path.fileSystemRepresentation) == 0)
+    {
+      self->_generation = generation;
+      ok = create_journal(self, journal_path(path));
+    }
+
+  pthread_rwlock_unlock(&self->_lock);
+
+  if (ok && [data writeToFile:path atomically:YES])
+    unlink(old_path.fileSystemRepresentation);
+}
+
+static void
+compact_journal(PDFileCatalog *self)
+{
+  if (self->_path == nil)
+    return;
+
+  if (dispatch_group_wait(self->_compactGroup, DISPATCH_TIME_NOW) != 0)
+    return;
+
+  dispatch_queue_t queue
+    = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0);
+
+  dispatch_group_async(self->_compactGroup, queue, ^
+    {
+      @autoreleasepool
+	{
+	  compact_journal_1(self);
+	}
+    });
+}
+
+/* Takes the lock for writing once no compaction is running. As the
+   compaction takes the lock itself it mustn't be waited for with the
+   lock held, and it can only be started with the lock held. */
+
+static void
+lock_when_not_compacting(PDFileCatalog *self)
+{
+  for (;;)
+    {
+      dispatch_group_wait(self->_compactGroup, DISPATCH_TIME_FOREVER);
+
+      pthread_rwlock_wrlock(&self->_lock);
+
+      if (dispatch_group_wait(self->_compactGroup, DISPATCH_TIME_NOW) == 0)
+	return;
+
+      pthread_rwlock_unlock(&self->_lock);
+    }
+}
+
+- (void)openJournalForFile:(NSString *)path
+{
+  pthread_rwlock_wrlock(&_lock);
+
+  if (_valid)
+    {
+      _path = [path copy];
+
+      NSString *old_path = old_journal_path(path);
+      NSString *new_path = journal_path(path);
+
+      uint32_t generation = _generation;
+      size_t old_size = replay_journal(self, old_path, &generation);
+      size_t size = replay_journal(self, new_path, &generation);
+
+      if (old_size != 0 || generation != _generation)
+	{
+	  /* We crashed while compacting. Write out everything we now
+	     know as a new generation so neither journal is needed. */
+
+	  _generation = generation + 1;
+	  NSData *data = copy_current_data(self, YES, _generation);
+
+	  if ([data writeToFile:path atomically:YES])
+	    {
+	      unlink(old_path.fileSystemRepresentation);
+	      create_journal(self, new_path);
+	      _needsRewrite = NO;
+	    }
+
+	  _dirty = YES;
+	}
+      else if (size != 0)
+	{
+	  if (size > sizeof(struct journal_header))
+	    _dirty = YES;
+
+	  /* Discard any partially written record at the end. */
+
+	  _journalFd = open(new_path.fileSystemRepresentation,
+			    O_WRONLY | O_APPEND);
+	  if (_journalFd >= 0 && ftruncate(_journalFd, size) == 0)
+	    _journalSize = size;
+	  else
+	    create_journal(self, new_path);
+	}
+      else
+	create_journal(self, new_path);
+    }
+
+  pthread_rwlock_unlock(&_lock);
+}
+
+- (void)invalidate
+{
+  lock_when_not_compacting(self);
+
+  if (_valid)
+    {
+      _valid = NO;
+
+      if (_journalFd >= 0)
+	{
+	  close(_journalFd);
+	  _journalFd = -1;
+	}
+
+      clear_catalog_data(self);
+      _root = nil;
+    }
+
+  pthread_rwlock_unlock(&_lock);
+}
+
+- (void)dealloc
+{
+  [self invalidate];
+  pthread_rwlock_destroy(&_lock);
+}
+
+- (void)synchronizeWithContentsOfFile:(NSString *)path
+{
+  lock_when_not_compacting(self);
+
+  if (!_valid)
+    {
+      pthread_rwlock_unlock(&_lock);
+      return;
+    }
+
+  /* _dirty is only set when files are renamed or new ids are added to
+     the tree. So we also check if the mapped file still has entries
+     that haven't been seen, in that case the current state is
+     different to what was read from the file system.
+
+     When only _dirty is set and we have a journal for 'path', all
+     changes are already recorded in it and just need to be flushed.
+     Otherwise the whole catalog is written, dropping stale entries,
+     and the journal restarted. */
+
+  uint32_t unseen = atomic_load(&_mapUnseen);
+
+  if (unseen == 0 && !_needsRewrite && _journalFd >= 0
+      && [path isEqualToString:_path])
+    {
+      if (_dirty && fsync(_journalFd) == 0)
+	_dirty = NO;
+    }
+  else if (_dirty || unseen != 0)
+    {
+      uint32_t generation = _generation + 1;
+      NSData *data = copy_current_data(self, NO, generation);
+
+      if ([data writeToFile:path atomically:YES])
+	{
+	  _dirty = NO;
+	  _needsRewrite = NO;
+
+	  /* Everything is now in the file we just wrote, so map that
+	     and start again with an empty tree. */
+
+	  NSData *mapped = [NSData dataWithContentsOfFile:path
+			    options:NSDataReadingMappedAlways error:nil];
+
+	  clear_catalog_data(self);
+	  if (!set_catalog_data(self, mapped))
+	    set_catalog_data(self, data);
+
+	  memset((void *)_mapSeen, 0xff, (_mapHeader->count + 7) / 8);
+	  atomic_store(&_mapUnseen, 0);
+
+	  _root = [[PDFileCatalogNode alloc] init];
+	  _treeCount = 0;
+
+	  if ([path isEqualToString:_path])
+	    create_journal(self, journal_path(path));
+	}
+      else
+	[[NSFileManager defaultManager] removeItemAtPath:path error:nil];
+    }
+
+  pthread_rwlock_unlock(&_lock);
+}
+
+- (void)renameDirectory:(NSString *)oldName to:(NSString *)newName
+{
+  /* Calling this method is preferred but optional. If directories are
+     renamed without doing so we'd just recreate the caches under the
+     new names and purge the old state after relaunching a couple of
+     times. */
+
+  pthread_rwlock_wrlock(&_lock);
+
+  if (_valid && catalog_rename_directory(self, oldName, newName))
+    {
+      append_journal(self, JOURNAL_RENAME_DIRECTORY, 0, oldName, newName);
+      _dirty = YES;
+    }
+
+  pthread_rwlock_unlock(&_lock);
+}
+
+- (void)renameFile:(NSString *)oldName to:(NSString *)newName
+{
+  pthread_rwlock_wrlock(&_lock);
+
+  if (_valid && catalog_rename_file(self, oldName, newName))
+    {
+      append_journal(self, JOURNAL_RENAME_FILE, 0, oldName, newName);
+      _dirty = YES;
+    }
+
+  pthread_rwlock_unlock(&_lock);
+}
+
+- (void)removeFileWithPath:(NSString *)path
+{
+  pthread_rwlock_wrlock(&_lock);
+
+  if (_valid && catalog_remove_file(self, path))
+    {
+      append_journal(self, JOURNAL_REMOVE, 0, path, nil);
+      _dirty = YES;
+    }
+
+  /* FIXME: also remove anything in the cache for these ids? */
+
+  pthread_rwlock_unlock(&_lock);
+}
+
+- (void)removeDirectory:(NSString *)path
+{
+  pthread_rwlock_wrlock(&_lock);
+
+  if (_valid && catalog_remove_directory(self, path))
+    {
+      append_journal(self, JOURNAL_REMOVE_DIRECTORY, 0, path, nil);
+      _dirty = YES;
+    }
+
+  pthread_rwlock_unlock(&_lock);
+}
+
+/* Called with the lock held. Returns the id of 'path' if it's known,
+   otherwise zero. */
+
+static uint32_t
+lookup_file_id(PDFileCatalog *self, NSString *path)
+{
+  uint32_t fid = tree_get(self, path);
+
+  if (fid == 0)
+    {
+      /* The mapped file holds the entries read from disk, the tree
+	 holds changes made since. We know that all extant files will
+	 have their ids queried at least once when the library is
+	 scanned on startup, so by marking entries as seen we know
+	 which are stale when the catalog is next written. */
+
+      int64_t i = map_find(self, path.UTF8String);
+
+      if (i >= 0)
+	{
+	  fid = self->_mapIds[i];
+	  see_map_entry(self, (uint32_t)i);
+	}
+    }
+
+  return fid;
+}
+
+- (uint32_t)fileIdForPath:(NSString *)path
+{
+  uint32_t fid = 0;
+
+  pthread_rwlock_rdlock(&_lock);
+
+  if (_valid)
+    fid = lookup_file_id(self, path);
+
+  pthread_rwlock_unlock(&_lock);
+
+  if (fid == 0)
+    {
+      /* Allocating a new id. Check again once we have exclusive access
+	 in case another thread got there first. */
+
+      pthread_rwlock_wrlock(&_lock);
+
+      if (_valid)
+	{
+	  fid = lookup_file_id(self, path);
+
+	  if (fid == 0)
+	    {
+	      fid = ++_lastFileId;
+
+	      tree_set(self, path, fid);
+	      append_journal(self, JOURNAL_ADD, fid, path, nil);
+	      _dirty = YES;
+	    }
+	}
+
+      pthread_rwlock_unlock(&_lock);
+    }
+
+  return fid;
+}
+
+- (NSIndexSet *)allFileIds
+{
+  NSMutableIndexSet *catalog = nil;
+
+  pthread_rwlock_rdlock(&_lock);
+
+  if (_valid)
+    {
+      catalog = [NSMutableIndexSet indexSet];
+
+      if (_map != nil)
+	{
+	  for (uint32_t i = 0; i < _mapHeader->count; i++)
+	    {
+	      if (!map_entry_dead(self, i))
+		[catalog addIndex:_mapIds[i]];
+	    }
+	}
+
+      tree_add_ids(_root, catalog);
+    }
+
+  pthread_rwlock_unlock(&_lock);
+
+  return catalog;
+}
+
+- (uint32_t)lastFileId
+{
+  pthread_rwlock_rdlock(&_lock);
+  uint32_t fid = _lastFileId;
+  pthread_rwlock_unlock(&_lock);
+
+  return fid;
+}
+
+- (NSDictionary *)fileIdsInDirectory:(NSString *)path
+{
+  NSMutableDictionary *dict = nil;
+
+  pthread_rwlock_rdlock(&_lock);
+
+  if (_valid)
+    {
+      dict = [NSMutableDictionary dictionary];
+
+      if (_map != nil)
+	{
+	  const char *prefix = (path.length != 0
+				? [path stringByAppendingString:@"/"].UTF8String
+				: "");
+	  size_t prefix_len = strlen(prefix);
+
+	  for (uint32_t i = map_lower_bound(self, prefix, prefix_len);
+	       i < _mapHeader->count; i++)
+	    {
+	      const char *str = _mapStrings + _mapOffsets[i];
+	      if (strncmp(str, prefix, prefix_len) != 0)
+		break;
+	      if (map_entry_dead(self, i) || strchr(str + prefix_len, '/'))
+		continue;
+
+	      NSString *name = [NSString stringWithUTF8String:str + prefix_len];
+	      dict[name] = @(_mapIds[i]);
+	    }
+	}
+
+      PDFileCatalogNode *node = (path.length != 0
+				 ? tree_node(self, path, NO, nil) : _root);
+
+      for (NSString *name in node != nil ? node->_children : nil)
+	{
+	  PDFileCatalogNode *child = node->_children[name];
+	  if (child->_fileId != 0)
+	    dict[name] = @(child->_fileId);
+	}
+    }
+
+  pthread_rwlock_unlock(&_lock);
+
+  return dict;
+}
+
+@end
+
+@implementation PDFileCatalogNode
 @end
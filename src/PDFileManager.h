@@ -63,6 +63,14 @@
 
 - (void)unmount;
 
+/* Start or stop watching for changes made outside the app. While
+   watching, the delegate is sent the PDFileManagerDelegate change
+   messages on the main thread. Returns NO if changes can't be
+   observed. */
+
+- (BOOL)startWatchingForChanges;
+- (void)stopWatchingForChanges;
+
 /* Constructs an absolute URL referencing the named file. This operation
    may fail, e.g. when direct file access is not supported. */
 
@@ -78,9 +86,21 @@
 /* Operations for reading file content. */
 
 - (NSData *)contentsOfFileAtPath:(NSString *)path;
+
+/* Returns up to range.length bytes starting at range.location (fewer
+   at the end of the file), or nil on error. */
+
+- (NSData *)contentsOfFileAtPath:(NSString *)path range:(NSRange)range;
 - (NSArray *)contentsOfDirectoryAtPath:(NSString *)path;
 - (CGImageSourceRef)copyImageSourceAtPath:(NSString *)path;
 
+/* Calls 'block' for each entry in directory 'path' (excluding "." and
+   ".."), saying whether it's a directory. Subclasses should override
+   this to avoid looking up each entry separately if possible. */
+
+- (void)foreachFileInDirectory:(NSString *)path
+    handler:(void (^)(NSString *file_name, BOOL is_dir))block;
+
 /* Operations for writing file content. */
 
 - (BOOL)writeData:(NSData *)data toFile:(NSString *)path
@@ -102,6 +122,25 @@
 @protocol PDFileManagerDelegate <NSObject>
 @optional
 
-/* FIXME add methods here. E.g. mount/unmount notifications? */
+/* Sent while watching for changes. Paths are relative to the root of
+   the file manager. Events arriving together are coalesced, so e.g. a
+   file created then deleted produces nothing, and each item is
+   reported at most once per batch. */
+
+- (void)fileManager:(PDFileManager *)manager
+    didRenameItemAtPath:(NSString *)oldPath toPath:(NSString *)newPath
+    isDirectory:(BOOL)flag;
+- (void)fileManager:(PDFileManager *)manager
+    didCreateItemAtPath:(NSString *)path isDirectory:(BOOL)flag;
+- (void)fileManager:(PDFileManager *)manager
+    didRemoveItemAtPath:(NSString *)path isDirectory:(BOOL)flag;
+
+/* Sent when changes under 'path' couldn't be tracked individually, its
+   contents (recursively) should be rescanned. */
+
+- (void)fileManager:(PDFileManager *)manager
+    directoryNeedsRescanAtPath:(NSString *)path;
+
+/* FIXME add more methods here. E.g. mount/unmount notifications? */
 
 @end
@@ -93,6 +93,15 @@
 {
 }
 
+- (BOOL)startWatchingForChanges
+{
+  return NO;
+}
+
+- (void)stopWatchingForChanges
+{
+}
+
 - (NSURL *)fileURLWithPath:(NSString *)path
 {
   return nil;
@@ -123,6 +132,18 @@
   return nil;
 }
 
+- (NSData *)contentsOfFileAtPath:(NSString *)path range:(NSRange)range
+{
+  NSData *data = [self contentsOfFileAtPath:path];
+  if (data == nil)
+    return nil;
+
+  NSUInteger start = MIN(range.location, data.length);
+  NSUInteger end = MIN(NSMaxRange(range), data.length);
+
+  return [data subdataWithRange:NSMakeRange(start, end - start)];
+}
+
 - (NSArray *)contentsOfDirectoryAtPath:(NSString *)path
 {
   return nil;
@@ -133,6 +154,20 @@
   return NULL;
 }
 
+- (void)foreachFileInDirectory:(NSString *)path
+    handler:(void (^)(NSString *file_name, BOOL is_dir))block
+{
+  for (NSString *file in [self contentsOfDirectoryAtPath:path])
+    {
+      BOOL is_dir = NO;
+      NSString *path_file = [path stringByAppendingPathComponent:file];
+      if (![self fileExistsAtPath:path_file isDirectory:&is_dir])
+	continue;
+
+      block(file, is_dir);
+    }
+}
+
 static BOOL
 unsupported_operation(PDFileManager *self, SEL sel, NSError **err)
 {
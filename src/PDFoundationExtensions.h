@@ -46,4 +46,10 @@
 
 - (NSString *)stringByRemovingPathPrefix:(NSString *)path;
 
+/* Returns the single immutable copy of the receiver's value kept in a
+   global (never emptied) table, so that values repeated across many
+   images share storage. Thread-safe. */
+
+- (NSString *)internedString;
+
 @end
@@ -30,6 +30,8 @@
 
 #import "PDMacros.h"
 
+#import <pthread.h>
+
 @implementation NSObject (PDFoundationExtensions)
 
 - (void)performVoidSelector:(SEL)sel withObject:(id)arg
@@ -122,4 +124,28 @@
 	    ? [self substringFromIndex:l2+1] : self);
 }
 
+- (NSString *)internedString
+{
+  static NSMutableSet *table;
+  static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+  pthread_mutex_lock(&lock);
+
+  if (table == nil)
+    table = [[NSMutableSet alloc] init];
+
+  NSString *str = [table member:self];
+
+  if (str == nil)
+    {
+      str = [self copy];
+      [table addObject:str];
+      [str release];
+    }
+
+  pthread_mutex_unlock(&lock);
+
+  return str;
+}
+
 @end
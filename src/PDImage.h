@@ -30,7 +30,7 @@ extern const CFStringRef PDTypePhodMetadata;	/* org.unfactored.phod-metadata */
 extern NSString *const PDImagePropertyDidChange;
 
 @protocol PDImageHost;
-@class PDImageLibrary;
+@class PDImageLibrary, PDImagePyramid;
 
 enum PDImageCompareKey
 {
@@ -58,6 +58,24 @@ typedef int PDImageCompareKey;
 + (void)callWithImageComparator:(PDImageCompareKey)key
     reversed:(BOOL)flag block:(void (^)(NSComparator))block;
 
+/* Image properties may be read off the main thread between these
+   calls, e.g. while filtering an image list concurrently, including
+   by work the calling thread waits for. The main thread doesn't
+   modify any image's properties meanwhile, it waits until every
+   reader has finished. Calls mustn't nest, and do nothing on the main
+   thread. */
+
++ (void)beginReadingProperties;
++ (void)endReadingProperties;
+
+/* Returns 'images' in the order given by the comparator above. Each
+   image's sort key is read once, rather than per comparison, and the
+   sort is stable. Keys are read concurrently, so 'images' mustn't
+   contain duplicates. */
+
++ (NSArray *)sortedImages:(NSArray *)images
+    usingKey:(PDImageCompareKey)key reversed:(BOOL)flag;
+
 + (NSString *)imageCompareKeyString:(PDImageCompareKey)key;
 + (PDImageCompareKey)imageCompareKeyFromString:(NSString *)str;
 
@@ -81,6 +99,14 @@ typedef int PDImageCompareKey;
 - (id)objectForKeyedSubscript:(NSString *)key;
 - (void)setObject:(id)obj forKeyedSubscript:(NSString *)key;
 
+/* Equivalent to [self[key] doubleValue] (i.e. zero when unset), but
+   avoids boxing when 'key' is in the property cache record. 'idx' is
+   from +[PDPropertyCache recordIndexOfKey:]. For evaluating filters
+   over the whole library. */
+
+- (double)numericImagePropertyForKey:(NSString *)key
+    recordIndex:(NSInteger)idx;
+
 + (BOOL)imagePropertyIsEditableInUI:(NSString *)key;
 
 /* Converting image properties to displayable forms. */
@@ -163,6 +189,12 @@ typedef int PDImageCompareKey;
 - (void)removeImageHost:(id<PDImageHost>)obj;
 - (void)updateImageHost:(id<PDImageHost>)obj;
 
+/* Tiles of the active image file, for displaying parts of it at large
+   sizes. Only valid while the image has a host, which keeps the tiles
+   from being evicted from the cache; released with the last host. */
+
+@property(nonatomic, strong, readonly) PDImagePyramid *pyramid;
+
 @end
 
 @protocol PDImageHost <NSObject>
@@ -245,6 +277,7 @@ extern NSString * const PDImage_FilePath;	// NSString
 extern NSString * const PDImage_FileDate;	// NSNumber
 extern NSString * const PDImage_FileSize;	// NSNumber
 extern NSString * const PDImage_Rejected;	// NSNumber<bool>
+extern NSString * const PDImage_Words;		// NSArray<NSString>
 
 /* Hosted image options. */
 
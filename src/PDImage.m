@@ -26,14 +26,22 @@
 
 #import "PDAppDelegate.h"
 #import "PDFoundationExtensions.h"
+#import "PDImageHeader.h"
 #import "PDImageLibrary.h"
 #import "PDImageProperty.h"
+#import "PDImagePyramid.h"
+#import "PDImageScale.h"
 #import "PDImageUUID.h"
+#import "PDMacros.h"
+#import "PDPropertyCache.h"
+#import "PDTextIndex.h"
 #import "PDWindowController.h"
 
 #import <QuartzCore/CATransaction.h>
 
-#import <sys/stat.h>
+#import <pthread.h>
+#import <stdlib.h>
+#import <string.h>
 
 #define METADATA_EXTENSION "phod"
 
@@ -58,6 +66,11 @@ enum
 
 @interface PDImage ()
 - (void)loadImageProperties;
+- (void)loadCachedProperties;
+- (void)faultImageProperties;
+- (NSArray *)indexedWords;
+- (void)assignUUID:(NSUUID *)uuid;
++ (void)dropImageProperties;
 @end
 
 const CFStringRef PDTypeRAWImage = CFSTR("public.camera-raw-image");
@@ -70,51 +83,26 @@ NSString * const PDImageHost_Thumbnail = @"Thumbnail";
 NSString * const PDImageHost_ColorSpace = @"ColorSpace";
 NSString * const PDImageHost_NoPreview = @"NoPreview";
 
-static time_t
-file_mtime(NSString *path)
+static NSData *
+copy_image_data(CGImageRef im, double quality)
 {
-  struct stat st;
+  NSMutableData *data = [NSMutableData data];
 
-  if (stat([path fileSystemRepresentation], &st) == 0)
-    return st.st_mtime;
-  else
-    return 0;
-}
-
-static CGImageSourceRef
-create_image_source_from_path(NSString *path)
-{
-  NSURL *url = [NSURL fileURLWithPath:path];
-  return CGImageSourceCreateWithURL((__bridge CFURLRef)url, NULL);
-}
+  CGImageDestinationRef dest = CGImageDestinationCreateWithData(
+    (__bridge CFMutableDataRef)data, kUTTypeJPEG, 1, NULL);
 
-static void
-write_image_to_path(CGImageRef im, NSString *path, double quality)
-{
-  NSFileManager *fm = [NSFileManager defaultManager];
-  NSString *dir = [path stringByDeletingLastPathComponent];
-
-  if (![fm fileExistsAtPath:dir])
-    {
-      if (![fm createDirectoryAtPath:dir withIntermediateDirectories:YES
-	    attributes:nil error:nil])
-	return;
-    }
+  if (dest == NULL)
+    return nil;
 
-  NSURL *url = [NSURL fileURLWithPath:path];
-  CGImageDestinationRef dest = CGImageDestinationCreateWithURL(
-    (__bridge CFURLRef)url, kUTTypeJPEG, 1, NULL);
+  NSDictionary *opts = @{
+    (__bridge id)kCGImageDestinationLossyCompressionQuality: @(quality)
+  };
 
-  if (dest != NULL)
-    {
-      NSDictionary *opts = @{
-	(__bridge id)kCGImageDestinationLossyCompressionQuality: @(quality)
-      };
+  CGImageDestinationAddImage(dest, im, (CFDictionaryRef)opts);
+  BOOL ok = CGImageDestinationFinalize(dest);
+  CFRelease(dest);
 
-      CGImageDestinationAddImage(dest, im, (CFDictionaryRef)opts);
-      CGImageDestinationFinalize(dest);
-      CFRelease(dest);
-    }
+  return ok ? data : nil;
 }
 
 static CGImageRef
@@ -172,6 +160,12 @@ copy_scaled_image(CGImageRef src_im, CGSize size, CGColorSpaceRef space)
   if (src_im == NULL)
     return NULL;
 
+  /* Resample in linear light where possible (see NOTES item 15). */
+
+  CGImageRef linear_im = PDImageCreateScaledImage(src_im, size, space);
+  if (linear_im != NULL)
+    return linear_im;
+
   CGColorSpaceRef srgb = NULL;
 
   if (space == NULL)
@@ -204,18 +198,54 @@ copy_scaled_image(CGImageRef src_im, CGSize size, CGColorSpaceRef space)
   return im;
 }
 
+/* Decodes the first image of 'src', whose longest side is 'pix_size'
+   pixels (zero if unknown), asking the decoder to reduce it by the
+   largest factor of 2, 4 or 8 that leaves its longest side at least
+   'min_size' pixels. JPEG decoders do this in the DCT domain, which is
+   much cheaper than decoding the full image and scaling it afterwards.
+   Decoders that can't subsample return the full image. The size is
+   passed in as asking ImageIO for it extracts all the properties. */
+
+static CGImageRef
+create_subsampled_image(CGImageSourceRef src, size_t pix_size,
+			size_t min_size)
+{
+  int factor = 1;
+
+  while (factor < 8 && pix_size / (factor * 2) >= min_size)
+    factor *= 2;
+
+  if (factor == 1)
+    return CGImageSourceCreateImageAtIndex(src, 0, NULL);
+
+  NSDictionary *opts = @{
+    (__bridge id)kCGImageSourceSubsampleFactor: @(factor)
+  };
+
+  return CGImageSourceCreateImageAtIndex(src, 0, (CFDictionaryRef)opts);
+}
+
 static NSString *
-cache_path_for_type(PDImageLibrary *lib, uint32_t file_id, NSInteger type)
+cache_base_for_type(NSInteger type)
 {
-  NSString *name;
   if (type == PDImage_Tiny)
-    name = @"t.jpg";
+    return @"t.jpg";
   else if (type == PDImage_Small)
-    name = @"s.jpg";
+    return @"s.jpg";
   else /* if (type == PDImage_Medium) */
-    name = @"m.jpg";
+    return @"m.jpg";
+}
 
-  return [lib cachePathForFileId:file_id base:name];
+static CGImageSourceRef
+create_cached_image_source(PDImageLibrary *lib, uint32_t file_id,
+			   NSInteger type, time_t mtime)
+{
+  NSData *data = [lib cachedDataForFileId:file_id
+		  base:cache_base_for_type(type) newerThan:mtime];
+  if (data == nil)
+    return NULL;
+
+  return CGImageSourceCreateWithData((__bridge CFDataRef)data, NULL);
 }
 
 @implementation PDImage
@@ -229,14 +259,26 @@ cache_path_for_type(PDImageLibrary *lib, uint32_t file_id, NSInteger type)
   NSMutableDictionary *_properties;
   NSDictionary *_implicitProperties;	/* from the image file(s) */
 
-  NSMapTable *_imageHosts;
+  /* Sort and filter keys from the library's property cache. Valid
+     when _hasRecord is set, used instead of _implicitProperties so
+     that idle images don't keep a dictionary each. */
+
+  PDPropertyCacheRecord _record;
+  NSArray *_keywords;
+
+  NSMapTable *_imageHosts;		/* created on demand */
+  uint32_t _pinnedFileId;		/* while _imageHosts is non-empty */
+  uint32_t _fileId;			/* zero until needed */
 
-  BOOL _donePrefetch;
   NSOperation *_prefetchOp;
+  PDImagePyramid *_pyramid;		/* while _imageHosts is non-empty */
 
   int _rating;
+  BOOL _hasRecord;
+  BOOL _donePrefetch;
   BOOL _deleted;
   BOOL _hidden;
+  BOOL _flagged;
   BOOL _removed;
 }
 
@@ -344,6 +386,21 @@ file_conforming_to(NSDictionary *file_types, CFStringRef type)
   return nil;
 }
 
+/* Returns a copy of 'file_types' whose keys are the interned type
+   identifiers, most of the library shares the same few. */
+
+static NSDictionary *
+intern_file_types(NSDictionary *file_types)
+{
+  NSMutableDictionary *dict
+    = [NSMutableDictionary dictionaryWithCapacity:file_types.count];
+
+  for (NSString *type in file_types)
+    dict[[type internedString]] = file_types[type];
+
+  return [dict copy];
+}
+
 /* Originally I did the usual thing and deferred all I/O until it's
    actually needed to implement a method. But that tends to lead to
    non-deterministic blocking later. It's better to do all I/O up front
@@ -361,6 +418,9 @@ file_conforming_to(NSDictionary *file_types, CFStringRef type)
   if (file_types.count == 0)
     return nil;
 
+  file_types = intern_file_types(file_types);
+  _properties[PDImage_FileTypes] = file_types;
+
   if (active_type == nil || file_types[active_type] == nil)
     {
       active_type = file_type_conforming_to(file_types, kUTTypeImage);
@@ -369,6 +429,8 @@ file_conforming_to(NSDictionary *file_types, CFStringRef type)
       else
 	return nil;
     }
+  else
+    _properties[PDImage_ActiveType] = [active_type internedString];
 
   NSString *uuid_str = _properties[PDImage_UUID];
   if (uuid_str != nil)
@@ -376,6 +438,7 @@ file_conforming_to(NSDictionary *file_types, CFStringRef type)
 
   _deleted = [_properties[PDImage_Deleted] boolValue];
   _hidden = [_properties[PDImage_Hidden] boolValue];
+  _flagged = [_properties[PDImage_Flagged] boolValue];
   _rating = [_properties[PDImage_Rating] intValue];
 
   if ([_properties[PDImage_Name] length] == 0)
@@ -390,9 +453,11 @@ file_conforming_to(NSDictionary *file_types, CFStringRef type)
 	_properties[PDImage_Name] = name;
     }
 
-  [self loadImageProperties];
+  [self loadCachedProperties];
 
-  _imageHosts = [NSMapTable strongToStrongObjectsMapTable];
+  uint32_t file_id = self.imageFileId;
+  if (![_library hasIndexedWordsForFileId:file_id])
+    [_library setIndexedWords:[self indexedWords] forFileId:file_id];
 
   return self;
 }
@@ -452,6 +517,9 @@ file_conforming_to(NSDictionary *file_types, CFStringRef type)
 - (void)dealloc
 {
   [_prefetchOp cancel];
+
+  if (_imageHosts.count != 0)
+    [_library unpinCachedDataForFileId:_pinnedFileId];
 }
 
 - (NSString *)description
@@ -481,10 +549,7 @@ file_conforming_to(NSDictionary *file_types, CFStringRef type)
 	    /* We're writing the file, it may as well have a UUID.. */
 
 	    if (_uuid == nil)
-	      {
-		_uuid = [[NSUUID alloc] init];
-		[_properties setObject:_uuid.UUIDString forKey:PDImage_UUID];
-	      }
+	      [self assignUUID:[NSUUID UUID]];
 
 	    dict[@"Properties"] =
 	      [NSDictionary dictionaryWithDictionary:_properties];
@@ -523,19 +588,163 @@ file_conforming_to(NSDictionary *file_types, CFStringRef type)
 
 - (uint32_t)imageFileId
 {
-  return [_library uniqueIdOfFile:self.imageLibraryPath];
+  /* Cached as filters over the whole library need it for every image,
+     cleared when the image's path changes. */
+
+  if (_fileId == 0)
+    _fileId = [_library uniqueIdOfFile:self.imageLibraryPath];
+
+  return _fileId;
+}
+
+/* The words of the image's text for the library's text index. Only
+   uses the implicit properties if they're already loaded. */
+
+- (NSArray *)indexedWords
+{
+  NSMutableOrderedSet *words = [NSMutableOrderedSet orderedSet];
+
+  [words addObjectsFromArray:[PDTextIndex wordsOfString:self.imageFile]];
+
+  for (NSString *key in @[PDImage_Name, PDImage_Title, PDImage_Caption])
+    {
+      id value = _properties[key];
+      if (value == nil)
+	value = _implicitProperties[key];
+      if ([value isKindOfClass:[NSString class]])
+	[words addObjectsFromArray:[PDTextIndex wordsOfString:value]];
+    }
+
+  id keywords = _properties[PDImage_Keywords];
+  if (keywords == nil)
+    {
+      keywords = (_implicitProperties != nil
+		  ? _implicitProperties[PDImage_Keywords] : _keywords);
+    }
+
+  if ([keywords isKindOfClass:[NSArray class]])
+    {
+      for (id str in keywords)
+	{
+	  if ([str isKindOfClass:[NSString class]])
+	    [words addObjectsFromArray:[PDTextIndex wordsOfString:str]];
+	}
+    }
+
+  return words.array;
+}
+
+/* Held for reading by threads reading image properties between
+   +beginReadingProperties and +endReadingProperties, and for writing
+   while the main thread modifies an image's property state, including
+   filling it in lazily. Readers never write the state of an image
+   another reader may be using. */
+
+static pthread_rwlock_t _propertiesLock = PTHREAD_RWLOCK_INITIALIZER;
+
+static inline void
+lock_properties(void)
+{
+  if ([NSThread isMainThread])
+    pthread_rwlock_wrlock(&_propertiesLock);
+}
+
+static inline void
+unlock_properties(void)
+{
+  if ([NSThread isMainThread])
+    pthread_rwlock_unlock(&_propertiesLock);
+}
+
++ (void)beginReadingProperties
+{
+  if (![NSThread isMainThread])
+    pthread_rwlock_rdlock(&_propertiesLock);
+}
+
++ (void)endReadingProperties
+{
+  if (![NSThread isMainThread])
+    pthread_rwlock_unlock(&_propertiesLock);
+}
+
+/* Images whose _implicitProperties have been faulted in. Accessed
+   under _faultedLock, the dictionaries are dropped again when the
+   system reports memory pressure. */
+
+static NSHashTable *_faultedImages;
+static pthread_mutex_t _faultedLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+note_faulted_image(PDImage *image)
+{
+  static dispatch_source_t source;
+  static dispatch_once_t once;
+
+  dispatch_once(&once, ^
+    {
+      _faultedImages = [NSHashTable weakObjectsHashTable];
+
+      source = dispatch_source_create(DISPATCH_SOURCE_TYPE_MEMORYPRESSURE,
+				      0, DISPATCH_MEMORYPRESSURE_WARN
+				      | DISPATCH_MEMORYPRESSURE_CRITICAL,
+				      dispatch_get_main_queue());
+      dispatch_source_set_event_handler(source, ^
+	{
+	  [PDImage dropImageProperties];
+	});
+      dispatch_resume(source);
+    });
+
+  pthread_mutex_lock(&_faultedLock);
+  [_faultedImages addObject:image];
+  pthread_mutex_unlock(&_faultedLock);
+}
+
+/* Keys that are only ever explicit properties or specially coded
+   below. Looking these up mustn't fault in the implicit properties,
+   they can never be there. */
+
+static BOOL
+implicit_key_p(NSString *key)
+{
+  static NSSet *keys;
+  static dispatch_once_t once;
+
+  dispatch_once(&once, ^
+    {
+      keys = [NSSet setWithObjects:PDImage_Flagged, PDImage_Hidden,
+	      PDImage_Deleted, PDImage_Date, PDImage_Words,
+	      PDImage_FileName, PDImage_FilePath, PDImage_FileDate,
+	      PDImage_FileSize, PDImage_Rejected, nil];
+    });
+
+  return ![keys containsObject:key];
 }
 
 - (id)imagePropertyForKey:(NSString *)key
 {
   id value = _properties[key];
 
-  if (value == nil)
+  if (value == nil && implicit_key_p(key))
     {
-      if (_implicitProperties == nil)
-	[self loadImageProperties];
+      /* Avoid loading the full set of implicit properties when the
+	 library's property cache has the value. */
+
+      if (_implicitProperties == nil && _hasRecord
+	  && [PDPropertyCache canStoreKey:key])
+	{
+	  if ([key isEqualToString:PDImage_Keywords])
+	    value = _keywords;
+	  else
+	    value = [PDPropertyCache valueForKey:key inRecord:&_record];
+	}
+      else
+	{
+	  [self faultImageProperties];
 
-      value = _implicitProperties[key];
+	  value = _implicitProperties[key];
+	}
     }
 
   if (value == nil)
@@ -546,6 +755,10 @@ file_conforming_to(NSDictionary *file_types, CFStringRef type)
 	{
 	  value = @([self.date timeIntervalSince1970]);
 	}
+      else if ([key isEqualToString:PDImage_Words])
+	{
+	  value = [self indexedWords];
+	}
       else if ([key isEqualToString:PDImage_FileName])
 	{
 	  value = self.imageFile;
@@ -576,6 +789,32 @@ file_conforming_to(NSDictionary *file_types, CFStringRef type)
   return value;
 }
 
+- (double)numericImagePropertyForKey:(NSString *)key
+    recordIndex:(NSInteger)idx
+{
+  /* Same lookup order as -imagePropertyForKey:. */
+
+  if (idx >= 0 && _hasRecord && _implicitProperties == nil)
+    {
+      id value = _properties[key];
+
+      if (value == nil)
+	{
+	  double d;
+	  if ([PDPropertyCache getNumber:&d atIndex:idx inRecord:&_record])
+	    return d;
+	  else
+	    return 0;
+	}
+      else if ([value isKindOfClass:[NSNumber class]])
+	return [value doubleValue];
+      else
+	return 0;
+    }
+
+  return [self[key] doubleValue];
+}
+
 - (void)setImageProperty:(id)value forKey:(NSString *)key
 {
   if (value == nil)
@@ -585,14 +824,18 @@ file_conforming_to(NSDictionary *file_types, CFStringRef type)
 
   if (![oldValue isEqual:value])
     {
-      _properties[key] = value;
+      BOOL file_changed = NO, text_changed = NO;
 
-      [self writeJSONFile];
+      lock_properties();
+
+      _properties[key] = value;
 
       if ([key isEqualToString:PDImage_Deleted])
 	_deleted = [value boolValue];
       else if ([key isEqualToString:PDImage_Hidden])
 	_hidden = [value boolValue];
+      else if ([key isEqualToString:PDImage_Flagged])
+	_flagged = [value boolValue];
       else if ([key isEqualToString:PDImage_Rating])
 	_rating = [value intValue];
       else if (([key isEqualToString:PDImage_OriginalDate]
@@ -602,6 +845,36 @@ file_conforming_to(NSDictionary *file_types, CFStringRef type)
 	       || [key isEqualToString:PDImage_FileTypes])
 	{
 	  _implicitProperties = nil;
+	  _keywords = nil;
+	  _hasRecord = NO;
+	  _fileId = 0;
+	  file_changed = YES;
+	}
+      else if ([key isEqualToString:PDImage_Name]
+	       || [key isEqualToString:PDImage_Title]
+	       || [key isEqualToString:PDImage_Caption]
+	       || [key isEqualToString:PDImage_Keywords])
+	{
+	  text_changed = YES;
+	}
+      else if ([key isEqualToString:PDImage_UUID])
+	{
+	  _uuid = nil;
+	  if (value != nil)
+	    _uuid = [[NSUUID alloc] initWithUUIDString:value];
+	}
+
+      unlock_properties();
+
+      [self writeJSONFile];
+
+      if (file_changed)
+	{
+	  /* The new file's entry may be left from when it was last
+	     active, with different text. */
+
+	  [_library setIndexedWords:[self indexedWords]
+	   forFileId:self.imageFileId];
 
 	  if (_donePrefetch)
 	    {
@@ -610,11 +883,15 @@ file_conforming_to(NSDictionary *file_types, CFStringRef type)
 	      _donePrefetch = NO;
 	    }
 	}
-      else if ([key isEqualToString:PDImage_UUID])
+      else if (text_changed)
 	{
-	  _uuid = nil;
-	  if (value != nil)
-	    _uuid = [[NSUUID alloc] initWithUUIDString:value];
+	  /* The index entry is replaced, so it needs the implicit
+	     properties' text as well. */
+
+	  [self faultImageProperties];
+
+	  [_library setIndexedWords:[self indexedWords]
+	   forFileId:self.imageFileId];
 	}
 
       [[NSNotificationCenter defaultCenter]
@@ -789,6 +1066,331 @@ file_conforming_to(NSDictionary *file_types, CFStringRef type)
     });
 }
 
+/* Sorting by precomputed keys. Numeric sort keys are mapped to
+   unsigned integers that order the same way (with "no value" below
+   everything else) and radix sorted; string keys are merge sorted.
+   Both sorts are stable, so images with equal keys keep their order
+   in the input array. Keys are read, and strings sorted, in chunks on
+   concurrent queues; the images mustn't be modified meanwhile, other
+   than by reading a key faulting in the image's own properties, so
+   no image may appear in the array twice. */
+
+#define SORT_CHUNK_SIZE 4096
+
+static inline size_t
+sort_chunk_count(size_t n)
+{
+  return (n + SORT_CHUNK_SIZE - 1) / SORT_CHUNK_SIZE;
+}
+
+static inline dispatch_queue_t
+sort_queue(void)
+{
+  return dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0);
+}
+
+struct sort_item
+{
+  uint64_t key;
+  uint32_t index;
+};
+
+static inline uint64_t
+double_sort_key(double d)
+{
+  if (d == 0)
+    d = 0;				/* -0 == 0 */
+
+  uint64_t u;
+  memcpy(&u, &d, sizeof(u));
+
+  u = (u & (1ULL << 63)) ? ~u : u | (1ULL << 63);
+
+  /* Zero is reserved for missing values. */
+
+  return u != 0 ? u : 1;
+}
+
+static void
+radix_sort(struct sort_item *items, size_t n)
+{
+  struct sort_item *tmp = malloc(n * sizeof(*tmp));
+  struct sort_item *src = items, *dst = tmp;
+
+  for (unsigned int shift = 0; shift < 64; shift += 8)
+    {
+      size_t count[256] = {0};
+
+      for (size_t i = 0; i < n; i++)
+	count[(src[i].key >> shift) & 255]++;
+
+      /* Skip digits where every key is the same. */
+
+      if (count[(src[0].key >> shift) & 255] == n)
+	continue;
+
+      size_t sum = 0;
+      for (size_t b = 0; b < 256; b++)
+	{
+	  size_t c = count[b];
+	  count[b] = sum;
+	  sum += c;
+	}
+
+      for (size_t i = 0; i < n; i++)
+	dst[count[(src[i].key >> shift) & 255]++] = src[i];
+
+      struct sort_item *t = src;
+      src = dst, dst = t;
+    }
+
+  if (src != items)
+    memcpy(items, src, n * sizeof(*items));
+
+  free(tmp);
+}
+
+/* Returns the numeric sort key of 'im', or nil if it has no value,
+   with the same ordering as +callWithImageComparator:. */
+
+static NSNumber *
+numeric_sort_value(PDImage *im, PDImageCompareKey sort_key)
+{
+  switch (sort_key)
+    {
+    case PDImageCompare_FileDate:
+      return @([im.library mtimeOfFileAtPath:im.imageLibraryPath]);
+
+    case PDImageCompare_FileSize:
+      return @([im.library sizeOfFileAtPath:im.imageLibraryPath]);
+
+    case PDImageCompare_Date:
+      return @([im.date timeIntervalSince1970]);
+
+    case PDImageCompare_PixelSize: {
+      CGSize size = im.pixelSize;
+      if (size.width != 0 && size.height != 0)
+	return @(size.width * size.height);
+      else
+	return nil; }
+
+    case PDImageCompare_Keywords:
+      /* Arrays don't respond to -compare:, so the comparator only
+	 distinguishes images with and without keywords. */
+      return im[PDImage_Keywords] != nil ? @0 : nil;
+
+    case PDImageCompare_Rating:
+      return im[PDImage_Rating];
+    case PDImageCompare_Flagged:
+      return im[PDImage_Flagged];
+    case PDImageCompare_Orientation:
+      return im[PDImage_Orientation];
+    case PDImageCompare_Altitude:
+      return im[PDImage_Altitude];
+    case PDImageCompare_ExposureLength:
+      return im[PDImage_ExposureLength];
+    case PDImageCompare_FNumber:
+      return im[PDImage_FNumber];
+    case PDImageCompare_ISOSpeed:
+      return im[PDImage_ISOSpeed];
+    }
+
+  return nil;
+}
+
+static NSArray *
+sort_numeric(NSArray *images, PDImageCompareKey sort_key, BOOL reversed)
+{
+  size_t count = images.count;
+
+  struct sort_item *items = malloc(count * sizeof(*items));
+
+  __unsafe_unretained PDImage **ims
+    = (__unsafe_unretained PDImage **)malloc(count * sizeof(id));
+  [images getObjects:ims range:NSMakeRange(0, count)];
+
+  dispatch_apply(sort_chunk_count(count), sort_queue(), ^(size_t c)
+    {
+      size_t end = MIN((c + 1) * SORT_CHUNK_SIZE, count);
+
+      @autoreleasepool
+	{
+	  for (size_t i = c * SORT_CHUNK_SIZE; i < end; i++)
+	    {
+	      NSNumber *value = numeric_sort_value(ims[i], sort_key);
+
+	      uint64_t key = 0;
+	      if ([value isKindOfClass:[NSNumber class]])
+		key = double_sort_key([value doubleValue]);
+
+	      items[i].key = reversed ? ~key : key;
+	      items[i].index = (uint32_t)i;
+	    }
+	}
+    });
+
+  free(ims);
+
+  radix_sort(items, count);
+
+  NSMutableArray *ret = [NSMutableArray arrayWithCapacity:count];
+  for (size_t j = 0; j < count; j++)
+    [ret addObject:images[items[j].index]];
+
+  free(items);
+
+  return ret;
+}
+
+/* Stable merge sort of 'order' by 'cmp': chunks are sorted
+   concurrently, then merged in pairs until one run is left. */
+
+static void
+parallel_mergesort(uint32_t *order, size_t count,
+		   int (^cmp)(uint32_t a, uint32_t b))
+{
+  size_t chunks = sort_chunk_count(count);
+
+  dispatch_apply(chunks, sort_queue(), ^(size_t c)
+    {
+      size_t start = c * SORT_CHUNK_SIZE;
+      size_t end = MIN(start + SORT_CHUNK_SIZE, count);
+
+      mergesort_b(order + start, end - start, sizeof(*order),
+		  ^(const void *a, const void *b)
+	{
+	  return cmp(*(const uint32_t *)a, *(const uint32_t *)b);
+	});
+    });
+
+  if (chunks < 2)
+    return;
+
+  uint32_t *tmp = malloc(count * sizeof(*tmp));
+  uint32_t *src = order, *dst = tmp;
+
+  for (size_t width = SORT_CHUNK_SIZE; width < count; width *= 2)
+    {
+      size_t pairs = (count + 2 * width - 1) / (2 * width);
+
+      dispatch_apply(pairs, sort_queue(), ^(size_t p)
+	{
+	  size_t i = p * 2 * width, k = i;
+	  size_t mid = MIN(i + width, count);
+	  size_t end = MIN(i + 2 * width, count);
+	  size_t j = mid;
+
+	  /* Ties take from the left run to keep the sort stable. */
+
+	  while (i < mid && j < end)
+	    dst[k++] = cmp(src[j], src[i]) < 0 ? src[j++] : src[i++];
+	  while (i < mid)
+	    dst[k++] = src[i++];
+	  while (j < end)
+	    dst[k++] = src[j++];
+	});
+
+      uint32_t *t = src;
+      src = dst, dst = t;
+    }
+
+  if (src != order)
+    memcpy(order, src, count * sizeof(*order));
+
+  free(tmp);
+}
+
+static NSArray *
+sort_strings(NSArray *images, PDImageCompareKey sort_key, BOOL reversed)
+{
+  size_t count = images.count;
+
+  NSString *key = (sort_key == PDImageCompare_Name ? PDImage_Name
+		   : sort_key == PDImageCompare_Caption ? PDImage_Caption
+		   : nil);
+
+  __unsafe_unretained PDImage **ims
+    = (__unsafe_unretained PDImage **)malloc(count * sizeof(id));
+  [images getObjects:ims range:NSMakeRange(0, count)];
+
+  /* Strong references, as the values may not be owned by the images,
+     cleared before the array is freed. */
+
+  __strong id *strs = (__strong id *)calloc(count, sizeof(id));
+
+  id null = [NSNull null];
+
+  dispatch_apply(sort_chunk_count(count), sort_queue(), ^(size_t c)
+    {
+      size_t end = MIN((c + 1) * SORT_CHUNK_SIZE, count);
+
+      @autoreleasepool
+	{
+	  for (size_t i = c * SORT_CHUNK_SIZE; i < end; i++)
+	    {
+	      PDImage *im = ims[i];
+	      id value = key != nil ? im[key] : im.imageFile;
+	      if (![value isKindOfClass:[NSString class]])
+		value = null;
+	      strs[i] = value;
+	    }
+	}
+    });
+
+  uint32_t *order = malloc(count * sizeof(*order));
+  for (uint32_t i = 0; i < count; i++)
+    order[i] = i;
+
+  parallel_mergesort(order, count, ^int (uint32_t a, uint32_t b)
+    {
+      id s1 = strs[a];
+      id s2 = strs[b];
+
+      NSComparisonResult ret;
+      if (s1 == s2)
+	ret = NSOrderedSame;
+      else if (s1 == null)
+	ret = NSOrderedAscending;
+      else if (s2 == null)
+	ret = NSOrderedDescending;
+      else
+	ret = [s1 compare:s2];
+
+      return (int)(reversed ? -ret : ret);
+    });
+
+  NSMutableArray *ret = [NSMutableArray arrayWithCapacity:count];
+  for (size_t j = 0; j < count; j++)
+    [ret addObject:ims[order[j]]];
+
+  for (size_t j = 0; j < count; j++)
+    strs[j] = nil;
+
+  free(order);
+  free(strs);
+  free(ims);
+
+  return ret;
+}
+
++ (NSArray *)sortedImages:(NSArray *)images
+    usingKey:(PDImageCompareKey)sort_key reversed:(BOOL)flag
+{
+  if (images.count < 2)
+    return images;
+
+  switch (sort_key)
+    {
+    case PDImageCompare_FileName:
+    case PDImageCompare_Name:
+    case PDImageCompare_Caption:
+      return sort_strings(images, sort_key, flag);
+
+    default:
+      return sort_numeric(images, sort_key, flag);
+    }
+}
+
 + (NSString *)imageCompareKeyString:(PDImageCompareKey)key
 {
   switch (key)
@@ -874,7 +1476,10 @@ file_conforming_to(NSDictionary *file_types, CFStringRef type)
       time_t t = (value != nil
 		  ? [value unsignedLongValue]
 		  : [_library mtimeOfFileAtPath:self.imageLibraryPath]);
-      _date = [[NSDate alloc] initWithTimeIntervalSince1970:t];
+      NSDate *date = [[NSDate alloc] initWithTimeIntervalSince1970:t];
+      lock_properties();
+      _date = date;
+      unlock_properties();
     }
 
   return _date;
@@ -884,8 +1489,7 @@ file_conforming_to(NSDictionary *file_types, CFStringRef type)
 {
   if (_uuid == nil)
     {
-      _uuid = [[NSUUID alloc] init];
-      _properties[PDImage_UUID] = [_uuid UUIDString];
+      [self assignUUID:[NSUUID UUID]];
       [self writeJSONFile];
     }
 
@@ -897,6 +1501,22 @@ file_conforming_to(NSDictionary *file_types, CFStringRef type)
   return _uuid;
 }
 
+/* For UUIDs created or changed implicitly, i.e. not via
+   -setImageProperty:forKey:. Observers such as PDImageIndex still need
+   to know about them. */
+
+- (void)assignUUID:(NSUUID *)uuid
+{
+  lock_properties();
+  _uuid = [uuid copy];
+  _properties[PDImage_UUID] = [_uuid UUIDString];
+  unlock_properties();
+
+  [[NSNotificationCenter defaultCenter]
+   postNotificationName:PDImagePropertyDidChange object:self
+   userInfo:@{@"key": PDImage_UUID}];
+}
+
 - (NSString *)name
 {
   return self[PDImage_Name];
@@ -949,7 +1569,7 @@ file_conforming_to(NSDictionary *file_types, CFStringRef type)
 
 - (BOOL)isFlagged
 {
-  return [self[PDImage_Flagged] boolValue];
+  return _flagged;
 }
 
 - (void)setFlagged:(BOOL)flag
@@ -1034,6 +1654,166 @@ file_conforming_to(NSDictionary *file_types, CFStringRef type)
     return CGSizeMake(pixelSize.height, pixelSize.width);
 }
 
+- (void)loadCachedProperties
+{
+  /* Sorting and filtering the library needs a few properties of every
+     image at startup, these come from the library's property cache.
+     The full dictionary is only loaded when something else asks for
+     it, e.g. the inspector. */
+
+  PDImageLibrary *lib = _library;
+  uint32_t file_id = self.imageFileId;
+
+  time_t mtime = [lib mtimeOfFileAtPath:self.imageLibraryPath];
+
+  NSArray *keywords = nil;
+
+  _hasRecord = [lib getCachedPropertyRecord:&_record keywords:&keywords
+		forFileId:file_id newerThan:mtime];
+
+  if (!_hasRecord)
+    {
+      [self loadImageProperties];
+
+      if (_implicitProperties != nil)
+	{
+	  [lib setCachedProperties:_implicitProperties forFileId:file_id];
+
+	  [PDPropertyCache getRecord:&_record keywords:&keywords
+	   fromProperties:_implicitProperties];
+	  _hasRecord = YES;
+
+	  /* Don't keep the dictionary, it will be faulted back in (from
+	     the p.json cache) if a key outside the record is needed. */
+
+	  _implicitProperties = nil;
+	}
+    }
+
+  _keywords = keywords;
+}
+
+/* Called on the main thread, as for -setImageProperty:forKey:. Images
+   that are currently displayed keep their properties. */
+
++ (void)dropImageProperties
+{
+  NSMutableArray *images = [NSMutableArray array];
+
+  pthread_mutex_lock(&_faultedLock);
+
+  for (PDImage *image in _faultedImages)
+    {
+      if (image->_hasRecord && image->_imageHosts.count == 0)
+	[images addObject:image];
+    }
+
+  for (PDImage *image in images)
+    [_faultedImages removeObject:image];
+
+  pthread_mutex_unlock(&_faultedLock);
+
+  lock_properties();
+
+  for (PDImage *image in images)
+    image->_implicitProperties = nil;
+
+  unlock_properties();
+}
+
+static BOOL
+parse_image_headers(void)
+{
+  static BOOL flag;
+  static dispatch_once_t once;
+
+  dispatch_once(&once, ^
+    {
+      flag = [[NSUserDefaults standardUserDefaults]
+	      boolForKey:@"PDParseImageHeaders"];
+    });
+
+  return flag;
+}
+
+/* Debugging aid: when set, properties are still read using ImageIO,
+   and any differences from the header parser's output are logged. */
+
+static BOOL
+verify_image_headers(void)
+{
+  static BOOL flag;
+  static dispatch_once_t once;
+
+  dispatch_once(&once, ^
+    {
+      flag = [[NSUserDefaults standardUserDefaults]
+	      boolForKey:@"PDVerifyImageHeaders"];
+    });
+
+  return flag;
+}
+
+static void
+verify_header_properties(NSString *path, NSDictionary *header_props,
+			 NSDictionary *imageio_props)
+{
+  /* Including keys only ImageIO produced, e.g. maker note values for
+     a make the parser doesn't leave to ImageIO. */
+
+  NSSet *keys = [PDImageHeaderPropertyKeys()
+		 setByAddingObjectsFromArray:imageio_props.allKeys];
+
+  for (NSString *key in keys)
+    {
+      id value = header_props[key];
+      id expected = imageio_props[key];
+
+      if (value != expected && ![value isEqual:expected])
+	{
+	  NSLog(@"PDImageHeader: %@: %@ = %@, ImageIO has %@",
+		path, key, value, expected);
+	}
+    }
+}
+
+/* Returns 'dict' with the string values that repeat across images
+   (camera, profile and keyword names) replaced by interned copies. */
+
+static NSDictionary *
+intern_image_properties(NSDictionary *dict)
+{
+  static NSString *const *keys[] =
+  {
+    &PDImage_CameraMake,
+    &PDImage_CameraModel,
+    &PDImage_CameraSoftware,
+    &PDImage_ProfileName,
+    &PDImage_ColorModel,
+  };
+
+  NSMutableDictionary *copy = [dict mutableCopy];
+
+  for (size_t i = 0; i < N_ELEMENTS(keys); i++)
+    {
+      id value = dict[*keys[i]];
+      if ([value isKindOfClass:[NSString class]])
+	copy[*keys[i]] = [value internedString];
+    }
+
+  NSArray *keywords = dict[PDImage_Keywords];
+  if ([keywords isKindOfClass:[NSArray class]])
+    {
+      copy[PDImage_Keywords] = [keywords mappedArray:^id (id str)
+	{
+	  return [str isKindOfClass:[NSString class]]
+	    ? [str internedString] : str;
+	}];
+    }
+
+  return copy;
+}
+
 - (void)loadImageProperties
 {
   /* Translated image properties are written into the library's cache.
@@ -1042,45 +1822,100 @@ file_conforming_to(NSDictionary *file_types, CFStringRef type)
      properties on startup as they're usually needed to sort the list
      of displayed images, which can be the entire library.) */
 
-  NSString *cache_path
-    = [_library cachePathForFileId:self.imageFileId base:@"p.json"];
+  PDImageLibrary *lib = _library;
+  uint32_t file_id = self.imageFileId;
 
   NSString *image_rel_path = self.imageLibraryPath;
 
-  if (file_mtime(cache_path) > [_library mtimeOfFileAtPath:image_rel_path])
+  NSData *data = [lib cachedDataForFileId:file_id base:@"p.json"
+		  newerThan:[lib mtimeOfFileAtPath:image_rel_path]];
+
+  if (data != nil)
     {
-      NSData *data = [[NSData alloc] initWithContentsOfFile:cache_path];
-      if (data != nil)
-	{
-	  id obj = [NSJSONSerialization
-		    JSONObjectWithData:data options:0 error:nil];
-	  if (obj != nil)
-	    _implicitProperties = [obj copy];
-	}
+      id obj = [NSJSONSerialization
+		JSONObjectWithData:data options:0 error:nil];
+      if (obj != nil)
+	_implicitProperties = [obj copy];
     }
 
+  BOOL from_file = _implicitProperties == nil;
+
   if (_implicitProperties == nil)
     {
-      CGImageSourceRef src = [_library copyImageSourceAtPath:image_rel_path];
+      /* Reading the headers directly is much faster than having
+	 ImageIO create an image source and extract everything. */
 
-      if (src != NULL)
+      NSDictionary *header_props = nil;
+
+      if (parse_image_headers())
 	{
-	  _implicitProperties = PDImageSourceCopyProperties(src);
-	  CFRelease(src);
+	  header_props = PDImageHeaderCopyProperties
+	    (self[PDImage_ActiveType], ^NSData *(size_t offset, size_t length)
+	      {
+		return [lib contentsOfFileAtPath:image_rel_path
+			range:NSMakeRange(offset, length)];
+	      });
 	}
 
+      if (header_props == nil || verify_image_headers())
+	{
+	  CGImageSourceRef src = [lib copyImageSourceAtPath:image_rel_path];
+
+	  if (src != NULL)
+	    {
+	      _implicitProperties = PDImageSourceCopyProperties(src);
+	      CFRelease(src);
+	    }
+
+	  if (header_props != nil)
+	    {
+	      verify_header_properties(image_rel_path, header_props,
+				       _implicitProperties);
+	    }
+	}
+      else
+	_implicitProperties = header_props;
+
       if (_implicitProperties != nil)
 	{
 	  id obj = _implicitProperties;
 	  NSOperation *op = [NSBlockOperation blockOperationWithBlock:^{
 	    NSData *data = [NSJSONSerialization dataWithJSONObject:obj
 			    options:0 error:nil];
-	    [data writeToFile:cache_path atomically:YES];
+	    if (data != nil)
+	      [lib setCachedData:data forFileId:file_id base:@"p.json"];
 	  }];
 
 	  [[PDImage writeQueue] addOperation:op];
 	}
     }
+
+  if (_implicitProperties != nil)
+    {
+      _implicitProperties = intern_image_properties(_implicitProperties);
+
+      /* Properties read from the file replace the index entry, as the
+	 file's metadata may have changed since it was indexed. Those
+	 from the cache were indexed when they were cached. */
+
+      if (from_file)
+	[lib setIndexedWords:[self indexedWords] forFileId:file_id];
+      else
+	[lib addIndexedWords:[self indexedWords] forFileId:file_id];
+    }
+}
+
+- (void)faultImageProperties
+{
+  if (_implicitProperties == nil)
+    {
+      lock_properties();
+      [self loadImageProperties];
+      unlock_properties();
+
+      if (_implicitProperties != nil)
+	note_faulted_image(self);
+    }
 }
 
 - (BOOL)removeFiles:(NSError **)err
@@ -1110,8 +1945,10 @@ file_conforming_to(NSDictionary *file_types, CFStringRef type)
       _jsonFile = nil;
     }
 
+  lock_properties();
   _properties[PDImage_FileTypes] = @{};
   [_properties removeObjectForKey:PDImage_ActiveType];
+  unlock_properties();
 
   _removed = YES;
 
@@ -1187,6 +2024,7 @@ find_unique_path(PDImageLibrary *lib, NSString *path)
 
   NSString *old_dir = _libraryDirectory;
   _libraryDirectory = [dir copy];
+  _fileId = 0;
 
   if (_jsonFile != nil)
     new_json_path = library_file_path(self, _jsonFile);
@@ -1256,16 +2094,14 @@ find_unique_path(PDImageLibrary *lib, NSString *path)
 	[_library removeItemAtPath:new_json_path error:nil];
 
       _libraryDirectory = old_dir;
+      _fileId = 0;
       return NO;
     }
 
   /* Success: update image instance and its library. */
 
   if (uuid != _uuid)
-    {
-      _uuid = [uuid copy];
-      _properties[PDImage_UUID] = [_uuid UUIDString];
-    }
+    [self assignUUID:uuid];
 
   for (NSString *type in file_types)
     {
@@ -1371,9 +2207,10 @@ find_unique_path(PDImageLibrary *lib, NSString *path)
       PDImageLibrary *lib = self.library;
       uint32_t file_id = self.imageFileId;
       NSString *image_rel_path = self.imageLibraryPath;
-      NSString *tiny_path = cache_path_for_type(lib, file_id, PDImage_Tiny);
-
-      if (file_mtime(tiny_path) > [lib mtimeOfFileAtPath:image_rel_path])
+      CGSize pixel_size = self.pixelSize;
+      if ([lib hasCachedDataForFileId:file_id
+	   base:cache_base_for_type(PDImage_Tiny)
+	   newerThan:[lib mtimeOfFileAtPath:image_rel_path]])
 	{
 	  _donePrefetch = YES;
 	  return;
@@ -1388,8 +2225,11 @@ find_unique_path(PDImageLibrary *lib, NSString *path)
 	  if (src == NULL)
 	    return;
 
-	  __block CGImageRef src_im
-	    = CGImageSourceCreateImageAtIndex(src, 0, NULL);
+	  /* All proxies are scaled from one reduced decode. */
+
+	  CGImageRef src_im = create_subsampled_image(src,
+			(size_t)fmax(pixel_size.width, pixel_size.height),
+			PDImage_MediumSize);
 
 	  CFRelease(src);
 
@@ -1412,11 +2252,13 @@ find_unique_path(PDImageLibrary *lib, NSString *path)
 
 	      if (im != NULL)
 		{
-		  NSString *cache_path
-		    = cache_path_for_type(lib, file_id, type);
-		  write_image_to_path(im, cache_path, CACHE_QUALITY);
-		  CGImageRelease(src_im);
-		  src_im = im;
+		  NSData *data = copy_image_data(im, CACHE_QUALITY);
+		  if (data != nil)
+		    {
+		      [lib setCachedData:data forFileId:file_id
+		       base:cache_base_for_type(type)];
+		    }
+		  CGImageRelease(im);
 		}
 	    };
 
@@ -1469,10 +2311,30 @@ setHostedImage(PDImage *self, id<PDImageHost> obj, CGImageRef im)
     });
 }
 
+- (PDImagePyramid *)pyramid
+{
+  uint32_t file_id = self.imageFileId;
+  NSString *path = self.imageLibraryPath;
+
+  /* The active file may have changed, or been moved. */
+
+  if (_pyramid == nil || _pyramid.fileId != file_id
+      || ![_pyramid.path isEqualToString:path])
+    {
+      _pyramid = [[PDImagePyramid alloc] initWithLibrary:_library
+		  fileId:file_id path:path pixelSize:self.pixelSize];
+    }
+
+  return _pyramid;
+}
+
 - (void)addImageHost:(id<PDImageHost>)obj
 {
   assert([_imageHosts objectForKey:obj] == nil);
 
+  if (_imageHosts == nil)
+    _imageHosts = [NSMapTable strongToStrongObjectsMapTable];
+
   PDImageLibrary *lib = self.library;
   uint32_t file_id = self.imageFileId;
   NSString *image_rel_path = self.imageLibraryPath;
@@ -1508,10 +2370,10 @@ setHostedImage(PDImage *self, id<PDImageHost> obj, CGImageRef im)
   else
     type = PDImage_Medium, type_size = PDImage_MediumSize;
 
-  NSString *type_path = cache_path_for_type(lib, file_id, type);
+  time_t image_mtime = [lib mtimeOfFileAtPath:image_rel_path];
 
-  BOOL cache_is_valid = (file_mtime(type_path)
-			 > [lib mtimeOfFileAtPath:image_rel_path]);
+  BOOL cache_is_valid = [lib hasCachedDataForFileId:file_id
+			 base:cache_base_for_type(type) newerThan:image_mtime];
 
   NSMutableArray *ops = [NSMutableArray array];
 
@@ -1583,11 +2445,13 @@ setHostedImage(PDImage *self, id<PDImageHost> obj, CGImageRef im)
 	  if (cache_ref.cancelled)
 	    return;
 
-	  CGImageSourceRef src = create_image_source_from_path(type_path);
+	  CGImageSourceRef src
+	    = create_cached_image_source(lib, file_id, type, image_mtime);
 	  if (src != NULL)
 	    {
-	      CGImageRef src_im
-		= CGImageSourceCreateImageAtIndex(src, 0, NULL);
+	      CGImageRef src_im = (thumb
+		? create_subsampled_image(src, type_size, ceil(max_size))
+		: CGImageSourceCreateImageAtIndex(src, 0, NULL));
 
 	      CFRelease(src);
 
@@ -1625,7 +2489,8 @@ setHostedImage(PDImage *self, id<PDImageHost> obj, CGImageRef im)
      if that's the one being used, rather than trying to reuse the one
      loaded above, ImageIO will probably cache it.
 
-     FIXME: we should be tiling large images here. */
+     Hosts displaying part of a large image use the tile pyramid
+     instead of asking for it at full size (see PDImageLayer). */
 
   if (need_scaled_op)
     {
@@ -1641,12 +2506,12 @@ setHostedImage(PDImage *self, id<PDImageHost> obj, CGImageRef im)
 	  if (max_size > type_size || !cache_is_valid)
 	    src = [lib copyImageSourceAtPath:image_rel_path];
 	  else
-	    src = create_image_source_from_path(type_path);
+	    src = create_cached_image_source(lib, file_id, type, image_mtime);
 
 	  if (src != NULL)
 	    {
 	      CGImageRef src_im
-	        = CGImageSourceCreateImageAtIndex(src, 0, NULL);
+	        = create_subsampled_image(src, ceil(max_size));
 	      CFRelease(src);
 
 	      /* Scale the image to required size, this has several
@@ -1670,6 +2535,14 @@ setHostedImage(PDImage *self, id<PDImageHost> obj, CGImageRef im)
       [ops addObject:full_op];
     }
 
+  /* Don't let the proxies be evicted while they're being displayed. */
+
+  if (_imageHosts.count == 0)
+    {
+      _pinnedFileId = file_id;
+      [lib pinCachedDataForFileId:file_id];
+    }
+
   [_imageHosts setObject:ops forKey:obj];
 
   /* First operation always goes into the maximally-concurrent queue,
@@ -1705,6 +2578,15 @@ setHostedImage(PDImage *self, id<PDImageHost> obj, CGImageRef im)
     [op cancel];
 
   [_imageHosts removeObjectForKey:obj];
+
+  /* Drop the pyramid and its decoded tiles once nothing displays the
+     image, so only images on screen hold tiles in memory. */
+
+  if (_imageHosts.count == 0)
+    {
+      [_library unpinCachedDataForFileId:_pinnedFileId];
+      _pyramid = nil;
+    }
 }
 
 - (void)updateImageHost:(id<PDImageHost>)obj
@@ -1713,8 +2595,15 @@ setHostedImage(PDImage *self, id<PDImageHost> obj, CGImageRef im)
      when zooming in above 100% we load the full-size image again for
      no reason.) */
 
+  /* Keep the pyramid's recent tiles while the host is re-added. */
+
+  PDImagePyramid *pyramid = _pyramid;
+
   [self removeImageHost:obj];
   [self addImageHost:obj];
+
+  if (_pyramid == nil)
+    _pyramid = pyramid;
 }
 
 // NSPasteboardWriting methods
@@ -31,6 +31,12 @@
 @property(nonatomic, weak) IBOutlet PDImageListViewController *controller;
 
 @property(nonatomic, copy) NSArray *images;
+
+/* Like setting 'images', given the changes from the old array in the
+   form of a PDImageListDidChange userInfo dictionary. Only redisplays
+   if the visible part of the grid is affected. */
+
+- (void)setImages:(NSArray *)array changes:(NSDictionary *)info;
 @property(nonatomic, assign) NSInteger primarySelection;
 @property(nonatomic, copy) NSIndexSet *selection;
 @property(nonatomic, assign) CGFloat scale;
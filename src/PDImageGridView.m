@@ -78,6 +78,55 @@
     }
 }
 
+- (void)setImages:(NSArray *)array changes:(NSDictionary *)info
+{
+  NSInteger old_count = _images.count;
+
+  _images = [array copy];
+
+  if (_images.count != old_count || _columns == 0)
+    {
+      [self setNeedsDisplay:YES];
+      return;
+    }
+
+  /* The number of images is unchanged, so only those between the
+     first and last changed indexes can have moved. */
+
+  NSIndexSet *removed = info[PDImageListRemovedIndexes];
+  NSIndexSet *inserted = info[PDImageListInsertedIndexes];
+  NSDictionary *moved = info[PDImageListMovedIndexes];
+
+  __block NSInteger first = NSIntegerMax, last = -1;
+
+  for (NSIndexSet *set in @[removed, inserted])
+    {
+      if (set.count != 0)
+	{
+	  first = MIN(first, (NSInteger)set.firstIndex);
+	  last = MAX(last, (NSInteger)set.lastIndex);
+	}
+    }
+
+  [moved enumerateKeysAndObjectsUsingBlock:^(id from, id to, BOOL *stop)
+    {
+      first = MIN(first, MIN([from integerValue], [to integerValue]));
+      last = MAX(last, MAX([from integerValue], [to integerValue]));
+    }];
+
+  if (last < 0)
+    return;
+
+  CGRect rect = self.visibleRect;
+  CGFloat v_spacing = GRID_SPACING + (_displaysMetadata ? TITLE_HEIGHT : 0);
+  NSInteger y0 = floor((rect.origin.y - GRID_MARGIN) / (_size + v_spacing));
+  NSInteger y1 = ceil((rect.origin.y + rect.size.height - GRID_MARGIN)
+		      / (_size + v_spacing));
+
+  if (last >= y0 * _columns && first < y1 * _columns)
+    [self setNeedsDisplay:YES];
+}
+
 - (void)setPrimarySelection:(NSInteger)idx
 {
   if (_primarySelection != idx)
@@ -0,0 +1,45 @@
+/* -*- c-style: gnu -*-
+
+   Copyright (c) 2013 John Harper <jsh@unfactored.org>
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE. */
+
+#import <Foundation/Foundation.h>
+
+/* Reads the metadata of an image file directly from its headers,
+   producing the same PDImage_* properties PDImageSourceCopyProperties()
+   would, without creating an image source. 'type' is the file's UTI,
+   'read' returns up to 'length' bytes of the file starting at 'offset'
+   (fewer at end of file).
+
+   JPEG, HEIF and TIFF-based camera raw files are handled. Returns nil
+   if the file isn't one of those, or has something that can't be
+   parsed here, including maker notes ImageIO would decode into more
+   properties; the caller should fall back to ImageIO. */
+
+extern NSDictionary *PDImageHeaderCopyProperties(NSString *type,
+    NSData *(^read)(size_t offset, size_t length));
+
+/* The keys PDImageHeaderCopyProperties() is responsible for. Anything
+   else ImageIO reports is not produced, files with maker notes whose
+   values ImageIO reports are left to ImageIO. */
+
+extern NSSet *PDImageHeaderPropertyKeys(void);
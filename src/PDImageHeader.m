@@ -0,0 +1,1503 @@
+/* -*- c-style: gnu -*-
+
+   Copyright (c) 2013 John Harper <jsh@unfactored.org>
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE. */
+
+#import "PDImageHeader.h"
+
+#import "PDImage.h"
+#import "PDImageProperty.h"
+#import "PDMacros.h"
+
+#import <CoreServices/CoreServices.h>
+#import <ImageIO/ImageIO.h>
+
+/* The file is read in chunks of READ_CHUNK bytes. Anything needing
+   more than MAX_HEAD_SIZE bytes from the start of the file, or more
+   than MAX_BOX_SIZE bytes of HEIF metadata, is left to ImageIO. */
+
+#define READ_CHUNK 65536
+#define MAX_HEAD_SIZE (4*1024*1024)
+#define MAX_BOX_SIZE (1024*1024)
+
+#define FOURCC(a, b, c, d) \
+  (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) \
+   | ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+@interface PDImageHeaderReader : NSObject
+{
+@public
+  NSData *(^_read)(size_t offset, size_t length);
+  NSMutableData *_head;
+  BOOL _eof;
+  NSData *_extra;
+  size_t _extra_offset;
+}
+@end
+
+/* Returns a pointer to 'length' bytes at 'offset' in the file, or null
+   if they can't be read. The pointer is only valid until the next
+   call. The start of the file is read incrementally and kept, other
+   ranges (e.g. TIFF directories near the end of a raw file) are read
+   on demand. */
+
+static const uint8_t *
+reader_bytes(PDImageHeaderReader *r, size_t offset, size_t length)
+{
+  size_t end = offset + length;
+  if (end < offset)
+    return NULL;
+
+  if (end <= r->_head.length)
+    return (const uint8_t *)r->_head.bytes + offset;
+
+  if (end <= MAX_HEAD_SIZE && offset <= r->_head.length + READ_CHUNK)
+    {
+      while (!r->_eof && r->_head.length < end)
+	{
+	  size_t size = r->_head.length;
+	  size_t want = MAX(end - size, READ_CHUNK);
+	  NSData *data = r->_read(size, want);
+	  if (data.length < want)
+	    r->_eof = YES;
+	  if (data != nil)
+	    [r->_head appendData:data];
+	}
+
+      if (end <= r->_head.length)
+	return (const uint8_t *)r->_head.bytes + offset;
+      else
+	return NULL;
+    }
+
+  if (r->_extra == nil || offset < r->_extra_offset
+      || end > r->_extra_offset + r->_extra.length)
+    {
+      r->_extra = r->_read(offset, MAX(length, READ_CHUNK));
+      r->_extra_offset = offset;
+    }
+
+  if (end <= r->_extra_offset + r->_extra.length)
+    return (const uint8_t *)r->_extra.bytes + (offset - r->_extra_offset);
+  else
+    return NULL;
+}
+
+static NSData *
+reader_copy(PDImageHeaderReader *r, size_t offset, size_t length)
+{
+  const uint8_t *ptr = reader_bytes(r, offset, length);
+  return ptr != NULL ? [NSData dataWithBytes:ptr length:length] : nil;
+}
+
+static inline uint32_t
+get_u16(const uint8_t *p, BOOL be)
+{
+  return be ? (p[0] << 8) | p[1] : (p[1] << 8) | p[0];
+}
+
+static inline uint32_t
+get_u32(const uint8_t *p, BOOL be)
+{
+  return (be
+	  ? ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]
+	  : ((uint32_t)p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0]);
+}
+
+/* Bounds-checked sequential reading of big-endian data. */
+
+struct cursor
+{
+  const uint8_t *p;
+  const uint8_t *end;
+  BOOL error;
+};
+
+static void
+cursor_init(struct cursor *c, NSData *data, size_t offset)
+{
+  c->p = (const uint8_t *)data.bytes + MIN(offset, data.length);
+  c->end = (const uint8_t *)data.bytes + data.length;
+  c->error = NO;
+}
+
+static uint64_t
+cursor_uint(struct cursor *c, size_t size)
+{
+  if (c->error || (size_t)(c->end - c->p) < size)
+    {
+      c->error = YES;
+      return 0;
+    }
+
+  uint64_t value = 0;
+  for (size_t i = 0; i < size; i++)
+    value = (value << 8) | *c->p++;
+
+  return value;
+}
+
+static NSString *
+string_from_bytes(const uint8_t *ptr, size_t length)
+{
+  /* ASCII values may be null-padded. */
+
+  while (length > 0 && ptr[length-1] == 0)
+    length--;
+
+  NSString *str = [[NSString alloc] initWithBytes:ptr length:length
+		   encoding:NSUTF8StringEncoding];
+  if (str == nil)
+    {
+      str = [[NSString alloc] initWithBytes:ptr length:length
+	     encoding:NSISOLatin1StringEncoding];
+    }
+
+  return str;
+}
+
+/* ICC profiles. */
+
+static NSString *
+icc_profile_description(NSData *icc)
+{
+  struct cursor c;
+  cursor_init(&c, icc, 128);
+
+  uint32_t count = (uint32_t)cursor_uint(&c, 4);
+
+  for (uint32_t i = 0; i < count && !c.error; i++)
+    {
+      uint32_t sig = (uint32_t)cursor_uint(&c, 4);
+      uint32_t offset = (uint32_t)cursor_uint(&c, 4);
+      uint32_t size = (uint32_t)cursor_uint(&c, 4);
+
+      if (c.error || sig != FOURCC('d','e','s','c'))
+	continue;
+      if (offset > icc.length || size > icc.length - offset)
+	return nil;
+
+      NSData *tag = [icc subdataWithRange:NSMakeRange(offset, size)];
+      struct cursor t;
+      cursor_init(&t, tag, 0);
+
+      uint32_t type = (uint32_t)cursor_uint(&t, 4);
+      cursor_uint(&t, 4);
+
+      if (type == FOURCC('d','e','s','c'))
+	{
+	  /* ICC v2 textDescriptionType, use the ASCII form. */
+
+	  uint32_t length = (uint32_t)cursor_uint(&t, 4);
+	  if (t.error || length > (size_t)(t.end - t.p))
+	    return nil;
+	  return string_from_bytes(t.p, length);
+	}
+      else if (type == FOURCC('m','l','u','c'))
+	{
+	  /* ICC v4 multiLocalizedUnicodeType, prefer en-US. */
+
+	  uint32_t records = (uint32_t)cursor_uint(&t, 4);
+	  uint32_t record_size = (uint32_t)cursor_uint(&t, 4);
+	  uint32_t str_offset = 0, str_length = 0;
+
+	  for (uint32_t j = 0; j < records && !t.error; j++)
+	    {
+	      struct cursor rc = t;
+	      rc.p += (size_t)j * record_size;
+	      if (rc.p > rc.end)
+		break;
+	      uint32_t lang = (uint32_t)cursor_uint(&rc, 4);
+	      uint32_t length = (uint32_t)cursor_uint(&rc, 4);
+	      uint32_t offset = (uint32_t)cursor_uint(&rc, 4);
+	      if (rc.error)
+		break;
+	      if (j == 0 || lang == FOURCC('e','n','U','S'))
+		{
+		  str_offset = offset;
+		  str_length = length;
+		}
+	    }
+
+	  if (str_offset > size || str_length > size - str_offset)
+	    return nil;
+
+	  return [[NSString alloc] initWithBytes:
+		  (const uint8_t *)tag.bytes + str_offset
+		  length:str_length encoding:NSUTF16BigEndianStringEncoding];
+	}
+
+      return nil;
+    }
+
+  return nil;
+}
+
+/* TIFF directories, as used by EXIF and TIFF-based raw formats. */
+
+struct tiff
+{
+  __unsafe_unretained PDImageHeaderReader *r;
+  size_t base;			/* file offset of TIFF header */
+  size_t limit;			/* max offset relative to base */
+  BOOL be;
+  uint32_t ifd0;
+};
+
+struct tiff_entry
+{
+  uint16_t tag;
+  uint16_t type;
+  uint32_t count;
+  size_t offset;		/* file offset of the value */
+};
+
+enum tiff_type
+{
+  tiff_byte = 1,
+  tiff_ascii = 2,
+  tiff_short = 3,
+  tiff_long = 4,
+  tiff_rational = 5,
+  tiff_sbyte = 6,
+  tiff_undefined = 7,
+  tiff_sshort = 8,
+  tiff_slong = 9,
+  tiff_srational = 10,
+  tiff_float = 11,
+  tiff_double = 12,
+  tiff_ifd = 13,
+};
+
+static const uint8_t tiff_type_size[] = {0, 1, 1, 2, 4, 8, 1, 1,
+					 2, 4, 8, 4, 8, 4};
+
+static BOOL
+tiff_init(struct tiff *t, PDImageHeaderReader *r, size_t base,
+	  size_t limit)
+{
+  const uint8_t *p = reader_bytes(r, base, 8);
+  if (p == NULL || limit < 8)
+    return NO;
+
+  if (p[0] == 'I' && p[1] == 'I')
+    t->be = NO;
+  else if (p[0] == 'M' && p[1] == 'M')
+    t->be = YES;
+  else
+    return NO;
+
+  /* Panasonic ("IIU") and Olympus ("IIRO", "IIRS") raw files use
+     their own magic numbers. */
+
+  uint32_t magic = get_u16(p + 2, t->be);
+  if (magic != 42 && magic != 0x55 && magic != 0x4f52 && magic != 0x5352)
+    return NO;
+
+  t->r = r;
+  t->base = base;
+  t->limit = limit;
+  t->ifd0 = get_u32(p + 4, t->be);
+
+  return YES;
+}
+
+/* Calls 'block' for each entry of the directory at 'ifd'. Returns
+   false if the directory can't be read. */
+
+static BOOL
+tiff_foreach_entry(struct tiff *t, uint32_t ifd,
+		   void (^block)(const struct tiff_entry *e))
+{
+  if (ifd < 8 || ifd > t->limit - 2)
+    return NO;
+
+  const uint8_t *p = reader_bytes(t->r, t->base + ifd, 2);
+  if (p == NULL)
+    return NO;
+
+  uint32_t count = get_u16(p, t->be);
+  if ((size_t)count * 12 > t->limit - ifd - 2)
+    return NO;
+
+  for (uint32_t i = 0; i < count; i++)
+    {
+      size_t pos = t->base + ifd + 2 + i * 12;
+      p = reader_bytes(t->r, pos, 12);
+      if (p == NULL)
+	return NO;
+
+      struct tiff_entry e;
+      e.tag = get_u16(p, t->be);
+      e.type = get_u16(p + 2, t->be);
+      e.count = get_u32(p + 4, t->be);
+
+      if (e.type == 0 || e.type >= N_ELEMENTS(tiff_type_size))
+	continue;
+
+      uint64_t size = (uint64_t)e.count * tiff_type_size[e.type];
+      if (size <= 4)
+	e.offset = pos + 8;
+      else
+	{
+	  uint32_t offset = get_u32(p + 8, t->be);
+	  if (offset > t->limit || size > t->limit - offset)
+	    continue;
+	  e.offset = t->base + offset;
+	}
+
+      block(&e);
+    }
+
+  return YES;
+}
+
+static BOOL
+tiff_entry_double(struct tiff *t, const struct tiff_entry *e,
+		  uint32_t i, double *ret)
+{
+  if (i >= e->count)
+    return NO;
+
+  size_t size = tiff_type_size[e->type];
+  const uint8_t *p = reader_bytes(t->r, e->offset + i * size, size);
+  if (p == NULL)
+    return NO;
+
+  switch (e->type)
+    {
+    case tiff_byte:
+    case tiff_undefined:
+      *ret = p[0];
+      return YES;
+    case tiff_sbyte:
+      *ret = (int8_t)p[0];
+      return YES;
+    case tiff_short:
+      *ret = get_u16(p, t->be);
+      return YES;
+    case tiff_sshort:
+      *ret = (int16_t)get_u16(p, t->be);
+      return YES;
+    case tiff_long:
+    case tiff_ifd:
+      *ret = get_u32(p, t->be);
+      return YES;
+    case tiff_slong:
+      *ret = (int32_t)get_u32(p, t->be);
+      return YES;
+    case tiff_rational:
+      {
+	uint32_t d = get_u32(p + 4, t->be);
+	if (d == 0)
+	  return NO;
+	*ret = (double)get_u32(p, t->be) / d;
+	return YES;
+      }
+    case tiff_srational:
+      {
+	int32_t d = (int32_t)get_u32(p + 4, t->be);
+	if (d == 0)
+	  return NO;
+	*ret = (double)(int32_t)get_u32(p, t->be) / d;
+	return YES;
+      }
+    case tiff_float:
+      {
+	uint32_t x = get_u32(p, t->be);
+	float f;
+	memcpy(&f, &x, sizeof(f));
+	*ret = f;
+	return YES;
+      }
+    case tiff_double:
+      {
+	/* Combine the two words in file order, then swap them back
+	   if little-endian. */
+
+	uint64_t x = ((uint64_t)get_u32(p, t->be) << 32
+		      | get_u32(p + 4, t->be));
+	if (!t->be)
+	  x = (x << 32) | (x >> 32);
+	memcpy(ret, &x, sizeof(*ret));
+	return YES;
+      }
+    }
+
+  return NO;
+}
+
+static BOOL
+tiff_entry_uint(struct tiff *t, const struct tiff_entry *e,
+		uint32_t i, uint32_t *ret)
+{
+  double value;
+
+  if (e->type != tiff_byte && e->type != tiff_short
+      && e->type != tiff_long && e->type != tiff_undefined)
+    return NO;
+
+  if (!tiff_entry_double(t, e, i, &value))
+    return NO;
+
+  *ret = (uint32_t)value;
+  return YES;
+}
+
+/* Returns the value at index 'i' the way ImageIO represents it:
+   integer types as integers, everything else as doubles. */
+
+static NSNumber *
+tiff_entry_number(struct tiff *t, const struct tiff_entry *e, uint32_t i)
+{
+  double value;
+
+  if (e->type == tiff_ascii || !tiff_entry_double(t, e, i, &value))
+    return nil;
+
+  switch (e->type)
+    {
+    case tiff_rational:
+    case tiff_srational:
+    case tiff_float:
+    case tiff_double:
+      return @(value);
+    default:
+      return @((long long)value);
+    }
+}
+
+static NSString *
+tiff_entry_string(struct tiff *t, const struct tiff_entry *e)
+{
+  if (e->type != tiff_ascii)
+    return nil;
+
+  const uint8_t *p = reader_bytes(t->r, e->offset, e->count);
+  if (p == NULL)
+    return nil;
+
+  return string_from_bytes(p, e->count);
+}
+
+/* Things found in the TIFF directories that aren't properties in their
+   own right, but determine other properties. */
+
+struct tiff_info
+{
+  uint32_t width, height;
+  uint32_t exif_width, exif_height;
+  uint32_t photometric;
+  uint32_t color_space;
+  BOOL has_photometric;
+  BOOL has_color_space;
+  BOOL adobe_rgb;
+  BOOL has_maker_note;
+  BOOL needs_image_io;
+};
+
+/* EXIF tags copied directly to properties. */
+
+static NSString *
+exif_property_key(uint16_t tag)
+{
+  switch (tag)
+    {
+    case 0x829a:
+      return PDImage_ExposureLength;
+    case 0x829d:
+      return PDImage_FNumber;
+    case 0x8822:
+      return PDImage_ExposureProgram;
+    case 0x8830:
+      return PDImage_SensitivityType;
+    case 0x8833:
+      return PDImage_ISOSpeed;
+    case 0x9204:
+      return PDImage_ExposureBias;
+    case 0x9205:
+      return PDImage_MaxAperture;
+    case 0x9207:
+      return PDImage_MeteringMode;
+    case 0x9208:
+      return PDImage_LightSource;
+    case 0x9209:
+      return PDImage_Flash;
+    case 0x920a:
+      return PDImage_FocalLength;
+    case 0xa301:
+      return PDImage_SceneType;
+    case 0xa402:
+      return PDImage_ExposureMode;
+    case 0xa403:
+      return PDImage_WhiteBalance;
+    case 0xa405:
+      return PDImage_FocalLength35mm;
+    case 0xa406:
+      return PDImage_SceneCaptureType;
+    case 0xa408:
+      return PDImage_Contrast;
+    case 0xa409:
+      return PDImage_Saturation;
+    case 0xa40a:
+      return PDImage_Sharpness;
+    default:
+      return nil;
+    }
+}
+
+static void
+set_property(NSMutableDictionary *dict, NSString *key, id value)
+{
+  if (value != nil)
+    dict[key] = value;
+}
+
+static void
+set_date_property(NSMutableDictionary *dict, NSString *key, NSString *str)
+{
+  NSDate *date = str != nil ? PDImageParseEXIFDateString(str) : nil;
+
+  if (date != nil)
+    dict[key] = @((time_t)date.timeIntervalSince1970);
+}
+
+static void
+parse_exif_ifd(struct tiff *t, uint32_t ifd, NSMutableDictionary *dict,
+	       struct tiff_info *info)
+{
+  __block NSNumber *iso_rating = nil;
+  __block uint32_t interop_ifd = 0;
+
+  tiff_foreach_entry(t, ifd, ^(const struct tiff_entry *e)
+    {
+      NSString *key = exif_property_key(e->tag);
+
+      if (key != nil)
+	{
+	  set_property(dict, key, tiff_entry_number(t, e, 0));
+	  return;
+	}
+
+      switch (e->tag)
+	{
+	case 0x8827:			/* ISOSpeedRatings */
+	  iso_rating = tiff_entry_number(t, e, 0);
+	  break;
+	case 0x9003:			/* DateTimeOriginal */
+	  set_date_property(dict, PDImage_OriginalDate,
+			    tiff_entry_string(t, e));
+	  break;
+	case 0x9004:			/* DateTimeDigitized */
+	  set_date_property(dict, PDImage_DigitizedDate,
+			    tiff_entry_string(t, e));
+	  break;
+	case 0xa001:			/* ColorSpace */
+	  info->has_color_space = tiff_entry_uint(t, e, 0,
+						  &info->color_space);
+	  break;
+	case 0xa002:			/* PixelXDimension */
+	  tiff_entry_uint(t, e, 0, &info->exif_width);
+	  break;
+	case 0xa003:			/* PixelYDimension */
+	  tiff_entry_uint(t, e, 0, &info->exif_height);
+	  break;
+	case 0xa005:			/* InteroperabilityIFD */
+	  tiff_entry_uint(t, e, 0, &interop_ifd);
+	  break;
+	case 0x927c:			/* MakerNote */
+	  info->has_maker_note = YES;
+	  break;
+	}
+    });
+
+  /* ISOSpeed takes precedence over the older ISOSpeedRatings. */
+
+  if (iso_rating != nil && dict[PDImage_ISOSpeed] == nil)
+    dict[PDImage_ISOSpeed] = iso_rating;
+
+  /* Uncalibrated color space plus the "R03" interoperability index is
+     how cameras mark Adobe RGB images. */
+
+  if (interop_ifd != 0)
+    {
+      tiff_foreach_entry(t, interop_ifd, ^(const struct tiff_entry *e)
+	{
+	  if (e->tag == 0x0001
+	      && [tiff_entry_string(t, e) isEqualToString:@"R03"])
+	    info->adobe_rgb = YES;
+	});
+    }
+}
+
+static BOOL
+gps_coordinate(struct tiff *t, const struct tiff_entry *e, double *ret)
+{
+  double d, m, s;
+
+  if (e->count < 3 || !tiff_entry_double(t, e, 0, &d)
+      || !tiff_entry_double(t, e, 1, &m) || !tiff_entry_double(t, e, 2, &s))
+    return NO;
+
+  *ret = d + m / 60 + s / 3600;
+  return YES;
+}
+
+static void
+parse_gps_ifd(struct tiff *t, uint32_t ifd, NSMutableDictionary *dict)
+{
+  __block double lat = 0, lon = 0, alt = 0;
+  __block BOOL has_lat = NO, has_lon = NO, has_alt = NO;
+  __block NSString *lat_ref = nil, *lon_ref = nil, *dir_ref = nil;
+  __block uint32_t alt_ref = 0;
+  __block NSNumber *direction = nil;
+
+  tiff_foreach_entry(t, ifd, ^(const struct tiff_entry *e)
+    {
+      switch (e->tag)
+	{
+	case 0x01:
+	  lat_ref = tiff_entry_string(t, e);
+	  break;
+	case 0x02:
+	  has_lat = gps_coordinate(t, e, &lat);
+	  break;
+	case 0x03:
+	  lon_ref = tiff_entry_string(t, e);
+	  break;
+	case 0x04:
+	  has_lon = gps_coordinate(t, e, &lon);
+	  break;
+	case 0x05:
+	  tiff_entry_uint(t, e, 0, &alt_ref);
+	  break;
+	case 0x06:
+	  has_alt = tiff_entry_double(t, e, 0, &alt);
+	  break;
+	case 0x10:
+	  dir_ref = tiff_entry_string(t, e);
+	  break;
+	case 0x11:
+	  direction = tiff_entry_number(t, e, 0);
+	  break;
+	}
+    });
+
+  /* Same conventions as process_gps_dictionary(). */
+
+  if (has_lat)
+    dict[PDImage_Latitude] = @([lat_ref isEqualToString:@"S"] ? -lat : lat);
+  if (has_lon)
+    dict[PDImage_Longitude] = @([lon_ref isEqualToString:@"W"] ? -lon : lon);
+  if (has_alt)
+    dict[PDImage_Altitude] = @(alt_ref == 1 ? -alt : alt);
+
+  if (direction != nil)
+    {
+      dict[PDImage_Direction] = direction;
+      set_property(dict, PDImage_DirectionRef, dir_ref);
+    }
+}
+
+/* True if ImageIO decodes the maker notes of cameras made by 'make',
+   i.e. those it has a kCGImagePropertyMaker...Dictionary for. Their
+   ExifAux values (flash compensation, image stabilization) come from
+   the maker notes. */
+
+static BOOL
+image_io_decodes_maker_note(NSString *make)
+{
+  if (make == nil)
+    return NO;
+
+  for (NSString *str in @[@"Canon", @"Nikon", @"Olympus", @"Pentax",
+			  @"Fujifilm", @"Minolta"])
+    {
+      if ([make rangeOfString:str options:NSCaseInsensitiveSearch].length != 0)
+	return YES;
+    }
+
+  return NO;
+}
+
+/* Reads IFD0 and the EXIF and GPS directories it references. */
+
+static BOOL
+parse_tiff(struct tiff *t, NSMutableDictionary *dict,
+	   struct tiff_info *info)
+{
+  __block uint32_t exif_ifd = 0, gps_ifd = 0;
+
+  BOOL ok = tiff_foreach_entry(t, t->ifd0, ^(const struct tiff_entry *e)
+    {
+      switch (e->tag)
+	{
+	case 0x0100:			/* ImageWidth */
+	  tiff_entry_uint(t, e, 0, &info->width);
+	  break;
+	case 0x0101:			/* ImageLength */
+	  tiff_entry_uint(t, e, 0, &info->height);
+	  break;
+	case 0x0106:			/* PhotometricInterpretation */
+	  info->has_photometric = tiff_entry_uint(t, e, 0,
+						  &info->photometric);
+	  break;
+	case 0x010f:
+	  set_property(dict, PDImage_CameraMake, tiff_entry_string(t, e));
+	  break;
+	case 0x0110:
+	  set_property(dict, PDImage_CameraModel, tiff_entry_string(t, e));
+	  break;
+	case 0x0131:
+	  set_property(dict, PDImage_CameraSoftware,
+		       tiff_entry_string(t, e));
+	  break;
+	case 0x0112:
+	  set_property(dict, PDImage_Orientation,
+		       tiff_entry_number(t, e, 0));
+	  break;
+	case 0x8769:
+	  tiff_entry_uint(t, e, 0, &exif_ifd);
+	  break;
+	case 0x8825:
+	  tiff_entry_uint(t, e, 0, &gps_ifd);
+	  break;
+	}
+    });
+
+  if (!ok)
+    return NO;
+
+  if (exif_ifd != 0)
+    parse_exif_ifd(t, exif_ifd, dict, info);
+  if (gps_ifd != 0)
+    parse_gps_ifd(t, gps_ifd, dict);
+
+  /* Maker notes aren't parsed here, leave files whose maker notes
+     ImageIO would decode to ImageIO, so the properties match. */
+
+  if (info->has_maker_note
+      && image_io_decodes_maker_note(dict[PDImage_CameraMake]))
+    info->needs_image_io = YES;
+
+  return YES;
+}
+
+/* ImageIO names the profile of untagged images from their EXIF color
+   space. */
+
+static void
+set_profile_name(NSMutableDictionary *dict, NSData *icc,
+		 const struct tiff_info *info)
+{
+  NSString *name = nil;
+
+  if (icc != nil)
+    name = icc_profile_description(icc);
+  else if (info->has_color_space && info->color_space == 1)
+    name = @"sRGB IEC61966-2.1";
+  else if (info->has_color_space && info->color_space == 0xffff
+	   && info->adobe_rgb)
+    name = @"Adobe RGB (1998)";
+
+  if (name != nil)
+    dict[PDImage_ProfileName] = name;
+}
+
+/* IPTC and XMP keywords and rating, as ImageIO merges them. */
+
+static void
+parse_iptc(NSData *data, NSMutableArray *keywords)
+{
+  const uint8_t *p = data.bytes;
+  size_t length = data.length;
+  size_t i = 0;
+
+  while (i + 5 <= length && p[i] == 0x1c)
+    {
+      uint32_t record = p[i+1];
+      uint32_t dataset = p[i+2];
+      size_t size = get_u16(p + i + 3, YES);
+
+      /* Extended datasets aren't used for keywords. */
+
+      if (size & 0x8000)
+	break;
+      if (size > length - i - 5)
+	break;
+
+      if (record == 2 && dataset == 25)
+	{
+	  NSString *str = string_from_bytes(p + i + 5, size);
+	  if (str != nil)
+	    [keywords addObject:str];
+	}
+
+      i += 5 + size;
+    }
+}
+
+static void
+parse_photoshop_resources(NSData *data, NSMutableArray *keywords)
+{
+  const uint8_t *p = data.bytes;
+  size_t length = data.length;
+  size_t i = 0;
+
+  while (i + 12 <= length && memcmp(p + i, "8BIM", 4) == 0)
+    {
+      uint32_t rid = get_u16(p + i + 4, YES);
+      size_t name_size = (1 + p[i+6] + 1) & ~(size_t)1;
+      size_t pos = i + 6 + name_size;
+      if (pos + 4 > length)
+	break;
+      size_t size = get_u32(p + pos, YES);
+      pos += 4;
+      if (size > length - pos)
+	break;
+
+      if (rid == 0x0404)
+	{
+	  parse_iptc([data subdataWithRange:NSMakeRange(pos, size)],
+		     keywords);
+	}
+
+      i = pos + ((size + 1) & ~(size_t)1);
+    }
+}
+
+static NSString *
+xml_unescape(NSString *str)
+{
+  if ([str rangeOfString:@"&"].location == NSNotFound)
+    return str;
+
+  NSMutableString *ret = [str mutableCopy];
+  [ret replaceOccurrencesOfString:@"&lt;" withString:@"<"
+   options:0 range:NSMakeRange(0, ret.length)];
+  [ret replaceOccurrencesOfString:@"&gt;" withString:@">"
+   options:0 range:NSMakeRange(0, ret.length)];
+  [ret replaceOccurrencesOfString:@"&quot;" withString:@"\""
+   options:0 range:NSMakeRange(0, ret.length)];
+  [ret replaceOccurrencesOfString:@"&apos;" withString:@"'"
+   options:0 range:NSMakeRange(0, ret.length)];
+  [ret replaceOccurrencesOfString:@"&amp;" withString:@"&"
+   options:0 range:NSMakeRange(0, ret.length)];
+  return ret;
+}
+
+/* Not a general XMP parser, just enough to find the two properties
+   we map from it. */
+
+static void
+parse_xmp(NSData *data, NSMutableDictionary *dict, NSMutableArray *keywords)
+{
+  NSString *xmp = string_from_bytes(data.bytes, data.length);
+  if (xmp == nil)
+    return;
+
+  NSRange r = [xmp rangeOfString:@"xmp:Rating"];
+  if (r.location != NSNotFound)
+    {
+      NSScanner *scanner = [NSScanner scannerWithString:xmp];
+      scanner.scanLocation = NSMaxRange(r);
+      scanner.charactersToBeSkipped
+        = [NSCharacterSet characterSetWithCharactersInString:@" =\">"];
+      NSInteger rating;
+      if ([scanner scanInteger:&rating])
+	dict[PDImage_Rating] = @(rating);
+    }
+
+  if (keywords.count == 0)
+    {
+      NSRange start = [xmp rangeOfString:@"<dc:subject>"];
+      NSRange end = [xmp rangeOfString:@"</dc:subject>"];
+      if (start.location == NSNotFound || end.location == NSNotFound
+	  || end.location < NSMaxRange(start))
+	return;
+
+      NSString *subject = [xmp substringWithRange:
+			   NSMakeRange(NSMaxRange(start),
+				       end.location - NSMaxRange(start))];
+
+      for (NSString *item in [subject componentsSeparatedByString:
+			      @"<rdf:li>"])
+	{
+	  NSRange item_end = [item rangeOfString:@"</rdf:li>"];
+	  if (item_end.location != NSNotFound)
+	    {
+	      [keywords addObject:xml_unescape
+	       ([item substringToIndex:item_end.location])];
+	    }
+	}
+    }
+}
+
+/* JPEG. Everything needed is in the segments before the scan data. */
+
+static NSDictionary *
+parse_jpeg(PDImageHeaderReader *r)
+{
+  const uint8_t *p = reader_bytes(r, 0, 2);
+  if (p == NULL || p[0] != 0xff || p[1] != 0xd8)
+    return nil;
+
+  NSMutableDictionary *dict = [NSMutableDictionary dictionary];
+  NSMutableArray *keywords = [NSMutableArray array];
+  NSMutableDictionary *icc_chunks = nil;
+  NSData *xmp = nil;
+  struct tiff_info info = {0};
+  BOOL has_exif = NO, has_frame = NO;
+  uint32_t components = 0;
+  size_t pos = 2;
+
+  while (1)
+    {
+      p = reader_bytes(r, pos, 4);
+      if (p == NULL || p[0] != 0xff)
+	return nil;
+
+      uint32_t marker = p[1];
+
+      if (marker == 0xff)
+	{
+	  pos++;
+	  continue;
+	}
+      else if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd8))
+	{
+	  pos += 2;
+	  continue;
+	}
+      else if (marker == 0xd9 || marker == 0xda)
+	break;
+
+      size_t length = get_u16(p + 2, YES);
+      if (length < 2)
+	return nil;
+
+      size_t data_pos = pos + 4;
+      size_t data_length = length - 2;
+
+      /* SOFn, except DHT (c4), JPG (c8) and DAC (cc). */
+
+      if (!has_frame && marker >= 0xc0 && marker <= 0xcf
+	  && marker != 0xc4 && marker != 0xc8 && marker != 0xcc)
+	{
+	  p = reader_bytes(r, data_pos, 6);
+	  if (p == NULL)
+	    return nil;
+	  dict[PDImage_PixelHeight] = @(get_u16(p + 1, YES));
+	  dict[PDImage_PixelWidth] = @(get_u16(p + 3, YES));
+	  components = p[5];
+	  has_frame = YES;
+	}
+      else if (marker == 0xe1 && !has_exif && data_length >= 6
+	       && (p = reader_bytes(r, data_pos, 6)) != NULL
+	       && memcmp(p, "Exif\0\0", 6) == 0)
+	{
+	  struct tiff t;
+	  if (tiff_init(&t, r, data_pos + 6, data_length - 6))
+	    has_exif = parse_tiff(&t, dict, &info);
+	  if (info.needs_image_io)
+	    return nil;
+	}
+      else if (marker == 0xe1 && xmp == nil && data_length >= 29
+	       && (p = reader_bytes(r, data_pos, 29)) != NULL
+	       && memcmp(p, "http://ns.adobe.com/xap/1.0/", 29) == 0)
+	{
+	  xmp = reader_copy(r, data_pos + 29, data_length - 29);
+	}
+      else if (marker == 0xe2 && data_length >= 14
+	       && (p = reader_bytes(r, data_pos, 14)) != NULL
+	       && memcmp(p, "ICC_PROFILE", 12) == 0)
+	{
+	  /* Profiles may be split over several segments, p[12] is the
+	     sequence number. */
+
+	  NSNumber *seq = @(p[12]);
+	  NSData *chunk = reader_copy(r, data_pos + 14, data_length - 14);
+	  if (chunk != nil)
+	    {
+	      if (icc_chunks == nil)
+		icc_chunks = [NSMutableDictionary dictionary];
+	      icc_chunks[seq] = chunk;
+	    }
+	}
+      else if (marker == 0xed && data_length >= 14
+	       && (p = reader_bytes(r, data_pos, 14)) != NULL
+	       && memcmp(p, "Photoshop 3.0", 14) == 0)
+	{
+	  NSData *data = reader_copy(r, data_pos + 14, data_length - 14);
+	  if (data != nil)
+	    parse_photoshop_resources(data, keywords);
+	}
+
+      pos = data_pos + data_length;
+    }
+
+  if (!has_frame)
+    return nil;
+
+  if (components == 1)
+    dict[PDImage_ColorModel] = (__bridge id)kCGImagePropertyColorModelGray;
+  else if (components == 3)
+    dict[PDImage_ColorModel] = (__bridge id)kCGImagePropertyColorModelRGB;
+  else if (components == 4)
+    dict[PDImage_ColorModel] = (__bridge id)kCGImagePropertyColorModelCMYK;
+
+  NSMutableData *icc = nil;
+  if (icc_chunks != nil)
+    {
+      icc = [NSMutableData data];
+      for (NSNumber *seq in [icc_chunks.allKeys
+			     sortedArrayUsingSelector:@selector(compare:)])
+	[icc appendData:icc_chunks[seq]];
+    }
+
+  set_profile_name(dict, icc, &info);
+
+  if (xmp != nil)
+    parse_xmp(xmp, dict, keywords);
+  if (keywords.count != 0)
+    dict[PDImage_Keywords] = keywords;
+
+  return dict;
+}
+
+/* TIFF-based raw files. ImageIO reports the size of the developed
+   image, which is only recorded in the EXIF pixel dimensions. */
+
+static NSDictionary *
+parse_raw(PDImageHeaderReader *r)
+{
+  struct tiff t;
+  if (!tiff_init(&t, r, 0, UINT32_MAX))
+    return nil;
+
+  NSMutableDictionary *dict = [NSMutableDictionary dictionary];
+  struct tiff_info info = {0};
+
+  if (!parse_tiff(&t, dict, &info) || info.needs_image_io)
+    return nil;
+
+  if (info.exif_width == 0 || info.exif_height == 0)
+    return nil;
+
+  dict[PDImage_PixelWidth] = @(info.exif_width);
+  dict[PDImage_PixelHeight] = @(info.exif_height);
+  dict[PDImage_ColorModel] = (__bridge id)kCGImagePropertyColorModelRGB;
+
+  return dict;
+}
+
+/* HEIF (ISO base media file format). The metadata is in the 'meta'
+   box near the start of the file, EXIF data is stored as a separate
+   item that may be anywhere. */
+
+static BOOL
+heif_brand(uint32_t brand)
+{
+  switch (brand)
+    {
+    case FOURCC('h','e','i','c'):
+    case FOURCC('h','e','i','x'):
+    case FOURCC('h','e','i','m'):
+    case FOURCC('h','e','i','s'):
+    case FOURCC('m','i','f','1'):
+    case FOURCC('m','s','f','1'):
+      return YES;
+    default:
+      return NO;
+    }
+}
+
+/* Calls 'block' with the type and data range of each box in 'c'.
+   Stops early if 'block' returns false. */
+
+static void
+foreach_box(struct cursor *c,
+	    BOOL (^block)(uint32_t type, const uint8_t *p, size_t size))
+{
+  while (!c->error && c->p < c->end)
+    {
+      const uint8_t *start = c->p;
+      uint64_t size = cursor_uint(c, 4);
+      uint32_t type = (uint32_t)cursor_uint(c, 4);
+      if (size == 1)
+	size = cursor_uint(c, 8);
+      else if (size == 0)
+	size = c->end - start;
+      size_t header = c->p - start;
+      if (c->error || size < header || size > (uint64_t)(c->end - start))
+	{
+	  c->error = YES;
+	  return;
+	}
+
+      if (!block(type, c->p, size - header))
+	return;
+
+      c->p = start + size;
+    }
+}
+
+static NSDictionary *
+parse_heif(PDImageHeaderReader *r)
+{
+  /* Find the 'ftyp' and 'meta' boxes at the top level. */
+
+  size_t pos = 0, meta_pos = 0, meta_size = 0;
+  BOOL is_heif = NO;
+
+  while (meta_size == 0)
+    {
+      const uint8_t *p = reader_bytes(r, pos, 8);
+      if (p == NULL)
+	return nil;
+
+      uint64_t size = get_u32(p, YES);
+      uint32_t type = get_u32(p + 4, YES);
+      size_t header = 8;
+
+      if (size == 1)
+	{
+	  p = reader_bytes(r, pos + 8, 8);
+	  if (p == NULL)
+	    return nil;
+	  size = (uint64_t)get_u32(p, YES) << 32 | get_u32(p + 4, YES);
+	  header = 16;
+	}
+      if (size < header)
+	return nil;
+
+      if (pos == 0)
+	{
+	  if (type != FOURCC('f','t','y','p') || size > READ_CHUNK)
+	    return nil;
+	  p = reader_bytes(r, header, size - header);
+	  if (p == NULL)
+	    return nil;
+	  for (size_t i = 0; i + 4 <= size - header; i += 4)
+	    {
+	      /* Major brand, minor version, compatible brands. */
+	      if (i != 4 && heif_brand(get_u32(p + i, YES)))
+		is_heif = YES;
+	    }
+	  if (!is_heif)
+	    return nil;
+	}
+      else if (type == FOURCC('m','e','t','a'))
+	{
+	  meta_pos = pos + header;
+	  meta_size = size - header;
+	}
+      else if (type == FOURCC('m','d','a','t'))
+	return nil;
+
+      pos += size;
+    }
+
+  if (meta_size > MAX_BOX_SIZE)
+    return nil;
+
+  NSData *meta = reader_copy(r, meta_pos, meta_size);
+  if (meta == nil)
+    return nil;
+
+  __block struct cursor pitm = {0}, iinf = {0}, iloc = {0};
+  __block struct cursor ipco = {0}, ipma = {0};
+
+  struct cursor c;
+  cursor_init(&c, meta, 4);
+
+  foreach_box(&c, ^BOOL (uint32_t type, const uint8_t *p, size_t size)
+    {
+      struct cursor box = {p, p + size, NO};
+      switch (type)
+	{
+	case FOURCC('p','i','t','m'):
+	  pitm = box;
+	  break;
+	case FOURCC('i','i','n','f'):
+	  iinf = box;
+	  break;
+	case FOURCC('i','l','o','c'):
+	  iloc = box;
+	  break;
+	case FOURCC('i','p','r','p'):
+	  foreach_box(&box, ^BOOL (uint32_t type, const uint8_t *p,
+				   size_t size)
+	    {
+	      if (type == FOURCC('i','p','c','o'))
+		ipco = (struct cursor){p, p + size, NO};
+	      else if (type == FOURCC('i','p','m','a'))
+		ipma = (struct cursor){p, p + size, NO};
+	      return YES;
+	    });
+	  break;
+	}
+      return YES;
+    });
+
+  if (c.error || pitm.p == NULL || ipco.p == NULL || ipma.p == NULL)
+    return nil;
+
+  /* Primary item id. */
+
+  uint32_t version = (uint32_t)cursor_uint(&pitm, 4) >> 24;
+  uint32_t primary_id = (uint32_t)cursor_uint(&pitm, version == 0 ? 2 : 4);
+  if (pitm.error)
+    return nil;
+
+  /* The EXIF item, if any. */
+
+  __block uint32_t exif_id = 0;
+
+  if (iinf.p != NULL)
+    {
+      version = (uint32_t)cursor_uint(&iinf, 4) >> 24;
+      cursor_uint(&iinf, version == 0 ? 2 : 4);
+
+      foreach_box(&iinf, ^BOOL (uint32_t type, const uint8_t *p,
+				size_t size)
+	{
+	  if (type != FOURCC('i','n','f','e'))
+	    return YES;
+	  struct cursor infe = {p, p + size, NO};
+	  uint32_t v = (uint32_t)cursor_uint(&infe, 4) >> 24;
+	  if (v < 2)
+	    return YES;
+	  uint32_t item_id = (uint32_t)cursor_uint(&infe, v == 2 ? 2 : 4);
+	  cursor_uint(&infe, 2);
+	  uint32_t item_type = (uint32_t)cursor_uint(&infe, 4);
+	  if (!infe.error && item_type == FOURCC('E','x','i','f'))
+	    {
+	      exif_id = item_id;
+	      return NO;
+	    }
+	  return YES;
+	});
+    }
+
+  /* Property indices associated with the primary item (1-based). */
+
+  NSMutableIndexSet *props = [NSMutableIndexSet indexSet];
+
+  uint32_t vflags = (uint32_t)cursor_uint(&ipma, 4);
+  uint32_t entries = (uint32_t)cursor_uint(&ipma, 4);
+  for (uint32_t i = 0; i < entries && !ipma.error; i++)
+    {
+      uint32_t item_id = (uint32_t)cursor_uint(&ipma,
+					       (vflags >> 24) < 1 ? 2 : 4);
+      uint32_t count = (uint32_t)cursor_uint(&ipma, 1);
+      for (uint32_t j = 0; j < count; j++)
+	{
+	  uint32_t idx = (vflags & 1
+			  ? (uint32_t)cursor_uint(&ipma, 2) & 0x7fff
+			  : (uint32_t)cursor_uint(&ipma, 1) & 0x7f);
+	  if (item_id == primary_id && idx != 0)
+	    [props addIndex:idx];
+	}
+    }
+  if (ipma.error)
+    return nil;
+
+  NSMutableDictionary *dict = [NSMutableDictionary dictionary];
+  __block NSData *icc = nil;
+  __block NSUInteger idx = 0;
+
+  foreach_box(&ipco, ^BOOL (uint32_t type, const uint8_t *p, size_t size)
+    {
+      if (![props containsIndex:++idx])
+	return YES;
+
+      struct cursor prop = {p, p + size, NO};
+
+      if (type == FOURCC('i','s','p','e'))
+	{
+	  cursor_uint(&prop, 4);
+	  uint32_t width = (uint32_t)cursor_uint(&prop, 4);
+	  uint32_t height = (uint32_t)cursor_uint(&prop, 4);
+	  if (!prop.error)
+	    {
+	      dict[PDImage_PixelWidth] = @(width);
+	      dict[PDImage_PixelHeight] = @(height);
+	    }
+	}
+      else if (type == FOURCC('c','o','l','r') && size > 4)
+	{
+	  uint32_t colr_type = (uint32_t)cursor_uint(&prop, 4);
+	  if (colr_type == FOURCC('p','r','o','f')
+	      || colr_type == FOURCC('r','I','C','C'))
+	    icc = [NSData dataWithBytes:p + 4 length:size - 4];
+	}
+      return YES;
+    });
+
+  if (dict[PDImage_PixelWidth] == nil)
+    return nil;
+
+  dict[PDImage_ColorModel] = (__bridge id)kCGImagePropertyColorModelRGB;
+
+  struct tiff_info info = {0};
+
+  if (exif_id != 0 && iloc.p != NULL)
+    {
+      /* Find the single extent of the EXIF item. */
+
+      uint32_t v = (uint32_t)cursor_uint(&iloc, 4) >> 24;
+      uint32_t sizes = (uint32_t)cursor_uint(&iloc, 2);
+      size_t offset_size = (sizes >> 12) & 15;
+      size_t length_size = (sizes >> 8) & 15;
+      size_t base_size = (sizes >> 4) & 15;
+      size_t index_size = (v == 1 || v == 2) ? sizes & 15 : 0;
+      uint32_t items = (uint32_t)cursor_uint(&iloc, v < 2 ? 2 : 4);
+      uint64_t exif_offset = 0, exif_length = 0;
+
+      for (uint32_t i = 0; i < items && !iloc.error; i++)
+	{
+	  uint32_t item_id = (uint32_t)cursor_uint(&iloc, v < 2 ? 2 : 4);
+	  uint32_t method = 0;
+	  if (v == 1 || v == 2)
+	    method = (uint32_t)cursor_uint(&iloc, 2) & 15;
+	  cursor_uint(&iloc, 2);
+	  uint64_t base = cursor_uint(&iloc, base_size);
+	  uint32_t extents = (uint32_t)cursor_uint(&iloc, 2);
+	  for (uint32_t j = 0; j < extents && !iloc.error; j++)
+	    {
+	      cursor_uint(&iloc, index_size);
+	      uint64_t offset = cursor_uint(&iloc, offset_size);
+	      uint64_t length = cursor_uint(&iloc, length_size);
+	      if (item_id == exif_id && method == 0 && extents == 1)
+		{
+		  exif_offset = base + offset;
+		  exif_length = length;
+		}
+	    }
+	}
+
+      /* Item data starts with the offset of the TIFF header. */
+
+      const uint8_t *p = NULL;
+      if (exif_length > 4 && exif_length <= MAX_BOX_SIZE
+	  && (p = reader_bytes(r, exif_offset, 4)) != NULL)
+	{
+	  uint32_t header = get_u32(p, YES);
+	  struct tiff t;
+	  if (header < exif_length - 4
+	      && tiff_init(&t, r, exif_offset + 4 + header,
+			   exif_length - 4 - header))
+	    {
+	      parse_tiff(&t, dict, &info);
+	    }
+	}
+    }
+
+  if (info.needs_image_io)
+    return nil;
+
+  set_profile_name(dict, icc, &info);
+
+  return dict;
+}
+
+NSDictionary *
+PDImageHeaderCopyProperties(NSString *type,
+    NSData *(^read)(size_t offset, size_t length))
+{
+  if (type == nil)
+    return nil;
+
+  CFStringRef uti = (__bridge CFStringRef)type;
+
+  NSDictionary *(*parse)(PDImageHeaderReader *r);
+
+  if (UTTypeConformsTo(uti, kUTTypeJPEG))
+    parse = parse_jpeg;
+  else if (UTTypeConformsTo(uti, CFSTR("public.heif")))
+    parse = parse_heif;
+  else if (UTTypeConformsTo(uti, CFSTR("public.camera-raw-image")))
+    parse = parse_raw;
+  else
+    return nil;
+
+  PDImageHeaderReader *r = [[PDImageHeaderReader alloc] init];
+  r->_read = read;
+  r->_head = [NSMutableData data];
+
+  return [parse(r) copy];
+}
+
+NSSet *
+PDImageHeaderPropertyKeys(void)
+{
+  static NSSet *keys;
+  static dispatch_once_t once;
+
+  dispatch_once(&once, ^
+    {
+      keys = [[NSSet alloc] initWithObjects:
+	      PDImage_Altitude,
+	      PDImage_CameraMake,
+	      PDImage_CameraModel,
+	      PDImage_CameraSoftware,
+	      PDImage_ColorModel,
+	      PDImage_Contrast,
+	      PDImage_DigitizedDate,
+	      PDImage_Direction,
+	      PDImage_DirectionRef,
+	      PDImage_ExposureBias,
+	      PDImage_ExposureLength,
+	      PDImage_ExposureMode,
+	      PDImage_ExposureProgram,
+	      PDImage_Flash,
+	      PDImage_FNumber,
+	      PDImage_FocalLength,
+	      PDImage_FocalLength35mm,
+	      PDImage_ISOSpeed,
+	      PDImage_Keywords,
+	      PDImage_Latitude,
+	      PDImage_LightSource,
+	      PDImage_Longitude,
+	      PDImage_MaxAperture,
+	      PDImage_MeteringMode,
+	      PDImage_Orientation,
+	      PDImage_OriginalDate,
+	      PDImage_PixelHeight,
+	      PDImage_PixelWidth,
+	      PDImage_ProfileName,
+	      PDImage_Rating,
+	      PDImage_Saturation,
+	      PDImage_SceneCaptureType,
+	      PDImage_SceneType,
+	      PDImage_SensitivityType,
+	      PDImage_Sharpness,
+	      PDImage_WhiteBalance,
+	      nil];
+    });
+
+  return keys;
+}
+
+@implementation PDImageHeaderReader
+@end
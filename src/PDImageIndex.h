@@ -0,0 +1,86 @@
+/* -*- c-style: gnu -*-
+
+   Copyright (c) 2013 John Harper <jsh@unfactored.org>
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE. */
+
+#import <Foundation/Foundation.h>
+
+@class PDImage;
+
+/* Secondary indexes over a fixed list of images (normally every image
+   in the library sidebar), so that common queries don't have to visit
+   each image: a set of images per rating value, the sets of flagged,
+   hidden and deleted images, the images ordered by date, an inverted
+   index of keywords, and the images by UUID. The indexes are kept
+   current by observing PDImagePropertyDidChange; the owner must create
+   a new index when the list of images itself changes. Main thread
+   only. */
+
+@interface PDImageIndex : NSObject
+
+- (id)initWithImages:(NSArray *)images;
+
+/* Also carries over the cached query results of 'old', so only images
+   that weren't in 'old' need to be tested against their predicates. */
+
+- (id)initWithImages:(NSArray *)images previousIndex:(PDImageIndex *)old;
+
+@property(nonatomic, copy, readonly) NSArray *images;
+
+/* Calls 'thunk' for each image matching 'pred' (all images if nil),
+   in the order of 'images'. The indexes are used to find candidate
+   images, which are then filtered by evaluating 'pred' unless the
+   indexes answered it exactly. Returns false if 'thunk' set its stop
+   flag, like -[PDLibraryItem foreachSubimage:]. */
+
+- (BOOL)foreachImageMatchingPredicate:(NSPredicate *)pred
+    usingBlock:(void (^)(PDImage *im, BOOL *stop))thunk;
+
+/* Like -foreachImageMatchingPredicate:usingBlock:, but keeps the set
+   of images matching 'pred' and updates it as their properties change,
+   so that repeating the query (e.g. selecting a smart album again)
+   doesn't test any images. Predicates whose dependencies can't be
+   tracked are evaluated as usual. */
+
+- (BOOL)foreachImageMatchingCachedPredicate:(NSPredicate *)pred
+    usingBlock:(void (^)(PDImage *im, BOOL *stop))thunk;
+
+/* Returns the number of images matching 'pred' whose deleted flag
+   matches 'deleted', not counting hidden images unless 'hidden' is
+   true. Uses the same cached results as the method above. */
+
+- (NSInteger)countOfImagesMatchingCachedPredicate:(NSPredicate *)pred
+    deleted:(BOOL)deleted includingHidden:(BOOL)hidden;
+
+/* Returns the image whose UUID is 'uuid', or nil if there isn't one,
+   e.g. if an album refers to an image that no longer exists. */
+
+- (PDImage *)imageWithUUID:(NSUUID *)uuid;
+
+/* Returns the number of images in 'range' of 'images' whose deleted
+   flag matches 'deleted', not counting hidden images unless 'hidden'
+   is true. */
+
+- (NSInteger)countOfImagesInRange:(NSRange)range deleted:(BOOL)deleted
+    includingHidden:(BOOL)hidden;
+
+@end
@@ -0,0 +1,1173 @@
+/* -*- c-style: gnu -*-
+
+   Copyright (c) 2013 John Harper <jsh@unfactored.org>
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE. */
+
+#import "PDImageIndex.h"
+
+#import "PDImage.h"
+#import "PDImageProperty.h"
+#import "PDMacros.h"
+#import "PDPropertyCache.h"
+
+#import <stdlib.h>
+#import <string.h>
+
+#define MIN_RATING -1
+#define MAX_RATING 5
+
+/* One bucket per integral rating in [MIN_RATING, MAX_RATING], plus
+   a final bucket for any other value. */
+
+#define RATING_BUCKETS (MAX_RATING - MIN_RATING + 2)
+#define OTHER_RATING (RATING_BUCKETS - 1)
+
+/* Cached query results are kept for the most recently used predicates
+   only. Results of predicates calling functions, e.g. "now() - 1 year"
+   in the default smart albums, expire after a while. */
+
+#define MAX_CACHED_QUERIES 32
+#define VOLATILE_QUERY_LIFETIME 60
+
+enum
+{
+  INDEX_RATING = 1U << 0,
+  INDEX_FLAGS = 1U << 1,
+  INDEX_DATE = 1U << 2,
+  INDEX_KEYWORDS = 1U << 3,
+  INDEX_ALL = ~0U,
+};
+
+/* Bitsets have one bit per image, stored in 64-bit words. Bits past
+   the last image are always zero. */
+
+static inline uint64_t *
+bitset_new(size_t words)
+{
+  return calloc(MAX(words, 1), sizeof(uint64_t));
+}
+
+static inline void
+bitset_set(uint64_t *set, NSInteger i, BOOL flag)
+{
+  uint64_t bit = (uint64_t)1 << (i & 63);
+
+  if (flag)
+    set[i >> 6] |= bit;
+  else
+    set[i >> 6] &= ~bit;
+}
+
+static inline void
+bitset_or(uint64_t *dst, const uint64_t *src, size_t words)
+{
+  for (size_t i = 0; i < words; i++)
+    dst[i] |= src[i];
+}
+
+static inline void
+bitset_and(uint64_t *dst, const uint64_t *src, size_t words)
+{
+  for (size_t i = 0; i < words; i++)
+    dst[i] &= src[i];
+}
+
+static inline BOOL
+bitset_empty_p(const uint64_t *set, size_t words)
+{
+  for (size_t i = 0; i < words; i++)
+    {
+      if (set[i] != 0)
+	return NO;
+    }
+
+  return YES;
+}
+
+/* Sets bits [start, end) of 'set'. */
+
+static void
+bitset_set_range(uint64_t *set, NSInteger start, NSInteger end)
+{
+  while (start < end && (start & 63) != 0)
+    bitset_set(set, start++, YES);
+
+  for (; start + 64 <= end; start += 64)
+    set[start >> 6] = ~(uint64_t)0;
+
+  for (; start < end; start++)
+    bitset_set(set, start, YES);
+}
+
+/* Inverts 'set' in place, keeping the bits past 'count' clear. */
+
+static void
+bitset_complement(uint64_t *set, NSInteger count, size_t words)
+{
+  for (size_t i = 0; i < words; i++)
+    set[i] = ~set[i];
+
+  if ((count & 63) != 0)
+    set[words - 1] &= ~(~(uint64_t)0 << (count & 63));
+  else if (count == 0)
+    set[0] = 0;
+}
+
+/* True if 'expr' doesn't depend on the object being evaluated, e.g.
+   the "now() - 1 year" expressions in the default smart albums. */
+
+static BOOL
+constant_expression_p(NSExpression *expr)
+{
+  switch (expr.expressionType)
+    {
+    case NSConstantValueExpressionType:
+      return YES;
+
+    case NSFunctionExpressionType:
+      if (!constant_expression_p(expr.operand))
+	return NO;
+      for (NSExpression *arg in expr.arguments)
+	{
+	  if (!constant_expression_p(arg))
+	    return NO;
+	}
+      return YES;
+
+    default:
+      return NO;
+    }
+}
+
+/* Evaluates 'pred' as if the image's value of 'key' was 'value'. Sets
+   'failed' if the predicate can't be evaluated that way. */
+
+static BOOL
+evaluate_predicate(NSPredicate *pred, NSString *key, id value, BOOL *failed)
+{
+  @try {
+    return [pred evaluateWithObject:@{key: value}];
+  } @catch (id exception) {
+    *failed = YES;
+    return NO;
+  }
+}
+
+static NSInteger
+lower_bound(const double *dates, const uint32_t *order, NSInteger count,
+	    double x, BOOL inclusive)
+{
+  /* Returns the first position whose date is >= x (or > x if not
+     'inclusive'). */
+
+  NSInteger lo = 0, hi = count;
+
+  while (lo < hi)
+    {
+      NSInteger mid = lo + (hi - lo) / 2;
+      double d = dates[order[mid]];
+      if (inclusive ? d < x : d <= x)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+
+  return lo;
+}
+
+/* Returns the image keys that 'expr' reads, adding them to 'keys'.
+   Returns false if it can't tell, e.g. if 'expr' uses SELF. Sets
+   'calls' if it contains any function calls. */
+
+static BOOL
+expression_keys(NSExpression *expr, NSMutableSet *keys, BOOL *calls)
+{
+  switch (expr.expressionType)
+    {
+    case NSConstantValueExpressionType:
+      return YES;
+
+    case NSKeyPathExpressionType: {
+      NSString *path = expr.keyPath;
+      NSRange r = [path rangeOfString:@"."];
+      if (r.length != 0)
+	path = [path substringToIndex:r.location];
+      [keys addObject:path];
+      return YES; }
+
+    case NSFunctionExpressionType:
+      *calls = YES;
+      if (!expression_keys(expr.operand, keys, calls))
+	return NO;
+      for (NSExpression *arg in expr.arguments)
+	{
+	  if (!expression_keys(arg, keys, calls))
+	    return NO;
+	}
+      return YES;
+
+    case NSAggregateExpressionType:
+      if (![expr.collection isKindOfClass:[NSArray class]])
+	return NO;
+      for (NSExpression *sub in expr.collection)
+	{
+	  if (!expression_keys(sub, keys, calls))
+	    return NO;
+	}
+      return YES;
+
+    default:
+      return NO;
+    }
+}
+
+static BOOL
+predicate_keys(NSPredicate *pred, NSMutableSet *keys, BOOL *calls)
+{
+  if ([pred isKindOfClass:[NSCompoundPredicate class]])
+    {
+      for (NSPredicate *sub in ((NSCompoundPredicate *)pred).subpredicates)
+	{
+	  if (!predicate_keys(sub, keys, calls))
+	    return NO;
+	}
+      return YES;
+    }
+  else if ([pred isKindOfClass:[NSComparisonPredicate class]])
+    {
+      NSComparisonPredicate *c_pred = (NSComparisonPredicate *)pred;
+      if (c_pred.predicateOperatorType == NSCustomSelectorPredicateOperatorType)
+	return NO;
+      return (expression_keys(c_pred.leftExpression, keys, calls)
+	      && expression_keys(c_pred.rightExpression, keys, calls));
+    }
+  else
+    return [pred isEqual:[NSPredicate predicateWithValue:YES]]
+	    || [pred isEqual:[NSPredicate predicateWithValue:NO]];
+}
+
+/* The keys whose values may change when image property 'key' does. */
+
+static NSSet *
+dependent_keys(NSString *key)
+{
+  static NSDictionary *dict;
+  static dispatch_once_t once;
+
+  dispatch_once(&once, ^
+    {
+      NSArray *words = @[PDImage_Words];
+      dict = @{
+	PDImage_Rating: @[PDImage_Rejected],
+	PDImage_OriginalDate: @[PDImage_Date],
+	PDImage_DigitizedDate: @[PDImage_Date],
+	PDImage_Name: words,
+	PDImage_Title: words,
+	PDImage_Caption: words,
+	PDImage_Keywords: words,
+      };
+    });
+
+  NSMutableSet *set = [NSMutableSet setWithObject:key];
+  NSArray *array = dict[key];
+  if (array != nil)
+    [set addObjectsFromArray:array];
+
+  return set;
+}
+
+/* The materialized result of a predicate: the images matching it, in
+   the index's image order. Updated as image properties change. */
+
+@interface PDImageIndexQuery : NSObject
+{
+@public
+  NSPredicate *_predicate;
+  PDImagePredicateBlock _filter;
+  NSSet *_keys;
+  NSTimeInterval _expires;		/* zero if never */
+  uint64_t *_matches;
+}
+@end
+
+@implementation PDImageIndexQuery
+
+- (void)dealloc
+{
+  free(_matches);
+}
+
+@end
+
+@implementation PDImageIndex
+{
+  NSArray *_images;
+  NSInteger _count;
+  size_t _words;
+
+  NSMapTable *_positions;		/* PDImage -> NSNumber/NSIndexSet */
+  NSMutableDictionary *_uuids;		/* NSUUID -> PDImage */
+
+  NSInteger _ratingRecordIndex;
+  uint64_t *_ratings[RATING_BUCKETS];
+  uint8_t *_ratingOf;
+
+  uint64_t *_flagged;
+  uint64_t *_hidden;
+  uint64_t *_deleted;
+
+  /* Built by the first query that needs them, as they may need each
+     image's cached properties to be loaded. */
+
+  double *_dates;
+  uint32_t *_dateOrder;
+  BOOL _dateOrderValid;
+
+  NSMutableDictionary *_keywords;	/* NSString -> NSMutableData */
+  NSMutableArray *_keywordsOf;		/* NSArray or NSNull per image */
+  uint64_t *_otherKeywords;
+
+  NSMutableArray *_queries;		/* PDImageIndexQuery, LRU first */
+}
+
+@synthesize images = _images;
+
+- (id)initWithImages:(NSArray *)images
+{
+  return [self initWithImages:images previousIndex:nil];
+}
+
+- (id)initWithImages:(NSArray *)images previousIndex:(PDImageIndex *)old
+{
+  self = [super init];
+  if (self == nil)
+    return nil;
+
+  _images = [images copy];
+  _count = _images.count;
+  _words = (_count + 63) / 64;
+
+  _positions = [NSMapTable strongToStrongObjectsMapTable];
+  _uuids = [[NSMutableDictionary alloc] init];
+
+  NSInteger i = 0;
+  for (PDImage *im in _images)
+    {
+      NSUUID *uuid = [im UUIDIfDefined];
+      if (uuid != nil)
+	_uuids[uuid] = im;
+
+      id pos = [_positions objectForKey:im];
+      if (pos == nil)
+	[_positions setObject:@(i) forKey:im];
+      else
+	{
+	  NSMutableIndexSet *set = [NSMutableIndexSet indexSet];
+	  if ([pos isKindOfClass:[NSNumber class]])
+	    [set addIndex:[pos unsignedIntegerValue]];
+	  else
+	    [set addIndexes:pos];
+	  [set addIndex:i];
+	  [_positions setObject:set forKey:im];
+	}
+      i++;
+    }
+
+  _ratingRecordIndex = [PDPropertyCache recordIndexOfKey:PDImage_Rating];
+
+  for (size_t b = 0; b < RATING_BUCKETS; b++)
+    _ratings[b] = bitset_new(_words);
+  _ratingOf = calloc(MAX(_count, 1), sizeof(uint8_t));
+
+  _flagged = bitset_new(_words);
+  _hidden = bitset_new(_words);
+  _deleted = bitset_new(_words);
+
+  for (i = 0; i < _count; i++)
+    [self updateImageAtIndex:i indexes:INDEX_RATING | INDEX_FLAGS];
+
+  _queries = [[NSMutableArray alloc] init];
+
+  if (old != nil)
+    [self copyQueriesFromIndex:old];
+
+  [[NSNotificationCenter defaultCenter]
+   addObserver:self selector:@selector(imagePropertyDidChange:)
+   name:PDImagePropertyDidChange object:nil];
+
+  return self;
+}
+
+- (void)dealloc
+{
+  [[NSNotificationCenter defaultCenter] removeObserver:self];
+
+  for (size_t b = 0; b < RATING_BUCKETS; b++)
+    free(_ratings[b]);
+  free(_ratingOf);
+  free(_flagged);
+  free(_hidden);
+  free(_deleted);
+  free(_dates);
+  free(_dateOrder);
+  free(_otherKeywords);
+}
+
+- (void)updateImageAtIndex:(NSInteger)i indexes:(unsigned int)mask
+{
+  PDImage *im = _images[i];
+
+  if (mask & INDEX_RATING)
+    {
+      /* Same value that compiled predicates test. */
+
+      double r = [im numericImagePropertyForKey:PDImage_Rating
+		  recordIndex:_ratingRecordIndex];
+
+      size_t b = OTHER_RATING;
+      if (r >= MIN_RATING && r <= MAX_RATING && r == (int)r)
+	b = (int)r - MIN_RATING;
+
+      bitset_set(_ratings[_ratingOf[i]], i, NO);
+      bitset_set(_ratings[b], i, YES);
+      _ratingOf[i] = (uint8_t)b;
+    }
+
+  if (mask & INDEX_FLAGS)
+    {
+      bitset_set(_flagged, i, im.flagged);
+      bitset_set(_hidden, i, im.hidden);
+      bitset_set(_deleted, i, im.deleted);
+    }
+
+  if ((mask & INDEX_DATE) && _dates != NULL)
+    {
+      /* Whole seconds, as dates are compared in predicates. */
+
+      _dates[i] = (unsigned long)[im.date timeIntervalSince1970];
+      _dateOrderValid = NO;
+    }
+
+  if ((mask & INDEX_KEYWORDS) && _keywords != nil)
+    {
+      id old_keywords = _keywordsOf[i];
+      if (old_keywords != [NSNull null])
+	{
+	  for (NSString *str in old_keywords)
+	    bitset_set([_keywords[str] mutableBytes], i, NO);
+	}
+
+      id keywords = im[PDImage_Keywords];
+      BOOL valid = keywords == nil || [keywords isKindOfClass:[NSArray class]];
+
+      if (valid)
+	{
+	  for (id str in keywords)
+	    {
+	      if (![str isKindOfClass:[NSString class]])
+		valid = NO;
+	    }
+	}
+
+      if (valid && keywords != nil)
+	{
+	  for (NSString *str in keywords)
+	    {
+	      NSMutableData *data = _keywords[str];
+	      if (data == nil)
+		{
+		  data = [NSMutableData dataWithLength:
+			  MAX(_words, 1) * sizeof(uint64_t)];
+		  _keywords[str] = data;
+		}
+	      bitset_set([data mutableBytes], i, YES);
+	    }
+	  _keywordsOf[i] = keywords;
+	}
+      else
+	_keywordsOf[i] = [NSNull null];
+
+      bitset_set(_otherKeywords, i, !valid);
+    }
+}
+
+- (void)imagePropertyDidChange:(NSNotification *)note
+{
+  id pos = [_positions objectForKey:note.object];
+  if (pos == nil)
+    return;
+
+  NSString *key = note.userInfo[@"key"];
+  unsigned int mask = 0;
+
+  [self updateQueriesForImage:note.object positions:pos key:key];
+
+  if ([key isEqualToString:PDImage_UUID])
+    {
+      /* Entries for the old UUID are rejected by -imageWithUUID:. */
+
+      NSUUID *uuid = [note.object UUIDIfDefined];
+      if (uuid != nil)
+	_uuids[uuid] = note.object;
+      return;
+    }
+
+  if ([key isEqualToString:PDImage_Rating])
+    mask = INDEX_RATING;
+  else if ([key isEqualToString:PDImage_Flagged]
+	   || [key isEqualToString:PDImage_Hidden]
+	   || [key isEqualToString:PDImage_Deleted])
+    mask = INDEX_FLAGS;
+  else if ([key isEqualToString:PDImage_OriginalDate]
+	   || [key isEqualToString:PDImage_DigitizedDate])
+    mask = INDEX_DATE;
+  else if ([key isEqualToString:PDImage_Keywords])
+    mask = INDEX_KEYWORDS;
+  else if ([key isEqualToString:PDImage_ActiveType]
+	   || [key isEqualToString:PDImage_FileTypes])
+    {
+      /* The image's implicit properties are from a different file. */
+
+      mask = INDEX_ALL;
+    }
+
+  if (mask == 0)
+    return;
+
+  if ([pos isKindOfClass:[NSNumber class]])
+    [self updateImageAtIndex:[pos integerValue] indexes:mask];
+  else
+    {
+      [pos enumerateIndexesUsingBlock:^(NSUInteger idx, BOOL *stop)
+	{
+	  [self updateImageAtIndex:idx indexes:mask];
+	}];
+    }
+}
+
+- (void)updateQueriesForImage:(PDImage *)im positions:(id)pos
+    key:(NSString *)key
+{
+  if (_queries.count == 0)
+    return;
+
+  /* Changing the image's file may change any of its properties. */
+
+  NSSet *keys = nil;
+  if (!([key isEqualToString:PDImage_ActiveType]
+	|| [key isEqualToString:PDImage_FileTypes]))
+    keys = dependent_keys(key);
+
+  for (PDImageIndexQuery *query in _queries)
+    {
+      if (keys != nil && ![keys intersectsSet:query->_keys])
+	continue;
+
+      BOOL flag = query->_filter(im);
+
+      if ([pos isKindOfClass:[NSNumber class]])
+	bitset_set(query->_matches, [pos integerValue], flag);
+      else
+	{
+	  [pos enumerateIndexesUsingBlock:^(NSUInteger idx, BOOL *stop)
+	    {
+	      bitset_set(query->_matches, idx, flag);
+	    }];
+	}
+    }
+}
+
+/* Reuses the results of 'old's queries for images in both indexes, so
+   that only images added since need to be tested. 'old' has kept its
+   results current, as it still observes property changes. */
+
+- (void)copyQueriesFromIndex:(PDImageIndex *)old
+{
+  NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+
+  for (PDImageIndexQuery *old_query in old->_queries)
+    {
+      if (old_query->_expires != 0 && old_query->_expires <= now)
+	continue;
+
+      PDImageIndexQuery *query = [[PDImageIndexQuery alloc] init];
+      query->_predicate = old_query->_predicate;
+      query->_filter = old_query->_filter;
+      query->_keys = old_query->_keys;
+      query->_expires = old_query->_expires;
+      query->_matches = bitset_new(_words);
+
+      const uint64_t *old_matches = old_query->_matches;
+
+      for (NSInteger i = 0; i < _count; i++)
+	{
+	  PDImage *im = _images[i];
+	  id pos = [old->_positions objectForKey:im];
+	  BOOL flag;
+
+	  if (pos == nil)
+	    flag = query->_filter(im);
+	  else
+	    {
+	      NSInteger j = ([pos isKindOfClass:[NSNumber class]]
+			     ? [pos integerValue] : [pos firstIndex]);
+	      flag = (old_matches[j >> 6] >> (j & 63)) & 1;
+	    }
+
+	  if (flag)
+	    bitset_set(query->_matches, i, YES);
+	}
+
+      [_queries addObject:query];
+    }
+}
+
+- (void)buildDateIndex
+{
+  if (_dates == NULL)
+    {
+      _dates = malloc(MAX(_count, 1) * sizeof(double));
+      _dateOrder = malloc(MAX(_count, 1) * sizeof(uint32_t));
+
+      for (NSInteger i = 0; i < _count; i++)
+	[self updateImageAtIndex:i indexes:INDEX_DATE];
+    }
+
+  if (!_dateOrderValid)
+    {
+      for (NSInteger i = 0; i < _count; i++)
+	_dateOrder[i] = (uint32_t)i;
+
+      const double *dates = _dates;
+
+      qsort_b(_dateOrder, _count, sizeof(uint32_t), ^int (const void *a,
+							 const void *b)
+	{
+	  uint32_t ia = *(const uint32_t *)a, ib = *(const uint32_t *)b;
+	  double da = dates[ia], db = dates[ib];
+	  return (da < db ? -1 : da > db ? 1
+		  : ia < ib ? -1 : ia > ib ? 1 : 0);
+	});
+
+      _dateOrderValid = YES;
+    }
+}
+
+- (void)buildKeywordIndex
+{
+  if (_keywords == nil)
+    {
+      _keywords = [NSMutableDictionary dictionary];
+      _keywordsOf = [NSMutableArray arrayWithCapacity:_count];
+      _otherKeywords = bitset_new(_words);
+
+      for (NSInteger i = 0; i < _count; i++)
+	{
+	  [_keywordsOf addObject:[NSNull null]];
+	  [self updateImageAtIndex:i indexes:INDEX_KEYWORDS];
+	}
+    }
+}
+
+/* The -candidates... methods return a malloc'd bitset containing at
+   least the images matching the predicate, setting 'exact' if it
+   contains exactly those images, or null if the indexes can't help. */
+
+- (uint64_t *)candidatesForRatingPredicate:(NSComparisonPredicate *)pred
+    key:(NSString *)key exact:(BOOL *)exact
+{
+  BOOL rejected = [key isEqualToString:PDImage_Rejected];
+  BOOL failed = NO;
+
+  uint64_t *set = bitset_new(_words);
+
+  for (int r = MIN_RATING; r <= MAX_RATING; r++)
+    {
+      id value = rejected ? @(r < 0) : @(r);
+      if (evaluate_predicate(pred, key, value, &failed))
+	bitset_or(set, _ratings[r - MIN_RATING], _words);
+    }
+
+  if (failed)
+    {
+      free(set);
+      return NULL;
+    }
+
+  *exact = bitset_empty_p(_ratings[OTHER_RATING], _words);
+  bitset_or(set, _ratings[OTHER_RATING], _words);
+
+  return set;
+}
+
+- (uint64_t *)candidatesForFlagPredicate:(NSComparisonPredicate *)pred
+    key:(NSString *)key flags:(const uint64_t *)flags exact:(BOOL *)exact
+{
+  BOOL failed = NO;
+  BOOL when_set = evaluate_predicate(pred, key, @YES, &failed);
+  BOOL when_clear = evaluate_predicate(pred, key, @NO, &failed);
+
+  if (failed)
+    return NULL;
+
+  uint64_t *set = bitset_new(_words);
+
+  if (when_set || when_clear)
+    {
+      memcpy(set, flags, _words * sizeof(uint64_t));
+      if (!when_set)
+	bitset_complement(set, _count, _words);
+      else if (when_clear)
+	bitset_set_range(set, 0, _count);
+    }
+
+  *exact = YES;
+  return set;
+}
+
+- (uint64_t *)candidatesForDatePredicate:(NSComparisonPredicate *)pred
+    exact:(BOOL *)exact
+{
+  if (pred.comparisonPredicateModifier != NSDirectPredicateModifier)
+    return NULL;
+
+  NSPredicateOperatorType op = pred.predicateOperatorType;
+
+  switch (op)
+    {
+    case NSLessThanPredicateOperatorType:
+    case NSLessThanOrEqualToPredicateOperatorType:
+    case NSGreaterThanPredicateOperatorType:
+    case NSGreaterThanOrEqualToPredicateOperatorType:
+    case NSEqualToPredicateOperatorType:
+    case NSNotEqualToPredicateOperatorType:
+      break;
+    default:
+      return NULL;
+    }
+
+  id value = nil;
+  @try {
+    value = [pred.rightExpression expressionValueWithObject:nil context:nil];
+  } @catch (id exception) {
+    return NULL;
+  }
+
+  if (![value isKindOfClass:[NSDate class]])
+    return NULL;
+
+  [self buildDateIndex];
+
+  double x = [value timeIntervalSince1970];
+  NSInteger lo = lower_bound(_dates, _dateOrder, _count, x, YES);
+  NSInteger hi = lower_bound(_dates, _dateOrder, _count, x, NO);
+
+  /* Positions [start, end) of the date order match, or don't match
+     when 'invert' is set. */
+
+  NSInteger start = 0, end = _count;
+  BOOL invert = NO;
+
+  switch (op)
+    {
+    case NSLessThanPredicateOperatorType:
+      end = lo;
+      break;
+    case NSLessThanOrEqualToPredicateOperatorType:
+      end = hi;
+      break;
+    case NSGreaterThanPredicateOperatorType:
+      start = hi;
+      break;
+    case NSGreaterThanOrEqualToPredicateOperatorType:
+      start = lo;
+      break;
+    case NSEqualToPredicateOperatorType:
+      start = lo, end = hi;
+      break;
+    default:
+      start = lo, end = hi, invert = YES;
+      break;
+    }
+
+  uint64_t *set = bitset_new(_words);
+
+  for (NSInteger i = start; i < end; i++)
+    bitset_set(set, _dateOrder[i], YES);
+
+  if (invert)
+    bitset_complement(set, _count, _words);
+
+  *exact = YES;
+  return set;
+}
+
+- (uint64_t *)candidatesForKeywordPredicate:(NSComparisonPredicate *)pred
+    key:(NSString *)key exact:(BOOL *)exact
+{
+  /* Only predicates that test each keyword separately can be answered
+     as a union of the keywords' image sets. */
+
+  if (!(pred.comparisonPredicateModifier == NSAnyPredicateModifier
+	|| (pred.comparisonPredicateModifier == NSDirectPredicateModifier
+	    && pred.predicateOperatorType
+	    == NSContainsPredicateOperatorType)))
+    return NULL;
+
+  BOOL failed = NO;
+  if (evaluate_predicate(pred, key, @[], &failed) || failed)
+    return NULL;
+
+  [self buildKeywordIndex];
+
+  uint64_t *set = bitset_new(_words);
+
+  for (NSString *str in _keywords)
+    {
+      if (evaluate_predicate(pred, key, @[str], &failed))
+	bitset_or(set, [_keywords[str] bytes], _words);
+    }
+
+  if (failed)
+    {
+      free(set);
+      return NULL;
+    }
+
+  *exact = bitset_empty_p(_otherKeywords, _words);
+  bitset_or(set, _otherKeywords, _words);
+
+  return set;
+}
+
+- (uint64_t *)candidatesForComparisonPredicate:(NSComparisonPredicate *)pred
+    exact:(BOOL *)exact
+{
+  NSExpression *lhs = pred.leftExpression;
+
+  if (lhs.expressionType != NSKeyPathExpressionType
+      || !constant_expression_p(pred.rightExpression))
+    return NULL;
+
+  NSString *key = lhs.keyPath;
+
+  if ([key isEqualToString:PDImage_Rating]
+      || [key isEqualToString:PDImage_Rejected])
+    return [self candidatesForRatingPredicate:pred key:key exact:exact];
+  else if ([key isEqualToString:PDImage_Flagged])
+    return [self candidatesForFlagPredicate:pred key:key
+	    flags:_flagged exact:exact];
+  else if ([key isEqualToString:PDImage_Hidden])
+    return [self candidatesForFlagPredicate:pred key:key
+	    flags:_hidden exact:exact];
+  else if ([key isEqualToString:PDImage_Deleted])
+    return [self candidatesForFlagPredicate:pred key:key
+	    flags:_deleted exact:exact];
+  else if ([key isEqualToString:PDImage_Date])
+    return [self candidatesForDatePredicate:pred exact:exact];
+  else if ([key isEqualToString:PDImage_Keywords])
+    return [self candidatesForKeywordPredicate:pred key:key exact:exact];
+  else
+    return NULL;
+}
+
+/* Unlike the other -candidates... methods, never returns null. */
+
+- (uint64_t *)candidatesForPredicate:(NSPredicate *)pred exact:(BOOL *)exact
+{
+  uint64_t *set = NULL;
+
+  if ([pred isKindOfClass:[NSCompoundPredicate class]])
+    {
+      NSCompoundPredicate *c_pred = (NSCompoundPredicate *)pred;
+      NSCompoundPredicateType type = c_pred.compoundPredicateType;
+      NSArray *subs = c_pred.subpredicates;
+
+      if (type == NSNotPredicateType && subs.count == 1)
+	{
+	  set = [self candidatesForPredicate:subs[0] exact:exact];
+	  if (*exact)
+	    bitset_complement(set, _count, _words);
+	  else
+	    bitset_set_range(set, 0, _count);
+	  return set;
+	}
+      else if (type == NSAndPredicateType || type == NSOrPredicateType)
+	{
+	  set = bitset_new(_words);
+	  if (type == NSAndPredicateType)
+	    bitset_set_range(set, 0, _count);
+
+	  *exact = YES;
+
+	  for (NSPredicate *sub in subs)
+	    {
+	      BOOL sub_exact = NO;
+	      uint64_t *sub_set = [self candidatesForPredicate:sub
+				   exact:&sub_exact];
+	      if (type == NSAndPredicateType)
+		bitset_and(set, sub_set, _words);
+	      else
+		bitset_or(set, sub_set, _words);
+	      free(sub_set);
+	      if (!sub_exact)
+		*exact = NO;
+	    }
+
+	  return set;
+	}
+    }
+  else if ([pred isKindOfClass:[NSComparisonPredicate class]])
+    {
+      set = [self candidatesForComparisonPredicate:
+	     (NSComparisonPredicate *)pred exact:exact];
+      if (set != NULL)
+	return set;
+    }
+
+  /* Anything else has to be tested against every image. */
+
+  set = bitset_new(_words);
+  bitset_set_range(set, 0, _count);
+  *exact = NO;
+
+  return set;
+}
+
+- (BOOL)foreachImageMatchingPredicate:(NSPredicate *)pred
+    usingBlock:(void (^)(PDImage *im, BOOL *stop))thunk
+{
+  BOOL exact = YES;
+  uint64_t *set = NULL;
+
+  if (pred != nil)
+    set = [self candidatesForPredicate:pred exact:&exact];
+  else
+    {
+      set = bitset_new(_words);
+      bitset_set_range(set, 0, _count);
+    }
+
+  PDImagePredicateBlock filter = exact ? nil : PDImageCompilePredicate(pred);
+
+  BOOL ret = [self foreachImageInSet:set filter:filter usingBlock:thunk];
+
+  free(set);
+  return ret;
+}
+
+- (BOOL)foreachImageInSet:(const uint64_t *)set
+    filter:(PDImagePredicateBlock)filter
+    usingBlock:(void (^)(PDImage *im, BOOL *stop))thunk
+{
+  for (size_t w = 0; w < _words; w++)
+    {
+      uint64_t bits = set[w];
+
+      while (bits != 0)
+	{
+	  NSInteger i = (NSInteger)(w * 64) + __builtin_ctzll(bits);
+	  bits &= bits - 1;
+
+	  PDImage *im = _images[i];
+
+	  if (filter == nil || filter(im))
+	    {
+	      BOOL stop = NO;
+	      thunk(im, &stop);
+	      if (stop)
+		return NO;
+	    }
+	}
+    }
+
+  return YES;
+}
+
+/* Returns the cached query for 'pred', creating it if needed, or nil
+   if its results can't be kept current. */
+
+- (PDImageIndexQuery *)queryForPredicate:(NSPredicate *)pred
+{
+  NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+
+  NSInteger idx = 0;
+  for (PDImageIndexQuery *query in _queries)
+    {
+      if ([query->_predicate isEqual:pred])
+	{
+	  if (query->_expires != 0 && query->_expires <= now)
+	    {
+	      [_queries removeObjectAtIndex:idx];
+	      break;
+	    }
+	  if (idx != _queries.count - 1)
+	    {
+	      [_queries removeObjectAtIndex:idx];
+	      [_queries addObject:query];
+	    }
+	  return query;
+	}
+      idx++;
+    }
+
+  NSMutableSet *keys = [NSMutableSet set];
+  BOOL calls = NO;
+  if (!predicate_keys(pred, keys, &calls))
+    return nil;
+
+  /* These can change without a property change notification. */
+
+  for (NSString *key in @[PDImage_FileName, PDImage_FilePath,
+			  PDImage_FileDate, PDImage_FileSize])
+    {
+      if ([keys containsObject:key])
+	return nil;
+    }
+
+  PDImageIndexQuery *query = [[PDImageIndexQuery alloc] init];
+  query->_predicate = [pred copy];
+  query->_filter = PDImageCompilePredicate(pred);
+  query->_keys = [keys copy];
+  query->_expires = calls ? now + VOLATILE_QUERY_LIFETIME : 0;
+
+  BOOL exact = NO;
+  query->_matches = [self candidatesForPredicate:pred exact:&exact];
+
+  if (!exact)
+    {
+      for (size_t w = 0; w < _words; w++)
+	{
+	  uint64_t bits = query->_matches[w];
+
+	  while (bits != 0)
+	    {
+	      NSInteger i = (NSInteger)(w * 64) + __builtin_ctzll(bits);
+	      bits &= bits - 1;
+	      if (!query->_filter(_images[i]))
+		bitset_set(query->_matches, i, NO);
+	    }
+	}
+    }
+
+  if (_queries.count >= MAX_CACHED_QUERIES)
+    [_queries removeObjectAtIndex:0];
+  [_queries addObject:query];
+
+  return query;
+}
+
+- (BOOL)foreachImageMatchingCachedPredicate:(NSPredicate *)pred
+    usingBlock:(void (^)(PDImage *im, BOOL *stop))thunk
+{
+  PDImageIndexQuery *query = pred != nil ? [self queryForPredicate:pred] : nil;
+
+  if (query == nil)
+    return [self foreachImageMatchingPredicate:pred usingBlock:thunk];
+
+  return [self foreachImageInSet:query->_matches filter:nil usingBlock:thunk];
+}
+
+- (NSInteger)countOfImagesMatchingCachedPredicate:(NSPredicate *)pred
+    deleted:(BOOL)deleted includingHidden:(BOOL)hidden
+{
+  if (pred == nil)
+    {
+      return [self countOfImagesInRange:NSMakeRange(0, _count)
+	      deleted:deleted includingHidden:hidden];
+    }
+
+  PDImageIndexQuery *query = [self queryForPredicate:pred];
+
+  if (query == nil)
+    {
+      __block NSInteger count = 0;
+
+      [self foreachImageMatchingPredicate:pred usingBlock:
+       ^(PDImage *im, BOOL *stop)
+	{
+	  if ((hidden || !im.hidden) && im.deleted == deleted)
+	    count++;
+	}];
+
+      return count;
+    }
+
+  NSInteger count = 0;
+
+  for (size_t w = 0; w < _words; w++)
+    {
+      uint64_t bits = query->_matches[w];
+
+      bits &= deleted ? _deleted[w] : ~_deleted[w];
+      if (!hidden)
+	bits &= ~_hidden[w];
+
+      count += __builtin_popcountll(bits);
+    }
+
+  return count;
+}
+
+- (PDImage *)imageWithUUID:(NSUUID *)uuid
+{
+  PDImage *im = _uuids[uuid];
+
+  if (im != nil && ![[im UUIDIfDefined] isEqual:uuid])
+    {
+      [_uuids removeObjectForKey:uuid];
+      im = nil;
+    }
+
+  return im;
+}
+
+- (NSInteger)countOfImagesInRange:(NSRange)range deleted:(BOOL)deleted
+    includingHidden:(BOOL)hidden
+{
+  NSInteger start = range.location;
+  NSInteger end = MIN(NSMaxRange(range), (NSUInteger)_count);
+
+  if (start >= end)
+    return 0;
+
+  NSInteger count = 0;
+
+  for (NSInteger w = start >> 6; w <= (end - 1) >> 6; w++)
+    {
+      uint64_t bits = deleted ? _deleted[w] : ~_deleted[w];
+
+      if (!hidden)
+	bits &= ~_hidden[w];
+
+      if (w == start >> 6)
+	bits &= ~(uint64_t)0 << (start & 63);
+      if (w == (end - 1) >> 6 && (end & 63) != 0)
+	bits &= ~(~(uint64_t)0 << (end & 63));
+
+      count += __builtin_popcountll(bits);
+    }
+
+  return count;
+}
+
+@end
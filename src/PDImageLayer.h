@@ -34,6 +34,12 @@
 
 @property(nonatomic, strong) __attribute__((NSObject)) CGColorSpaceRef colorSpace;
 
+/* The visible part of the layer, in its own coordinates. When that's
+   only part of the image, the image is displayed as tiles covering
+   the visible part, over a proxy of the whole image. */
+
+@property(nonatomic, assign) CGRect exposedRect;
+
 - (void)invalidate;
 
 - (void)removeContent;
@@ -26,9 +26,15 @@
 
 #import "PDAppDelegate.h"
 #import "PDImage.h"
+#import "PDImagePyramid.h"
 
 #import <QuartzCore/QuartzCore.h>
 
+/* Largest size the whole image is requested at while it's tiled, the
+   medium proxy size, so it comes from the proxy cache. */
+
+#define TILED_IMAGE_SIZE 1024
+
 CA_HIDDEN @interface PDImageLayerLayer : CALayer
 @end
 
@@ -40,6 +46,10 @@ CA_HIDDEN @interface PDImageLayerLayer : CALayer
   BOOL _addedImageHost;
   CGSize _imageSize;
   OSSpinLock _imageLock;
+
+  CGRect _exposedRect;
+  PDImagePyramid *_pyramid;		/* while tiled */
+  NSMutableDictionary *_tileLayers;	/* NSNumber -> CALayer */
 }
 
 @synthesize image = _image;
@@ -61,12 +71,15 @@ CA_HIDDEN @interface PDImageLayerLayer : CALayer
       _image = src->_image;
       _thumbnail = src->_thumbnail;
       _colorSpace = CGColorSpaceRetain(src->_colorSpace);
+      _exposedRect = src->_exposedRect;
     }
   return self;
 }
 
 - (void)invalidate
 {
+  [self removeTiles];
+
   if (_addedImageHost)
     {
       [_image removeImageHost:self];
@@ -120,6 +133,8 @@ CA_HIDDEN @interface PDImageLayerLayer : CALayer
 
       old_image = nil;
 
+      [self removeTiles];
+
       ((CALayer *)[self.sublayers firstObject]).contents = nil;
       [self setNeedsLayout];
     }
@@ -139,6 +154,116 @@ CA_HIDDEN @interface PDImageLayerLayer : CALayer
     }
 }
 
+- (CGRect)exposedRect
+{
+  return _exposedRect;
+}
+
+- (void)setExposedRect:(CGRect)r
+{
+  if (!CGRectEqualToRect(_exposedRect, r))
+    {
+      _exposedRect = r;
+      [self setNeedsLayout];
+    }
+}
+
+- (void)removeTiles
+{
+  for (NSNumber *key in _tileLayers)
+    [_tileLayers[key] removeFromSuperlayer];
+
+  _tileLayers = nil;
+  _pyramid = nil;
+}
+
+/* Adds layers for the tiles of the current level that intersect the
+   exposed rect to 'image_layer', removing any others. Its bounds are
+   the unoriented image, and the geometry is flipped (as the image
+   view is), so y increases down the image as it does in the tiles. */
+
+- (void)updateTilesOfLayer:(CALayer *)image_layer
+{
+  if (_pyramid == nil)
+    {
+      _pyramid = _image.pyramid;
+      _tileLayers = [NSMutableDictionary dictionary];
+    }
+
+  CGSize pixel_size = _pyramid.pixelSize;
+  CGRect bounds = image_layer.bounds;
+
+  if (pixel_size.width == 0 || pixel_size.height == 0
+      || bounds.size.width == 0 || bounds.size.height == 0)
+    return;
+
+  CGFloat sx = pixel_size.width / bounds.size.width;
+  CGFloat sy = pixel_size.height / bounds.size.height;
+
+  CGRect r = [image_layer convertRect:_exposedRect fromLayer:self];
+
+  CGRect pixel_r = CGRectMake((r.origin.x - bounds.origin.x) * sx,
+			      (r.origin.y - bounds.origin.y) * sy,
+			      r.size.width * sx, r.size.height * sy);
+
+  NSInteger level
+    = [_pyramid levelForScale:self.contentsScale / fmax(sx, sy)];
+
+  NSRange xs, ys;
+  [_pyramid getTilesAtLevel:level inRect:pixel_r columns:&xs rows:&ys];
+
+  NSMutableDictionary *old_layers = _tileLayers;
+  _tileLayers = [NSMutableDictionary dictionary];
+
+  for (NSInteger y = ys.location; y < NSMaxRange(ys); y++)
+    {
+      for (NSInteger x = xs.location; x < NSMaxRange(xs); x++)
+	{
+	  NSNumber *key = @(((uint64_t)level << 48)
+			    | ((uint64_t)y << 24) | x);
+
+	  CALayer *layer = old_layers[key];
+	  BOOL new_layer = layer == nil;
+
+	  if (!new_layer)
+	    [old_layers removeObjectForKey:key];
+	  else
+	    {
+	      layer = [PDImageLayerLayer layer];
+	      layer.delegate = self.delegate;
+	      [image_layer addSublayer:layer];
+	    }
+
+	  CGRect tile_r = [_pyramid rectOfTileAtLevel:level x:x y:y];
+
+	  layer.frame = CGRectMake(bounds.origin.x + tile_r.origin.x / sx,
+				   bounds.origin.y + tile_r.origin.y / sy,
+				   tile_r.size.width / sx,
+				   tile_r.size.height / sy);
+	  layer.contentsScale = self.contentsScale;
+
+	  _tileLayers[key] = layer;
+
+	  /* The handler may be called before this returns, if the tile
+	     is already in memory, so the layer must already be in the
+	     dictionary. */
+
+	  if (new_layer)
+	    {
+	      [_pyramid loadTileAtLevel:level x:x y:y handler:
+	       ^(CGImageRef im)
+		{
+		  if (_tileLayers[key] == layer)
+		    layer.contents = (__bridge id)im;
+		}];
+	    }
+	}
+    }
+
+  for (NSNumber *key in old_layers)
+    [old_layers[key] removeFromSuperlayer];
+}
+
 - (void)layoutSublayers
 {
   if (_image == nil)
@@ -172,6 +297,19 @@ CA_HIDDEN @interface PDImageLayerLayer : CALayer
       [self addSublayer:image_layer];
     }
 
+  /* When only part of a large image is visible, display the visible
+     tiles over a proxy of the whole image, rather than decoding and
+     holding the whole image at the displayed size. */
+
+  BOOL tiled = (!_thumbnail && !CGRectIsEmpty(_exposedRect)
+		&& !CGRectContainsRect(_exposedRect, bounds));
+
+  if (tiled && fmax(size.width, size.height) > TILED_IMAGE_SIZE)
+    {
+      CGFloat f = TILED_IMAGE_SIZE / fmax(size.width, size.height);
+      size = CGSizeMake(ceil(size.width * f), ceil(size.height * f));
+    }
+
   /* Don't call -addImageHost: etc until the image layer exists -- the
      images are supplied asynchronously via a concurrent queue. */
 
@@ -214,6 +352,11 @@ CA_HIDDEN @interface PDImageLayerLayer : CALayer
   image_layer.affineTransform = m;
   image_layer.frame = bounds;
   image_layer.contentsScale = scale;
+
+  if (tiled)
+    [self updateTilesOfLayer:image_layer];
+  else if (_pyramid != nil)
+    [self removeTiles];
 }
 
 - (NSDictionary *)imageHostOptions
@@ -22,7 +22,7 @@
    CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
    SOFTWARE. */
 
-#import <Foundation/Foundation.h>
+#import "PDPropertyCache.h"
 
 @class PDFileCatalog, PDFileManager, PDImage, NSImage;
 
@@ -63,7 +63,60 @@ extern NSString *const PDImageLibraryDirectoryDidChange;
 
 - (NSString *)cachePathForFileId:(uint32_t)file_id base:(NSString *)str;
 
-/* Write catalog to disk (if it has changed). */
+/* Access to cached data for object with 'file_id'. Data is only
+   returned if it was written after 'mtime'. Depending on the
+   PDPackedImageCache default this uses either the files returned by
+   -cachePathForFileId:base: or a packed cache. */
+
+- (BOOL)hasCachedDataForFileId:(uint32_t)file_id base:(NSString *)str
+    newerThan:(time_t)mtime;
+- (NSData *)cachedDataForFileId:(uint32_t)file_id base:(NSString *)str
+    newerThan:(time_t)mtime;
+- (void)setCachedData:(NSData *)data forFileId:(uint32_t)file_id
+    base:(NSString *)str;
+
+/* Cached data of 'file_id' is never evicted while pinned. Calls may
+   be nested. */
+
+- (void)pinCachedDataForFileId:(uint32_t)file_id;
+- (void)unpinCachedDataForFileId:(uint32_t)file_id;
+
+/* Limit in bytes on the size of the cached proxy images of all
+   libraries, from the PDImageCacheSizeLimit default (in megabytes),
+   zero if unlimited. When exceeded, tile pyramid levels are evicted
+   first, then medium proxies before small and tiny ones, each least
+   recently used first. */
+
++ (uint64_t)cacheSizeLimit;
+
+/* Counters of cache lookups and evictions since the library was
+   opened. */
+
+@property(nonatomic, readonly) uint64_t cacheHits;
+@property(nonatomic, readonly) uint64_t cacheMisses;
+@property(nonatomic, readonly) uint64_t cacheEvictions;
+@property(nonatomic, readonly) uint64_t cacheEvictedBytes;
+
+/* Access to the library's columnar cache of the image properties
+   used for sorting and filtering, see PDPropertyCache. */
+
+- (BOOL)getCachedPropertyRecord:(PDPropertyCacheRecord *)rec
+    keywords:(NSArray **)keywords forFileId:(uint32_t)file_id
+    newerThan:(time_t)mtime;
+- (void)setCachedProperties:(NSDictionary *)dict forFileId:(uint32_t)file_id;
+
+/* Access to the library's index of the words in image text, see
+   PDTextIndex. Words must be folded by +[PDTextIndex wordsOfString:]
+   or +foldedString:. The generation changes with every update. */
+
+- (BOOL)hasIndexedWordsForFileId:(uint32_t)file_id;
+- (void)setIndexedWords:(NSArray *)words forFileId:(uint32_t)file_id;
+- (void)addIndexedWords:(NSArray *)words forFileId:(uint32_t)file_id;
+- (NSIndexSet *)fileIdsMatchingWord:(NSString *)word prefix:(BOOL)flag;
+@property(nonatomic, readonly) uint64_t textIndexGeneration;
+
+/* Write catalog, property cache and text index to disk (if they have
+   changed). */
 
 - (void)synchronize;
 
@@ -86,6 +139,7 @@ extern NSString *const PDImageLibraryDirectoryDidChange;
 - (void)didRenameDirectory:(NSString *)oldName to:(NSString *)newName;
 - (void)didRenameFile:(NSString *)oldName to:(NSString *)newName;
 - (void)didRemoveFileWithPath:(NSString *)rel_path;
+- (void)didRemoveDirectoryWithPath:(NSString *)rel_path;
 
 @end
 
@@ -97,6 +151,24 @@ extern NSString *const PDImageLibraryDirectoryDidChange;
 - (void)loadImagesInSubdirectory:(NSString *)dir
     recursively:(BOOL)flag handler:(void (^)(PDImage *))block;
 
+/* Directories are scanned and images created on multiple threads, but
+   'block' is called with one batch of images at a time. Returns once
+   every batch has been handled. */
+
+- (void)loadImagesInSubdirectory:(NSString *)dir
+    recursively:(BOOL)flag batchHandler:(void (^)(NSArray *images))block;
+
+/* Incremental form of the above. 'snapshot' is the (opaque) value
+   returned by the previous scan of 'dir', or nil. Directories whose
+   mtime and entry count match the snapshot aren't rescanned, their
+   existing images are passed to 'block' again. In other directories
+   images are only created for new or modified files. Returns the
+   snapshot to pass next time. */
+
+- (NSDictionary *)loadImagesInSubdirectory:(NSString *)dir
+    recursively:(BOOL)flag snapshot:(NSDictionary *)snapshot
+    batchHandler:(void (^)(NSArray *images))block;
+
 + (void)removeImages:(NSArray *)images;
 
 - (void)copyImages:(NSArray *)images toDirectory:(NSString *)dir;
@@ -122,6 +194,7 @@ extern NSString *const PDImageLibraryDirectoryDidChange;
 - (size_t)sizeOfFileAtPath:(NSString *)path;
 
 - (NSData *)contentsOfFileAtPath:(NSString *)path;
+- (NSData *)contentsOfFileAtPath:(NSString *)path range:(NSRange)range;
 - (NSArray *)contentsOfDirectoryAtPath:(NSString *)path;
 - (CGImageSourceRef)copyImageSourceAtPath:(NSString *)path;
 
@@ -136,6 +209,8 @@ extern NSString *const PDImageLibraryDirectoryDidChange;
     error:(NSError **)error;
 - (BOOL)removeItemAtPath:(NSString *)path error:(NSError **)err;
 
+- (void)foreachFileInDirectory:(NSString *)dir
+    handler:(void (^)(NSString *file_name, BOOL is_dir))block;
 - (void)foreachSubdirectoryOfDirectory:(NSString *)dir
     handler:(void (^)(NSString *dir_name))block;
 
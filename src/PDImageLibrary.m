@@ -28,24 +28,67 @@
 #import "PDFileCatalog.h"
 #import "PDFileManager.h"
 #import "PDImage.h"
+#import "PDMacros.h"
+#import "PDPackedCache.h"
+#import "PDPropertyCache.h"
+#import "PDTextIndex.h"
 
 #import <AppKit/AppKit.h>
 
+#import <pthread.h>
+#import <stdatomic.h>
 #import <stdlib.h>
 #import <sys/stat.h>
+#import <unistd.h>
 #import <utime.h>
 
-#define CATALOG_FILE "catalog.json"
+#define CATALOG_FILE "catalog.db"
+#define JSON_CATALOG_FILE "catalog.json"
+#define PROPERTY_CACHE_FILE "properties.db"
+#define TEXT_INDEX_FILE "text-index.db"
+#define MANIFEST_FILE "manifest"
+#define MANIFEST_MAGIC 0x4d434450	/* 'PDCM' */
+#define MANIFEST_VERSION 1
+#define ACCESS_FILE "access"
+#define ACCESS_MAGIC 0x41434450		/* 'PDCA' */
+
+/* Once over budget, evict until the caches are this fraction of it. */
+
+#define EVICTION_LOW_WATER .9
 #define CACHE_BITS 6
 #define CACHE_SEP '$'
+#define PACK_DIR "pack"
 
 #define METADATA_EXTENSION "phod"
 
+#define LOAD_BATCH_SIZE 64
+
 #define ERROR_DOMAIN @"org.unfactored.PDImageLibrary"
 
 NSString *const PDImageLibraryDirectoryDidChange = @"PDImageLibraryDirectoryDidChangeDidChange";
 
-@interface PDImageLibrary ()
+@interface PDImageLibraryExtension : NSObject
+{
+@public
+  int _kind;
+  NSString *_type;
+}
+@end
+
+/* State of one directory as of its last incremental scan. */
+
+@interface PDImageLibrarySnapshot : NSObject
+{
+@public
+  time_t _mtime;
+  NSUInteger _count;
+  time_t _scanTime;
+  NSDictionary *_groups;		/* stem -> sorted [ext...] */
+  NSMutableDictionary *_images;		/* stem -> PDImage */
+}
+@end
+
+@interface PDImageLibrary () <PDFileManagerDelegate>
 - (id)initWithDictionary:(NSDictionary *)dict;
 - (BOOL)pathEqualToPath:(NSString *)path;
 - (NSString *)cachePath;
@@ -61,6 +104,44 @@ NSString *const PDImageLibraryDirectoryDidChange = @"PDImageLibraryDirectoryDidC
   NSString *_cachePath;
   uint32_t _libraryId;
   PDFileCatalog *_catalog;
+  PDPackedCache *_pack;
+  PDPropertyCache *_propertyCache;
+  PDTextIndex *_textIndex;
+
+  /* Loose cache files: base name -> NSMutableIndexSet<file-id>. Saved
+     as the manifest, so validating the cache doesn't need to list the
+     cache directories. Protected by _cacheLock, as are _writtenIds and
+     _validated. */
+
+  pthread_mutex_t _cacheLock;
+  NSMutableDictionary *_cacheFiles;
+  NSMutableIndexSet *_writtenIds;
+  BOOL _validated;
+  BOOL _manifestDirty;
+  uint32_t _trustedFileId;
+  dispatch_group_t _validateGroup;
+
+  /* Last access time of each file id's cached data, for eviction, and
+     the ids with active image hosts, that mustn't be evicted. Also
+     protected by _cacheLock. */
+
+  uint32_t *_accessTimes;
+  size_t _accessCount;
+  BOOL _accessDirty;
+  NSCountedSet *_pinnedIds;
+
+  _Atomic(uint64_t) _cacheHits;
+  _Atomic(uint64_t) _cacheMisses;
+  _Atomic(uint64_t) _cacheEvictions;
+  _Atomic(uint64_t) _cacheEvictedBytes;
+  /* Paths we've changed recently, so the file manager's reports of
+     those changes can be ignored, and the directories with outside
+     changes not yet posted. Protected by _changeLock. */
+
+  pthread_mutex_t _changeLock;
+  NSMutableDictionary *_localChanges;
+  NSMutableSet *_changedDirectories;
+
   BOOL _transient;
   NSOperationQueue *_ioQueue;
   NSMutableArray *_activeImports;
@@ -89,6 +170,94 @@ catalog_path(PDImageLibrary *self)
   return [self.cachePath stringByAppendingPathComponent:@CATALOG_FILE];
 }
 
+static NSString *
+json_catalog_path(PDImageLibrary *self)
+{
+  return [self.cachePath stringByAppendingPathComponent:@JSON_CATALOG_FILE];
+}
+
+static NSString *
+property_cache_path(PDImageLibrary *self)
+{
+  return [self.cachePath stringByAppendingPathComponent:
+	  @PROPERTY_CACHE_FILE];
+}
+
+static NSString *
+text_index_path(PDImageLibrary *self)
+{
+  return [self.cachePath stringByAppendingPathComponent:@TEXT_INDEX_FILE];
+}
+
+static NSString *
+manifest_path(PDImageLibrary *self)
+{
+  return [self.cachePath stringByAppendingPathComponent:@MANIFEST_FILE];
+}
+
+static NSString *
+access_path(PDImageLibrary *self)
+{
+  return [self.cachePath stringByAppendingPathComponent:@ACCESS_FILE];
+}
+
+struct access_header
+{
+  uint32_t magic;
+  uint32_t count;
+};
+
+static void
+load_access_times(PDImageLibrary *self)
+{
+  NSData *data = [NSData dataWithContentsOfFile:access_path(self)];
+  if (data.length < sizeof(struct access_header))
+    return;
+
+  const struct access_header *h = data.bytes;
+  if (h->magic != ACCESS_MAGIC
+      || (data.length - sizeof(*h)) / sizeof(uint32_t) < h->count)
+    return;
+
+  uint32_t *times = malloc(MAX(h->count, 1) * sizeof(uint32_t));
+  if (times == NULL)
+    return;
+
+  memcpy(times, h + 1, h->count * sizeof(uint32_t));
+
+  free(self->_accessTimes);
+  self->_accessTimes = times;
+  self->_accessCount = h->count;
+}
+
+/* Called with _cacheLock held. */
+
+static NSData *
+copy_access_data(PDImageLibrary *self)
+{
+  struct access_header h;
+  h.magic = ACCESS_MAGIC;
+  h.count = (uint32_t)self->_accessCount;
+
+  NSMutableData *data = [NSMutableData dataWithBytes:&h length:sizeof(h)];
+  [data appendBytes:self->_accessTimes
+   length:self->_accessCount * sizeof(uint32_t)];
+
+  return data;
+}
+
+static NSString *
+pack_path(PDImageLibrary *self)
+{
+  return [self.cachePath stringByAppendingPathComponent:@PACK_DIR];
+}
+
+static BOOL
+use_pack(PDImageLibrary *self, NSString *base)
+{
+  return self->_pack != nil && [PDPackedCache canStoreBase:base];
+}
+
 + (void)removeInvalidLibraries
 {
   /* For now, simply remove any libraries that don't have catalogs. By
@@ -106,8 +275,11 @@ catalog_path(PDImageLibrary *self)
       NSString *path = [dir stringByAppendingPathComponent:file];
       NSString *catalog_path
         = [path stringByAppendingPathComponent:@CATALOG_FILE];
+      NSString *json_path
+        = [path stringByAppendingPathComponent:@JSON_CATALOG_FILE];
 
-      if (![fm fileExistsAtPath:catalog_path])
+      if (![fm fileExistsAtPath:catalog_path]
+	  && ![fm fileExistsAtPath:json_path])
 	{
 	  NSLog(@"PDImageLibrary: orphan library: %@", file);
 	  [fm removeItemAtPath:path error:nil];
@@ -249,10 +421,44 @@ catalog_path(PDImageLibrary *self)
 	}
     }
 
+  /* Libraries created by older versions of the app only have a JSON
+     catalog, it's also used as a fallback if the binary catalog can't
+     be read for some reason. */
+
   _catalog = [[PDFileCatalog alloc] initWithContentsOfFile:catalog_path(self)];
+  if (_catalog == nil)
+    {
+      _catalog = [[PDFileCatalog alloc]
+		  initWithContentsOfFile:json_catalog_path(self)];
+    }
+  if (_catalog == nil)
+    _catalog = [[PDFileCatalog alloc] init];
+
+  [_catalog openJournalForFile:catalog_path(self)];
+
+  _propertyCache = [[PDPropertyCache alloc]
+		    initWithPath:property_cache_path(self)];
+
+  _textIndex = [[PDTextIndex alloc] initWithPath:text_index_path(self)];
+
+  NSUserDefaults *defaults = [NSUserDefaults standardUserDefaults];
+
+  if ([defaults boolForKey:@"PDPackedImageCache"])
+    _pack = [[PDPackedCache alloc] initWithPath:pack_path(self)];
+
+  pthread_mutex_init(&_cacheLock, NULL);
+  pthread_mutex_init(&_changeLock, NULL);
+  _writtenIds = [[NSMutableIndexSet alloc] init];
+  _pinnedIds = [[NSCountedSet alloc] init];
+  _validateGroup = dispatch_group_create();
+
+  load_access_times(self);
 
   [self validateCaches];
 
+  _manager.delegate = self;
+  [_manager startWatchingForChanges];
+
   if (_allLibraries == nil)
     _allLibraries = [[NSMutableArray alloc] init];
 
@@ -283,9 +489,24 @@ catalog_path(PDImageLibrary *self)
 {
   [self waitForImportsToComplete];
 
+  if (_validateGroup != nil)
+    dispatch_group_wait(_validateGroup, DISPATCH_TIME_FOREVER);
+
   [_catalog invalidate];
   _catalog = nil;
 
+  [_propertyCache invalidate];
+  _propertyCache = nil;
+
+  [_textIndex invalidate];
+  _textIndex = nil;
+
+  pthread_mutex_lock(&_cacheLock);
+  [_pack invalidate];
+  _pack = nil;
+  _cacheFiles = nil;
+  pthread_mutex_unlock(&_cacheLock);
+
   [_ioQueue removeObserver:self forKeyPath:@"operationCount"];
   [_ioQueue waitUntilAllOperationsAreFinished];
   _ioQueue = nil;
@@ -303,6 +524,9 @@ catalog_path(PDImageLibrary *self)
 - (void)dealloc
 {
   [self invalidate];
+  pthread_mutex_destroy(&_cacheLock);
+  pthread_mutex_destroy(&_changeLock);
+  free(_accessTimes);
 }
 
 - (NSImage *)iconImage
@@ -338,39 +562,818 @@ catalog_path(PDImageLibrary *self)
   return [[self cachePath] stringByAppendingPathComponent:base];
 }
 
-- (uint32_t)uniqueIdOfFile:(NSString *)path
-{
-  return [_catalog fileIdForPath:path];
-}
+/* Proxy images are evicted in this order when the caches are over
+   budget, least recently used first within each base. Pyramid tiles
+   go first, largest level first, as they're only needed when zooming
+   in. Other cached data (e.g. properties) is never evicted. */
+
+static const char *const evictable_bases[] =
+{
+  "0.tiles", "1.tiles", "2.tiles", "3.tiles", "m.jpg", "s.jpg", "t.jpg",
+};
+
+struct cache_item
+{
+  uint32_t library;			/* index into libraries array */
+  uint32_t file_id;
+  uint32_t access;
+  uint16_t tier;			/* index into evictable_bases */
+  uint16_t packed;
+  uint64_t size;
+};
+
+struct cache_items
+{
+  struct cache_item *items;
+  size_t count;
+  size_t capacity;
+  uint64_t total;
+};
+
+static atomic_bool _evictionPending;
+static _Atomic(uint64_t) _estimatedCacheSize;
+
++ (uint64_t)cacheSizeLimit
+{
+  NSInteger mb = [[NSUserDefaults standardUserDefaults]
+		  integerForKey:@"PDImageCacheSizeLimit"];
+
+  return mb > 0 ? (uint64_t)mb << 20 : 0;
+}
+
+static dispatch_queue_t
+eviction_queue(void)
+{
+  static dispatch_queue_t queue;
+  static dispatch_once_t once;
+
+  dispatch_once(&once, ^{
+    queue = dispatch_queue_create("PDImageLibrary.eviction",
+				  DISPATCH_QUEUE_SERIAL);
+    dispatch_set_target_queue(queue, dispatch_get_global_queue
+			      (DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0));
+  });
+
+  return queue;
+}
+
+static int
+evictable_tier(NSString *base)
+{
+  const char *str = base.UTF8String;
+
+  for (size_t i = 0; i < N_ELEMENTS(evictable_bases); i++)
+    {
+      if (strcmp(str, evictable_bases[i]) == 0)
+	return (int)i;
+    }
+
+  return -1;
+}
+
+static void
+add_item(struct cache_items *list, const struct cache_item *item)
+{
+  if (list->count == list->capacity)
+    {
+      size_t capacity = MAX(list->capacity * 2, 1024);
+      struct cache_item *items = realloc(list->items,
+					 capacity * sizeof(*items));
+      if (items == NULL)
+	return;
+      list->items = items;
+      list->capacity = capacity;
+    }
+
+  list->items[list->count++] = *item;
+  list->total += item->size;
+}
+
+/* Adds every evictable item cached by 'lib' to 'list'. */
+
+static void
+collect_items(PDImageLibrary *lib, uint32_t idx, struct cache_items *list)
+{
+  NSIndexSet *loose[N_ELEMENTS(evictable_bases)];
+
+  pthread_mutex_lock(&lib->_cacheLock);
+
+  PDPackedCache *pack = lib->_pack;
+
+  for (size_t i = 0; i < N_ELEMENTS(evictable_bases); i++)
+    {
+      NSString *base = @(evictable_bases[i]);
+      loose[i] = [lib->_cacheFiles[base] copy];
+    }
+
+  size_t access_count = lib->_accessCount;
+  uint32_t *access = malloc(MAX(access_count, 1) * sizeof(uint32_t));
+  if (access != NULL)
+    memcpy(access, lib->_accessTimes, access_count * sizeof(uint32_t));
+  else
+    access_count = 0;
+
+  pthread_mutex_unlock(&lib->_cacheLock);
+
+  /* Items that haven't been accessed since access times were first
+     recorded use their modification time instead. */
+
+  for (size_t i = 0; i < N_ELEMENTS(evictable_bases); i++)
+    {
+      NSString *base = @(evictable_bases[i]);
+
+      [loose[i] enumerateIndexesUsingBlock:^(NSUInteger fid, BOOL *stop)
+	{
+	  struct stat st;
+	  NSString *path = [lib cachePathForFileId:(uint32_t)fid base:base];
+	  if (lstat(path.fileSystemRepresentation, &st) != 0)
+	    return;
+
+	  struct cache_item item;
+	  item.library = idx;
+	  item.file_id = (uint32_t)fid;
+	  item.access = fid < access_count ? access[fid] : 0;
+	  if (item.access == 0)
+	    item.access = (uint32_t)st.st_mtime;
+	  item.tier = (uint16_t)i;
+	  item.packed = 0;
+	  item.size = st.st_size;
+	  add_item(list, &item);
+	}];
+    }
+
+  [pack enumerateDataUsingBlock:^(uint32_t fid, NSString *base,
+				  size_t length, time_t mtime)
+    {
+      int tier = evictable_tier(base);
+      if (tier < 0)
+	return;
+
+      struct cache_item item;
+      item.library = idx;
+      item.file_id = fid;
+      item.access = fid < access_count ? access[fid] : 0;
+      if (item.access == 0)
+	item.access = (uint32_t)mtime;
+      item.tier = (uint16_t)tier;
+      item.packed = 1;
+      item.size = length;
+      add_item(list, &item);
+    }];
+
+  free(access);
+}
+
+static int
+compare_items(const void *a, const void *b)
+{
+  const struct cache_item *x = a, *y = b;
+
+  if (x->tier != y->tier)
+    return x->tier < y->tier ? -1 : 1;
+  else
+    return x->access < y->access ? -1 : x->access > y->access;
+}
+
+/* Removes the item unless it's pinned or has been used since it was
+   collected. Returns true if it was removed. */
+
+static BOOL
+evict_item(PDImageLibrary *lib, const struct cache_item *item)
+{
+  BOOL ret = NO;
+  uint32_t fid = item->file_id;
+  NSString *base = @(evictable_bases[item->tier]);
+
+  pthread_mutex_lock(&lib->_cacheLock);
+
+  if (![lib->_pinnedIds containsObject:@(fid)]
+      && !(fid < lib->_accessCount && lib->_accessTimes[fid] > item->access))
+    {
+      if (item->packed)
+	{
+	  if (lib->_pack != nil)
+	    {
+	      [lib->_pack removeDataForFileId:fid base:base];
+	      ret = YES;
+	    }
+	}
+      else if (lib->_cacheFiles != nil)
+	{
+	  NSString *path = [lib cachePathForFileId:fid base:base];
+	  unlink(path.fileSystemRepresentation);
+	  [lib->_cacheFiles[base] removeIndex:fid];
+	  lib->_manifestDirty = YES;
+	  ret = YES;
+	}
+    }
+
+  pthread_mutex_unlock(&lib->_cacheLock);
+
+  if (ret)
+    {
+      atomic_fetch_add(&lib->_cacheEvictions, 1);
+      atomic_fetch_add(&lib->_cacheEvictedBytes, item->size);
+    }
+
+  return ret;
+}
+
+static void
+evict_caches(NSArray *libraries)
+{
+  uint64_t limit = [PDImageLibrary cacheSizeLimit];
+  if (limit == 0)
+    return;
+
+  struct cache_items list = {0};
+
+  for (NSUInteger i = 0; i < libraries.count; i++)
+    collect_items(libraries[i], (uint32_t)i, &list);
+
+  uint64_t total = list.total;
+
+  if (total > limit)
+    {
+      qsort(list.items, list.count, sizeof(struct cache_item), compare_items);
+
+      uint64_t target = limit * EVICTION_LOW_WATER;
+
+      for (size_t i = 0; i < list.count && total > target; i++)
+	{
+	  const struct cache_item *item = &list.items[i];
+	  if (evict_item(libraries[item->library], item))
+	    total -= item->size;
+	}
+    }
+
+  atomic_store(&_estimatedCacheSize, total);
+
+  free(list.items);
+}
+
+/* Runs an eviction pass over all libraries on a low priority queue,
+   unless one is already pending. */
+
+static void
+schedule_eviction(void)
+{
+  if (atomic_exchange(&_evictionPending, true))
+    return;
+
+  dispatch_async(dispatch_get_main_queue(), ^
+    {
+      NSArray *libraries = [[PDImageLibrary allLibraries] copy];
+
+      dispatch_async(eviction_queue(), ^
+	{
+	  atomic_store(&_evictionPending, false);
+
+	  @autoreleasepool
+	    {
+	      evict_caches(libraries);
+	    }
+	});
+    });
+}
+
+static void
+cache_did_grow(size_t size)
+{
+  uint64_t limit = [PDImageLibrary cacheSizeLimit];
+
+  if (limit != 0 && atomic_fetch_add(&_estimatedCacheSize, size) > limit)
+    schedule_eviction();
+}
+
+/* Called with _cacheLock held. */
+
+static void
+record_access(PDImageLibrary *self, uint32_t file_id)
+{
+  if (file_id >= self->_accessCount)
+    {
+      size_t count = MAX(file_id + 1, self->_accessCount * 2);
+      count = MAX(count, 1024);
+      uint32_t *times = realloc(self->_accessTimes, count * sizeof(uint32_t));
+      if (times == NULL)
+	return;
+      memset(times + self->_accessCount, 0,
+	     (count - self->_accessCount) * sizeof(uint32_t));
+      self->_accessTimes = times;
+      self->_accessCount = count;
+    }
+
+  self->_accessTimes[file_id] = (uint32_t)time(NULL);
+  self->_accessDirty = YES;
+}
+
+/* Records that the cached data of 'file_id' is being used, returns
+   true if it can be trusted.
+
+   Until the cache has been validated it may contain data left behind
+   for ids the catalog has since forgotten and is now reallocating (see
+   -validateCaches), so data for ids newer than the catalog is only
+   used if it was written by this session. */
+
+static BOOL
+cache_access(PDImageLibrary *self, uint32_t file_id)
+{
+  pthread_mutex_lock(&self->_cacheLock);
+
+  record_access(self, file_id);
+
+  BOOL ret = (file_id <= self->_trustedFileId || self->_validated
+	      || [self->_writtenIds containsIndex:file_id]);
+
+  pthread_mutex_unlock(&self->_cacheLock);
+
+  return ret;
+}
+
+static void
+count_lookup(PDImageLibrary *self, BOOL hit)
+{
+  if (hit)
+    atomic_fetch_add(&self->_cacheHits, 1);
+  else
+    atomic_fetch_add(&self->_cacheMisses, 1);
+}
+
+static BOOL
+loose_file_is_valid(PDImageLibrary *self, uint32_t file_id, NSString *str,
+		    time_t mtime)
+{
+  struct stat st;
+  NSString *path = [self cachePathForFileId:file_id base:str];
+
+  if (stat([path fileSystemRepresentation], &st) != 0)
+    return NO;
+
+  return st.st_mtime > mtime;
+}
+
+- (BOOL)hasCachedDataForFileId:(uint32_t)file_id base:(NSString *)str
+    newerThan:(time_t)mtime
+{
+  BOOL ret = NO;
+
+  if (!cache_access(self, file_id))
+    ret = NO;
+  else if (use_pack(self, str))
+    ret = [_pack hasDataForFileId:file_id base:str newerThan:mtime];
+  else
+    ret = loose_file_is_valid(self, file_id, str, mtime);
+
+  count_lookup(self, ret);
+
+  return ret;
+}
+
+- (NSData *)cachedDataForFileId:(uint32_t)file_id base:(NSString *)str
+    newerThan:(time_t)mtime
+{
+  NSData *data = nil;
+
+  if (!cache_access(self, file_id))
+    data = nil;
+  else if (use_pack(self, str))
+    data = [_pack dataForFileId:file_id base:str newerThan:mtime];
+  else if (loose_file_is_valid(self, file_id, str, mtime))
+    {
+      NSString *path = [self cachePathForFileId:file_id base:str];
+      data = [NSData dataWithContentsOfFile:path
+	      options:NSDataReadingMappedIfSafe error:nil];
+    }
+
+  count_lookup(self, data != nil);
+
+  return data;
+}
+
+- (void)setCachedData:(NSData *)data forFileId:(uint32_t)file_id
+    base:(NSString *)str
+{
+  pthread_mutex_lock(&_cacheLock);
+
+  [_writtenIds addIndex:file_id];
+  record_access(self, file_id);
+
+  if (!use_pack(self, str))
+    {
+      NSMutableIndexSet *ids = _cacheFiles[str];
+      if (ids == nil)
+	{
+	  ids = [NSMutableIndexSet indexSet];
+	  _cacheFiles[str] = ids;
+	}
+      [ids addIndex:file_id];
+      _manifestDirty = YES;
+    }
+
+  pthread_mutex_unlock(&_cacheLock);
+
+  cache_did_grow(data.length);
+
+  if (use_pack(self, str))
+    {
+      [_pack setData:data forFileId:file_id base:str];
+      return;
+    }
+
+  NSString *path = [self cachePathForFileId:file_id base:str];
+  NSString *dir = [path stringByDeletingLastPathComponent];
+  NSFileManager *fm = [NSFileManager defaultManager];
+
+  if (![fm fileExistsAtPath:dir])
+    {
+      if (![fm createDirectoryAtPath:dir withIntermediateDirectories:YES
+	    attributes:nil error:nil])
+	return;
+    }
+
+  [data writeToFile:path atomically:YES];
+}
+
+- (void)pinCachedDataForFileId:(uint32_t)file_id
+{
+  pthread_mutex_lock(&_cacheLock);
+  [_pinnedIds addObject:@(file_id)];
+  pthread_mutex_unlock(&_cacheLock);
+}
+
+- (void)unpinCachedDataForFileId:(uint32_t)file_id
+{
+  pthread_mutex_lock(&_cacheLock);
+  [_pinnedIds removeObject:@(file_id)];
+  pthread_mutex_unlock(&_cacheLock);
+}
+
+- (uint64_t)cacheHits
+{
+  return atomic_load(&_cacheHits);
+}
+
+- (uint64_t)cacheMisses
+{
+  return atomic_load(&_cacheMisses);
+}
+
+- (uint64_t)cacheEvictions
+{
+  return atomic_load(&_cacheEvictions);
+}
+
+- (uint64_t)cacheEvictedBytes
+{
+  return atomic_load(&_cacheEvictedBytes);
+}
+
+- (BOOL)getCachedPropertyRecord:(PDPropertyCacheRecord *)rec
+    keywords:(NSArray **)keywords forFileId:(uint32_t)file_id
+    newerThan:(time_t)mtime
+{
+  return [_propertyCache getRecord:rec keywords:keywords
+	  forFileId:file_id newerThan:mtime];
+}
+
+- (void)setCachedProperties:(NSDictionary *)dict forFileId:(uint32_t)file_id
+{
+  [_propertyCache setProperties:dict forFileId:file_id];
+}
+
+- (BOOL)hasIndexedWordsForFileId:(uint32_t)file_id
+{
+  return [_textIndex hasWordsForFileId:file_id];
+}
+
+- (void)setIndexedWords:(NSArray *)words forFileId:(uint32_t)file_id
+{
+  [_textIndex setWords:words forFileId:file_id];
+}
+
+- (void)addIndexedWords:(NSArray *)words forFileId:(uint32_t)file_id
+{
+  [_textIndex addWords:words forFileId:file_id];
+}
+
+- (NSIndexSet *)fileIdsMatchingWord:(NSString *)word prefix:(BOOL)flag
+{
+  return [_textIndex fileIdsMatchingWord:word prefix:flag];
+}
+
+- (uint64_t)textIndexGeneration
+{
+  return _textIndex.generation;
+}
+
+- (uint32_t)uniqueIdOfFile:(NSString *)path
+{
+  return [_catalog fileIdForPath:path];
+}
+
+/* The manifest lists each base name with the ranges of file ids that
+   have loose cache files of that name. */
+
+struct manifest_header
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t base_count;
+};
+
+struct manifest_base
+{
+  uint32_t name_length;
+  uint32_t range_count;
+};
+
+static NSData *
+copy_manifest_data(NSDictionary *files)
+{
+  NSMutableData *data = [NSMutableData data];
+
+  struct manifest_header h;
+  h.magic = MANIFEST_MAGIC;
+  h.version = MANIFEST_VERSION;
+  h.base_count = (uint32_t)files.count;
+  [data appendBytes:&h length:sizeof(h)];
+
+  for (NSString *base in files)
+    {
+      NSIndexSet *ids = files[base];
+      const char *name = base.UTF8String;
+
+      __block uint32_t count = 0;
+      [ids enumerateRangesUsingBlock:^(NSRange r, BOOL *stop) {
+	count++;
+      }];
+
+      struct manifest_base b;
+      b.name_length = (uint32_t)strlen(name);
+      b.range_count = count;
+      [data appendBytes:&b length:sizeof(b)];
+      [data appendBytes:name length:b.name_length];
+
+      [ids enumerateRangesUsingBlock:^(NSRange r, BOOL *stop) {
+	uint32_t range[2] = {(uint32_t)r.location, (uint32_t)r.length};
+	[data appendBytes:range length:sizeof(range)];
+      }];
+    }
+
+  return data;
+}
+
+/* Returns nil if 'data' isn't a valid manifest. */
+
+static NSMutableDictionary *
+parse_manifest_data(NSData *data)
+{
+  const uint8_t *ptr = data.bytes;
+  const uint8_t *end = ptr + data.length;
+
+  struct manifest_header h;
+  if (end - ptr < (ptrdiff_t)sizeof(h))
+    return nil;
+  memcpy(&h, ptr, sizeof(h));
+  ptr += sizeof(h);
+
+  if (h.magic != MANIFEST_MAGIC || h.version != MANIFEST_VERSION)
+    return nil;
+
+  NSMutableDictionary *files = [NSMutableDictionary dictionary];
+
+  for (uint32_t i = 0; i < h.base_count; i++)
+    {
+      struct manifest_base b;
+      if (end - ptr < (ptrdiff_t)sizeof(b))
+	return nil;
+      memcpy(&b, ptr, sizeof(b));
+      ptr += sizeof(b);
+
+      if ((size_t)(end - ptr) < b.name_length
+	  || (size_t)(end - ptr - b.name_length) / (2 * sizeof(uint32_t))
+	     < b.range_count)
+	return nil;
+
+      NSString *base = [[NSString alloc] initWithBytes:ptr
+			length:b.name_length encoding:NSUTF8StringEncoding];
+      ptr += b.name_length;
+      if (base == nil)
+	return nil;
+
+      NSMutableIndexSet *ids = [NSMutableIndexSet indexSet];
+
+      for (uint32_t j = 0; j < b.range_count; j++)
+	{
+	  uint32_t range[2];
+	  memcpy(range, ptr, sizeof(range));
+	  ptr += sizeof(range);
+	  [ids addIndexesInRange:NSMakeRange(range[0], range[1])];
+	}
+
+      files[base] = ids;
+    }
+
+  return files;
+}
+
+- (void)synchronize
+{
+  NSString *path = catalog_path(self);
+
+  [_catalog synchronizeWithContentsOfFile:path];
+
+  [_propertyCache synchronize];
+  [_textIndex synchronize];
+  [_pack synchronize];
+
+  /* The manifest is only valid once validation has finished, until
+     then there's no manifest and the next launch will scan. */
+
+  NSData *manifest = nil;
+
+  pthread_mutex_lock(&_cacheLock);
+  if (_validated && _manifestDirty)
+    {
+      manifest = copy_manifest_data(_cacheFiles);
+      _manifestDirty = NO;
+    }
+  pthread_mutex_unlock(&_cacheLock);
+
+  if (manifest != nil)
+    [manifest writeToFile:manifest_path(self) atomically:YES];
+
+  NSData *access = nil;
+
+  pthread_mutex_lock(&_cacheLock);
+  if (_accessDirty)
+    {
+      access = copy_access_data(self);
+      _accessDirty = NO;
+    }
+  pthread_mutex_unlock(&_cacheLock);
+
+  if (access != nil)
+    [access writeToFile:access_path(self) atomically:YES];
+
+  /* Once the binary catalog has been written any JSON catalog is
+     stale, falling back to it could reuse ids allocated since. */
+
+  NSFileManager *fm = [NSFileManager defaultManager];
+  NSString *json_path = json_catalog_path(self);
+
+  if ([fm fileExistsAtPath:path] && [fm fileExistsAtPath:json_path])
+    [fm removeItemAtPath:json_path error:nil];
+}
+
+static unsigned int
+convert_hexdigit(int c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  else if (c >= 'A' && c <= 'F')
+    return 10 + c - 'A';
+  else if (c >= 'a' && c <= 'f')
+    return 10 + c - 'a';
+  else
+    return 0;
+}
+
+/* Deletes the loose cache file unless it was written by this session,
+   returns true if it was deleted. Called with _cacheLock held, so the
+   file can't be rewritten while it's being checked. */
+
+static BOOL
+remove_cache_file(PDImageLibrary *self, uint32_t fid, NSString *base)
+{
+  if ([self->_writtenIds containsIndex:fid])
+    return NO;
+
+  NSString *path = [self cachePathForFileId:fid base:base];
+  unlink(path.fileSystemRepresentation);
+
+  return YES;
+}
+
+/* Deletes loose cache files listed in the manifest that either don't
+   exist in the catalog or are now stored in the packed cache. */
+
+static void
+validate_manifest(PDImageLibrary *self, NSIndexSet *catalogIds)
+{
+  pthread_mutex_lock(&self->_cacheLock);
+
+  for (NSString *base in [self->_cacheFiles allKeys])
+    {
+      NSMutableIndexSet *ids = self->_cacheFiles[base];
+      BOOL packed = use_pack(self, base);
+      NSMutableIndexSet *removed = [NSMutableIndexSet indexSet];
+
+      [ids enumerateIndexesUsingBlock:^(NSUInteger fid, BOOL *stop) {
+	if ((packed || ![catalogIds containsIndex:fid])
+	    && remove_cache_file(self, (uint32_t)fid, base))
+	  {
+	    [removed addIndex:fid];
+	  }
+      }];
+
+      if (removed.count != 0)
+	{
+	  [ids removeIndexes:removed];
+	  self->_manifestDirty = YES;
+	}
+    }
+
+  pthread_mutex_unlock(&self->_cacheLock);
+}
+
+/* Lists the cache directories, deleting any unexpected files and
+   rebuilding the manifest from those that remain. */
+
+static void
+validate_directories(PDImageLibrary *self, NSIndexSet *catalogIds)
+{
+  NSString *dir = self.cachePath;
+  NSFileManager *fm = [NSFileManager defaultManager];
+
+  unsigned int i;
+  for (i = 0; i < (1U << CACHE_BITS); i++)
+    {
+      NSString *path = [dir stringByAppendingPathComponent:
+			[NSString stringWithFormat:@"%02x", i]];
+      if (![fm fileExistsAtPath:path])
+	continue;
+
+      for (NSString *file in [fm contentsOfDirectoryAtPath:path error:nil])
+	{
+	  const char *start = file.UTF8String;
+	  const char *str = start;
+	  const char *end = strchr(str, CACHE_SEP);
+
+	  if (end == NULL)
+	    {
+	      NSLog(@"PDImageLibrary: cache orphan: %02x/%@", i, file);
+	      [fm removeItemAtPath:
+	       [path stringByAppendingPathComponent:file] error:nil];
+	      continue;
+	    }
+
+	  uint32_t fid = 0;
+	  for (; str != end; str++)
+	    fid = fid * 16 + convert_hexdigit(*str);
+	  fid = (fid << CACHE_BITS) | i;
+
+	  NSString *base = [file substringFromIndex:end - start + 1];
+
+	  pthread_mutex_lock(&self->_cacheLock);
+
+	  if (![catalogIds containsIndex:fid] || use_pack(self, base))
+	    {
+	      if (remove_cache_file(self, fid, base))
+		NSLog(@"PDImageLibrary: cache orphan: %02x/%@", i, file);
+	    }
+	  else
+	    {
+	      NSMutableIndexSet *ids = self->_cacheFiles[base];
+	      if (ids == nil)
+		{
+		  ids = [NSMutableIndexSet indexSet];
+		  self->_cacheFiles[base] = ids;
+		}
+	      [ids addIndex:fid];
+	    }
 
-- (void)synchronize
-{
-  [_catalog synchronizeWithContentsOfFile:catalog_path(self)];
-}
+	  pthread_mutex_unlock(&self->_cacheLock);
+	}
+    }
 
-static unsigned int
-convert_hexdigit(int c)
-{
-  if (c >= '0' && c <= '9')
-    return c - '0';
-  else if (c >= 'A' && c <= 'F')
-    return 10 + c - 'A';
-  else if (c >= 'a' && c <= 'f')
-    return 10 + c - 'a';
-  else
-    return 0;
+  pthread_mutex_lock(&self->_cacheLock);
+  self->_manifestDirty = YES;
+  pthread_mutex_unlock(&self->_cacheLock);
 }
 
 - (void)validateCaches
 {
-  /* This runs immediately after loading the catalog and before we pull
-     anything out of the cache. It scans the cache directory hierarchy
-     for any files that don't exist in the catalog and deletes them.
+  /* This runs after loading the catalog. It deletes anything in the
+     cache belonging to file ids that don't exist in the catalog.
 
      This is to handle the case where the app crashed after finding new
      files (adding their results to the cache) but before writing out
-     the updated catalog and library state. In this case we'll reuse
-     image ids and musn't find data for those ids already in the cache.
+     the updated catalog and library state. The catalog journal records
+     new ids as they're allocated so normally they survive the crash,
+     but if the journal is lost we'll reuse image ids and musn't find
+     data for those ids already in the cache.
+
+     The loose cache files are found from the manifest saved by the
+     last -synchronize. The manifest is deleted as soon as it's read,
+     so if the app doesn't exit cleanly the next launch falls back to
+     listing every cache directory.
+
+     Either way the work is done on a low priority queue so it doesn't
+     hold up launching. Until it's finished cache_is_trusted() hides
+     data for any ids the catalog didn't know about when it was loaded,
+     unless it was written by this session.
 
      Note that this doesn't immediately remove items from the cache
      that exist in the catalog but not in the library itself. Due to
@@ -379,59 +1382,111 @@ convert_hexdigit(int c)
      called the next time the app is launched.
 
      (Or we could choose a point after all libraries have been scanned
-     to release _catalog0 then call -validateCaches.) */
+     to release _catalog0 then call -validateCaches.)
 
-  @autoreleasepool
-    {
-      NSString *dir = self.cachePath;
-      NSFileManager *fm = [NSFileManager defaultManager];
+     When the packed cache is enabled any loose files it replaces are
+     deleted as well, so switching between the two doesn't leave stale
+     data behind. */
 
-      NSIndexSet *catalogIds = _catalog.allFileIds;
+  NSString *path = manifest_path(self);
 
-      unsigned int i;
-      for (i = 0; i < (1U << CACHE_BITS); i++)
+  NSMutableDictionary *files = parse_manifest_data
+    ([NSData dataWithContentsOfFile:path]);
+
+  unlink(path.fileSystemRepresentation);
+
+  uint32_t trusted_id = _catalog.lastFileId;
+
+  /* The manifest has been deleted, so it must be written again even
+     if nothing is added to the cache this session. */
+
+  pthread_mutex_lock(&_cacheLock);
+  _validated = NO;
+  _cacheFiles = files != nil ? files : [NSMutableDictionary dictionary];
+  _trustedFileId = trusted_id;
+  _manifestDirty = YES;
+  pthread_mutex_unlock(&_cacheLock);
+
+  dispatch_group_t group = _validateGroup;
+  dispatch_queue_t queue = dispatch_get_global_queue
+    (DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0);
+
+  dispatch_group_async(group, queue, ^
+    {
+      @autoreleasepool
 	{
-	  NSString *path = [dir stringByAppendingPathComponent:
-			    [NSString stringWithFormat:@"%02x", i]];
-	  if (![fm fileExistsAtPath:path])
-	    continue;
+	  NSIndexSet *catalogIds = _catalog.allFileIds;
 
-	  for (NSString *file in [fm contentsOfDirectoryAtPath:path error:nil])
-	    {
-	      const char *str = file.UTF8String;
-	      const char *end = strchr(str, CACHE_SEP);
+	  [_propertyCache removePropertiesForFileIdsNotInSet:catalogIds];
+	  [_textIndex removeWordsForFileIdsNotInSet:catalogIds];
 
-	      BOOL delete = NO;
-	      if (end != NULL)
-		{
-		  uint32_t fid = 0;
-		  for (; str != end; str++)
-		    fid = fid * 16 + convert_hexdigit(*str);
-		  fid = (fid << CACHE_BITS) | i;
-		  if (![catalogIds containsIndex:fid])
-		    delete = YES;
-		}
-	      else
-		delete = YES;
+	  /* Ids allocated since the catalog was loaded may be reusing
+	     ids whose cached data outlived them, so only keep what this
+	     session wrote for those. */
 
-	      if (delete)
-		{
-		  NSLog(@"PDImageLibrary: cache orphan: %02x/%@", i, file);
-		  [fm removeItemAtPath:
-		   [path stringByAppendingPathComponent:file] error:nil];
-		}
+	  NSMutableIndexSet *cacheIds = [catalogIds mutableCopy];
+
+	  if (trusted_id < UINT32_MAX)
+	    {
+	      [cacheIds removeIndexesInRange:
+	       NSMakeRange(trusted_id + 1, UINT32_MAX - trusted_id)];
 	    }
+
+	  pthread_mutex_lock(&_cacheLock);
+	  [_writtenIds enumerateIndexesUsingBlock:^(NSUInteger fid, BOOL *stop) {
+	    if ([catalogIds containsIndex:fid])
+	      [cacheIds addIndex:fid];
+	  }];
+	  pthread_mutex_unlock(&_cacheLock);
+
+	  [_pack removeDataForFileIdsNotInSet:cacheIds];
+
+	  if (files != nil)
+	    validate_manifest(self, cacheIds);
+	  else
+	    validate_directories(self, cacheIds);
+
+	  pthread_mutex_lock(&_cacheLock);
+	  _validated = YES;
+	  _trustedFileId = UINT32_MAX;
+	  pthread_mutex_unlock(&_cacheLock);
 	}
-    }
+
+      schedule_eviction();
+    });
 }
 
 - (void)emptyCaches
 {
   if (_cachePath != nil)
     {
+      dispatch_group_wait(_validateGroup, DISPATCH_TIME_FOREVER);
+      [_catalog invalidate];
+      [_propertyCache invalidate];
+      [_textIndex invalidate];
+      pthread_mutex_lock(&_cacheLock);
+      BOOL packed = _pack != nil;
+      [_pack invalidate];
+      _pack = nil;
+      pthread_mutex_unlock(&_cacheLock);
       [[NSFileManager defaultManager] removeItemAtPath:_cachePath error:nil];
       _cachePath = nil;
       _catalog = [[PDFileCatalog alloc] init];
+      [_catalog openJournalForFile:catalog_path(self)];
+      _propertyCache = [[PDPropertyCache alloc]
+			initWithPath:property_cache_path(self)];
+      _textIndex = [[PDTextIndex alloc] initWithPath:text_index_path(self)];
+      pthread_mutex_lock(&_cacheLock);
+      if (packed)
+	_pack = [[PDPackedCache alloc] initWithPath:pack_path(self)];
+      _cacheFiles = [NSMutableDictionary dictionary];
+      [_writtenIds removeAllIndexes];
+      _manifestDirty = YES;
+      free(_accessTimes);
+      _accessTimes = NULL;
+      _accessCount = 0;
+      _accessDirty = NO;
+      pthread_mutex_unlock(&_cacheLock);
     }
 }
 
@@ -462,6 +1517,141 @@ convert_hexdigit(int c)
   [_catalog removeFileWithPath:path];
 }
 
+- (void)didRemoveDirectoryWithPath:(NSString *)path
+{
+  [_catalog removeDirectory:path];
+}
+
+/* Changes made through our own file operations are already accounted
+   for, so are ignored when the file manager reports them. */
+
+#define LOCAL_CHANGE_TIMEOUT 10
+
+static void
+note_local_change(PDImageLibrary *self, NSString *path)
+{
+  time_t now = time(NULL);
+
+  pthread_mutex_lock(&self->_changeLock);
+
+  if (self->_localChanges == nil)
+    self->_localChanges = [[NSMutableDictionary alloc] init];
+
+  self->_localChanges[path] = @(now);
+
+  if (self->_localChanges.count > 256)
+    {
+      NSMutableArray *expired = [NSMutableArray array];
+      for (NSString *key in self->_localChanges)
+	{
+	  if ([self->_localChanges[key] longValue]
+	      < now - LOCAL_CHANGE_TIMEOUT)
+	    [expired addObject:key];
+	}
+      [self->_localChanges removeObjectsForKeys:expired];
+    }
+
+  pthread_mutex_unlock(&self->_changeLock);
+}
+
+static BOOL
+is_local_change(PDImageLibrary *self, NSString *path)
+{
+  time_t now = time(NULL);
+
+  pthread_mutex_lock(&self->_changeLock);
+
+  NSNumber *t = self->_localChanges[path];
+  BOOL ret = t != nil && [t longValue] >= now - LOCAL_CHANGE_TIMEOUT;
+
+  if (t != nil && !ret)
+    [self->_localChanges removeObjectForKey:path];
+
+  pthread_mutex_unlock(&self->_changeLock);
+
+  return ret;
+}
+
+/* Coalesces the directory change notifications for one batch of
+   outside changes, the observers mark the affected items as needing
+   to be rescanned. Called on the main thread. */
+
+static void
+directory_did_change(PDImageLibrary *self, NSString *dir)
+{
+  if (self->_changedDirectories == nil)
+    self->_changedDirectories = [[NSMutableSet alloc] init];
+
+  if (self->_changedDirectories.count == 0)
+    {
+      dispatch_async(dispatch_get_main_queue(), ^
+	{
+	  NSSet *dirs = [self->_changedDirectories copy];
+	  [self->_changedDirectories removeAllObjects];
+
+	  for (NSString *lib_dir in dirs)
+	    {
+	      [[NSNotificationCenter defaultCenter]
+	       postNotificationName:PDImageLibraryDirectoryDidChange
+	       object:self userInfo:@{@"libraryDirectory": lib_dir}];
+	    }
+	});
+    }
+
+  [self->_changedDirectories addObject:dir];
+}
+
+- (void)fileManager:(PDFileManager *)manager
+    didRenameItemAtPath:(NSString *)oldPath toPath:(NSString *)newPath
+    isDirectory:(BOOL)flag
+{
+  if (is_local_change(self, oldPath) && is_local_change(self, newPath))
+    return;
+
+  /* Renaming the catalog entries keeps the file ids, and hence the
+     cached data, of the moved files. */
+
+  if (flag)
+    [self didRenameDirectory:oldPath to:newPath];
+  else
+    [self didRenameFile:oldPath to:newPath];
+
+  directory_did_change(self, [oldPath stringByDeletingLastPathComponent]);
+  directory_did_change(self, [newPath stringByDeletingLastPathComponent]);
+}
+
+- (void)fileManager:(PDFileManager *)manager
+    didCreateItemAtPath:(NSString *)path isDirectory:(BOOL)flag
+{
+  if (is_local_change(self, path))
+    return;
+
+  directory_did_change(self, [path stringByDeletingLastPathComponent]);
+}
+
+- (void)fileManager:(PDFileManager *)manager
+    didRemoveItemAtPath:(NSString *)path isDirectory:(BOOL)flag
+{
+  if (is_local_change(self, path))
+    return;
+
+  /* The files of a directory moved elsewhere aren't reported, so all
+     the catalog's entries under it are removed. */
+
+  if (!flag)
+    [self didRemoveFileWithPath:path];
+  else
+    [self didRemoveDirectoryWithPath:path];
+
+  directory_did_change(self, [path stringByDeletingLastPathComponent]);
+}
+
+- (void)fileManager:(PDFileManager *)manager
+    directoryNeedsRescanAtPath:(NSString *)path
+{
+  directory_did_change(self, path);
+}
+
 - (NSOperationQueue *)IOQueue
 {
   if (_ioQueue == nil)
@@ -617,92 +1807,336 @@ copy_item_atomically(PDImageLibrary *self, NSString *dst_path,
   return YES;
 }
 
-- (void)loadImagesInSubdirectory:(NSString *)dir
-    recursively:(BOOL)flag handler:(void (^)(PDImage *))block
+/* Classification of file name extensions, cached as looking up the
+   UTI of every file is expensive. */
+
+enum extension_kind
 {
-  @autoreleasepool
+  extension_other,
+  extension_metadata,
+  extension_image,
+};
+
+static PDImageLibraryExtension *
+classify_extension(NSString *ext)
+{
+  static NSMutableDictionary *cache;
+  static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+  pthread_mutex_lock(&lock);
+  if (cache == nil)
+    cache = [[NSMutableDictionary alloc] init];
+  PDImageLibraryExtension *info = cache[ext];
+  pthread_mutex_unlock(&lock);
+
+  if (info != nil)
+    return info;
+
+  info = [[PDImageLibraryExtension alloc] init];
+  info->_kind = extension_other;
+
+  CFStringRef type = UTTypeCreatePreferredIdentifierForTag(
+				kUTTagClassFilenameExtension,
+				(__bridge CFStringRef)ext, NULL);
+  if (type != NULL)
     {
-      /* Build table of file-name-minus-extension -> [extensions...] */
+      if (UTTypeConformsTo(type, PDTypePhodMetadata))
+	info->_kind = extension_metadata;
+      else if (UTTypeConformsTo(type, kUTTypeImage))
+	info->_kind = extension_image;
+      info->_type = CFBridgingRelease(type);
+    }
+
+  pthread_mutex_lock(&lock);
+  cache[ext] = info;
+  pthread_mutex_unlock(&lock);
+
+  return info;
+}
+
+/* Builds one image from the files in 'dir' named 'stem' with each of
+   'exts', if possible. */
+
+static PDImage *
+create_image(PDImageLibrary *self, NSString *dir, NSString *stem,
+	     NSArray *exts)
+{
+  NSMutableDictionary *image_types = nil;
 
-      NSMutableDictionary *groups = [NSMutableDictionary dictionary];
+  for (NSString *ext in exts)
+    {
+      PDImageLibraryExtension *info = classify_extension(ext);
 
-      for (NSString *file in [self contentsOfDirectoryAtPath:dir])
+      if (info->_kind == extension_metadata)
 	{
-	  if ([file characterAtIndex:0] == '.')
-	    continue;
+	  NSString *file = [stem stringByAppendingPathExtension:ext];
+	  return [[PDImage alloc] initWithLibrary:self directory:dir
+		  JSONFile:file];
+	}
+      else if (info->_kind == extension_image)
+	{
+	  if (image_types == nil)
+	    image_types = [NSMutableDictionary dictionary];
+	  NSString *file = [stem stringByAppendingPathExtension:ext];
+	  image_types[info->_type] = file;
+	}
+    }
 
-	  NSString *dir_file = [dir stringByAppendingPathComponent:file];
-	  BOOL is_dir = NO;
-	  if (![self fileExistsAtPath:dir_file isDirectory:&is_dir])
-	    continue;
-	  if (is_dir)
-	    {
-	      if (flag)
-		{
-		  [self loadImagesInSubdirectory:dir_file recursively:YES
-		   handler:block];
-		}
-	      continue;
-	    }
+  if (image_types.count == 0)
+    return nil;
+
+  return [[PDImage alloc] initWithLibrary:self directory:dir
+	  properties:@{PDImage_FileTypes: image_types}];
+}
 
-	  NSString *stem = [file stringByDeletingPathExtension];
-	  NSString *ext = [file pathExtension];
+/* Returns true if any of the files in 'dir' named 'stem' with each of
+   'exts' has been modified at or after time 't'. */
 
-	  NSMutableArray *exts = groups[stem];
-	  if (exts != nil)
-	    [exts addObject:ext];
-	  else
+static BOOL
+files_modified_since(PDImageLibrary *self, NSString *dir, NSString *stem,
+		     NSArray *exts, time_t t)
+{
+  for (NSString *ext in exts)
+    {
+      NSString *file = [stem stringByAppendingPathExtension:ext];
+      NSString *path = [dir stringByAppendingPathComponent:file];
+      if ([self mtimeOfFileAtPath:path] >= t)
+	return YES;
+    }
+
+  return NO;
+}
+
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Passes 'images' to 'emit' in batches. */
+
+static void
+emit_images(NSArray *images, void (^emit)(NSArray *images))
+{
+  NSUInteger count = images.count;
+
+  for (NSUInteger i = 0; i < count; i += LOAD_BATCH_SIZE)
+    {
+      emit([images subarrayWithRange:
+	    NSMakeRange(i, MIN(count - i, LOAD_BATCH_SIZE))]);
+    }
+}
+
+/* Groups the files in 'dir' by stem, then creates their images in
+   batches. Subdirectories (if recursive) and batches are queued
+   separately, so they're spread over all cores.
+
+   The state of 'dir' is recorded in 'snapshots'. When 'old_snapshots'
+   shows that 'dir' is unchanged since it was last
+   scanned its previous images are passed through as-is, otherwise
+   images are only created for stems that are new or whose files have
+   changed. */
+
+static void
+scan_directory(PDImageLibrary *self, NSString *dir, BOOL recursive,
+	       NSDictionary *old_snapshots, NSMutableDictionary *snapshots,
+	       dispatch_group_t group, dispatch_queue_t queue,
+	       void (^emit)(NSArray *images))
+{
+  /* Directory mtimes only have one second granularity, so note the
+     time before reading anything: a directory whose mtime isn't
+     earlier than that could have changed while we were reading it. */
+
+  time_t scan_time = time(NULL);
+  time_t mtime = [self mtimeOfFileAtPath:dir];
+
+  /* Build table of file-name-minus-extension -> [extensions...] */
+
+  NSMutableDictionary *groups = [NSMutableDictionary dictionary];
+  __block NSUInteger entry_count = 0;
+
+  [self foreachFileInDirectory:dir handler:^(NSString *file, BOOL is_dir)
+    {
+      entry_count++;
+
+      if (file.length == 0 || [file characterAtIndex:0] == '.')
+	return;
+
+      if (is_dir)
+	{
+	  if (recursive)
 	    {
-	      exts = [NSMutableArray arrayWithObject:ext];
-	      groups[stem] = exts;
+	      NSString *subdir = [dir stringByAppendingPathComponent:file];
+	      dispatch_group_async(group, queue, ^
+		{
+		  @autoreleasepool
+		    {
+		      scan_directory(self, subdir, YES, old_snapshots,
+				     snapshots, group, queue, emit);
+		    }
+		});
 	    }
+	  return;
 	}
 
-      /* Scan each group of files to build one image if possible. */
+      NSString *stem = [file stringByDeletingPathExtension];
+      NSString *ext = [file pathExtension];
 
-      for (NSString *stem in groups)
+      NSMutableArray *exts = groups[stem];
+      if (exts != nil)
+	[exts addObject:ext];
+      else
 	{
-	  PDImage *image = nil;
-	  NSMutableDictionary *image_types = nil;
+	  exts = [NSMutableArray arrayWithObject:ext];
+	  groups[stem] = exts;
+	}
+    }];
+
+  PDImageLibrarySnapshot *old = old_snapshots[dir];
+
+  /* Nothing added, removed or renamed: reuse the old images. The entry
+     count catches file systems that don't maintain directory mtimes
+     reliably. */
+
+  if (old != nil && mtime != 0 && old->_mtime == mtime
+      && old->_count == entry_count && mtime < old->_scanTime)
+    {
+      pthread_mutex_lock(&snapshot_lock);
+      snapshots[dir] = old;
+      NSArray *images = [old->_images allValues];
+      pthread_mutex_unlock(&snapshot_lock);
 
-	  for (NSString *ext in groups[stem])
+      emit_images(images, emit);
+      return;
+    }
+
+  PDImageLibrarySnapshot *snap = [[PDImageLibrarySnapshot alloc] init];
+  snap->_mtime = mtime;
+  snap->_count = entry_count;
+  snap->_scanTime = scan_time;
+  snap->_images = [NSMutableDictionary dictionary];
+
+  /* Sort each stem's extensions so groups can be compared. */
+
+  NSMutableDictionary *sorted = [NSMutableDictionary dictionary];
+  for (NSString *stem in groups)
+    sorted[stem] = [groups[stem] sortedArrayUsingSelector:@selector(compare:)];
+  snap->_groups = sorted;
+
+  pthread_mutex_lock(&snapshot_lock);
+  snapshots[dir] = snap;
+  pthread_mutex_unlock(&snapshot_lock);
+
+  /* Scan each group of files to build one image if possible. */
+
+  NSArray *stems = [groups allKeys];
+  NSUInteger count = stems.count;
+
+  for (NSUInteger i = 0; i < count; i += LOAD_BATCH_SIZE)
+    {
+      NSArray *batch = [stems subarrayWithRange:
+			NSMakeRange(i, MIN(count - i, LOAD_BATCH_SIZE))];
+
+      dispatch_group_async(group, queue, ^
+	{
+	  @autoreleasepool
 	    {
-	      CFStringRef type = UTTypeCreatePreferredIdentifierForTag(
-					kUTTagClassFilenameExtension,
-					(__bridge CFStringRef)ext, NULL);
-	      if (type == NULL)
-		continue;
+	      NSMutableArray *images = [NSMutableArray array];
+	      NSMutableArray *image_stems = [NSMutableArray array];
 
-	      if (UTTypeConformsTo(type, PDTypePhodMetadata))
+	      for (NSString *stem in batch)
 		{
-		  NSString *file = [stem stringByAppendingPathExtension:ext];
-		  image = [[PDImage alloc] initWithLibrary:self directory:dir
-			   JSONFile:file];
+		  NSArray *exts = sorted[stem];
+		  PDImage *image = nil;
+
+		  /* Unchanged stems keep their old image (or lack of). */
+
+		  if (old != nil && [old->_groups[stem] isEqual:exts]
+		      && !files_modified_since(self, dir, stem, exts,
+					       old->_scanTime))
+		    {
+		      pthread_mutex_lock(&snapshot_lock);
+		      image = old->_images[stem];
+		      pthread_mutex_unlock(&snapshot_lock);
+		    }
+		  else
+		    image = create_image(self, dir, stem, exts);
+
+		  if (image != nil)
+		    {
+		      [images addObject:image];
+		      [image_stems addObject:stem];
+		    }
 		}
-	      else if (UTTypeConformsTo(type, kUTTypeImage))
+
+	      if (images.count != 0)
 		{
-		  if (image_types == nil)
-		    image_types = [NSMutableDictionary dictionary];
-		  NSString *file = [stem stringByAppendingPathExtension:ext];
-		  image_types[(__bridge id)type] = file;
+		  pthread_mutex_lock(&snapshot_lock);
+		  NSUInteger n = images.count;
+		  for (NSUInteger j = 0; j < n; j++)
+		    snap->_images[image_stems[j]] = images[j];
+		  pthread_mutex_unlock(&snapshot_lock);
 		}
 
-	      CFRelease(type);
-
-	      if (image != nil)
-		break;
+	      if (images.count != 0)
+		emit(images);
 	    }
+	});
+    }
+}
 
-	  if (image == nil && image_types.count != 0)
+- (NSDictionary *)loadImagesInSubdirectory:(NSString *)dir
+    recursively:(BOOL)flag snapshot:(NSDictionary *)snapshot
+    batchHandler:(void (^)(NSArray *))block
+{
+  dispatch_group_t group = dispatch_group_create();
+  dispatch_queue_t queue = dispatch_get_global_queue
+    (DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+
+  /* Batches are passed to the handler one at a time. */
+
+  dispatch_queue_t handler_queue = dispatch_queue_create
+    ("PDImageLibrary.loadImages", DISPATCH_QUEUE_SERIAL);
+
+  void (^emit)(NSArray *) = ^(NSArray *images)
+    {
+      dispatch_group_async(group, handler_queue, ^
+	{
+	  @autoreleasepool
 	    {
-	      image = [[PDImage alloc] initWithLibrary:self directory:dir
-		       properties:@{PDImage_FileTypes: image_types}];
+	      block(images);
 	    }
+	});
+    };
 
-	  if (image != nil)
-	    block(image);
-	}
+  /* Directories that no longer exist are dropped from the new
+     snapshot, as it only contains what this scan visited. */
+
+  NSMutableDictionary *new_snapshot = [NSMutableDictionary dictionary];
+
+  @autoreleasepool
+    {
+      scan_directory(self, dir, flag, snapshot, new_snapshot,
+		     group, queue, emit);
     }
+
+  dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+
+  return new_snapshot;
+}
+
+- (void)loadImagesInSubdirectory:(NSString *)dir
+    recursively:(BOOL)flag batchHandler:(void (^)(NSArray *))block
+{
+  [self loadImagesInSubdirectory:dir recursively:flag snapshot:nil
+   batchHandler:block];
+}
+
+- (void)loadImagesInSubdirectory:(NSString *)dir
+    recursively:(BOOL)flag handler:(void (^)(PDImage *))block
+{
+  [self loadImagesInSubdirectory:dir recursively:flag
+   batchHandler:^(NSArray *images)
+    {
+      for (PDImage *image in images)
+	block(image);
+    }];
 }
 
 + (void)removeImages:(NSArray *)images
@@ -1218,6 +2652,11 @@ error:
   return [_manager contentsOfFileAtPath:path];
 }
 
+- (NSData *)contentsOfFileAtPath:(NSString *)path range:(NSRange)range
+{
+  return [_manager contentsOfFileAtPath:path range:range];
+}
+
 - (NSArray *)contentsOfDirectoryAtPath:(NSString *)path
 {
   return [_manager contentsOfDirectoryAtPath:path];
@@ -1231,6 +2670,7 @@ error:
 - (BOOL)writeData:(NSData *)data toFile:(NSString *)path
     options:(NSDataWritingOptions)options error:(NSError **)err
 {
+  note_local_change(self, path);
   return [_manager writeData:data toFile:path options:options error:err];
 }
 
@@ -1238,6 +2678,7 @@ error:
     withIntermediateDirectories:(BOOL)flag attributes:(NSDictionary *)dict
     error:(NSError **)err
 {
+  note_local_change(self, path);
   return [_manager createDirectoryAtPath:path
 	  withIntermediateDirectories:flag attributes:dict error:err];
 }
@@ -1245,35 +2686,44 @@ error:
 - (BOOL)copyItemAtPath:(NSString *)src toPath:(NSString *)dst
     error:(NSError **)err
 {
+  note_local_change(self, dst);
   return [_manager copyItemAtPath:src toPath:dst error:err];
 }
 
 - (BOOL)moveItemAtPath:(NSString *)src toPath:(NSString *)dst
     error:(NSError **)err
 {
+  note_local_change(self, src);
+  note_local_change(self, dst);
   return [_manager moveItemAtPath:src toPath:dst error:err];
 }
 
 - (BOOL)removeItemAtPath:(NSString *)path error:(NSError **)err
 {
+  note_local_change(self, path);
   return [_manager removeItemAtPath:path error:err];
 }
 
+- (void)foreachFileInDirectory:(NSString *)dir
+    handler:(void (^)(NSString *file_name, BOOL is_dir))block
+{
+  [_manager foreachFileInDirectory:dir handler:block];
+}
+
 - (void)foreachSubdirectoryOfDirectory:(NSString *)dir
     handler:(void (^)(NSString *dir_name))block
 {
-  for (NSString *file in [self contentsOfDirectoryAtPath:dir])
+  [self foreachFileInDirectory:dir handler:^(NSString *file, BOOL is_dir)
     {
-      if ([file characterAtIndex:0] == '.')
-	continue;
+      if (is_dir && file.length != 0 && [file characterAtIndex:0] != '.')
+	block(file);
+    }];
+}
 
-      BOOL is_dir = NO;
-      NSString *dir_file = [dir stringByAppendingPathComponent:file];
-      if (![self fileExistsAtPath:dir_file isDirectory:&is_dir] || !is_dir)
-	continue;
+@end
 
-      block(file);
-    }
-}
+@implementation PDImageLibraryExtension
+@end
 
+@implementation PDImageLibrarySnapshot
 @end
@@ -28,6 +28,7 @@
 #import "PDColor.h"
 #import "PDImage.h"
 #import "PDImageGridView.h"
+#import "PDImageProperty.h"
 #import "PDLibraryViewController.h"
 #import "PDWindowController.h"
 
@@ -136,7 +137,12 @@
 {
   NSArray *images = _controller.filteredImageList;
 
-  _gridView.images = images;
+  NSDictionary *info = note.userInfo;
+
+  if (info[PDImageListInsertedIndexes] != nil)
+    [_gridView setImages:images changes:info];
+  else
+    _gridView.images = images;
 
   _titleLabel.stringValue = _controller.imageListTitle;
 }
@@ -160,7 +166,15 @@
 
 - (void)imagePredicateDidChange:(NSNotification *)note
 {
-  NSString *str = _controller.imagePredicate.predicateFormat;
+  NSPredicate *pred = _controller.imagePredicate;
+
+  /* Don't replace the words being searched for by their predicate. */
+
+  if (pred != nil
+      && [PDImageSearchPredicate(_searchField.stringValue) isEqual:pred])
+    return;
+
+  NSString *str = pred.predicateFormat;
   if (str.length == 0)
     str = @"";
   _searchField.stringValue = str;
@@ -252,20 +266,25 @@
 	{
 	  NSPredicate *pred = [_controller imagePredicateWithFormat:str];
 
-	  /* If parsing a non-null string fails, we don't want to
-	     update the in-use predicate, that would probably set the
-	     string being edited to the empty string. */
+	  /* Anything that isn't a predicate searches the images' text. */
+
+	  if (pred == nil)
+	    pred = PDImageSearchPredicate(str);
+
+	  /* If there's still no predicate, we don't want to update the
+	     in-use predicate, that would probably set the string being
+	     edited to the empty string. */
 
 	  if (pred != nil)
 	    {
 	      _controller.imagePredicate = pred;
-	      [_controller rebuildImageList:0];
+	      [_controller setNeedsRebuildImageList:0];
 	    }
 	}
       else if (_controller.imagePredicate != nil)
 	{
 	  _controller.imagePredicate = nil;
-	  [_controller rebuildImageList:0];
+	  [_controller setNeedsRebuildImageList:0];
 	}
     }
 }
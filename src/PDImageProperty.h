@@ -38,4 +38,21 @@ extern NSDate *PDImageParseEXIFDateString(NSString *str);
 
 extern id PDImageExpressionValues(PDImage *im);
 
+/* Compiles 'pred' into a block with the same result as evaluating it
+   against the image's -expressionValues, but reading typed property
+   values directly. Parts of the predicate that can't be compiled are
+   evaluated using the predicate itself. Returns nil if 'pred' is nil.
+   The block may be called from several threads at once, as long as
+   the images it's called with aren't being modified. */
+
+typedef BOOL (^PDImagePredicateBlock)(PDImage *im);
+
+extern PDImagePredicateBlock PDImageCompilePredicate(NSPredicate *pred);
+
+/* Returns a predicate matching images with a word starting with each
+   word of 'str' in their text (see PDImage_Words), or nil if 'str'
+   has no words. Compiled predicates answer it from the text index. */
+
+extern NSPredicate *PDImageSearchPredicate(NSString *str);
+
 extern NSArray *PDImagePredicateEditorRowTemplates(void);
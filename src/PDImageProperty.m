@@ -26,7 +26,11 @@
 
 #import <time.h>
 
+#import "PDFoundationExtensions.h"
+#import "PDImageLibrary.h"
 #import "PDMacros.h"
+#import "PDPropertyCache.h"
+#import "PDTextIndex.h"
 
 CA_HIDDEN @interface PDImageExpressionObject : NSObject
 {
@@ -425,6 +429,7 @@ static const type_pair type_map[] =
   {"title", type_string},
   {"UUID", type_string},
   {"white_balance", type_white_balance},
+  {"words", type_string_array},
 };
 
 static inline property_type
@@ -806,6 +811,447 @@ PDImageExpressionValues(PDImage *im)
 @end
 
 
+/* Compiled predicates. Comparisons between a key path and a constant,
+   the form built by the predicate editor templates, become blocks that
+   read the image's typed properties directly. The result is the same
+   as evaluating against -expressionValues (see above), but avoids KVC,
+   the property-type lookup and boxing per image. */
+
+static PDImagePredicateBlock compile_predicate(NSPredicate *pred);
+
+static PDImagePredicateBlock
+fallback_predicate(NSPredicate *pred)
+{
+  return ^BOOL (PDImage *im)
+    {
+      return [pred evaluateWithObject:im.expressionValues];
+    };
+}
+
+static PDImagePredicateBlock
+compile_compound_predicate(NSCompoundPredicate *pred)
+{
+  NSArray *subs = [pred.subpredicates mappedArray:^id (id sub)
+    {
+      return compile_predicate(sub);
+    }];
+
+  switch (pred.compoundPredicateType)
+    {
+    case NSNotPredicateType:
+      if (subs.count == 1)
+	{
+	  PDImagePredicateBlock sub = subs[0];
+	  return ^BOOL (PDImage *im)
+	    {
+	      return !sub(im);
+	    };
+	}
+      break;
+
+    case NSAndPredicateType:
+      return ^BOOL (PDImage *im)
+	{
+	  for (PDImagePredicateBlock sub in subs)
+	    {
+	      if (!sub(im))
+		return NO;
+	    }
+	  return YES;
+	};
+
+    case NSOrPredicateType:
+      return ^BOOL (PDImage *im)
+	{
+	  for (PDImagePredicateBlock sub in subs)
+	    {
+	      if (sub(im))
+		return YES;
+	    }
+	  return NO;
+	};
+    }
+
+  return nil;
+}
+
+static inline BOOL
+compare_numbers(double lhs, NSPredicateOperatorType op, double rhs)
+{
+  switch (op)
+    {
+    case NSEqualToPredicateOperatorType:
+      return lhs == rhs;
+    case NSNotEqualToPredicateOperatorType:
+      return lhs != rhs;
+    case NSLessThanPredicateOperatorType:
+      return lhs < rhs;
+    case NSLessThanOrEqualToPredicateOperatorType:
+      return lhs <= rhs;
+    case NSGreaterThanPredicateOperatorType:
+      return lhs > rhs;
+    case NSGreaterThanOrEqualToPredicateOperatorType:
+      return lhs >= rhs;
+    default:
+      return NO;
+    }
+}
+
+static inline BOOL
+compare_strings(NSString *lhs, NSPredicateOperatorType op, NSString *rhs,
+		NSStringCompareOptions opts)
+{
+  switch (op)
+    {
+    case NSEqualToPredicateOperatorType:
+      return (opts == 0 ? [lhs isEqualToString:rhs]
+	      : [lhs compare:rhs options:opts] == NSOrderedSame);
+    case NSNotEqualToPredicateOperatorType:
+      return (opts == 0 ? ![lhs isEqualToString:rhs]
+	      : [lhs compare:rhs options:opts] != NSOrderedSame);
+    case NSBeginsWithPredicateOperatorType:
+      return [lhs rangeOfString:rhs options:opts
+	      | NSAnchoredSearch].location != NSNotFound;
+    case NSEndsWithPredicateOperatorType:
+      return [lhs rangeOfString:rhs options:opts | NSAnchoredSearch
+	      | NSBackwardsSearch].location != NSNotFound;
+    case NSContainsPredicateOperatorType:
+      return [lhs rangeOfString:rhs options:opts].location != NSNotFound;
+    default:
+      return NO;
+    }
+}
+
+static BOOL
+numeric_operator_p(NSPredicateOperatorType op)
+{
+  switch (op)
+    {
+    case NSEqualToPredicateOperatorType:
+    case NSNotEqualToPredicateOperatorType:
+    case NSLessThanPredicateOperatorType:
+    case NSLessThanOrEqualToPredicateOperatorType:
+    case NSGreaterThanPredicateOperatorType:
+    case NSGreaterThanOrEqualToPredicateOperatorType:
+      return YES;
+    default:
+      return NO;
+    }
+}
+
+static BOOL
+string_operator_p(NSPredicateOperatorType op)
+{
+  switch (op)
+    {
+    case NSEqualToPredicateOperatorType:
+    case NSNotEqualToPredicateOperatorType:
+    case NSBeginsWithPredicateOperatorType:
+    case NSEndsWithPredicateOperatorType:
+    case NSContainsPredicateOperatorType:
+      return YES;
+    default:
+      return NO;
+    }
+}
+
+/* "ANY words BEGINSWITH[cd] 'str'" etc, answered by the libraries'
+   text indexes. Returns nil unless the index gives the same result as
+   evaluating the predicate. */
+
+static PDImagePredicateBlock
+compile_words_predicate(NSComparisonPredicate *pred)
+{
+  NSPredicateOperatorType op = pred.predicateOperatorType;
+  id value = pred.rightExpression.constantValue;
+
+  if (pred.comparisonPredicateModifier != NSAnyPredicateModifier
+      || (op != NSBeginsWithPredicateOperatorType
+	  && op != NSEqualToPredicateOperatorType)
+      || ![value isKindOfClass:[NSString class]] || [value length] == 0)
+    return nil;
+
+  /* Indexed words are folded, so the string must be too, unless the
+     comparison ignores case and diacritics. */
+
+  NSString *word = [PDTextIndex foldedString:value];
+  NSUInteger fold_opts = (NSCaseInsensitivePredicateOption
+			  | NSDiacriticInsensitivePredicateOption);
+
+  if ((pred.options & fold_opts) != fold_opts && ![word isEqual:value])
+    return nil;
+
+  BOOL prefix = op == NSBeginsWithPredicateOperatorType;
+
+  /* PDImageLibrary -> @[generation, file-ids], refreshed when the
+     library's index changes. The block may be called from several
+     threads at once, so the cached state is only accessed under
+     'lock'. */
+
+  NSMapTable *matches = [NSMapTable weakToStrongObjectsMapTable];
+  NSLock *lock = [[NSLock alloc] init];
+
+  __block PDImageLibrary *last_lib = nil;
+  __block uint64_t last_generation = 0;
+  __block NSIndexSet *last_ids = nil;
+
+  return ^BOOL (PDImage *im)
+    {
+      PDImageLibrary *lib = im.library;
+      uint64_t generation = lib.textIndexGeneration;
+
+      [lock lock];
+
+      if (lib != last_lib || generation != last_generation)
+	{
+	  NSArray *entry = [matches objectForKey:lib];
+
+	  if (entry == nil || [entry[0] unsignedLongLongValue] != generation)
+	    {
+	      entry = @[@(generation),
+			[lib fileIdsMatchingWord:word prefix:prefix]];
+	      [matches setObject:entry forKey:lib];
+	    }
+
+	  last_lib = lib;
+	  last_generation = generation;
+	  last_ids = entry[1];
+	}
+
+      NSIndexSet *ids = last_ids;
+
+      [lock unlock];
+
+      return [ids containsIndex:im.imageFileId];
+    };
+}
+
+static PDImagePredicateBlock
+compile_comparison_predicate(NSComparisonPredicate *pred)
+{
+  NSExpression *lhs = pred.leftExpression;
+  NSExpression *rhs = pred.rightExpression;
+
+  if (lhs.expressionType != NSKeyPathExpressionType
+      || rhs.expressionType != NSConstantValueExpressionType)
+    return nil;
+
+  NSString *key = lhs.keyPath;
+  id value = rhs.constantValue;
+  NSPredicateOperatorType op = pred.predicateOperatorType;
+  NSComparisonPredicateModifier modifier
+    = pred.comparisonPredicateModifier;
+
+  NSStringCompareOptions opts = 0;
+  NSUInteger pred_opts = pred.options;
+  if (pred_opts & NSCaseInsensitivePredicateOption)
+    opts |= NSCaseInsensitiveSearch;
+  if (pred_opts & NSDiacriticInsensitivePredicateOption)
+    opts |= NSDiacriticInsensitiveSearch;
+  if (pred_opts & ~(NSCaseInsensitivePredicateOption
+		    | NSDiacriticInsensitivePredicateOption))
+    return nil;
+
+  property_type type = lookup_property_type(key.UTF8String);
+
+  switch (type)
+    {
+    case type_bool:
+      if (modifier != NSDirectPredicateModifier || !numeric_operator_p(op)
+	  || ![value isKindOfClass:[NSNumber class]])
+	break;
+      {
+	double r = [value doubleValue];
+	return ^BOOL (PDImage *im)
+	  {
+	    return compare_numbers([im[key] intValue] != 0, op, r);
+	  };
+      }
+
+    case type_unix_date:
+      if (modifier != NSDirectPredicateModifier || !numeric_operator_p(op)
+	  || ![value isKindOfClass:[NSDate class]])
+	break;
+      {
+	double r = [value timeIntervalSince1970];
+	NSInteger idx = [PDPropertyCache recordIndexOfKey:key];
+	return ^BOOL (PDImage *im)
+	  {
+	    double l = [im numericImagePropertyForKey:key recordIndex:idx];
+	    return compare_numbers((unsigned long)l, op, r);
+	  };
+      }
+
+    case type_string:
+      if (modifier != NSDirectPredicateModifier || !string_operator_p(op)
+	  || ![value isKindOfClass:[NSString class]] || [value length] == 0)
+	break;
+      {
+	NSString *r = value;
+	PDImagePredicateBlock fallback = fallback_predicate(pred);
+	return ^BOOL (PDImage *im)
+	  {
+	    id l = im[key];
+	    if (l == nil)
+	      l = @"";
+	    else if (![l isKindOfClass:[NSString class]])
+	      return fallback(im);
+	    return compare_strings(l, op, r, opts);
+	  };
+      }
+
+    case type_string_array:
+    case type_string_dict:
+      if ([key isEqualToString:PDImage_Words])
+	{
+	  PDImagePredicateBlock block = compile_words_predicate(pred);
+	  if (block != nil)
+	    return block;
+	}
+      if (modifier != NSAnyPredicateModifier || !string_operator_p(op)
+	  || ![value isKindOfClass:[NSString class]] || [value length] == 0)
+	break;
+      {
+	NSString *r = value;
+	PDImagePredicateBlock fallback = fallback_predicate(pred);
+	return ^BOOL (PDImage *im)
+	  {
+	    id l = im[key];
+	    if (l == nil)
+	      return NO;
+	    if (![l isKindOfClass:[NSArray class]]
+		&& ![l isKindOfClass:[NSDictionary class]])
+	      return fallback(im);
+	    for (id str in l)
+	      {
+		if (![str isKindOfClass:[NSString class]])
+		  return fallback(im);
+		if (compare_strings(str, op, r, opts))
+		  return YES;
+	      }
+	    return NO;
+	  };
+      }
+
+    case type_contrast:
+    case type_exposure_mode:
+    case type_exposure_program:
+    case type_flash_mode:
+    case type_metering_mode:
+    case type_white_balance:
+    case type_scene_type:
+    case type_scene_capture_type:
+    case type_sensitivity_type:
+    case type_light_source:
+    case type_orientation:
+    case type_focus_mode:
+    case type_image_stabilization_mode:
+      if (modifier != NSDirectPredicateModifier
+	  || (op != NSEqualToPredicateOperatorType
+	      && op != NSNotEqualToPredicateOperatorType))
+	break;
+      if (opts != 0)
+	{
+	  /* Case or diacritic insensitive, as strings. */
+
+	  if (![value isKindOfClass:[NSString class]])
+	    break;
+
+	  NSInteger idx = [PDPropertyCache recordIndexOfKey:key];
+	  return ^BOOL (PDImage *im)
+	    {
+	      int l = (int)[im numericImagePropertyForKey:key recordIndex:idx];
+	      id str = lookup_enum_string(type, l);
+	      if (str == nil)
+		return op == NSNotEqualToPredicateOperatorType;
+	      return compare_strings(str, op, value, opts);
+	    };
+	}
+      {
+	NSInteger idx = [PDPropertyCache recordIndexOfKey:key];
+	BOOL equal = op == NSEqualToPredicateOperatorType;
+	return ^BOOL (PDImage *im)
+	  {
+	    int l = (int)[im numericImagePropertyForKey:key recordIndex:idx];
+	    id str = lookup_enum_string(type, l);
+	    return (str == value || [str isEqual:value]) == equal;
+	  };
+      }
+
+    case type_direction:
+    case type_exposure_bias:
+    case type_fstop:
+    case type_duration:
+    case type_iso_speed:
+    case type_latitude:
+    case type_longitude:
+    case type_metres:
+    case type_millimetres:
+    case type_bytes:
+    case type_flash_compensation:
+    case type_pixels:
+    case type_rating:
+    case type_saturation:
+    case type_sharpness:
+      if (modifier != NSDirectPredicateModifier || !numeric_operator_p(op)
+	  || ![value isKindOfClass:[NSNumber class]])
+	break;
+      {
+	double r = [value doubleValue];
+	NSInteger idx = [PDPropertyCache recordIndexOfKey:key];
+	return ^BOOL (PDImage *im)
+	  {
+	    double l = [im numericImagePropertyForKey:key recordIndex:idx];
+	    return compare_numbers(l, op, r);
+	  };
+      }
+
+    case type_unknown:
+      break;
+    }
+
+  return nil;
+}
+
+static PDImagePredicateBlock
+compile_predicate(NSPredicate *pred)
+{
+  PDImagePredicateBlock block = nil;
+
+  if ([pred isKindOfClass:[NSCompoundPredicate class]])
+    block = compile_compound_predicate((NSCompoundPredicate *)pred);
+  else if ([pred isKindOfClass:[NSComparisonPredicate class]])
+    block = compile_comparison_predicate((NSComparisonPredicate *)pred);
+
+  return block != nil ? block : fallback_predicate(pred);
+}
+
+PDImagePredicateBlock
+PDImageCompilePredicate(NSPredicate *pred)
+{
+  return pred != nil ? compile_predicate(pred) : nil;
+}
+
+NSPredicate *
+PDImageSearchPredicate(NSString *str)
+{
+  NSMutableArray *subs = [NSMutableArray array];
+
+  for (NSString *word in [PDTextIndex wordsOfString:str])
+    {
+      [subs addObject:[NSPredicate predicateWithFormat:
+		       @"ANY %K BEGINSWITH[cd] %@", PDImage_Words, word]];
+    }
+
+  if (subs.count == 0)
+    return nil;
+  else if (subs.count == 1)
+    return subs[0];
+  else
+    return [NSCompoundPredicate andPredicateWithSubpredicates:subs];
+}
+
+
 /* EXIF date parsing. */
 
 static time_t
@@ -1097,3 +1543,4 @@ NSString * const PDImage_FilePath = @"file_path";
 NSString * const PDImage_FileDate = @"file_date";
 NSString * const PDImage_FileSize = @"file_size";
 NSString * const PDImage_Rejected = @"rejected";
+NSString * const PDImage_Words = @"words";
@@ -0,0 +1,75 @@
+/* -*- c-style: gnu -*-
+
+   Copyright (c) 2013 John Harper <jsh@unfactored.org>
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE. */
+
+
+#import <Foundation/Foundation.h>
+#import <CoreGraphics/CoreGraphics.h>
+
+@class PDImageLibrary;
+
+/* Tiles of the full-size image at power-of-two reductions, for
+   displaying parts of large images zoomed in. Level n is the image
+   reduced by 2^n, each level is split into square tiles, row by row.
+
+   A level is built the first time one of its tiles is needed, from a
+   single decode of the image file (subsampled by the decoder for
+   levels above zero), and stored in the library's proxy cache. Tiles
+   are then decoded individually from the cached level, so showing a
+   different part of the image never decodes the file again. */
+
+@interface PDImagePyramid : NSObject
+
+- (id)initWithLibrary:(PDImageLibrary *)lib fileId:(uint32_t)file_id
+    path:(NSString *)path pixelSize:(CGSize)size;
+
+@property(nonatomic, readonly) uint32_t fileId;
+@property(nonatomic, copy, readonly) NSString *path;
+
+/* Size of the full-size image, in unoriented pixels. */
+
+@property(nonatomic, readonly) CGSize pixelSize;
+
+/* The smallest level with at least 'scale' of its pixels per pixel
+   of the full-size image. */
+
+- (NSInteger)levelForScale:(CGFloat)scale;
+
+/* Sets 'xs' and 'ys' to the columns and rows of tiles of 'level'
+   intersecting 'rect', in full-size image pixels (y down). */
+
+- (void)getTilesAtLevel:(NSInteger)level inRect:(CGRect)rect
+    columns:(NSRange *)xs rows:(NSRange *)ys;
+
+/* Returns the area covered by a tile, in full-size image pixels. */
+
+- (CGRect)rectOfTileAtLevel:(NSInteger)level x:(NSInteger)x y:(NSInteger)y;
+
+/* Calls 'handler' on the main queue with the tile's image once it's
+   been decoded, or with null if it can't be. Must be called on the
+   main thread. Recently used tiles are kept in memory. */
+
+- (void)loadTileAtLevel:(NSInteger)level x:(NSInteger)x y:(NSInteger)y
+    handler:(void (^)(CGImageRef im))handler;
+
+@end
@@ -0,0 +1,523 @@
+/* -*- c-style: gnu -*-
+
+   Copyright (c) 2013 John Harper <jsh@unfactored.org>
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE. */
+
+
+#import "PDImagePyramid.h"
+
+#import "PDImageLibrary.h"
+#import "PDImageScale.h"
+#import "PDMacros.h"
+
+#import <CoreServices/CoreServices.h>
+#import <ImageIO/ImageIO.h>
+#import <pthread.h>
+
+#define TILE_SIZE 256
+#define TILE_QUALITY .85
+
+/* Decoders subsample by at most 8, smaller levels aren't needed as the
+   proxies cover those sizes. */
+
+#define MAX_LEVEL 3
+
+/* Number of decoded tiles kept after they're last displayed. */
+
+#define TILE_CACHE_COUNT 64
+
+#define TILES_MAGIC 0x5044544cU		/* 'PDTL' */
+#define TILES_VERSION 1
+
+/* A cached level is this header, then 'count + 1' offsets from the
+   start of the data (tile i is [offset[i], offset[i+1])), then the
+   tiles as JPEG data. */
+
+struct tiles_header
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  uint32_t tile_size;
+  uint32_t count;
+};
+
+static NSString *
+tiles_base(NSInteger level)
+{
+  return [NSString stringWithFormat:@"%d.tiles", (int)level];
+}
+
+/* One full-size decode at a time, they need a lot of memory. */
+
+static dispatch_queue_t
+build_queue(void)
+{
+  static dispatch_queue_t queue;
+  static dispatch_once_t once;
+
+  dispatch_once(&once, ^{
+    queue = dispatch_queue_create("PDImagePyramid.build",
+				  DISPATCH_QUEUE_SERIAL);
+    dispatch_set_target_queue(queue, dispatch_get_global_queue
+			      (DISPATCH_QUEUE_PRIORITY_DEFAULT, 0));
+  });
+
+  return queue;
+}
+
+static dispatch_queue_t
+tile_queue(void)
+{
+  return dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0);
+}
+
+static NSData *
+copy_jpeg_data(CGImageRef im)
+{
+  NSMutableData *data = [NSMutableData data];
+
+  CGImageDestinationRef dest = CGImageDestinationCreateWithData(
+    (__bridge CFMutableDataRef)data, kUTTypeJPEG, 1, NULL);
+
+  if (dest == NULL)
+    return nil;
+
+  NSDictionary *opts = @{
+    (__bridge id)kCGImageDestinationLossyCompressionQuality: @(TILE_QUALITY)
+  };
+
+  CGImageDestinationAddImage(dest, im, (CFDictionaryRef)opts);
+  BOOL ok = CGImageDestinationFinalize(dest);
+  CFRelease(dest);
+
+  return ok ? data : nil;
+}
+
+@implementation PDImagePyramid
+{
+  PDImageLibrary *_library;
+  time_t _mtime;
+
+  pthread_mutex_t _lock;
+  NSData *_levels[MAX_LEVEL + 1];	/* mapped cache data */
+  NSMutableArray *_waiting[MAX_LEVEL + 1]; /* blocks, while building */
+  BOOL _failed[MAX_LEVEL + 1];		/* don't keep decoding */
+
+  NSCache *_tiles;			/* NSNumber -> CGImageRef */
+}
+
+@synthesize fileId = _fileId;
+@synthesize path = _path;
+@synthesize pixelSize = _pixelSize;
+
+- (id)initWithLibrary:(PDImageLibrary *)lib fileId:(uint32_t)file_id
+    path:(NSString *)path pixelSize:(CGSize)size
+{
+  self = [super init];
+  if (self == nil)
+    return nil;
+
+  _library = lib;
+  _fileId = file_id;
+  _path = [path copy];
+  _pixelSize = size;
+  _mtime = [lib mtimeOfFileAtPath:path];
+
+  pthread_mutex_init(&_lock, NULL);
+
+  _tiles = [[NSCache alloc] init];
+  _tiles.countLimit = TILE_CACHE_COUNT;
+
+  return self;
+}
+
+- (void)dealloc
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+static inline size_t
+level_width(PDImagePyramid *self, NSInteger level)
+{
+  return ((size_t)self->_pixelSize.width + (1U << level) - 1) >> level;
+}
+
+static inline size_t
+level_height(PDImagePyramid *self, NSInteger level)
+{
+  return ((size_t)self->_pixelSize.height + (1U << level) - 1) >> level;
+}
+
+- (NSInteger)levelForScale:(CGFloat)scale
+{
+  NSInteger level = 0;
+
+  while (level < MAX_LEVEL && scale * (1U << (level + 1)) <= 1)
+    level++;
+
+  return level;
+}
+
+- (void)getTilesAtLevel:(NSInteger)level inRect:(CGRect)rect
+    columns:(NSRange *)xs rows:(NSRange *)ys
+{
+  CGFloat size = TILE_SIZE << level;
+
+  NSInteger nx = (level_width(self, level) + TILE_SIZE - 1) / TILE_SIZE;
+  NSInteger ny = (level_height(self, level) + TILE_SIZE - 1) / TILE_SIZE;
+
+  rect = CGRectIntersection(rect, CGRectMake(0, 0, _pixelSize.width,
+					     _pixelSize.height));
+
+  if (CGRectIsEmpty(rect) || nx == 0 || ny == 0)
+    {
+      *xs = *ys = NSMakeRange(0, 0);
+      return;
+    }
+
+  NSInteger x0 = MAX(0, (NSInteger)floor(CGRectGetMinX(rect) / size));
+  NSInteger x1 = MIN(nx, (NSInteger)ceil(CGRectGetMaxX(rect) / size));
+  NSInteger y0 = MAX(0, (NSInteger)floor(CGRectGetMinY(rect) / size));
+  NSInteger y1 = MIN(ny, (NSInteger)ceil(CGRectGetMaxY(rect) / size));
+
+  *xs = NSMakeRange(x0, MAX(x1 - x0, 0));
+  *ys = NSMakeRange(y0, MAX(y1 - y0, 0));
+}
+
+- (CGRect)rectOfTileAtLevel:(NSInteger)level x:(NSInteger)x y:(NSInteger)y
+{
+  CGFloat size = TILE_SIZE << level;
+
+  CGFloat x0 = x * size, y0 = y * size;
+  CGFloat x1 = fmin(x0 + size, _pixelSize.width);
+  CGFloat y1 = fmin(y0 + size, _pixelSize.height);
+
+  return CGRectMake(x0, y0, x1 - x0, y1 - y0);
+}
+
+/* Returns the cached data of 'level' if it's valid, loading it if
+   necessary. Called on any thread. */
+
+- (NSData *)dataForLevel:(NSInteger)level
+{
+  pthread_mutex_lock(&_lock);
+  NSData *data = _levels[level];
+  pthread_mutex_unlock(&_lock);
+
+  if (data != nil)
+    return data;
+
+  data = [_library cachedDataForFileId:_fileId base:tiles_base(level)
+	  newerThan:_mtime];
+
+  if (data.length < sizeof(struct tiles_header))
+    return nil;
+
+  const struct tiles_header *h = data.bytes;
+
+  size_t count = ((level_width(self, level) + TILE_SIZE - 1) / TILE_SIZE
+		  * ((level_height(self, level) + TILE_SIZE - 1) / TILE_SIZE));
+
+  if (h->magic != TILES_MAGIC || h->version != TILES_VERSION
+      || h->width != level_width(self, level)
+      || h->height != level_height(self, level)
+      || h->tile_size != TILE_SIZE || h->count != count
+      || data.length < sizeof(*h) + (count + 1) * sizeof(uint32_t))
+    return nil;
+
+  const uint32_t *offsets = (const uint32_t *)(h + 1);
+
+  if (offsets[count] > data.length)
+    return nil;
+
+  pthread_mutex_lock(&_lock);
+  _levels[level] = data;
+  pthread_mutex_unlock(&_lock);
+
+  return data;
+}
+
+/* Decodes 'level' from the image file, and writes its tiles to the
+   cache. Called on the build queue. */
+
+- (NSData *)buildLevel:(NSInteger)level
+{
+  size_t width = level_width(self, level);
+  size_t height = level_height(self, level);
+
+  if (width == 0 || height == 0)
+    return nil;
+
+  CGImageSourceRef src = [_library copyImageSourceAtPath:_path];
+  if (src == NULL)
+    return nil;
+
+  NSDictionary *opts = nil;
+  if (level > 0)
+    {
+      opts = @{(__bridge id)kCGImageSourceSubsampleFactor: @(1 << level)};
+    }
+
+  CGImageRef src_im
+    = CGImageSourceCreateImageAtIndex(src, 0, (CFDictionaryRef)opts);
+
+  CFRelease(src);
+
+  if (src_im == NULL)
+    return nil;
+
+  /* Decoders that can't subsample return the full image. If it's too
+     large for the linear-light scaler, it's scaled when drawn into the
+     level's bitmap below instead. */
+
+  if (CGImageGetWidth(src_im) != width || CGImageGetHeight(src_im) != height)
+    {
+      CGImageRef im = PDImageCreateScaledImage(src_im,
+				CGSizeMake(width, height), NULL);
+      if (im != NULL)
+	{
+	  CGImageRelease(src_im);
+	  src_im = im;
+	}
+    }
+
+  /* Draw the decoded image into a bitmap once, so that cropping each
+     tile from it doesn't decode the image again. Matched to sRGB, as
+     the proxies are. */
+
+  CGColorSpaceRef srgb = CGColorSpaceCreateWithName(kCGColorSpaceSRGB);
+
+  CGContextRef ctx = CGBitmapContextCreate(NULL, width, height, 8, 0, srgb,
+		kCGBitmapByteOrder32Host | kCGImageAlphaNoneSkipFirst);
+
+  CGColorSpaceRelease(srgb);
+
+  if (ctx == NULL)
+    {
+      CGImageRelease(src_im);
+      return nil;
+    }
+
+  CGContextSetBlendMode(ctx, kCGBlendModeCopy);
+  CGContextSetInterpolationQuality(ctx, kCGInterpolationHigh);
+  CGContextDrawImage(ctx, CGRectMake(0, 0, width, height), src_im);
+  CGImageRelease(src_im);
+
+  CGImageRef level_im = CGBitmapContextCreateImage(ctx);
+  CGContextRelease(ctx);
+
+  if (level_im == NULL)
+    return nil;
+
+  size_t nx = (width + TILE_SIZE - 1) / TILE_SIZE;
+  size_t ny = (height + TILE_SIZE - 1) / TILE_SIZE;
+  size_t count = nx * ny;
+
+  size_t header_size = sizeof(struct tiles_header)
+    + (count + 1) * sizeof(uint32_t);
+
+  NSMutableData *data = [NSMutableData dataWithLength:header_size];
+  uint32_t *offsets = (uint32_t *)((struct tiles_header *)
+				   data.mutableBytes + 1);
+
+  BOOL ok = YES;
+
+  for (size_t y = 0; y < ny && ok; y++)
+    {
+      for (size_t x = 0; x < nx && ok; x++)
+	{
+	  @autoreleasepool
+	    {
+	      CGRect r = CGRectMake(x * TILE_SIZE, y * TILE_SIZE,
+				    MIN(TILE_SIZE, width - x * TILE_SIZE),
+				    MIN(TILE_SIZE, height - y * TILE_SIZE));
+
+	      CGImageRef tile_im = CGImageCreateWithImageInRect(level_im, r);
+	      NSData *tile_data = tile_im != NULL ? copy_jpeg_data(tile_im) : nil;
+	      CGImageRelease(tile_im);
+
+	      if (tile_data != nil)
+		{
+		  /* mutableBytes may move as the data grows. */
+
+		  offsets = (uint32_t *)((struct tiles_header *)
+					 data.mutableBytes + 1);
+		  offsets[y * nx + x] = (uint32_t)data.length;
+		  [data appendData:tile_data];
+		}
+	      else
+		ok = NO;
+	    }
+	}
+    }
+
+  CGImageRelease(level_im);
+
+  if (!ok || data.length > UINT32_MAX)
+    return nil;
+
+  struct tiles_header *h = data.mutableBytes;
+  h->magic = TILES_MAGIC;
+  h->version = TILES_VERSION;
+  h->width = (uint32_t)width;
+  h->height = (uint32_t)height;
+  h->tile_size = TILE_SIZE;
+  h->count = (uint32_t)count;
+
+  offsets = (uint32_t *)(h + 1);
+  offsets[count] = (uint32_t)data.length;
+
+  [_library setCachedData:data forFileId:_fileId base:tiles_base(level)];
+
+  /* Use the mapped cache file rather than keeping the whole level in
+     memory, unless it couldn't be written. */
+
+  NSData *mapped = [self dataForLevel:level];
+
+  if (mapped == nil)
+    {
+      mapped = data;
+      pthread_mutex_lock(&_lock);
+      _levels[level] = data;
+      pthread_mutex_unlock(&_lock);
+    }
+
+  return mapped;
+}
+
+/* Calls 'thunk' on a tile queue once 'level' is in the cache, building
+   it if necessary. Requests for a level that's being built wait for
+   that build, rather than starting another. */
+
+- (void)whenLevelIsReady:(NSInteger)level do:(dispatch_block_t)thunk
+{
+  pthread_mutex_lock(&_lock);
+
+  BOOL building = _waiting[level] != nil;
+
+  if (!building)
+    _waiting[level] = [NSMutableArray array];
+
+  [_waiting[level] addObject:[thunk copy]];
+
+  pthread_mutex_unlock(&_lock);
+
+  if (building)
+    return;
+
+  dispatch_async(build_queue(), ^
+    {
+      BOOL failed = NO;
+      if ([self dataForLevel:level] == nil)
+	failed = [self buildLevel:level] == nil;
+
+      pthread_mutex_lock(&_lock);
+      if (failed)
+	_failed[level] = YES;
+      NSArray *blocks = _waiting[level];
+      _waiting[level] = nil;
+      pthread_mutex_unlock(&_lock);
+
+      for (dispatch_block_t block in blocks)
+	dispatch_async(tile_queue(), block);
+    });
+}
+
+static CGImageRef
+create_tile_image(NSData *data, size_t idx)
+{
+  const struct tiles_header *h = data.bytes;
+  const uint32_t *offsets = (const uint32_t *)(h + 1);
+
+  if (idx >= h->count || offsets[idx] >= offsets[idx + 1]
+      || offsets[idx + 1] > data.length)
+    return NULL;
+
+  NSData *tile_data = [data subdataWithRange:
+		       NSMakeRange(offsets[idx], offsets[idx + 1]
+				   - offsets[idx])];
+
+  CGImageSourceRef src
+    = CGImageSourceCreateWithData((__bridge CFDataRef)tile_data, NULL);
+  if (src == NULL)
+    return NULL;
+
+  /* Decode now, not when the layer is first drawn. */
+
+  NSDictionary *opts = @{
+    (__bridge id)kCGImageSourceShouldCacheImmediately: @YES
+  };
+
+  CGImageRef im = CGImageSourceCreateImageAtIndex(src, 0,
+						 (CFDictionaryRef)opts);
+  CFRelease(src);
+
+  return im;
+}
+
+- (void)loadTileAtLevel:(NSInteger)level x:(NSInteger)x y:(NSInteger)y
+    handler:(void (^)(CGImageRef im))handler
+{
+  level = MAX(0, MIN(level, MAX_LEVEL));
+
+  NSNumber *key = @(((uint64_t)level << 48) | ((uint64_t)y << 24) | x);
+
+  id tile = [_tiles objectForKey:key];
+  if (tile != nil)
+    {
+      handler((__bridge CGImageRef)tile);
+      return;
+    }
+
+  size_t nx = (level_width(self, level) + TILE_SIZE - 1) / TILE_SIZE;
+  size_t idx = y * nx + x;
+
+  dispatch_block_t load = ^
+    {
+      NSData *data = [self dataForLevel:level];
+      CGImageRef im = data != nil ? create_tile_image(data, idx) : NULL;
+
+      dispatch_async(dispatch_get_main_queue(), ^
+	{
+	  if (im != NULL)
+	    [_tiles setObject:(__bridge id)im forKey:key];
+	  handler(im);
+	  CGImageRelease(im);
+	});
+    };
+
+  dispatch_async(tile_queue(), ^
+    {
+      pthread_mutex_lock(&_lock);
+      BOOL failed = _failed[level];
+      pthread_mutex_unlock(&_lock);
+
+      if (failed || [self dataForLevel:level] != nil)
+	load();
+      else
+	[self whenLevelIsReady:level do:load];
+    });
+}
+
+@end
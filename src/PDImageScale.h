@@ -0,0 +1,39 @@
+/* -*- c-style: gnu -*-
+
+   Copyright (c) 2013 John Harper <jsh@unfactored.org>
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE. */
+
+
+#import <CoreGraphics/CoreGraphics.h>
+
+/* Returns a copy of 'im' resampled to 'size' pixels (rounded up) and
+   converted to 'space', or sRGB if 'space' is null. The image is
+   resampled with a Lanczos filter on linear 16-bit values, instead of
+   on the gamma-encoded 8-bit values CGContextDrawImage() uses, so that
+   downsampling doesn't shift the colors of fine detail. Large
+   reductions are first box filtered, also in linear light, so memory
+   use is about one 8-bit copy of the source. Returns null if the
+   image couldn't be converted or is too large, the caller should fall
+   back to drawing it. */
+
+extern CGImageRef PDImageCreateScaledImage(CGImageRef im, CGSize size,
+    CGColorSpaceRef space);
@@ -0,0 +1,207 @@
+/* -*- c-style: gnu -*-
+
+   Copyright (c) 2013 John Harper <jsh@unfactored.org>
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE. */
+
+
+#import "PDImageScale.h"
+
+#import <Accelerate/Accelerate.h>
+#import <dispatch/dispatch.h>
+#import <math.h>
+#import <stdlib.h>
+#import <string.h>
+
+/* Larger sources are left to the caller to draw, as they'd need a
+   full-size 8-bit copy of the image to convert. */
+
+#define MAX_SOURCE_PIXELS (32 * 1024 * 1024)
+
+/* Every RGB space we display in or cache to has a transfer curve close
+   to sRGB's, so that's used to linearize pixels in any of them. */
+
+static uint16_t to_linear[256];
+static uint8_t from_linear[65536];
+
+static void
+init_tables(void)
+{
+  static dispatch_once_t once;
+
+  dispatch_once(&once, ^
+    {
+      for (int i = 0; i < 256; i++)
+	{
+	  double x = i / 255.;
+	  double y = (x <= .04045 ? x / 12.92 : pow((x + .055) / 1.055, 2.4));
+	  to_linear[i] = (uint16_t)lrint(y * 65535);
+	}
+
+      for (int i = 0; i < 65536; i++)
+	{
+	  double x = i / 65535.;
+	  double y = (x <= .0031308 ? x * 12.92
+		      : 1.055 * pow(x, 1 / 2.4) - .055);
+	  from_linear[i] = (uint8_t)lrint(y * 255);
+	}
+    });
+}
+
+CGImageRef
+PDImageCreateScaledImage(CGImageRef im, CGSize size, CGColorSpaceRef space)
+{
+  if (im == NULL)
+    return NULL;
+
+  size_t dw = ceil(size.width);
+  size_t dh = ceil(size.height);
+
+  if (dw == 0 || dh == 0)
+    return NULL;
+
+  size_t sw = CGImageGetWidth(im);
+  size_t sh = CGImageGetHeight(im);
+
+  if (sw == 0 || sh == 0 || sw * sh > MAX_SOURCE_PIXELS)
+    return NULL;
+
+  init_tables();
+
+  CGColorSpaceRef srgb = NULL;
+
+  if (space == NULL)
+    {
+      srgb = CGColorSpaceCreateWithName(kCGColorSpaceSRGB);
+      space = srgb;
+    }
+
+  vImage_CGImageFormat format = {
+    .bitsPerComponent = 8,
+    .bitsPerPixel = 32,
+    .colorSpace = space,
+    .bitmapInfo = kCGBitmapByteOrder32Host | kCGImageAlphaNoneSkipFirst,
+    .renderingIntent = kCGRenderingIntentDefault,
+  };
+
+  CGImageRef ret = NULL;
+
+  vImage_Buffer src8 = {0}, src16 = {0}, dst16 = {0}, dst8 = {0};
+
+  /* Converts to the destination space at the source size. */
+
+  if (vImageBuffer_InitWithCGImage(&src8, &format, NULL, im,
+				   kvImageNoFlags) != kvImageNoError)
+    goto out;
+
+  /* When reducing a lot, first average blocks of k*k pixels while
+     linearizing, keeping at least twice the destination size for the
+     Lanczos pass. The linear copy is then only 1/k^2 of the source. */
+
+  sw = src8.width;
+  sh = src8.height;
+
+  /* Limited so the 32-bit sums of 16-bit values can't overflow. */
+
+  size_t k = MIN(MIN(sw / (dw * 2), sh / (dh * 2)), 256);
+  if (k < 1)
+    k = 1;
+
+  size_t iw = (sw + k - 1) / k;
+  size_t ih = (sh + k - 1) / k;
+
+  uint32_t *sums = NULL;
+
+  if (vImageBuffer_Init(&src16, ih, iw, 64,
+			kvImageNoFlags) != kvImageNoError
+      || vImageBuffer_Init(&dst16, dh, dw, 64,
+			   kvImageNoFlags) != kvImageNoError
+      || vImageBuffer_Init(&dst8, dh, dw, 32,
+			   kvImageNoFlags) != kvImageNoError
+      || (sums = malloc(iw * 4 * sizeof(*sums))) == NULL)
+    goto out;
+
+  /* All four channels go through the tables, the unused one too. Edge
+     blocks may be partial, so each is divided by its own area. */
+
+  for (size_t iy = 0; iy < ih; iy++)
+    {
+      size_t y0 = iy * k, y1 = MIN(y0 + k, sh);
+
+      memset(sums, 0, iw * 4 * sizeof(*sums));
+
+      for (size_t y = y0; y < y1; y++)
+	{
+	  const uint8_t *s = (const uint8_t *)src8.data + y * src8.rowBytes;
+
+	  for (size_t x = 0; x < sw; x++)
+	    {
+	      uint32_t *sum = sums + (x / k) * 4;
+	      sum[0] += to_linear[s[x*4+0]];
+	      sum[1] += to_linear[s[x*4+1]];
+	      sum[2] += to_linear[s[x*4+2]];
+	      sum[3] += to_linear[s[x*4+3]];
+	    }
+	}
+
+      uint16_t *d = (uint16_t *)((uint8_t *)src16.data + iy * src16.rowBytes);
+
+      for (size_t ix = 0; ix < iw; ix++)
+	{
+	  size_t x0 = ix * k, x1 = MIN(x0 + k, sw);
+	  uint32_t area = (uint32_t)((x1 - x0) * (y1 - y0));
+
+	  for (size_t c = 0; c < 4; c++)
+	    d[ix*4+c] = (uint16_t)((sums[ix*4+c] + area / 2) / area);
+	}
+    }
+
+  free(sums);
+  free(src8.data);
+  src8.data = NULL;
+
+  if (vImageScale_ARGB16U(&src16, &dst16, NULL,
+			  kvImageHighQualityResampling) != kvImageNoError)
+    goto out;
+
+  for (size_t y = 0; y < dh; y++)
+    {
+      const uint16_t *s
+        = (const uint16_t *)((const uint8_t *)dst16.data + y * dst16.rowBytes);
+      uint8_t *d = (uint8_t *)dst8.data + y * dst8.rowBytes;
+
+      for (size_t x = 0; x < dw * 4; x++)
+	d[x] = from_linear[s[x]];
+    }
+
+  ret = vImageCreateCGImageFromBuffer(&dst8, &format, NULL, NULL,
+				      kvImageNoFlags, NULL);
+
+out:
+  free(src8.data);
+  free(src16.data);
+  free(dst16.data);
+  free(dst8.data);
+
+  CGColorSpaceRelease(srgb);
+
+  return ret;
+}
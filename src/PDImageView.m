@@ -258,6 +258,8 @@
 		   -_imageOrigin.y + scaledSize.height * (CGFloat).5);
       _imageLayer.colorSpace = self.window.colorSpace.CGColorSpace;
       _imageLayer.contentsScale = self.window.backingScaleFactor;
+      _imageLayer.exposedRect
+        = [_imageLayer convertRect:_clipLayer.bounds fromLayer:_clipLayer];
 
       _imageLayer.image = _image;
       _clipLayer.hidden = NO;
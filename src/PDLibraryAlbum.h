@@ -31,4 +31,8 @@
 - (void)addImageWithUUID:(NSUUID *)uuid;
 - (void)removeImageWithUUID:(NSUUID *)uuid;
 
+/* UUIDs in the album that don't refer to any image in the library. */
+
+@property(nonatomic, readonly) NSArray *danglingImageUUIDs;
+
 @end
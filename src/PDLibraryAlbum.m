@@ -27,6 +27,7 @@
 #import "PDAppDelegate.h"
 #import "PDAppKitExtensions.h"
 #import "PDImage.h"
+#import "PDImageIndex.h"
 #import "PDWindowController.h"
 
 #import "PDMacros.h"
@@ -81,23 +82,48 @@
   [_imageUUIDs removeObject:uuid];
 }
 
-- (BOOL)foreachSubimage:(void (^)(PDImage *im, BOOL *stop))thunk
+static PDImageIndex *
+image_index(void)
 {
   PDWindowController *controller
     = ((PDAppDelegate *)[NSApp delegate]).windowController;
 
-  BOOL saw_all = [controller foreachImage:^(PDImage *im, BOOL *stop) {
-    NSUUID *uuid = [im UUIDIfDefined];
-    if (uuid != nil && [_allUUIDs containsObject:uuid])
-      thunk(im, stop);
-  }];
+  return controller.imageIndex;
+}
 
-  if (!saw_all)
-    return NO;
+- (BOOL)foreachSubimage:(void (^)(PDImage *im, BOOL *stop))thunk
+{
+  PDImageIndex *index = image_index();
+
+  for (NSUUID *uuid in _imageUUIDs)
+    {
+      PDImage *im = [index imageWithUUID:uuid];
+      if (im == nil)
+	continue;
+
+      BOOL stop = NO;
+      thunk(im, &stop);
+      if (stop)
+	return NO;
+    }
 
   return [super foreachSubimage:thunk];
 }
 
+- (NSArray *)danglingImageUUIDs
+{
+  PDImageIndex *index = image_index();
+  NSMutableArray *array = [NSMutableArray array];
+
+  for (NSUUID *uuid in _imageUUIDs)
+    {
+      if ([index imageWithUUID:uuid] == nil)
+	[array addObject:uuid];
+    }
+
+  return array;
+}
+
 - (BOOL)hasTitleImage
 {
   return YES;
@@ -116,7 +142,16 @@
 
 - (NSInteger)badgeValue
 {
-  return _imageUUIDs.count;
+  PDImageIndex *index = image_index();
+  NSInteger count = 0;
+
+  for (NSUUID *uuid in _imageUUIDs)
+    {
+      if ([index imageWithUUID:uuid] != nil)
+	count++;
+    }
+
+  return count;
 }
 
 @end
@@ -36,6 +36,7 @@
 @implementation PDLibraryDirectory
 {
   NSMutableArray *_subimages;
+  NSDictionary *_snapshot;
   BOOL _subitemsNeedUpdate;
   BOOL _subimagesNeedUpdate;
 }
@@ -78,6 +79,7 @@
   if (![_libraryDirectory isEqualToString:dir])
     {
       _libraryDirectory = [dir copy];
+      _snapshot = nil;
       [self setNeedsUpdate];
     }
 }
@@ -121,14 +123,19 @@
 
   NSMutableArray *new_subimages = [NSMutableArray array];
 
+  /* Rescans only recreate the images of files that have changed since
+     the last scan completed. */
+
+  NSDictionary *snapshot = _snapshot;
+
   [queue addOperation:[NSBlockOperation blockOperationWithBlock:^
     {
       NSMutableArray *local_subimages = [[NSMutableArray alloc] init];
       __block CFTimeInterval last_t = CACurrentMediaTime();
 
-      void (^add_image)(PDImage *image) = ^(PDImage *image)
+      void (^add_images)(NSArray *images) = ^(NSArray *images)
         {
-	  [local_subimages addObject:image];
+	  [local_subimages addObjectsFromArray:images];
 
 	  if (update_immediately && CACurrentMediaTime() - last_t > .5)
 	    {
@@ -145,8 +152,10 @@
 	    }
 	};
 
-      [_library loadImagesInSubdirectory:_libraryDirectory
-       recursively:[[self class] flattensSubdirectories] handler:add_image];
+      NSDictionary *new_snapshot = [_library
+       loadImagesInSubdirectory:_libraryDirectory
+       recursively:[[self class] flattensSubdirectories]
+       snapshot:snapshot batchHandler:add_images];
 
       if (update_immediately && local_subimages.count != 0)
 	{
@@ -154,6 +163,7 @@
 
 	  dispatch_async(dispatch_get_main_queue(), ^
 	    {
+	      _snapshot = new_snapshot;
 	      [new_subimages addObjectsFromArray:local_subimages];
 	      [local_subimages removeAllObjects];
 	      [[NSNotificationCenter defaultCenter] postNotificationName:
@@ -167,6 +177,7 @@
 	  dispatch_async(dispatch_get_main_queue(), ^
 	    {
 	      _subimages = local_subimages;
+	      _snapshot = new_snapshot;
 	      [[NSNotificationCenter defaultCenter] postNotificationName:
 	       PDLibraryItemSubimagesDidChange object:self];
 	    });
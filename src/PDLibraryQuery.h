@@ -30,4 +30,8 @@
 @property(nonatomic, assign, getter=isTrashcan) BOOL trashcan;
 @property(nonatomic, assign) BOOL nilPredicateIncludesRejected;
 
+/* The predicate the query's own images are found with. */
+
+@property(nonatomic, readonly) NSPredicate *indexPredicate;
+
 @end
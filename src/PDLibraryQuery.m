@@ -27,6 +27,7 @@
 #import "PDAppDelegate.h"
 #import "PDAppKitExtensions.h"
 #import "PDImage.h"
+#import "PDImageIndex.h"
 #import "PDWindowController.h"
 
 @implementation PDLibraryQuery
@@ -35,19 +36,25 @@
 @synthesize trashcan = _trashcan;
 @synthesize nilPredicateIncludesRejected = _nilPredicateIncludesRejected;
 
+- (NSPredicate *)indexPredicate
+{
+  /* Only deleted images are shown in the trash, so let the index find
+     them instead of visiting every image. */
+
+  NSPredicate *pred = _predicate;
+  if (pred == nil && _trashcan)
+    pred = [NSPredicate predicateWithFormat:@"%K == YES", PDImage_Deleted];
+
+  return pred;
+}
+
 - (BOOL)foreachSubimage:(void (^)(PDImage *im, BOOL *stop))thunk
 {
   PDWindowController *controller
     = [(PDAppDelegate *)[NSApp delegate] windowController];
 
-  BOOL saw_all = [controller foreachImage:^(PDImage *im, BOOL *stop)
-    {
-      if (_predicate == nil
-	  || [_predicate evaluateWithObject:im.expressionValues])
-	{
-	  thunk(im, stop);
-	}
-    }];
+  BOOL saw_all = [controller.imageIndex foreachImageMatchingCachedPredicate:
+		  self.indexPredicate usingBlock:thunk];
 
   if (!saw_all)
     return NO;
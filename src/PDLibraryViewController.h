@@ -30,11 +30,17 @@
 /* posted to window controller. */
 extern NSString *const PDLibrarySelectionDidChange;
 
-@class PDLibraryGroup, PDImage, PDImageLibrary, PDImageTextCell, PDLibraryItem;
+@class PDLibraryGroup, PDImage, PDImageIndex, PDImageLibrary, PDImageTextCell;
+@class PDLibraryItem;
 
 @interface PDLibraryViewController : PDViewController
     <PXSourceListDataSource, PXSourceListDelegate>
 
+/* Index of every image in the library and device items, rebuilt
+   lazily when their contents change. */
+
+@property(nonatomic, readonly) PDImageIndex *imageIndex;
+
 - (BOOL)foreachImage:(void (^)(PDImage *im, BOOL *stop))thunk;
 
 - (void)selectLibrary:(PDImageLibrary *)lib directory:(NSString *)dir;
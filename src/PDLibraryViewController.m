@@ -27,6 +27,7 @@
 #import "PDAppKitExtensions.h"
 #import "PDFoundationExtensions.h"
 #import "PDImage.h"
+#import "PDImageIndex.h"
 #import "PDImageLibrary.h"
 #import "PDImageTextCell.h"
 #import "PDImageUUID.h"
@@ -78,6 +79,15 @@ NSString *const PDLibraryItemType = @"org.unfactored.PDLibraryItem";
   int _ignoreNotifications;
 
   NSArray *_selectedItems;
+
+  NSMutableSet *_changedImages;		/* pending -updateChangedImages */
+  BOOL _changedImagesNeedFullUpdate;
+
+  PDImageIndex *_imageIndex;		/* nil until needed */
+  PDImageIndex *_previousImageIndex;	/* cached queries for next index */
+  NSArray *_imageIndexItems;
+  NSMapTable *_imageIndexRanges;	/* PDLibraryItem -> NSValue<NSRange> */
+  NSHashTable *_staleImageIndexItems;	/* top-level items not in index */
 }
 
 @synthesize outlineView = _outlineView;
@@ -340,15 +350,105 @@ invalidate_library(PDImageLibrary *lib)
   _importButton.enabled = _devicesGroup.subitems.count != 0;
 }
 
-- (BOOL)foreachImage:(void (^)(PDImage *im, BOOL *stop))thunk
+/* The top-level items whose images are in the image index. */
+
+- (NSArray *)imageIndexItems
 {
-  if (![_foldersGroup foreachSubimage:thunk])
-    return NO;
+  NSMutableArray *items = [NSMutableArray array];
 
-  if (![_devicesGroup foreachSubimage:thunk])
-    return NO;
+  for (PDLibraryGroup *group in @[_foldersGroup, _devicesGroup])
+    {
+      for (PDLibraryItem *item in group.subitems)
+	{
+	  if (!item.hidden)
+	    [items addObject:item];
+	}
+    }
 
-  return YES;
+  return items;
+}
+
+- (PDImageIndex *)imageIndex
+{
+  NSArray *items = [self imageIndexItems];
+
+  if (_staleImageIndexItems.count != 0)
+    [self invalidateImageIndex];
+
+  if (_imageIndex == nil || ![_imageIndexItems isEqualToArray:items])
+    {
+      NSMutableArray *images = [NSMutableArray array];
+      NSMapTable *ranges = [NSMapTable strongToStrongObjectsMapTable];
+
+      for (PDLibraryItem *item in items)
+	{
+	  NSInteger start = images.count;
+
+	  [item foreachSubimage:^(PDImage *im, BOOL *stop)
+	    {
+	      [images addObject:im];
+	    }];
+
+	  [ranges setObject:[NSValue valueWithRange:
+			     NSMakeRange(start, images.count - start)]
+	   forKey:item];
+	}
+
+      PDImageIndex *old = (_imageIndex != nil
+			   ? _imageIndex : _previousImageIndex);
+
+      _imageIndex = [[PDImageIndex alloc] initWithImages:images
+		     previousIndex:old];
+      _previousImageIndex = nil;
+      _imageIndexItems = items;
+      _imageIndexRanges = ranges;
+    }
+
+  return _imageIndex;
+}
+
+- (void)invalidateImageIndex
+{
+  if (_imageIndex != nil)
+    _previousImageIndex = _imageIndex;
+
+  _imageIndex = nil;
+  _imageIndexItems = nil;
+  _imageIndexRanges = nil;
+  [_staleImageIndexItems removeAllObjects];
+}
+
+/* Called when the images of 'item' have changed. Rather than
+   rebuilding the whole index for every change while a directory is
+   being scanned, only marks the top-level item containing 'item' as
+   stale: its badge is counted directly until something else needs the
+   index, which is then rebuilt once. */
+
+- (void)invalidateImageIndexOfItem:(PDLibraryItem *)item
+{
+  if (_imageIndex == nil)
+    return;
+
+  PDLibraryItem *top = item;
+  while (top.parent != nil && top.parent != _foldersGroup
+	 && top.parent != _devicesGroup)
+    top = top.parent;
+
+  if ([_imageIndexRanges objectForKey:top] == nil)
+    {
+      [self invalidateImageIndex];
+      return;
+    }
+
+  if (_staleImageIndexItems == nil)
+    _staleImageIndexItems = [NSHashTable weakObjectsHashTable];
+
+  [_staleImageIndexItems addObject:top];
+}
+
+- (BOOL)foreachImage:(void (^)(PDImage *im, BOOL *stop))thunk
+{
+  return [self.imageIndex foreachImageMatchingPredicate:nil usingBlock:thunk];
 }
 
 - (void)updateSelectedItems
@@ -464,6 +564,31 @@ invalidate_library(PDImageLibrary *lib)
   BOOL showsHidden = _controller.showsHiddenImages;
   BOOL trash_item = item.trashcan;
 
+  if (item.parent == _foldersGroup || item.parent == _devicesGroup)
+    {
+      /* Top-level items' images are a range of the index, unless
+	 they've changed since it was built. */
+
+      if (![_staleImageIndexItems containsObject:item])
+	{
+	  PDImageIndex *index = self.imageIndex;
+	  NSValue *range = [_imageIndexRanges objectForKey:item];
+
+	  if (range != nil)
+	    {
+	      return [index countOfImagesInRange:range.rangeValue
+		      deleted:trash_item includingHidden:showsHidden];
+	    }
+	}
+    }
+  else if ([item isKindOfClass:[PDLibraryQuery class]]
+	   && ((PDLibraryQuery *)item).subitems.count == 0)
+    {
+      return [self.imageIndex countOfImagesMatchingCachedPredicate:
+	      ((PDLibraryQuery *)item).indexPredicate deleted:trash_item
+	      includingHidden:showsHidden];
+    }
+
   __block NSInteger count = 0;
 
   [item foreachSubimage:^(PDImage *im, BOOL *stop)
@@ -480,6 +605,8 @@ invalidate_library(PDImageLibrary *lib)
   PDLibraryItem *item = note.object;
   BOOL need_update = NO;
 
+  [self invalidateImageIndexOfItem:item];
+
   while (item != nil)
     {
       [_outlineView reloadItem:item];
@@ -1009,6 +1136,8 @@ reload_item(PDLibraryItem *item)
 {
   NSArray *images = note.userInfo[@"imagesRemoved"];
 
+  [self invalidateImageIndex];
+
   NSMutableSet *items = [NSMutableSet set];
 
   for (PDImage *image in images)
@@ -1221,6 +1350,8 @@ expand_item_recursively(NSOutlineView *view, PDLibraryItem *item)
   NSDictionary *info = note.userInfo;
   NSString *lib_dir = info[@"libraryDirectory"];
 
+  [self invalidateImageIndex];
+
   for (PDLibraryFolder *item in _foldersGroup.subitems)
     {
       if (item.library == lib)
@@ -1250,9 +1381,83 @@ expand_item_recursively(NSOutlineView *view, PDLibraryItem *item)
 	      PDImage_Deleted, PDImage_Hidden, PDImage_Rating, nil];
     });
 
-  if ([keys containsObject:note.userInfo[@"key"]])
+  NSString *key = note.userInfo[@"key"];
+
+  if ([keys containsObject:key])
+    {
+      /* Changes come in batches, e.g. when rating the selection, so
+	 coalesce them into a single update. */
+
+      if (_changedImages == nil)
+	{
+	  _changedImages = [NSMutableSet set];
+
+	  dispatch_async(dispatch_get_main_queue(), ^
+	    {
+	      [self updateChangedImages];
+	    });
+	}
+
+      [_changedImages addObject:note.object];
+
+      /* Deleting or hiding images changes the unfiltered list. */
+
+      if (![key isEqualToString:PDImage_Rating])
+	_changedImagesNeedFullUpdate = YES;
+    }
+}
+
+/* Returns true if the images under 'item' depend on their properties,
+   i.e. it contains a query with a predicate. */
+
+static BOOL
+item_filters_images(PDLibraryItem *item)
+{
+  if ([item isKindOfClass:[PDLibraryQuery class]]
+      && ((PDLibraryQuery *)item).predicate != nil)
+    return YES;
+
+  /* Queries are only found in groups (including albums and other
+     queries), and listing a directory's subitems would scan it. */
+
+  if (![item isKindOfClass:[PDLibraryGroup class]])
+    return NO;
+
+  for (PDLibraryItem *subitem in item.subitems)
+    {
+      if (item_filters_images(subitem))
+	return YES;
+    }
+
+  return NO;
+}
+
+- (void)updateChangedImages
+{
+  NSSet *images = _changedImages;
+  BOOL full_update = _changedImagesNeedFullUpdate;
+
+  _changedImages = nil;
+  _changedImagesNeedFullUpdate = NO;
+
+  if (!full_update)
+    {
+      for (PDLibraryItem *item in _selectedItems)
+	{
+	  if (item_filters_images(item))
+	    {
+	      full_update = YES;
+	      break;
+	    }
+	}
+    }
+
+  if (full_update)
+    [self updateImageList:PDWindowController_PreserveSelectedImages];
+  else
     {
-      [self updateImageList:PDWindowController_PreserveSelectedImages];
+      [_controller rebuildImageListForImages:images
+       flags:PDWindowController_PreserveSelectedImages];
     }
 }
 
@@ -25,15 +25,25 @@
 #import "PDLocalFileManager.h"
 
 #import <AppKit/AppKit.h>
+#import <CoreServices/CoreServices.h>
 
+#import <dirent.h>
+#import <fcntl.h>
 #import <sys/stat.h>
+#import <unistd.h>
 
 #define ERROR_DOMAIN @"org.unfactored.PDFileManager"
 
+/* Seconds FSEvents waits for related events before delivering them. */
+
+#define WATCH_LATENCY 1.0
+
 @implementation PDLocalFileManager
 {
   NSString *_path;
   NSFileManager *_manager;
+  FSEventStreamRef _stream;
+  NSString *_streamPath;
 }
 
 @synthesize delegate = _delegate;
@@ -83,6 +93,7 @@
 
 - (void)invalidate
 {
+  [self stopWatchingForChanges];
 }
 
 - (void)dealloc
@@ -118,6 +129,235 @@ absolute_path(PDLocalFileManager *self, NSString *path)
   return [self->_path stringByAppendingPathComponent:path];
 }
 
+/* Maps an absolute path reported by FSEvents to one relative to our
+   root, or nil if it's outside the root. */
+
+static NSString *
+stream_relative_path(PDLocalFileManager *self, NSString *path)
+{
+  NSString *root = self->_streamPath;
+  NSUInteger len = root.length;
+
+  if ([path hasSuffix:@"/"])
+    path = [path substringToIndex:path.length - 1];
+
+  if ([path isEqualToString:root])
+    return @"";
+  else if (path.length > len + 1 && [path hasPrefix:root]
+	   && [path characterAtIndex:len] == '/')
+    return [path substringFromIndex:len + 1];
+  else
+    return nil;
+}
+
+static BOOL
+is_hidden_path(NSString *path)
+{
+  return ([path hasPrefix:@"."]
+	  || [path rangeOfString:@"/."].location != NSNotFound);
+}
+
+static BOOL
+path_exists(NSString *path)
+{
+  struct stat st;
+  return lstat([path fileSystemRepresentation], &st) == 0;
+}
+
+/* Turns one batch of FSEvents into delegate messages. Renames arrive
+   as two consecutive events, the first for the old name, the second
+   for the new name. Since FSEvents merges the flags of repeated events
+   on the same path, whether the item still exists decides what really
+   happened to it. */
+
+static void
+handle_events(PDLocalFileManager *self, NSArray *paths,
+	      const FSEventStreamEventFlags *flags,
+	      const FSEventStreamEventId *ids, size_t count)
+{
+  id<PDFileManagerDelegate> delegate = self.delegate;
+  if (delegate == nil)
+    return;
+
+  NSMutableArray *renames = [NSMutableArray array];
+  NSMutableDictionary *created = [NSMutableDictionary dictionary];
+  NSMutableDictionary *removed = [NSMutableDictionary dictionary];
+  NSMutableOrderedSet *rescans = [NSMutableOrderedSet orderedSet];
+
+  void (^add_created)(NSString *, BOOL) = ^(NSString *path, BOOL is_dir)
+    {
+      if (path != nil && !is_hidden_path(path))
+	{
+	  [removed removeObjectForKey:path];
+	  created[path] = @(is_dir);
+	}
+    };
+
+  void (^add_removed)(NSString *, BOOL) = ^(NSString *path, BOOL is_dir)
+    {
+      if (path != nil && !is_hidden_path(path))
+	{
+	  /* Created and removed in the same batch: nothing to say. */
+
+	  if (created[path] != nil)
+	    [created removeObjectForKey:path];
+	  else
+	    {
+	      removed[path] = @(is_dir);
+
+	      /* Nothing is reported for the contents of a directory
+		 moved out of the tree, only for the directory. */
+
+	      if (is_dir)
+		[rescans addObject:path];
+	    }
+	}
+    };
+
+  for (size_t i = 0; i < count; i++)
+    {
+      NSString *abs_path = paths[i];
+      NSString *path = stream_relative_path(self, abs_path);
+      FSEventStreamEventFlags f = flags[i];
+      BOOL is_dir = (f & kFSEventStreamEventFlagItemIsDir) != 0;
+
+      if (f & (kFSEventStreamEventFlagMustScanSubDirs
+	       | kFSEventStreamEventFlagRootChanged))
+	{
+	  if (path != nil)
+	    [rescans addObject:path];
+	  continue;
+	}
+
+      if (path == nil || path.length == 0)
+	continue;
+
+      BOOL exists = path_exists(abs_path);
+
+      if (f & kFSEventStreamEventFlagItemRenamed)
+	{
+	  if (!exists && i + 1 < count
+	      && (flags[i+1] & kFSEventStreamEventFlagItemRenamed)
+	      && ids[i+1] == ids[i] + 1 && path_exists(paths[i+1]))
+	    {
+	      NSString *new_path = stream_relative_path(self, paths[++i]);
+
+	      /* Moves into or out of the visible tree are creations or
+		 removals as far as the delegate is concerned. */
+
+	      if (new_path == nil || new_path.length == 0
+		  || is_hidden_path(new_path))
+		add_removed(path, is_dir);
+	      else if (is_hidden_path(path))
+		add_created(new_path, is_dir);
+	      else
+		[renames addObject:@[path, new_path, @(is_dir)]];
+	    }
+	  else if (exists)
+	    add_created(path, is_dir);
+	  else
+	    add_removed(path, is_dir);
+	}
+      else if ((f & kFSEventStreamEventFlagItemRemoved) && !exists)
+	add_removed(path, is_dir);
+      else if ((f & kFSEventStreamEventFlagItemCreated) && exists)
+	add_created(path, is_dir);
+    }
+
+  if ([delegate respondsToSelector:
+       @selector(fileManager:didRenameItemAtPath:toPath:isDirectory:)])
+    {
+      for (NSArray *rename in renames)
+	{
+	  [delegate fileManager:self didRenameItemAtPath:rename[0]
+	   toPath:rename[1] isDirectory:[rename[2] boolValue]];
+	}
+    }
+
+  if ([delegate respondsToSelector:
+       @selector(fileManager:didRemoveItemAtPath:isDirectory:)])
+    {
+      for (NSString *path in removed)
+	{
+	  [delegate fileManager:self didRemoveItemAtPath:path
+	   isDirectory:[removed[path] boolValue]];
+	}
+    }
+
+  if ([delegate respondsToSelector:
+       @selector(fileManager:didCreateItemAtPath:isDirectory:)])
+    {
+      for (NSString *path in created)
+	{
+	  [delegate fileManager:self didCreateItemAtPath:path
+	   isDirectory:[created[path] boolValue]];
+	}
+    }
+
+  if ([delegate respondsToSelector:
+       @selector(fileManager:directoryNeedsRescanAtPath:)])
+    {
+      for (NSString *path in rescans)
+	[delegate fileManager:self directoryNeedsRescanAtPath:path];
+    }
+}
+
+static void
+stream_callback(ConstFSEventStreamRef stream, void *info, size_t count,
+		void *paths, const FSEventStreamEventFlags flags[],
+		const FSEventStreamEventId ids[])
+{
+  @autoreleasepool
+    {
+      handle_events((__bridge PDLocalFileManager *)info,
+		    (__bridge NSArray *)paths, flags, ids, count);
+    }
+}
+
+- (BOOL)startWatchingForChanges
+{
+  if (_stream != NULL)
+    return YES;
+
+  /* FSEvents reports paths with any symlinks resolved. */
+
+  _streamPath = [_path stringByResolvingSymlinksInPath];
+
+  /* The stream doesn't retain us, -invalidate stops it. */
+
+  FSEventStreamContext ctx = {0, (__bridge void *)self, NULL, NULL, NULL};
+
+  _stream = FSEventStreamCreate(NULL, stream_callback, &ctx,
+				(__bridge CFArrayRef)@[_streamPath],
+				kFSEventStreamEventIdSinceNow, WATCH_LATENCY,
+				kFSEventStreamCreateFlagUseCFTypes
+				| kFSEventStreamCreateFlagFileEvents);
+  if (_stream == NULL)
+    return NO;
+
+  FSEventStreamScheduleWithRunLoop(_stream, CFRunLoopGetMain(),
+				   kCFRunLoopDefaultMode);
+
+  if (!FSEventStreamStart(_stream))
+    {
+      [self stopWatchingForChanges];
+      return NO;
+    }
+
+  return YES;
+}
+
+- (void)stopWatchingForChanges
+{
+  if (_stream != NULL)
+    {
+      FSEventStreamStop(_stream);
+      FSEventStreamInvalidate(_stream);
+      FSEventStreamRelease(_stream);
+      _stream = NULL;
+    }
+}
+
 - (NSURL *)fileURLWithPath:(NSString *)path
 {
   return [NSURL fileURLWithPath:absolute_path(self, path)];
@@ -157,12 +397,90 @@ absolute_path(PDLocalFileManager *self, NSString *path)
   return [NSData dataWithContentsOfFile:absolute_path(self, path)];
 }
 
+- (NSData *)contentsOfFileAtPath:(NSString *)path range:(NSRange)range
+{
+  int fd = open([absolute_path(self, path) fileSystemRepresentation],
+		O_RDONLY);
+  if (fd < 0)
+    return nil;
+
+  NSMutableData *data = [NSMutableData dataWithLength:range.length];
+  uint8_t *ptr = data.mutableBytes;
+  size_t done = 0;
+
+  while (done < range.length)
+    {
+      ssize_t n = pread(fd, ptr + done, range.length - done,
+			range.location + done);
+      if (n < 0)
+	{
+	  close(fd);
+	  return nil;
+	}
+      else if (n == 0)
+	break;
+      done += n;
+    }
+
+  close(fd);
+
+  data.length = done;
+  return data;
+}
+
 - (NSArray *)contentsOfDirectoryAtPath:(NSString *)path
 {
   return [_manager contentsOfDirectoryAtPath:
 	  absolute_path(self, path) error:nil];
 }
 
+- (void)foreachFileInDirectory:(NSString *)path
+    handler:(void (^)(NSString *file_name, BOOL is_dir))block
+{
+  /* Use the type stored in the directory entry when the file system
+     provides it, so we don't need to stat every file. */
+
+  DIR *dir = opendir([absolute_path(self, path) fileSystemRepresentation]);
+  if (dir == NULL)
+    return;
+
+  struct dirent *de;
+
+  while ((de = readdir(dir)) != NULL)
+    {
+      const char *name = de->d_name;
+
+      if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+	continue;
+
+      BOOL is_dir;
+
+      if (de->d_type == DT_DIR)
+	is_dir = YES;
+      else if (de->d_type == DT_REG)
+	is_dir = NO;
+      else
+	{
+	  /* Unknown type or symlink, follow it like -fileExistsAtPath:
+	     would. */
+
+	  struct stat st;
+	  if (fstatat(dirfd(dir), name, &st, 0) != 0)
+	    continue;
+	  is_dir = S_ISDIR(st.st_mode);
+	}
+
+      NSString *file = [_manager stringWithFileSystemRepresentation:name
+			length:strlen(name)];
+      if (file == nil)
+	continue;
+
+      block(file, is_dir);
+    }
+
+  closedir(dir);
+}
+
 - (CGImageSourceRef)copyImageSourceAtPath:(NSString *)path
 {
   NSURL *url = [NSURL fileURLWithPath:absolute_path(self, path)];
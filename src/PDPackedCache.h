@@ -0,0 +1,79 @@
+/* -*- c-style: gnu -*-
+
+   Copyright (c) 2013 John Harper <jsh@unfactored.org>
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE. */
+
+#import <Foundation/Foundation.h>
+
+/* Cached data for a library stored in a few large append-only segment
+   files, instead of one small file per item. Items are keyed by file
+   id and base name (e.g. "t.jpg"), and record the time they were
+   written so callers can check them against the source file. Space
+   used by replaced or removed items is reclaimed by compacting
+   segments in the background. All methods are thread-safe. */
+
+@interface PDPackedCache : NSObject
+
+/* Returns true if 'base' is one of the names that can be stored. */
+
++ (BOOL)canStoreBase:(NSString *)base;
+
+/* 'path' is a directory, created if it doesn't exist. */
+
+- (id)initWithPath:(NSString *)path;
+
+- (void)invalidate;
+
+/* Writes the index to disk. Without this the index is rebuilt from
+   the segment files the next time the cache is opened. */
+
+- (void)synchronize;
+
+/* Returns true if an item exists and was written after 'mtime'. */
+
+- (BOOL)hasDataForFileId:(uint32_t)fid base:(NSString *)base
+    newerThan:(time_t)mtime;
+
+/* Returns nil unless the item exists and was written after 'mtime'. */
+
+- (NSData *)dataForFileId:(uint32_t)fid base:(NSString *)base
+    newerThan:(time_t)mtime;
+
+- (BOOL)setData:(NSData *)data forFileId:(uint32_t)fid base:(NSString *)base;
+
+- (void)removeDataForFileId:(uint32_t)fid base:(NSString *)base;
+
+/* Removes all items whose file ids aren't in 'set'. */
+
+- (void)removeDataForFileIdsNotInSet:(NSIndexSet *)set;
+
+/* Calls 'block' once for each stored item. The items are copied
+   first, so the block may modify the cache. */
+
+- (void)enumerateDataUsingBlock:(void (^)(uint32_t fid, NSString *base,
+    size_t length, time_t mtime))block;
+
+/* Total size of all segment files. */
+
+@property(nonatomic, readonly) uint64_t size;
+
+@end
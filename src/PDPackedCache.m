@@ -0,0 +1,1042 @@
+/* -*- c-style: gnu -*-
+
+   Copyright (c) 2013 John Harper <jsh@unfactored.org>
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE. */
+
+#import "PDPackedCache.h"
+
+#import "PDMacros.h"
+
+#import <fcntl.h>
+#import <pthread.h>
+#import <stdatomic.h>
+#import <stdlib.h>
+#import <sys/stat.h>
+#import <time.h>
+#import <unistd.h>
+
+/* Segment files are named by hex id, only the newest segment is ever
+   appended to. Each item is stored as a record header followed by its
+   data. Records are never modified once written, so the index can
+   always be rebuilt (or brought up to date) by scanning the segments.
+
+   The index file is a snapshot of the hash table, with the length of
+   each segment at the time it was written; on opening, any records
+   past that point are scanned and added. */
+
+#define INDEX_FILE "index"
+#define SEGMENT_SUFFIX ".seg"
+#define SEGMENT_MAX_SIZE (64*1024*1024)
+
+#define RECORD_MAGIC 0x52504450		/* 'PDPR' */
+#define INDEX_MAGIC 0x49504450		/* 'PDPI' */
+#define INDEX_VERSION 1
+
+/* Segments are compacted once less than this fraction of their
+   contents is still referenced by the index. */
+
+#define COMPACT_THRESHOLD .5
+
+struct pack_record
+{
+  uint32_t magic;
+  uint32_t file_id;
+  uint32_t base;
+  uint32_t mtime;
+  uint32_t length;
+  uint32_t flags;
+};
+
+enum
+{
+  RECORD_REMOVED = 1U << 0,		/* no data, removes the item */
+};
+
+struct pack_entry
+{
+  uint32_t file_id;			/* zero for empty slots */
+  uint32_t base;
+  uint32_t segment;
+  uint32_t offset;			/* of the record header */
+  uint32_t length;			/* of the data */
+  uint32_t mtime;
+};
+
+struct pack_segment
+{
+  uint32_t id;
+  int fd;
+  uint64_t size;
+  uint64_t live;			/* bytes referenced by the index */
+};
+
+struct index_header
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t segment_count;
+  uint32_t entry_count;
+};
+
+struct index_segment
+{
+  uint32_t id;
+  uint32_t reserved;
+  uint64_t size;
+};
+
+static const char *const base_names[] = {"t.jpg", "s.jpg", "m.jpg", "p.json"};
+
+static uint32_t
+base_code(NSString *base)
+{
+  const char *str = base.UTF8String;
+
+  for (size_t i = 0; i < N_ELEMENTS(base_names); i++)
+    {
+      if (strcmp(str, base_names[i]) == 0)
+	return (uint32_t)i + 1;
+    }
+
+  return 0;
+}
+
+static inline uint32_t
+record_size(uint32_t length)
+{
+  return (uint32_t)sizeof(struct pack_record) + length;
+}
+
+/* Reads take _lock for reading. Anything modifying the index or the
+   segment list takes it for writing. Appends are also serialized by
+   _appendLock (always taken before _lock). Compaction takes it for
+   each record it moves, not for the whole pass, so writes are only
+   held up briefly. */
+
+@implementation PDPackedCache
+{
+  NSString *_path;
+
+  pthread_rwlock_t _lock;
+  pthread_mutex_t _appendLock;
+
+  struct pack_entry *_entries;
+  size_t _capacity;			/* power of two */
+  size_t _count;
+
+  struct pack_segment *_segments;	/* sorted by id */
+  size_t _segmentCount;
+
+  BOOL _indexDirty;
+  _Atomic(BOOL) _compactPending;
+  dispatch_queue_t _compactQueue;
+}
+
++ (BOOL)canStoreBase:(NSString *)base
+{
+  return base_code(base) != 0;
+}
+
+static inline size_t
+entry_hash(uint32_t fid, uint32_t base)
+{
+  return (fid * 2654435761U) ^ (base * 0x9e3779b9U);
+}
+
+static struct pack_entry *
+entry_lookup(PDPackedCache *self, uint32_t fid, uint32_t base)
+{
+  if (self->_capacity == 0)
+    return NULL;
+
+  size_t mask = self->_capacity - 1;
+
+  for (size_t i = entry_hash(fid, base) & mask;; i = (i + 1) & mask)
+    {
+      struct pack_entry *e = &self->_entries[i];
+      if (e->file_id == 0)
+	return NULL;
+      if (e->file_id == fid && e->base == base)
+	return e;
+    }
+}
+
+static struct pack_segment *
+find_segment(PDPackedCache *self, uint32_t id)
+{
+  size_t lo = 0, hi = self->_segmentCount;
+
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      if (self->_segments[mid].id < id)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+
+  if (lo < self->_segmentCount && self->_segments[lo].id == id)
+    return &self->_segments[lo];
+  else
+    return NULL;
+}
+
+static void
+entry_insert_1(PDPackedCache *self, const struct pack_entry *e)
+{
+  size_t mask = self->_capacity - 1;
+
+  for (size_t i = entry_hash(e->file_id, e->base) & mask;; i = (i + 1) & mask)
+    {
+      if (self->_entries[i].file_id == 0)
+	{
+	  self->_entries[i] = *e;
+	  return;
+	}
+    }
+}
+
+/* Removes the entry at 'e', using backward-shift deletion so no
+   tombstones are needed. */
+
+static void
+entry_remove(PDPackedCache *self, struct pack_entry *e)
+{
+  struct pack_segment *seg = find_segment(self, e->segment);
+  if (seg != NULL)
+    seg->live -= record_size(e->length);
+
+  size_t mask = self->_capacity - 1;
+  size_t i = e - self->_entries;
+
+  for (size_t j = (i + 1) & mask;; j = (j + 1) & mask)
+    {
+      struct pack_entry *f = &self->_entries[j];
+      if (f->file_id == 0)
+	break;
+
+      size_t k = entry_hash(f->file_id, f->base) & mask;
+
+      /* Can 'f' move back to slot i? Only if its home slot k is not
+	 cyclically in (i, j]. */
+
+      if (i <= j ? (k <= i || k > j) : (k <= i && k > j))
+	{
+	  self->_entries[i] = *f;
+	  i = j;
+	}
+    }
+
+  self->_entries[i].file_id = 0;
+  self->_count--;
+}
+
+/* Adds or replaces the entry for e's key, updating segment usage. */
+
+static void
+entry_insert(PDPackedCache *self, const struct pack_entry *e)
+{
+  struct pack_entry *old = entry_lookup(self, e->file_id, e->base);
+  if (old != NULL)
+    entry_remove(self, old);
+
+  if ((self->_count + 1) * 4 > self->_capacity * 3)
+    {
+      size_t old_capacity = self->_capacity;
+      struct pack_entry *old_entries = self->_entries;
+
+      self->_capacity = old_capacity != 0 ? old_capacity * 2 : 1024;
+      self->_entries = calloc(self->_capacity, sizeof(struct pack_entry));
+
+      for (size_t i = 0; i < old_capacity; i++)
+	{
+	  if (old_entries[i].file_id != 0)
+	    entry_insert_1(self, &old_entries[i]);
+	}
+
+      free(old_entries);
+    }
+
+  entry_insert_1(self, e);
+  self->_count++;
+
+  struct pack_segment *seg = find_segment(self, e->segment);
+  if (seg != NULL)
+    seg->live += record_size(e->length);
+}
+
+static NSString *
+segment_path(PDPackedCache *self, uint32_t id)
+{
+  return [self->_path stringByAppendingPathComponent:
+	  [NSString stringWithFormat:@"%08x" SEGMENT_SUFFIX, id]];
+}
+
+/* Called with _lock held for writing. */
+
+static struct pack_segment *
+add_segment(PDPackedCache *self, uint32_t id, int fd, uint64_t size)
+{
+  self->_segments = realloc(self->_segments, (self->_segmentCount + 1)
+			    * sizeof(struct pack_segment));
+
+  size_t i = self->_segmentCount++;
+  while (i > 0 && self->_segments[i-1].id > id)
+    {
+      self->_segments[i] = self->_segments[i-1];
+      i--;
+    }
+
+  struct pack_segment *seg = &self->_segments[i];
+  seg->id = id;
+  seg->fd = fd;
+  seg->size = size;
+  seg->live = 0;
+
+  return seg;
+}
+
+/* Called with _lock held for writing. */
+
+static void
+remove_segment(PDPackedCache *self, struct pack_segment *seg)
+{
+  close(seg->fd);
+  unlink(segment_path(self, seg->id).fileSystemRepresentation);
+
+  size_t i = seg - self->_segments;
+  memmove(seg, seg + 1, (self->_segmentCount - i - 1) * sizeof(*seg));
+  self->_segmentCount--;
+}
+
+/* Adds all complete records in 'seg' starting from 'offset'. Anything
+   after the last complete record is truncated. */
+
+static void
+scan_segment(PDPackedCache *self, struct pack_segment *seg, uint64_t offset)
+{
+  while (offset + sizeof(struct pack_record) <= seg->size)
+    {
+      struct pack_record r;
+      if (pread(seg->fd, &r, sizeof(r), offset) != sizeof(r)
+	  || r.magic != RECORD_MAGIC
+	  || offset + record_size(r.length) > seg->size)
+	break;
+
+      if (!(r.flags & RECORD_REMOVED))
+	{
+	  struct pack_entry e;
+	  e.file_id = r.file_id;
+	  e.base = r.base;
+	  e.segment = seg->id;
+	  e.offset = (uint32_t)offset;
+	  e.length = r.length;
+	  e.mtime = r.mtime;
+	  entry_insert(self, &e);
+	}
+      else
+	{
+	  struct pack_entry *e = entry_lookup(self, r.file_id, r.base);
+	  if (e != NULL)
+	    entry_remove(self, e);
+	}
+
+      offset += record_size(r.length);
+    }
+
+  if (offset < seg->size)
+    {
+      if (ftruncate(seg->fd, offset) == 0)
+	seg->size = offset;
+    }
+
+  self->_indexDirty = YES;
+}
+
+static void
+load_index(PDPackedCache *self, uint64_t *scanned)
+{
+  NSData *data = [NSData dataWithContentsOfFile:
+		  [self->_path stringByAppendingPathComponent:@INDEX_FILE]];
+
+  if (data.length < sizeof(struct index_header))
+    return;
+
+  const struct index_header *h = data.bytes;
+
+  if (h->magic != INDEX_MAGIC || h->version != INDEX_VERSION
+      || data.length != (sizeof(*h)
+			 + (size_t)h->segment_count * sizeof(struct index_segment)
+			 + (size_t)h->entry_count * sizeof(struct pack_entry)))
+    return;
+
+  const struct index_segment *segs = (const void *)(h + 1);
+  const struct pack_entry *entries = (const void *)(segs + h->segment_count);
+
+  for (uint32_t i = 0; i < h->segment_count; i++)
+    {
+      struct pack_segment *seg = find_segment(self, segs[i].id);
+
+      /* If a segment is shorter than we remember something is very
+	 wrong, discard everything. */
+
+      if (seg != NULL && seg->size < segs[i].size)
+	{
+	  memset(scanned, 0, self->_segmentCount * sizeof(scanned[0]));
+	  return;
+	}
+    }
+
+  for (uint32_t i = 0; i < h->entry_count; i++)
+    {
+      const struct pack_entry *e = &entries[i];
+      struct pack_segment *seg = find_segment(self, e->segment);
+
+      if (e->file_id != 0 && seg != NULL
+	  && e->offset + (uint64_t)record_size(e->length) <= seg->size)
+	entry_insert(self, e);
+    }
+
+  for (uint32_t i = 0; i < h->segment_count; i++)
+    {
+      struct pack_segment *seg = find_segment(self, segs[i].id);
+      if (seg != NULL)
+	scanned[seg - self->_segments] = segs[i].size;
+    }
+}
+
+- (id)initWithPath:(NSString *)path
+{
+  self = [super init];
+  if (self == nil)
+    return nil;
+
+  _path = [path copy];
+
+  pthread_rwlock_init(&_lock, NULL);
+  pthread_mutex_init(&_appendLock, NULL);
+
+  _compactQueue = dispatch_queue_create("PDPackedCache.compact",
+					DISPATCH_QUEUE_SERIAL);
+  dispatch_set_target_queue(_compactQueue, dispatch_get_global_queue
+			    (DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0));
+
+  NSFileManager *fm = [NSFileManager defaultManager];
+
+  if (![fm fileExistsAtPath:_path])
+    {
+      [fm createDirectoryAtPath:_path withIntermediateDirectories:YES
+       attributes:nil error:nil];
+    }
+
+  for (NSString *file in [fm contentsOfDirectoryAtPath:_path error:nil])
+    {
+      if (![file hasSuffix:@SEGMENT_SUFFIX])
+	continue;
+
+      uint32_t id = (uint32_t)strtoul(file.UTF8String, NULL, 16);
+      int fd = open(segment_path(self, id).fileSystemRepresentation, O_RDWR);
+      if (fd < 0)
+	continue;
+
+      struct stat st;
+      if (fstat(fd, &st) != 0)
+	{
+	  close(fd);
+	  continue;
+	}
+
+      add_segment(self, id, fd, st.st_size);
+    }
+
+  uint64_t *scanned = calloc(MAX(_segmentCount, 1), sizeof(uint64_t));
+
+  load_index(self, scanned);
+
+  for (size_t i = 0; i < _segmentCount; i++)
+    {
+      if (scanned[i] < _segments[i].size)
+	scan_segment(self, &_segments[i], scanned[i]);
+    }
+
+  free(scanned);
+
+  return self;
+}
+
+- (void)invalidate
+{
+  if (_compactQueue != nil)
+    {
+      dispatch_sync(_compactQueue, ^{});
+      _compactQueue = nil;
+    }
+
+  pthread_mutex_lock(&_appendLock);
+  pthread_rwlock_wrlock(&_lock);
+
+  for (size_t i = 0; i < _segmentCount; i++)
+    close(_segments[i].fd);
+
+  free(_segments);
+  _segments = NULL;
+  _segmentCount = 0;
+
+  free(_entries);
+  _entries = NULL;
+  _capacity = 0;
+  _count = 0;
+
+  pthread_rwlock_unlock(&_lock);
+  pthread_mutex_unlock(&_appendLock);
+}
+
+- (void)dealloc
+{
+  [self invalidate];
+  pthread_rwlock_destroy(&_lock);
+  pthread_mutex_destroy(&_appendLock);
+}
+
+/* Called with _appendLock held. */
+
+static void
+write_index(PDPackedCache *self)
+{
+  pthread_rwlock_rdlock(&self->_lock);
+
+  NSMutableData *data = nil;
+
+  if (self->_indexDirty)
+    {
+      size_t size = (sizeof(struct index_header)
+		     + self->_segmentCount * sizeof(struct index_segment)
+		     + self->_count * sizeof(struct pack_entry));
+
+      data = [NSMutableData dataWithLength:size];
+
+      struct index_header *h = data.mutableBytes;
+      h->magic = INDEX_MAGIC;
+      h->version = INDEX_VERSION;
+      h->segment_count = (uint32_t)self->_segmentCount;
+      h->entry_count = (uint32_t)self->_count;
+
+      struct index_segment *segs = (void *)(h + 1);
+      for (size_t i = 0; i < self->_segmentCount; i++)
+	{
+	  segs[i].id = self->_segments[i].id;
+	  segs[i].size = self->_segments[i].size;
+	}
+
+      struct pack_entry *ptr = (void *)(segs + self->_segmentCount);
+      for (size_t i = 0; i < self->_capacity; i++)
+	{
+	  if (self->_entries[i].file_id != 0)
+	    *ptr++ = self->_entries[i];
+	}
+
+      /* Segment sizes in the index mustn't be longer than what's on
+	 disk, so flush them first. */
+
+      for (size_t i = 0; i < self->_segmentCount; i++)
+	fsync(self->_segments[i].fd);
+    }
+
+  pthread_rwlock_unlock(&self->_lock);
+
+  if (data != nil)
+    {
+      if ([data writeToFile:[self->_path stringByAppendingPathComponent:
+			     @INDEX_FILE] atomically:YES])
+	self->_indexDirty = NO;
+    }
+}
+
+- (void)synchronize
+{
+  pthread_mutex_lock(&_appendLock);
+  write_index(self);
+  pthread_mutex_unlock(&_appendLock);
+}
+
+- (BOOL)hasDataForFileId:(uint32_t)fid base:(NSString *)base
+    newerThan:(time_t)mtime
+{
+  uint32_t code = base_code(base);
+  if (code == 0)
+    return NO;
+
+  pthread_rwlock_rdlock(&_lock);
+
+  struct pack_entry *e = entry_lookup(self, fid, code);
+  BOOL ret = e != NULL && e->mtime > mtime;
+
+  pthread_rwlock_unlock(&_lock);
+
+  return ret;
+}
+
+- (NSData *)dataForFileId:(uint32_t)fid base:(NSString *)base
+    newerThan:(time_t)mtime
+{
+  uint32_t code = base_code(base);
+  if (code == 0)
+    return nil;
+
+  NSMutableData *data = nil;
+
+  /* The lock is held while reading so that compaction can't remove
+     the segment from under us. */
+
+  pthread_rwlock_rdlock(&_lock);
+
+  struct pack_entry *e = entry_lookup(self, fid, code);
+
+  if (e != NULL && e->mtime > mtime)
+    {
+      struct pack_segment *seg = find_segment(self, e->segment);
+
+      if (seg != NULL)
+	{
+	  data = [NSMutableData dataWithLength:e->length];
+
+	  if (pread(seg->fd, data.mutableBytes, e->length,
+		    e->offset + sizeof(struct pack_record))
+	      != (ssize_t)e->length)
+	    data = nil;
+	}
+    }
+
+  pthread_rwlock_unlock(&_lock);
+
+  return data;
+}
+
+/* Called with _appendLock held. Appends a record to the newest
+   segment, starting a new one if needed, and fills in 'e' (apart from
+   the key and mtime) to reference it. */
+
+static BOOL
+append_record(PDPackedCache *self, const struct pack_record *r,
+	      const void *bytes, struct pack_entry *e)
+{
+  uint32_t size = record_size(r->length);
+
+  struct pack_segment *seg = (self->_segmentCount != 0
+			      ? &self->_segments[self->_segmentCount - 1]
+			      : NULL);
+
+  if (seg == NULL || (seg->size != 0 && seg->size + size > SEGMENT_MAX_SIZE))
+    {
+      uint32_t id = seg != NULL ? seg->id + 1 : 1;
+
+      int fd = open(segment_path(self, id).fileSystemRepresentation,
+		    O_RDWR | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0)
+	return NO;
+
+      pthread_rwlock_wrlock(&self->_lock);
+      seg = add_segment(self, id, fd, 0);
+      pthread_rwlock_unlock(&self->_lock);
+    }
+
+  off_t offset = seg->size;
+
+  if (pwrite(seg->fd, r, sizeof(*r), offset) != sizeof(*r)
+      || (r->length != 0
+	  && pwrite(seg->fd, bytes, r->length, offset + sizeof(*r))
+	     != (ssize_t)r->length))
+    {
+      ftruncate(seg->fd, offset);
+      return NO;
+    }
+
+  e->segment = seg->id;
+  e->offset = (uint32_t)offset;
+  e->length = r->length;
+
+  pthread_rwlock_wrlock(&self->_lock);
+  seg->size += size;
+  pthread_rwlock_unlock(&self->_lock);
+
+  return YES;
+}
+
+static void
+schedule_compaction(PDPackedCache *self);
+
+- (BOOL)setData:(NSData *)data forFileId:(uint32_t)fid base:(NSString *)base
+{
+  uint32_t code = base_code(base);
+  if (code == 0 || fid == 0 || data.length > SEGMENT_MAX_SIZE)
+    return NO;
+
+  struct pack_record r = {0};
+  r.magic = RECORD_MAGIC;
+  r.file_id = fid;
+  r.base = code;
+  r.mtime = (uint32_t)time(NULL);
+  r.length = (uint32_t)data.length;
+
+  struct pack_entry e;
+  e.file_id = fid;
+  e.base = code;
+  e.mtime = r.mtime;
+
+  pthread_mutex_lock(&_appendLock);
+
+  BOOL ret = append_record(self, &r, data.bytes, &e);
+
+  if (ret)
+    {
+      pthread_rwlock_wrlock(&_lock);
+      entry_insert(self, &e);
+      _indexDirty = YES;
+      pthread_rwlock_unlock(&_lock);
+    }
+
+  pthread_mutex_unlock(&_appendLock);
+
+  schedule_compaction(self);
+
+  return ret;
+}
+
+/* Removals are recorded in the segment as well, so they don't come
+   back if the index isn't written. Called with _appendLock held. */
+
+static void
+append_removal(PDPackedCache *self, uint32_t fid, uint32_t base)
+{
+  struct pack_record r = {0};
+  r.magic = RECORD_MAGIC;
+  r.file_id = fid;
+  r.base = base;
+  r.flags = RECORD_REMOVED;
+
+  struct pack_entry e;
+  append_record(self, &r, NULL, &e);
+}
+
+- (void)removeDataForFileId:(uint32_t)fid base:(NSString *)base
+{
+  uint32_t code = base_code(base);
+  if (code == 0)
+    return;
+
+  pthread_mutex_lock(&_appendLock);
+  pthread_rwlock_wrlock(&_lock);
+
+  struct pack_entry *e = entry_lookup(self, fid, code);
+  if (e != NULL)
+    {
+      entry_remove(self, e);
+      _indexDirty = YES;
+    }
+
+  pthread_rwlock_unlock(&_lock);
+
+  if (e != NULL)
+    append_removal(self, fid, code);
+
+  pthread_mutex_unlock(&_appendLock);
+
+  schedule_compaction(self);
+}
+
+- (void)removeDataForFileIdsNotInSet:(NSIndexSet *)set
+{
+  pthread_mutex_lock(&_appendLock);
+  pthread_rwlock_wrlock(&_lock);
+
+  NSMutableArray *removed = [NSMutableArray array];
+
+  for (size_t i = 0; i < _capacity;)
+    {
+      struct pack_entry *e = &_entries[i];
+
+      /* Removal may shift a later entry into this slot, so only
+	 advance if nothing was removed. */
+
+      if (e->file_id != 0 && ![set containsIndex:e->file_id])
+	{
+	  [removed addObject:@[@(e->file_id), @(e->base)]];
+	  entry_remove(self, e);
+	  _indexDirty = YES;
+	}
+      else
+	i++;
+    }
+
+  pthread_rwlock_unlock(&_lock);
+
+  for (NSArray *key in removed)
+    {
+      append_removal(self, [key[0] unsignedIntValue],
+		     [key[1] unsignedIntValue]);
+    }
+
+  pthread_mutex_unlock(&_appendLock);
+
+  schedule_compaction(self);
+}
+
+- (void)enumerateDataUsingBlock:(void (^)(uint32_t fid, NSString *base,
+    size_t length, time_t mtime))block
+{
+  pthread_rwlock_rdlock(&_lock);
+
+  size_t count = 0;
+  struct pack_entry *entries = malloc(MAX(_count, 1)
+				      * sizeof(struct pack_entry));
+
+  for (size_t i = 0; i < _capacity; i++)
+    {
+      if (_entries[i].file_id != 0)
+	entries[count++] = _entries[i];
+    }
+
+  pthread_rwlock_unlock(&_lock);
+
+  NSString *bases[N_ELEMENTS(base_names)];
+  for (size_t i = 0; i < N_ELEMENTS(base_names); i++)
+    bases[i] = [NSString stringWithUTF8String:base_names[i]];
+
+  for (size_t i = 0; i < count; i++)
+    {
+      const struct pack_entry *e = &entries[i];
+      block(e->file_id, bases[e->base - 1], e->length, e->mtime);
+    }
+
+  free(entries);
+}
+
+- (uint64_t)size
+{
+  uint64_t size = 0;
+
+  pthread_rwlock_rdlock(&_lock);
+
+  for (size_t i = 0; i < _segmentCount; i++)
+    size += _segments[i].size;
+
+  pthread_rwlock_unlock(&_lock);
+
+  return size;
+}
+
+/* Moves every live record out of segment 'id' into the newest
+   segment, then deletes it. Removal records are moved too, unless
+   the item has been stored again since, while an older segment may
+   still hold the data they remove, so it can't come back when the
+   segments are rescanned. Called on _compactQueue, only the newest
+   segment is appended to meanwhile. */
+
+static void
+compact_segment(PDPackedCache *self, uint32_t id)
+{
+  pthread_rwlock_rdlock(&self->_lock);
+
+  struct pack_segment *seg = find_segment(self, id);
+  int fd = seg != NULL ? seg->fd : -1;
+  uint64_t size = seg != NULL ? seg->size : 0;
+  BOOL has_older = seg != NULL && seg != self->_segments;
+
+  pthread_rwlock_unlock(&self->_lock);
+
+  if (fd < 0)
+    return;
+
+  BOOL failed = NO;
+  uint64_t offset = 0;
+
+  while (!failed && offset < size)
+    {
+      struct pack_record r;
+      if (pread(fd, &r, sizeof(r), offset) != sizeof(r)
+	  || r.magic != RECORD_MAGIC
+	  || offset + record_size(r.length) > size)
+	{
+	  failed = YES;
+	  break;
+	}
+
+      uint64_t record_offset = offset;
+      offset += record_size(r.length);
+
+      if (r.flags & RECORD_REMOVED)
+	{
+	  if (!has_older)
+	    continue;
+
+	  pthread_mutex_lock(&self->_appendLock);
+
+	  pthread_rwlock_rdlock(&self->_lock);
+	  BOOL stored = entry_lookup(self, r.file_id, r.base) != NULL;
+	  pthread_rwlock_unlock(&self->_lock);
+
+	  struct pack_entry e;
+	  if (!stored && !append_record(self, &r, NULL, &e))
+	    failed = YES;
+
+	  pthread_mutex_unlock(&self->_appendLock);
+	  continue;
+	}
+
+      /* Skip records the index no longer refers to. */
+
+      pthread_rwlock_rdlock(&self->_lock);
+      struct pack_entry *cur = entry_lookup(self, r.file_id, r.base);
+      BOOL current = (cur != NULL && cur->segment == id
+		      && cur->offset == record_offset);
+      pthread_rwlock_unlock(&self->_lock);
+
+      if (!current)
+	continue;
+
+      NSMutableData *data = [NSMutableData dataWithLength:r.length];
+
+      if (pread(fd, data.mutableBytes, r.length,
+		record_offset + sizeof(struct pack_record))
+	  != (ssize_t)r.length)
+	{
+	  failed = YES;
+	  break;
+	}
+
+      pthread_mutex_lock(&self->_appendLock);
+
+      struct pack_entry ne;
+      ne.file_id = r.file_id;
+      ne.base = r.base;
+      ne.mtime = r.mtime;
+
+      if (!append_record(self, &r, data.bytes, &ne))
+	failed = YES;
+      else
+	{
+	  /* Only update the index if the entry wasn't replaced or
+	     removed while we were copying it. */
+
+	  pthread_rwlock_wrlock(&self->_lock);
+
+	  cur = entry_lookup(self, r.file_id, r.base);
+	  current = (cur != NULL && cur->segment == id
+		     && cur->offset == record_offset);
+	  if (current)
+	    {
+	      entry_insert(self, &ne);
+	      self->_indexDirty = YES;
+	    }
+
+	  pthread_rwlock_unlock(&self->_lock);
+
+	  if (cur == NULL)
+	    append_removal(self, r.file_id, r.base);
+	}
+
+      pthread_mutex_unlock(&self->_appendLock);
+    }
+
+  if (!failed)
+    {
+      /* Index must reach the disk before the old segment goes away. */
+
+      pthread_mutex_lock(&self->_appendLock);
+
+      write_index(self);
+
+      pthread_rwlock_wrlock(&self->_lock);
+
+      seg = find_segment(self, id);
+      if (seg != NULL && seg->live == 0)
+	remove_segment(self, seg);
+
+      pthread_rwlock_unlock(&self->_lock);
+
+      pthread_mutex_unlock(&self->_appendLock);
+    }
+}
+
+static void
+schedule_compaction(PDPackedCache *self)
+{
+  pthread_rwlock_rdlock(&self->_lock);
+
+  BOOL needed = NO;
+
+  /* Never the newest segment, it's still being appended to. */
+
+  for (size_t i = 0; i + 1 < self->_segmentCount; i++)
+    {
+      struct pack_segment *seg = &self->_segments[i];
+      if (seg->live < seg->size * COMPACT_THRESHOLD)
+	needed = YES;
+    }
+
+  pthread_rwlock_unlock(&self->_lock);
+
+  if (!needed || self->_compactQueue == nil
+      || atomic_exchange(&self->_compactPending, YES))
+    return;
+
+  dispatch_async(self->_compactQueue, ^
+    {
+      atomic_store(&self->_compactPending, NO);
+
+      for (;;)
+	{
+	  uint32_t id = 0;
+
+	  pthread_rwlock_rdlock(&self->_lock);
+
+	  for (size_t i = 0; i + 1 < self->_segmentCount; i++)
+	    {
+	      struct pack_segment *seg = &self->_segments[i];
+	      if (seg->live < seg->size * COMPACT_THRESHOLD)
+		{
+		  id = seg->id;
+		  break;
+		}
+	    }
+
+	  pthread_rwlock_unlock(&self->_lock);
+
+	  if (id == 0)
+	    break;
+
+	  @autoreleasepool
+	    {
+	      compact_segment(self, id);
+	    }
+
+	  pthread_rwlock_rdlock(&self->_lock);
+	  BOOL removed = find_segment(self, id) == NULL;
+	  pthread_rwlock_unlock(&self->_lock);
+
+	  if (!removed)
+	    break;
+	}
+    });
+}
+
+@end
@@ -0,0 +1,115 @@
+/* -*- c-style: gnu -*-
+
+   Copyright (c) 2013 John Harper <jsh@unfactored.org>
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE. */
+
+#import <Foundation/Foundation.h>
+
+/* Typed columns of the image properties needed to sort and filter a
+   library, indexed by file id. The whole cache is a single file that
+   is mapped on load, so reading properties for every image at startup
+   doesn't require opening a file per image. Only a subset of each
+   image's properties is stored, see +canStoreKey:. All methods are
+   thread-safe. */
+
+/* Fixed-size copy of the numeric columns of a row, for callers that
+   keep the sort keys of every image in memory and can't afford a
+   dictionary each. Which fields have values is private to the cache,
+   use +valueForKey:inRecord: to read them. */
+
+typedef struct PDPropertyCacheRecord PDPropertyCacheRecord;
+
+struct PDPropertyCacheRecord
+{
+  uint32_t present;
+  int32_t rating;
+  int32_t pixelWidth;
+  int32_t pixelHeight;
+  int32_t orientation;
+  int64_t originalDate;
+  int64_t digitizedDate;
+  double isoSpeed;
+  double fNumber;
+  double exposureLength;
+  double altitude;
+};
+
+@interface PDPropertyCache : NSObject
+
+/* Returns true if values of property 'key' are stored. */
+
++ (BOOL)canStoreKey:(NSString *)key;
+
+/* Maps the cache file at 'path' if it exists and is valid, otherwise
+   creates an empty cache that will be written to 'path'. */
+
+- (id)initWithPath:(NSString *)path;
+
+- (void)invalidate;
+
+/* Writes any changes back to the cache file. */
+
+- (void)synchronize;
+
+/* Returns nil unless properties for 'fid' were stored after 'mtime'.
+   The dictionary only contains keys that can be stored. */
+
+- (NSDictionary *)propertiesForFileId:(uint32_t)fid newerThan:(time_t)mtime;
+
+/* Record form of the above. Returns false (and leaves 'rec' unchanged)
+   unless properties for 'fid' were stored after 'mtime'. Keywords
+   aren't part of the record, they're returned in '*keywords', or nil
+   if the row has none. */
+
+- (BOOL)getRecord:(PDPropertyCacheRecord *)rec keywords:(NSArray **)keywords
+    forFileId:(uint32_t)fid newerThan:(time_t)mtime;
+
+/* Fills 'rec' and '*keywords' from the storable keys in 'dict'. */
+
++ (void)getRecord:(PDPropertyCacheRecord *)rec keywords:(NSArray **)keywords
+    fromProperties:(NSDictionary *)dict;
+
+/* Returns the value of 'key' in 'rec' as an NSNumber, or nil if it has
+   no value or isn't one of the record's keys. */
+
++ (id)valueForKey:(NSString *)key inRecord:(const PDPropertyCacheRecord *)rec;
+
+/* For callers reading the same key from many records: returns the
+   index of numeric key 'key' in the record, or -1. */
+
++ (NSInteger)recordIndexOfKey:(NSString *)key;
+
+/* Returns false if 'rec' has no value at 'idx', else stores the value
+   in '*value'. */
+
++ (BOOL)getNumber:(double *)value atIndex:(NSInteger)idx
+    inRecord:(const PDPropertyCacheRecord *)rec;
+
+/* Stores the values of all storable keys in 'dict'. */
+
+- (void)setProperties:(NSDictionary *)dict forFileId:(uint32_t)fid;
+
+/* Removes all rows whose file ids aren't in 'set'. */
+
+- (void)removePropertiesForFileIdsNotInSet:(NSIndexSet *)set;
+
+@end
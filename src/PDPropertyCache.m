@@ -0,0 +1,821 @@
+/* -*- c-style: gnu -*-
+
+   Copyright (c) 2013 John Harper <jsh@unfactored.org>
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE. */
+
+#import "PDPropertyCache.h"
+
+#import "PDFoundationExtensions.h"
+#import "PDImage.h"
+#import "PDMacros.h"
+
+#import <pthread.h>
+#import <stddef.h>
+#import <stdlib.h>
+#import <time.h>
+
+/* File layout: header, then one array per column, each padded to a
+   multiple of eight bytes, then the string pool. The first three
+   arrays are the (sorted) file ids, a bitmask of which columns have
+   values in each row, and the time each row was written. Keyword
+   lists are stored as an offset into the string pool and a count of
+   consecutive NUL-terminated strings. */
+
+#define CACHE_MAGIC 0x43504450		/* 'PDPC' */
+#define CACHE_VERSION 1
+
+enum column_type
+{
+  column_int32,
+  column_int64,
+  column_double,
+  column_strings,
+};
+
+struct column
+{
+  NSString *const *key;
+  enum column_type type;
+  size_t record_offset;			/* unused for column_strings */
+};
+
+#define RECORD_FIELD(x) offsetof(PDPropertyCacheRecord, x)
+
+static const struct column columns[] =
+{
+  {&PDImage_OriginalDate, column_int64, RECORD_FIELD(originalDate)},
+  {&PDImage_DigitizedDate, column_int64, RECORD_FIELD(digitizedDate)},
+  {&PDImage_Rating, column_int32, RECORD_FIELD(rating)},
+  {&PDImage_PixelWidth, column_int32, RECORD_FIELD(pixelWidth)},
+  {&PDImage_PixelHeight, column_int32, RECORD_FIELD(pixelHeight)},
+  {&PDImage_Orientation, column_int32, RECORD_FIELD(orientation)},
+  {&PDImage_ISOSpeed, column_double, RECORD_FIELD(isoSpeed)},
+  {&PDImage_FNumber, column_double, RECORD_FIELD(fNumber)},
+  {&PDImage_ExposureLength, column_double, RECORD_FIELD(exposureLength)},
+  {&PDImage_Altitude, column_double, RECORD_FIELD(altitude)},
+  {&PDImage_Keywords, column_strings, 0},
+};
+
+#define COLUMN_COUNT N_ELEMENTS(columns)
+
+struct cache_header
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t count;
+  uint32_t column_count;
+  uint32_t string_size;
+  uint32_t padding;
+};
+
+struct string_list
+{
+  uint32_t offset;
+  uint32_t count;
+};
+
+@interface PDPropertyCacheRow : NSObject
+{
+@public
+  time_t _stamp;
+  NSDictionary *_dict;
+}
+@end
+
+@implementation PDPropertyCache
+{
+  NSString *_path;
+
+  pthread_rwlock_t _lock;
+
+  /* Mapped contents of the cache file. */
+
+  NSData *_data;
+  uint32_t _count;
+  const uint32_t *_fileIds;
+  const uint32_t *_present;
+  const int64_t *_stamps;
+  const void *_columns[COLUMN_COUNT];
+  const char *_strings;
+  uint32_t _stringSize;
+
+  /* Mapped rows that have been replaced or removed. */
+
+  NSMutableIndexSet *_removed;
+
+  /* NSNumber<file-id> -> PDPropertyCacheRow, rows added since the file
+     was mapped. */
+
+  NSMutableDictionary *_pending;
+
+  BOOL _dirty;
+}
+
++ (BOOL)canStoreKey:(NSString *)key
+{
+  static NSSet *keys;
+  static dispatch_once_t once;
+
+  dispatch_once(&once, ^{
+    NSMutableSet *set = [NSMutableSet set];
+    for (size_t i = 0; i < COLUMN_COUNT; i++)
+      [set addObject:*columns[i].key];
+    keys = [set copy];
+  });
+
+  return [keys containsObject:key];
+}
+
+static inline size_t
+column_width(enum column_type type)
+{
+  switch (type)
+    {
+    case column_int32:
+      return sizeof(int32_t);
+    case column_int64:
+      return sizeof(int64_t);
+    case column_double:
+      return sizeof(double);
+    case column_strings:
+      return sizeof(struct string_list);
+    }
+
+  return 0;
+}
+
+static inline size_t
+array_size(size_t count, size_t width)
+{
+  return (count * width + 7) & ~(size_t)7;
+}
+
+/* Sets up the column pointers for file contents 'data', returns false
+   if it's not a valid cache file. */
+
+static BOOL
+map_data(PDPropertyCache *self, NSData *data)
+{
+  const uint8_t *bytes = data.bytes;
+  size_t length = data.length;
+
+  if (length < sizeof(struct cache_header))
+    return NO;
+
+  const struct cache_header *h = (const void *)bytes;
+
+  if (h->magic != CACHE_MAGIC || h->version != CACHE_VERSION
+      || h->column_count != COLUMN_COUNT)
+    return NO;
+
+  size_t n = h->count;
+  size_t offset = sizeof(struct cache_header);
+
+  size_t size = (offset + array_size(n, sizeof(uint32_t)) * 2
+		 + array_size(n, sizeof(int64_t)));
+  for (size_t i = 0; i < COLUMN_COUNT; i++)
+    size += array_size(n, column_width(columns[i].type));
+  size += h->string_size;
+
+  if (length < size)
+    return NO;
+
+  self->_fileIds = (const void *)(bytes + offset);
+  offset += array_size(n, sizeof(uint32_t));
+  self->_present = (const void *)(bytes + offset);
+  offset += array_size(n, sizeof(uint32_t));
+  self->_stamps = (const void *)(bytes + offset);
+  offset += array_size(n, sizeof(int64_t));
+
+  for (size_t i = 0; i < COLUMN_COUNT; i++)
+    {
+      self->_columns[i] = bytes + offset;
+      offset += array_size(n, column_width(columns[i].type));
+    }
+
+  self->_strings = (const char *)(bytes + offset);
+  self->_stringSize = h->string_size;
+  self->_count = h->count;
+  self->_data = data;
+
+  return YES;
+}
+
+static void
+unmap_data(PDPropertyCache *self)
+{
+  self->_data = nil;
+  self->_count = 0;
+  self->_fileIds = NULL;
+  self->_present = NULL;
+  self->_stamps = NULL;
+  memset(self->_columns, 0, sizeof(self->_columns));
+  self->_strings = NULL;
+  self->_stringSize = 0;
+}
+
+- (id)initWithPath:(NSString *)path
+{
+  self = [super init];
+  if (self == nil)
+    return nil;
+
+  _path = [path copy];
+
+  pthread_rwlock_init(&_lock, NULL);
+
+  _removed = [[NSMutableIndexSet alloc] init];
+  _pending = [[NSMutableDictionary alloc] init];
+
+  NSData *data = [NSData dataWithContentsOfFile:_path
+		  options:NSDataReadingMappedAlways error:nil];
+
+  if (data != nil && !map_data(self, data))
+    {
+      unmap_data(self);
+      _dirty = YES;
+    }
+
+  return self;
+}
+
+- (void)invalidate
+{
+  pthread_rwlock_wrlock(&_lock);
+
+  unmap_data(self);
+  [_removed removeAllIndexes];
+  [_pending removeAllObjects];
+  _dirty = NO;
+
+  pthread_rwlock_unlock(&_lock);
+}
+
+- (void)dealloc
+{
+  pthread_rwlock_destroy(&_lock);
+}
+
+/* Returns the index of the mapped row for 'fid', or -1. */
+
+static ssize_t
+find_row(PDPropertyCache *self, uint32_t fid)
+{
+  const uint32_t *ids = self->_fileIds;
+  size_t lo = 0, hi = self->_count;
+
+  while (lo < hi)
+    {
+      size_t mid = (lo + hi) / 2;
+      if (ids[mid] < fid)
+	lo = mid + 1;
+      else if (ids[mid] > fid)
+	hi = mid;
+      else
+	return [self->_removed containsIndex:fid] ? -1 : (ssize_t)mid;
+    }
+
+  return -1;
+}
+
+static NSArray *
+copy_string_list(PDPropertyCache *self, struct string_list list)
+{
+  NSMutableArray *array = [NSMutableArray arrayWithCapacity:list.count];
+
+  const char *str = self->_strings + list.offset;
+  const char *end = self->_strings + self->_stringSize;
+
+  for (uint32_t i = 0; i < list.count && str < end; i++)
+    {
+      size_t len = strnlen(str, end - str);
+      NSString *s = [[NSString alloc] initWithBytes:str length:len
+		     encoding:NSUTF8StringEncoding];
+      if (s != nil)
+	[array addObject:[s internedString]];
+      str += len + 1;
+    }
+
+  return array;
+}
+
+static NSDictionary *
+copy_row(PDPropertyCache *self, size_t row)
+{
+  NSMutableDictionary *dict = [NSMutableDictionary dictionary];
+
+  uint32_t present = self->_present[row];
+
+  for (size_t i = 0; i < COLUMN_COUNT; i++)
+    {
+      if (!(present & (1U << i)))
+	continue;
+
+      const void *col = self->_columns[i];
+      id value = nil;
+
+      switch (columns[i].type)
+	{
+	case column_int32:
+	  value = @(((const int32_t *)col)[row]);
+	  break;
+	case column_int64:
+	  value = @(((const int64_t *)col)[row]);
+	  break;
+	case column_double:
+	  value = @(((const double *)col)[row]);
+	  break;
+	case column_strings:
+	  value = copy_string_list(self,
+				   ((const struct string_list *)col)[row]);
+	  break;
+	}
+
+      if (value != nil)
+	dict[*columns[i].key] = value;
+    }
+
+  return dict;
+}
+
+- (NSDictionary *)propertiesForFileId:(uint32_t)fid newerThan:(time_t)mtime
+{
+  NSDictionary *dict = nil;
+
+  pthread_rwlock_rdlock(&_lock);
+
+  PDPropertyCacheRow *row = _pending[@(fid)];
+
+  if (row != nil)
+    {
+      if (row->_stamp > mtime)
+	dict = row->_dict;
+    }
+  else
+    {
+      ssize_t idx = find_row(self, fid);
+      if (idx >= 0 && _stamps[idx] > mtime)
+	dict = copy_row(self, idx);
+    }
+
+  pthread_rwlock_unlock(&_lock);
+
+  return dict;
+}
+
++ (NSInteger)recordIndexOfKey:(NSString *)key
+{
+  for (size_t i = 0; i < COLUMN_COUNT; i++)
+    {
+      if (columns[i].type != column_strings
+	  && [key isEqualToString:*columns[i].key])
+	return i;
+    }
+
+  return -1;
+}
+
++ (BOOL)getNumber:(double *)value atIndex:(NSInteger)idx
+    inRecord:(const PDPropertyCacheRecord *)rec
+{
+  if (idx < 0 || idx >= (NSInteger)COLUMN_COUNT
+      || !(rec->present & (1U << idx)))
+    return NO;
+
+  const void *field = (const char *)rec + columns[idx].record_offset;
+
+  switch (columns[idx].type)
+    {
+    case column_int32:
+      *value = *(const int32_t *)field;
+      return YES;
+    case column_int64:
+      *value = *(const int64_t *)field;
+      return YES;
+    case column_double:
+      *value = *(const double *)field;
+      return YES;
+    case column_strings:
+      break;
+    }
+
+  return NO;
+}
+
+/* Returns true if 'value' can be stored in a column of 'type'. */
+
+static BOOL
+valid_value(id value, enum column_type type)
+{
+  if (type != column_strings)
+    return [value isKindOfClass:[NSNumber class]];
+
+  if (![value isKindOfClass:[NSArray class]])
+    return NO;
+
+  for (id str in value)
+    {
+      if (![str isKindOfClass:[NSString class]])
+	return NO;
+    }
+
+  return YES;
+}
+
+/* Fills 'rec' from mapped row 'row', returns its keyword list. */
+
+static NSArray *
+copy_record(PDPropertyCache *self, size_t row, PDPropertyCacheRecord *rec)
+{
+  NSArray *keywords = nil;
+
+  uint32_t present = self->_present[row];
+
+  memset(rec, 0, sizeof(*rec));
+
+  for (size_t i = 0; i < COLUMN_COUNT; i++)
+    {
+      if (!(present & (1U << i)))
+	continue;
+
+      const void *col = self->_columns[i];
+      void *field = (char *)rec + columns[i].record_offset;
+
+      switch (columns[i].type)
+	{
+	case column_int32:
+	  *(int32_t *)field = ((const int32_t *)col)[row];
+	  break;
+	case column_int64:
+	  *(int64_t *)field = ((const int64_t *)col)[row];
+	  break;
+	case column_double:
+	  *(double *)field = ((const double *)col)[row];
+	  break;
+	case column_strings:
+	  keywords = copy_string_list(self,
+				      ((const struct string_list *)col)[row]);
+	  continue;
+	}
+
+      rec->present |= 1U << i;
+    }
+
+  return keywords;
+}
+
+- (BOOL)getRecord:(PDPropertyCacheRecord *)rec keywords:(NSArray **)keywords
+    forFileId:(uint32_t)fid newerThan:(time_t)mtime
+{
+  BOOL ret = NO;
+  NSDictionary *dict = nil;
+  NSArray *list = nil;
+
+  pthread_rwlock_rdlock(&_lock);
+
+  PDPropertyCacheRow *row = _pending[@(fid)];
+
+  if (row != nil)
+    {
+      if (row->_stamp > mtime)
+	dict = row->_dict, ret = YES;
+    }
+  else
+    {
+      ssize_t idx = find_row(self, fid);
+      if (idx >= 0 && _stamps[idx] > mtime)
+	list = copy_record(self, idx, rec), ret = YES;
+    }
+
+  pthread_rwlock_unlock(&_lock);
+
+  if (dict != nil)
+    [PDPropertyCache getRecord:rec keywords:&list fromProperties:dict];
+
+  if (ret)
+    *keywords = list.count != 0 ? list : nil;
+
+  return ret;
+}
+
++ (void)getRecord:(PDPropertyCacheRecord *)rec keywords:(NSArray **)keywords
+    fromProperties:(NSDictionary *)dict
+{
+  memset(rec, 0, sizeof(*rec));
+  *keywords = nil;
+
+  for (size_t i = 0; i < COLUMN_COUNT; i++)
+    {
+      id value = dict[*columns[i].key];
+      if (value == nil || !valid_value(value, columns[i].type))
+	continue;
+
+      void *field = (char *)rec + columns[i].record_offset;
+
+      switch (columns[i].type)
+	{
+	case column_int32:
+	  *(int32_t *)field = [value intValue];
+	  break;
+	case column_int64:
+	  *(int64_t *)field = [value longLongValue];
+	  break;
+	case column_double:
+	  *(double *)field = [value doubleValue];
+	  break;
+	case column_strings:
+	  if ([value count] != 0)
+	    *keywords = value;
+	  continue;
+	}
+
+      rec->present |= 1U << i;
+    }
+}
+
++ (id)valueForKey:(NSString *)key inRecord:(const PDPropertyCacheRecord *)rec
+{
+  for (size_t i = 0; i < COLUMN_COUNT; i++)
+    {
+      NSString *ckey = *columns[i].key;
+
+      if (key != ckey && ![key isEqualToString:ckey])
+	continue;
+
+      if (!(rec->present & (1U << i)))
+	return nil;
+
+      const void *field = (const char *)rec + columns[i].record_offset;
+
+      switch (columns[i].type)
+	{
+	case column_int32:
+	  return @(*(const int32_t *)field);
+	case column_int64:
+	  return @(*(const int64_t *)field);
+	case column_double:
+	  return @(*(const double *)field);
+	case column_strings:
+	  return nil;
+	}
+    }
+
+  return nil;
+}
+
+- (void)setProperties:(NSDictionary *)dict forFileId:(uint32_t)fid
+{
+  NSMutableDictionary *values = [NSMutableDictionary dictionary];
+
+  for (size_t i = 0; i < COLUMN_COUNT; i++)
+    {
+      NSString *key = *columns[i].key;
+      id value = dict[key];
+      if (value != nil && valid_value(value, columns[i].type))
+	values[key] = value;
+    }
+
+  PDPropertyCacheRow *row = [[PDPropertyCacheRow alloc] init];
+  row->_stamp = time(NULL);
+  row->_dict = [values copy];
+
+  pthread_rwlock_wrlock(&_lock);
+
+  _pending[@(fid)] = row;
+  _dirty = YES;
+
+  pthread_rwlock_unlock(&_lock);
+}
+
+- (void)removePropertiesForFileIdsNotInSet:(NSIndexSet *)set
+{
+  pthread_rwlock_wrlock(&_lock);
+
+  for (size_t i = 0; i < _count; i++)
+    {
+      uint32_t fid = _fileIds[i];
+      if (![set containsIndex:fid] && ![_removed containsIndex:fid])
+	{
+	  [_removed addIndex:fid];
+	  _dirty = YES;
+	}
+    }
+
+  for (NSNumber *key in [_pending allKeys])
+    {
+      if (![set containsIndex:[key unsignedIntValue]])
+	{
+	  [_pending removeObjectForKey:key];
+	  _dirty = YES;
+	}
+    }
+
+  pthread_rwlock_unlock(&_lock);
+}
+
+static void
+append_strings(NSMutableData *pool, NSArray *array, struct string_list *list)
+{
+  list->offset = (uint32_t)pool.length;
+  list->count = 0;
+
+  for (NSString *str in array)
+    {
+      const char *s = str.UTF8String;
+      if (s == NULL)
+	continue;
+      [pool appendBytes:s length:strlen(s) + 1];
+      list->count++;
+    }
+}
+
+/* Stores the value of column 'i' from 'value' into row 'row' of the
+   column array 'col'. */
+
+static void
+store_value(void *col, size_t i, size_t row, id value, NSMutableData *pool)
+{
+  switch (columns[i].type)
+    {
+    case column_int32:
+      ((int32_t *)col)[row] = [value intValue];
+      break;
+    case column_int64:
+      ((int64_t *)col)[row] = [value longLongValue];
+      break;
+    case column_double:
+      ((double *)col)[row] = [value doubleValue];
+      break;
+    case column_strings:
+      append_strings(pool, value, &((struct string_list *)col)[row]);
+      break;
+    }
+}
+
+static int
+compare_file_ids(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* Called with the write lock held. */
+
+static NSData *
+copy_file_data(PDPropertyCache *self)
+{
+  /* Merge the live mapped rows with the pending rows. */
+
+  size_t n = 0;
+  uint32_t *ids = malloc((self->_count + self->_pending.count)
+			 * sizeof(uint32_t));
+  if (ids == NULL)
+    return nil;
+
+  for (size_t i = 0; i < self->_count; i++)
+    {
+      uint32_t fid = self->_fileIds[i];
+      if (![self->_removed containsIndex:fid] && self->_pending[@(fid)] == nil)
+	ids[n++] = fid;
+    }
+
+  for (NSNumber *key in self->_pending)
+    ids[n++] = [key unsignedIntValue];
+
+  qsort(ids, n, sizeof(uint32_t), compare_file_ids);
+
+  size_t size = (sizeof(struct cache_header)
+		 + array_size(n, sizeof(uint32_t)) * 2
+		 + array_size(n, sizeof(int64_t)));
+  for (size_t i = 0; i < COLUMN_COUNT; i++)
+    size += array_size(n, column_width(columns[i].type));
+
+  NSMutableData *data = [NSMutableData dataWithLength:size];
+  NSMutableData *pool = [NSMutableData data];
+
+  uint8_t *bytes = data.mutableBytes;
+  size_t offset = sizeof(struct cache_header);
+
+  uint32_t *fids = (void *)(bytes + offset);
+  offset += array_size(n, sizeof(uint32_t));
+  uint32_t *present = (void *)(bytes + offset);
+  offset += array_size(n, sizeof(uint32_t));
+  int64_t *stamps = (void *)(bytes + offset);
+  offset += array_size(n, sizeof(int64_t));
+
+  void *cols[COLUMN_COUNT];
+  for (size_t i = 0; i < COLUMN_COUNT; i++)
+    {
+      cols[i] = bytes + offset;
+      offset += array_size(n, column_width(columns[i].type));
+    }
+
+  for (size_t j = 0; j < n; j++)
+    {
+      uint32_t fid = ids[j];
+      fids[j] = fid;
+
+      PDPropertyCacheRow *row = self->_pending[@(fid)];
+      NSDictionary *dict;
+
+      if (row != nil)
+	{
+	  stamps[j] = row->_stamp;
+	  dict = row->_dict;
+	}
+      else
+	{
+	  ssize_t idx = find_row(self, fid);
+	  stamps[j] = self->_stamps[idx];
+	  dict = copy_row(self, idx);
+	}
+
+      uint32_t mask = 0;
+
+      for (size_t i = 0; i < COLUMN_COUNT; i++)
+	{
+	  id value = dict[*columns[i].key];
+	  if (value != nil)
+	    {
+	      store_value(cols[i], i, j, value, pool);
+	      mask |= 1U << i;
+	    }
+	}
+
+      present[j] = mask;
+    }
+
+  free(ids);
+
+  struct cache_header *h = (void *)bytes;
+  h->magic = CACHE_MAGIC;
+  h->version = CACHE_VERSION;
+  h->count = (uint32_t)n;
+  h->column_count = COLUMN_COUNT;
+  h->string_size = (uint32_t)pool.length;
+
+  [data appendData:pool];
+
+  return data;
+}
+
+- (void)synchronize
+{
+  pthread_rwlock_wrlock(&_lock);
+
+  if (_dirty)
+    {
+      @autoreleasepool
+	{
+	  NSData *data = copy_file_data(self);
+
+	  if ([data writeToFile:_path atomically:YES])
+	    {
+	      /* Switch to the new file, so the old one can be released
+		 and all rows are found by binary search again. */
+
+	      NSData *mapped = [NSData dataWithContentsOfFile:_path
+				options:NSDataReadingMappedAlways error:nil];
+
+	      unmap_data(self);
+	      if (mapped == nil || !map_data(self, mapped))
+		{
+		  unmap_data(self);
+		  map_data(self, data);
+		}
+
+	      [_removed removeAllIndexes];
+	      [_pending removeAllObjects];
+	      _dirty = NO;
+	    }
+	}
+    }
+
+  pthread_rwlock_unlock(&_lock);
+}
+
+@end
+
+@implementation PDPropertyCacheRow
+@end
@@ -0,0 +1,79 @@
+/* -*- c-style: gnu -*-
+
+   Copyright (c) 2013 John Harper <jsh@unfactored.org>
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE. */
+
+#import <Foundation/Foundation.h>
+
+/* Inverted index from the words of each image's name, title, caption,
+   keywords and file name to the file ids of the images containing
+   them, so that searching a library's text doesn't visit every image.
+   Words are case- and diacritic-folded. The index is stored in a
+   single file and loaded in full. All methods are thread-safe. */
+
+@interface PDTextIndex : NSObject
+
+/* Returns the distinct folded words of 'str'. */
+
++ (NSArray *)wordsOfString:(NSString *)str;
+
+/* Returns 'str' case- and diacritic-folded, as words are stored. */
+
++ (NSString *)foldedString:(NSString *)str;
+
+/* Loads the index file at 'path' if it exists and is valid, otherwise
+   creates an empty index that will be written to 'path'. */
+
+- (id)initWithPath:(NSString *)path;
+
+- (void)invalidate;
+
+/* Writes any changes back to the index file. */
+
+- (void)synchronize;
+
+/* Incremented by every change to the index. */
+
+@property(nonatomic, readonly) uint64_t generation;
+
+- (BOOL)hasWordsForFileId:(uint32_t)fid;
+
+/* Replaces the words of 'fid' with 'words', which must already be
+   folded. */
+
+- (void)setWords:(NSArray *)words forFileId:(uint32_t)fid;
+
+/* Adds 'words' to those of 'fid', e.g. once the image file's own
+   metadata has been read. */
+
+- (void)addWords:(NSArray *)words forFileId:(uint32_t)fid;
+
+/* Returns the ids of the files containing 'word' (already folded), or
+   a word starting with 'word' if 'prefix' is true. */
+
+- (NSIndexSet *)fileIdsMatchingWord:(NSString *)word prefix:(BOOL)prefix;
+
+/* Removes all files whose ids aren't in 'set'. */
+
+- (void)removeWordsForFileIdsNotInSet:(NSIndexSet *)set;
+
+@end
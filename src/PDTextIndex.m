@@ -0,0 +1,496 @@
+/* -*- c-style: gnu -*-
+
+   Copyright (c) 2013 John Harper <jsh@unfactored.org>
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE. */
+
+#import "PDTextIndex.h"
+
+#import <pthread.h>
+#import <stdatomic.h>
+#import <stdlib.h>
+#import <string.h>
+
+/* File layout: header, then for each word its UTF-8 length and the
+   number of files containing it, the UTF-8 bytes padded to a multiple
+   of four, then the (sorted) file ids. */
+
+#define INDEX_MAGIC 0x49544450		/* 'PDTI' */
+#define INDEX_VERSION 1
+
+struct index_header
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t word_count;
+  uint32_t padding;
+};
+
+struct word_header
+{
+  uint32_t length;
+  uint32_t count;
+};
+
+@implementation PDTextIndex
+{
+  NSString *_path;
+
+  pthread_rwlock_t _lock;
+
+  /* NSString -> NSMutableIndexSet<file-id> */
+
+  NSMutableDictionary *_words;
+
+  /* Ids of all files with words, so new files can be added without
+     searching every word's set. */
+
+  NSMutableIndexSet *_fileIds;
+
+  /* Keys of _words in sorted order, for prefix lookups, or nil after
+     a word has been added or removed. */
+
+  NSArray *_sortedWords;
+
+  /* Replacing a file's words means removing its id from every word's
+     set, so replacements are queued and applied together before the
+     next lookup. NSNumber<file-id> -> NSArray. */
+
+  NSMutableDictionary *_pending;
+
+  _Atomic(uint64_t) _generation;
+
+  BOOL _dirty;
+}
+
++ (NSString *)foldedString:(NSString *)str
+{
+  return [str stringByFoldingWithOptions:(NSCaseInsensitiveSearch
+					  | NSDiacriticInsensitiveSearch)
+	  locale:nil];
+}
+
++ (NSArray *)wordsOfString:(NSString *)str
+{
+  static NSCharacterSet *separators;
+  static dispatch_once_t once;
+
+  dispatch_once(&once, ^{
+    separators = [[NSCharacterSet alphanumericCharacterSet] invertedSet];
+  });
+
+  if (str.length == 0)
+    return @[];
+
+  NSArray *parts = [[self foldedString:str]
+		    componentsSeparatedByCharactersInSet:separators];
+
+  NSMutableOrderedSet *words = [NSMutableOrderedSet orderedSet];
+
+  for (NSString *part in parts)
+    {
+      if (part.length != 0)
+	[words addObject:part];
+    }
+
+  return words.array;
+}
+
+static BOOL
+load_data(PDTextIndex *self, NSData *data)
+{
+  const uint8_t *bytes = data.bytes;
+  size_t length = data.length;
+
+  if (length < sizeof(struct index_header))
+    return NO;
+
+  const struct index_header *h = (const void *)bytes;
+
+  if (h->magic != INDEX_MAGIC || h->version != INDEX_VERSION)
+    return NO;
+
+  size_t offset = sizeof(struct index_header);
+
+  NSMutableDictionary *words
+    = [NSMutableDictionary dictionaryWithCapacity:h->word_count];
+  NSMutableIndexSet *file_ids = [NSMutableIndexSet indexSet];
+
+  for (uint32_t i = 0; i < h->word_count; i++)
+    {
+      if (length - offset < sizeof(struct word_header))
+	return NO;
+
+      const struct word_header *w = (const void *)(bytes + offset);
+      offset += sizeof(struct word_header);
+
+      size_t str_size = (w->length + 3) & ~(size_t)3;
+      size_t ids_size = (size_t)w->count * sizeof(uint32_t);
+
+      if (length - offset < str_size + ids_size)
+	return NO;
+
+      NSString *str = [[NSString alloc] initWithBytes:bytes + offset
+		       length:w->length encoding:NSUTF8StringEncoding];
+      offset += str_size;
+
+      const uint32_t *ids = (const void *)(bytes + offset);
+      offset += ids_size;
+
+      if (str == nil)
+	return NO;
+
+      NSMutableIndexSet *set = [NSMutableIndexSet indexSet];
+      for (uint32_t j = 0; j < w->count;)
+	{
+	  uint32_t k = j + 1;
+	  while (k < w->count && ids[k] == ids[k - 1] + 1)
+	    k++;
+	  [set addIndexesInRange:NSMakeRange(ids[j], k - j)];
+	  j = k;
+	}
+
+      words[str] = set;
+      [file_ids addIndexes:set];
+    }
+
+  self->_words = words;
+  self->_fileIds = file_ids;
+
+  return YES;
+}
+
+- (id)initWithPath:(NSString *)path
+{
+  self = [super init];
+  if (self == nil)
+    return nil;
+
+  _path = [path copy];
+
+  pthread_rwlock_init(&_lock, NULL);
+
+  _pending = [[NSMutableDictionary alloc] init];
+
+  NSData *data = [NSData dataWithContentsOfFile:_path
+		  options:NSDataReadingMappedIfSafe error:nil];
+
+  if (data == nil || !load_data(self, data))
+    {
+      _words = [[NSMutableDictionary alloc] init];
+      _fileIds = [[NSMutableIndexSet alloc] init];
+      _dirty = data != nil;
+    }
+
+  return self;
+}
+
+- (void)invalidate
+{
+  pthread_rwlock_wrlock(&_lock);
+
+  [_words removeAllObjects];
+  [_fileIds removeAllIndexes];
+  [_pending removeAllObjects];
+  _sortedWords = nil;
+  _dirty = NO;
+  atomic_fetch_add(&_generation, 1);
+
+  pthread_rwlock_unlock(&_lock);
+}
+
+- (void)dealloc
+{
+  pthread_rwlock_destroy(&_lock);
+}
+
+- (uint64_t)generation
+{
+  return atomic_load(&_generation);
+}
+
+- (BOOL)hasWordsForFileId:(uint32_t)fid
+{
+  pthread_rwlock_rdlock(&_lock);
+
+  BOOL ret = [_fileIds containsIndex:fid];
+
+  pthread_rwlock_unlock(&_lock);
+
+  return ret;
+}
+
+/* Called with the write lock held. */
+
+static void
+add_words(PDTextIndex *self, NSArray *words, uint32_t fid)
+{
+  for (NSString *word in words)
+    {
+      NSMutableIndexSet *set = self->_words[word];
+      if (set == nil)
+	{
+	  set = [[NSMutableIndexSet alloc] init];
+	  self->_words[word] = set;
+	  self->_sortedWords = nil;
+	}
+      [set addIndex:fid];
+    }
+
+  [self->_fileIds addIndex:fid];
+}
+
+/* Removes the ids in 'set' from every word. Called with the write lock
+   held. */
+
+static void
+remove_file_ids(PDTextIndex *self, NSIndexSet *set)
+{
+  NSMutableArray *empty = [NSMutableArray array];
+
+  for (NSString *word in self->_words)
+    {
+      NSMutableIndexSet *word_set = self->_words[word];
+      [word_set removeIndexes:set];
+      if (word_set.count == 0)
+	[empty addObject:word];
+    }
+
+  if (empty.count != 0)
+    {
+      [self->_words removeObjectsForKeys:empty];
+      self->_sortedWords = nil;
+    }
+
+  [self->_fileIds removeIndexes:set];
+}
+
+/* Applies queued replacements. Called with the write lock held. */
+
+static void
+flush_pending(PDTextIndex *self)
+{
+  if (self->_pending.count == 0)
+    return;
+
+  NSMutableIndexSet *set = [NSMutableIndexSet indexSet];
+  for (NSNumber *key in self->_pending)
+    [set addIndex:[key unsignedIntValue]];
+
+  remove_file_ids(self, set);
+
+  for (NSNumber *key in self->_pending)
+    add_words(self, self->_pending[key], [key unsignedIntValue]);
+
+  [self->_pending removeAllObjects];
+}
+
+- (void)setWords:(NSArray *)words forFileId:(uint32_t)fid
+{
+  pthread_rwlock_wrlock(&_lock);
+
+  if ([_fileIds containsIndex:fid])
+    _pending[@(fid)] = [words copy];
+  else
+    add_words(self, words, fid);
+
+  _dirty = YES;
+  atomic_fetch_add(&_generation, 1);
+
+  pthread_rwlock_unlock(&_lock);
+}
+
+- (void)addWords:(NSArray *)words forFileId:(uint32_t)fid
+{
+  pthread_rwlock_wrlock(&_lock);
+
+  NSArray *pending = _pending[@(fid)];
+
+  if (pending != nil)
+    _pending[@(fid)] = [pending arrayByAddingObjectsFromArray:words];
+  else
+    add_words(self, words, fid);
+
+  _dirty = YES;
+  atomic_fetch_add(&_generation, 1);
+
+  pthread_rwlock_unlock(&_lock);
+}
+
+- (NSIndexSet *)fileIdsMatchingWord:(NSString *)word prefix:(BOOL)prefix
+{
+  pthread_rwlock_rdlock(&_lock);
+
+  if (_pending.count != 0 || (prefix && _sortedWords == nil))
+    {
+      /* Needs exclusive access first, other lookups don't. */
+
+      pthread_rwlock_unlock(&_lock);
+      pthread_rwlock_wrlock(&_lock);
+
+      flush_pending(self);
+
+      if (prefix && _sortedWords == nil)
+	{
+	  _sortedWords = [_words.allKeys sortedArrayUsingComparator:
+			  ^NSComparisonResult (id a, id b) {
+			    return [a compare:b options:NSLiteralSearch];
+			  }];
+	}
+    }
+
+  NSMutableIndexSet *set = [NSMutableIndexSet indexSet];
+
+  if (!prefix)
+    {
+      NSIndexSet *word_set = _words[word];
+      if (word_set != nil)
+	[set addIndexes:word_set];
+    }
+  else
+    {
+      /* Words starting with 'word' are contiguous from the first word
+	 not ordered before it. */
+
+      NSArray *sorted = _sortedWords;
+      NSInteger count = sorted.count;
+
+      NSInteger lo = [sorted indexOfObject:word inSortedRange:
+		      NSMakeRange(0, count) options:
+		      NSBinarySearchingFirstEqual
+		      | NSBinarySearchingInsertionIndex
+		      usingComparator:^NSComparisonResult (id a, id b) {
+			return [a compare:b options:NSLiteralSearch];
+		      }];
+
+      for (NSInteger i = lo; i < count; i++)
+	{
+	  NSString *str = sorted[i];
+	  if (![str hasPrefix:word])
+	    break;
+	  [set addIndexes:_words[str]];
+	}
+    }
+
+  pthread_rwlock_unlock(&_lock);
+
+  return set;
+}
+
+- (void)removeWordsForFileIdsNotInSet:(NSIndexSet *)set
+{
+  pthread_rwlock_wrlock(&_lock);
+
+  flush_pending(self);
+
+  NSMutableIndexSet *removed = [_fileIds mutableCopy];
+  [removed removeIndexes:set];
+
+  if (removed.count != 0)
+    {
+      remove_file_ids(self, removed);
+
+      _dirty = YES;
+      atomic_fetch_add(&_generation, 1);
+    }
+
+  pthread_rwlock_unlock(&_lock);
+}
+
+/* Called with the write lock held. */
+
+static NSData *
+copy_file_data(PDTextIndex *self)
+{
+  NSMutableData *data = [NSMutableData data];
+
+  struct index_header h = {0};
+  h.magic = INDEX_MAGIC;
+  h.version = INDEX_VERSION;
+  h.word_count = (uint32_t)self->_words.count;
+
+  [data appendBytes:&h length:sizeof(h)];
+
+  uint32_t *ids = NULL;
+  size_t ids_size = 0;
+
+  for (NSString *word in self->_words)
+    {
+      NSIndexSet *set = self->_words[word];
+      const char *str = word.UTF8String;
+
+      struct word_header w;
+      w.length = (uint32_t)strlen(str);
+      w.count = (uint32_t)set.count;
+
+      [data appendBytes:&w length:sizeof(w)];
+      [data appendBytes:str length:w.length];
+
+      static const char zero[4];
+      if (w.length & 3)
+	[data appendBytes:zero length:4 - (w.length & 3)];
+
+      if (w.count > ids_size)
+	{
+	  uint32_t *new_ids = realloc(ids, w.count * sizeof(uint32_t));
+	  if (new_ids == NULL)
+	    {
+	      free(ids);
+	      return nil;
+	    }
+	  ids = new_ids;
+	  ids_size = w.count;
+	}
+
+      __block size_t n = 0;
+      [set enumerateIndexesUsingBlock:^(NSUInteger idx, BOOL *stop) {
+	ids[n++] = (uint32_t)idx;
+      }];
+
+      [data appendBytes:ids length:n * sizeof(uint32_t)];
+    }
+
+  free(ids);
+
+  return data;
+}
+
+- (void)synchronize
+{
+  pthread_rwlock_wrlock(&_lock);
+
+  if (_dirty)
+    {
+      @autoreleasepool
+	{
+	  flush_pending(self);
+
+	  NSData *data = copy_file_data(self);
+
+	  if ([data writeToFile:_path atomically:YES])
+	    _dirty = NO;
+	}
+    }
+
+  pthread_rwlock_unlock(&_lock);
+}
+
+@end
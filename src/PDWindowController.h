@@ -25,6 +25,18 @@
 #import <AppKit/AppKit.h>
 
 extern NSString *const PDImageListDidChange;
+
+/* Keys of the PDImageListDidChange userInfo dictionary, present when
+   the filtered list was updated incrementally (see
+   -rebuildImageListForImages:flags:). Without them, observers should
+   assume the whole list changed. Removed indexes are relative to the
+   old list, inserted indexes to the new list. Moved maps old to new
+   indexes for images that stayed in the list but changed position.
+   The indexes of all other images shift implicitly. */
+
+extern NSString *const PDImageListRemovedIndexes;	/* NSIndexSet */
+extern NSString *const PDImageListInsertedIndexes;	/* NSIndexSet */
+extern NSString *const PDImageListMovedIndexes;	/* NSDictionary */
 extern NSString *const PDSelectionDidChange;
 extern NSString *const PDShowsHiddenImagesDidChange;
 extern NSString *const PDImagePredicateDidChange;
@@ -60,7 +72,7 @@ enum PDWindowControllerRebuildImageListFlags
 };
 
 @class PDViewController, PDPredicatePanelController;
-@class PDSplitView, PDImage, PDImageLibrary;
+@class PDSplitView, PDImage, PDImageIndex, PDImageLibrary;
 
 @interface PDWindowController : NSWindowController <NSSplitViewDelegate>
 
@@ -78,6 +90,8 @@ enum PDWindowControllerRebuildImageListFlags
 
 @property(nonatomic, assign) BOOL showsHiddenImages;
 
+@property(nonatomic, readonly) PDImageIndex *imageIndex;
+
 - (BOOL)foreachImage:(void (^)(PDImage *, BOOL *stop))thunk;
 
 /* Setting the 'imageList' doesn't call -rebuildImageList implicitly,
@@ -101,11 +115,28 @@ enum PDWindowControllerRebuildImageListFlags
 
 /* Setting the sort key or image predicate does not change the result
    of filteredImageList, this method must be called explicitly. (But
-   setting imageList does filter and sort the new array.) */
+   setting imageList does filter and sort the new array.) Large lists
+   are filtered and sorted on a background queue, filteredImageList
+   changes (and PDImageListDidChange is posted) once that finishes,
+   unless the list has been rebuilt again meanwhile. */
 
 - (void)rebuildImageList:(uint32_t)flags;
 - (void)rebuildImageListIfPreserving;
 
+/* Calls -rebuildImageList: after a short delay, so that a series of
+   changes (e.g. typing in the search field) only rebuilds the list
+   once, with the latest predicate. Calling -rebuildImageList: first
+   cancels the deferred rebuild. */
+
+- (void)setNeedsRebuildImageList:(uint32_t)flags;
+
+/* Equivalent to -rebuildImageList: after properties of 'images' have
+   changed (e.g. their ratings), but only re-filters those images, and
+   inserts the ones that pass into the existing sorted list. Images
+   that aren't in 'imageList' are ignored. */
+
+- (void)rebuildImageListForImages:(NSSet *)images flags:(uint32_t)flags;
+
 @property(nonatomic, copy) NSIndexSet *selectedImageIndexes;
 @property(nonatomic, assign) NSInteger primarySelectionIndex;
 - (void)setSelectedImageIndexes:(NSIndexSet *)set primary:(NSInteger)idx;
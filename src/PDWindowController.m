@@ -29,7 +29,9 @@
 #import "PDColor.h"
 #import "PDFoundationExtensions.h"
 #import "PDImage.h"
+#import "PDImageIndex.h"
 #import "PDImageLibrary.h"
+#import "PDImageProperty.h"
 #import "PDImageViewController.h"
 #import "PDImageListViewController.h"
 #import "PDImportViewController.h"
@@ -39,7 +41,18 @@
 #import "PDLibraryViewController.h"
 #import "PDPredicatePanelController.h"
 
+/* Images are filtered in chunks of this many on concurrent queues. */
+
+#define FILTER_CHUNK_SIZE 4096
+
+/* Seconds to wait for further changes before a deferred rebuild. */
+
+#define REBUILD_DELAY .05
+
 NSString *const PDImageListDidChange = @"PDImageListDidChange";
+NSString *const PDImageListRemovedIndexes = @"removedIndexes";
+NSString *const PDImageListInsertedIndexes = @"insertedIndexes";
+NSString *const PDImageListMovedIndexes = @"movedIndexes";
 NSString *const PDSelectionDidChange = @"PDSelectionDidChange";
 NSString *const PDShowsHiddenImagesDidChange = @"PDShowsHiddenImagesDidChange";
 NSString *const PDImagePredicateDidChange = @"PDImagePredicateDidChange";
@@ -50,10 +63,18 @@ NSString *const PDTrashWasEmptied = @"PDTrashWasEmptied";
 @implementation PDWindowController
 {
   PDPredicatePanelController *_predicatePanelController;
+  PDImagePredicateBlock _compiledImagePredicate;
 
   NSMutableArray *_viewControllers;
 
+  NSMapTable *_imageIndexes;		/* PDImage -> index in _imageList,
+					   created lazily */
+
   BOOL _filteredImageListIsPreservingImages;
+
+  uint32_t _pendingRebuildFlags;	/* for -setNeedsRebuildImageList: */
+  NSUInteger _rebuildGeneration;
+  BOOL _rebuildingImageList;		/* on a background queue */
 }
 
 @synthesize splitView = _splitView;
@@ -435,7 +456,13 @@ wasFirstResponder(NSView *view)
 - (void)predicateDidChange:(NSNotification *)note
 {
   self.imagePredicate = _predicatePanelController.predicate;
-  [self rebuildImageList:PDWindowController_StopPreservingImages];
+  [self setNeedsRebuildImageList:PDWindowController_StopPreservingImages];
+}
+
+- (PDImageIndex *)imageIndex
+{
+  return [(PDLibraryViewController *)[self viewControllerWithClass:
+	  [PDLibraryViewController class]] imageIndex];
 }
 
 - (BOOL)foreachImage:(void (^)(PDImage *im, BOOL *stop))thunk;
@@ -460,6 +487,7 @@ wasFirstResponder(NSView *view)
   if (![_imageList isEqual:array])
     {
       _imageList = [array copy];
+      _imageIndexes = nil;
     }
 }
 
@@ -493,6 +521,7 @@ wasFirstResponder(NSView *view)
   if (_imagePredicate != pred)
     {
       _imagePredicate = [pred copy];
+      _compiledImagePredicate = PDImageCompilePredicate(_imagePredicate);
 
       _predicatePanelController.predicate = _imagePredicate;
 
@@ -523,54 +552,337 @@ wasFirstResponder(NSView *view)
     }
 }
 
-- (void)rebuildImageList:(uint32_t)flags
+/* Filters and sorts 'image_list', concurrently for large lists.
+   Called off the main thread for lists larger than a chunk, so each
+   chunk of images is read between +[PDImage beginReadingProperties]
+   and +endReadingProperties, and so is the sort. Evaluating the
+   predicate may fault in an image's properties (writing its
+   _implicitProperties, _fileId and _date), which is only safe because
+   no image is in the list twice, so each is only touched by one
+   worker. The image list must stay unique (see
+   -[PDLibraryViewController updateImageList:]). */
+
+static NSArray *
+filter_and_sort_images(NSArray *image_list, PDImagePredicateBlock pred,
+		       BOOL includes_rejected, NSSet *preserved_set,
+		       PDImageCompareKey sort_key, BOOL reversed,
+		       BOOL *preserving_ptr)
 {
-  NSArray *selected_images = [self.selectedImages copy];
-  PDImage *primary_image = self.primarySelectedImage;
+  size_t count = image_list.count;
+
+  __unsafe_unretained PDImage **images
+    = (__unsafe_unretained PDImage **)malloc(MAX(count, 1) * sizeof(id));
+  [image_list getObjects:images range:NSMakeRange(0, count)];
+
+  BOOL *included = malloc(MAX(count, 1) * sizeof(BOOL));
+
+  dispatch_apply((count + FILTER_CHUNK_SIZE - 1) / FILTER_CHUNK_SIZE,
+		 dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0),
+		 ^(size_t c)
+    {
+      size_t end = MIN((c + 1) * FILTER_CHUNK_SIZE, count);
+
+      [PDImage beginReadingProperties];
+
+      @autoreleasepool
+	{
+	  for (size_t i = c * FILTER_CHUNK_SIZE; i < end; i++)
+	    {
+	      /* Implicit predicate is "rating >= 0" (i.e.
+		 not-rejected). */
+
+	      PDImage *image = images[i];
+	      included[i] = (pred != nil ? pred(image)
+			     : (includes_rejected ? YES : image.rating >= 0));
+	    }
+	}
+
+      [PDImage endReadingProperties];
+    });
 
   NSMutableArray *array = [NSMutableArray array];
+  BOOL preserving = NO;
+
+  for (size_t i = 0; i < count; i++)
+    {
+      PDImage *image = images[i];
+
+      if (included[i])
+	[array addObject:image];
+      else if ([preserved_set containsObject:image])
+	{
+	  [array addObject:image];
+	  preserving = YES;
+	}
+    }
+
+  free(included);
+  free(images);
+
+  [PDImage beginReadingProperties];
+
+  NSArray *sorted = [PDImage sortedImages:array usingKey:sort_key
+		     reversed:reversed];
+
+  [PDImage endReadingProperties];
+
+  *preserving_ptr = preserving;
+  return sorted;
+}
+
+- (void)rebuildImageList:(uint32_t)flags
+{
+  /* Subsumes any deferred rebuild. */
+
+  flags |= _pendingRebuildFlags;
+  _pendingRebuildFlags = 0;
+
+  NSUInteger generation = ++_rebuildGeneration;
 
   if (_filteredImageListIsPreservingImages
       && !(flags & PDWindowController_StopPreservingImages))
     flags |= PDWindowController_PreserveSelectedImages;
 
-  _filteredImageListIsPreservingImages = NO;
+  NSSet *preserved_set = nil;
+  if (flags & PDWindowController_PreserveSelectedImages)
+    preserved_set = [NSSet setWithArray:self.selectedImages];
+
+  NSArray *image_list = _imageList;
+  PDImagePredicateBlock pred = _compiledImagePredicate;
+  BOOL includes_rejected = _nilPredicateIncludesRejected;
+  PDImageCompareKey sort_key = _imageSortKey;
+  BOOL reversed = _imageSortReversed;
+
+  void (^swap_list)(NSArray *, BOOL) = ^(NSArray *sorted, BOOL preserving)
+    {
+      /* Drop results superseded by a later rebuild. */
+
+      if (_rebuildGeneration != generation)
+	return;
+
+      _rebuildingImageList = NO;
+      _filteredImageListIsPreservingImages = preserving;
+
+      if (![sorted isEqual:_filteredImageList])
+	{
+	  NSArray *selected_images = [self.selectedImages copy];
+	  PDImage *primary_image = self.primarySelectedImage;
+
+	  _filteredImageList = [sorted copy];
+
+	  [[NSNotificationCenter defaultCenter]
+	   postNotificationName:PDImageListDidChange object:self];
+
+	  [self setSelectedImages:selected_images primary:primary_image];
+	}
+    };
+
+  /* Small lists aren't worth the round trip, and rebuilding them
+     synchronously doesn't briefly show the previous list. */
+
+  if (image_list.count <= FILTER_CHUNK_SIZE)
+    {
+      BOOL preserving = NO;
+      NSArray *sorted = filter_and_sort_images(image_list, pred,
+			  includes_rejected, preserved_set, sort_key,
+			  reversed, &preserving);
+      swap_list(sorted, preserving);
+      return;
+    }
+
+  /* Otherwise filter and sort on a background queue, so the UI stays
+     responsive, and swap the new list in on the main thread, unless
+     another rebuild has started meanwhile. */
+
+  _rebuildingImageList = YES;
+
+  dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^
+    {
+      BOOL preserving = NO;
+      NSArray *sorted = filter_and_sort_images(image_list, pred,
+			  includes_rejected, preserved_set, sort_key,
+			  reversed, &preserving);
+
+      dispatch_async(dispatch_get_main_queue(), ^
+	{
+	  swap_list(sorted, preserving);
+	});
+    });
+}
+
+- (void)setNeedsRebuildImageList:(uint32_t)flags
+{
+  _pendingRebuildFlags |= flags;
+
+  NSUInteger generation = ++_rebuildGeneration;
+
+  dispatch_after(dispatch_time(DISPATCH_TIME_NOW,
+			       (int64_t)(REBUILD_DELAY * NSEC_PER_SEC)),
+		 dispatch_get_main_queue(), ^
+    {
+      if (_rebuildGeneration == generation)
+	[self rebuildImageList:0];
+    });
+}
+
+- (void)rebuildImageListForImages:(NSSet *)changed flags:(uint32_t)flags
+{
+  if ((flags & PDWindowController_StopPreservingImages)
+      || _rebuildingImageList)
+    {
+      /* Every image needs to be filtered again, or a rebuild is in
+	 progress and may not have seen the changes, so replace it. */
+
+      [self rebuildImageList:flags];
+      return;
+    }
+
+  if (_filteredImageListIsPreservingImages)
+    flags |= PDWindowController_PreserveSelectedImages;
+
+  if (_imageIndexes == nil)
+    {
+      _imageIndexes = [NSMapTable strongToStrongObjectsMapTable];
+      NSInteger i = 0;
+      for (PDImage *image in _imageList)
+	[_imageIndexes setObject:@(i++) forKey:image];
+    }
+
+  NSMapTable *image_indexes = _imageIndexes;
 
-  for (PDImage *image in _imageList)
+  NSArray *selected_images = [self.selectedImages copy];
+  PDImage *primary_image = self.primarySelectedImage;
+
+  NSSet *preserved_set = nil;
+  if (flags & PDWindowController_PreserveSelectedImages)
+    preserved_set = [NSSet setWithArray:selected_images];
+
+  /* Remove the changed images from the sorted list, remembering where
+     they were. */
+
+  NSArray *old_list = _filteredImageList;
+  NSMutableArray *rest = [NSMutableArray arrayWithCapacity:old_list.count];
+  NSMapTable *old_indexes = [NSMapTable strongToStrongObjectsMapTable];
+
+  NSInteger idx = 0;
+  for (PDImage *image in old_list)
     {
-      /* Implicit predicate is "rating >= 0" (i.e. not-rejected). */
+      if ([changed containsObject:image])
+	[old_indexes setObject:@(idx) forKey:image];
+      else
+	[rest addObject:image];
+      idx++;
+    }
+
+  /* Filter the changed images, as -rebuildImageList: does. This is
+     on the main thread, so doesn't need to lock the properties. */
+
+  NSMutableArray *added = [NSMutableArray array];
 
-      BOOL included = (_imagePredicate != nil
-	  ? [_imagePredicate evaluateWithObject:image.expressionValues]
+  for (PDImage *image in changed)
+    {
+      if ([image_indexes objectForKey:image] == nil)
+	continue;
+
+      BOOL included = (_compiledImagePredicate != nil
+	  ? _compiledImagePredicate(image)
 	  : (_nilPredicateIncludesRejected ? YES : image.rating >= 0));
 
-      if (!included && (flags & PDWindowController_PreserveSelectedImages)
-	  && [selected_images indexOfObjectIdenticalTo:image] != NSNotFound)
+      if (!included && [preserved_set containsObject:image])
 	{
 	  included = YES;
 	  _filteredImageListIsPreservingImages = YES;
 	}
-      
+
       if (included)
-	{
-	  [array addObject:image];
-	}
+	[added addObject:image];
     }
 
-  [PDImage callWithImageComparator:_imageSortKey reversed:_imageSortReversed
-   block:^(NSComparator cmp) {
-     [array sortUsingComparator:cmp];
-   }];
+  if (old_indexes.count == 0 && added.count == 0)
+    return;
 
-  if (![array isEqual:_filteredImageList])
+  /* The full sort is stable, so images that compare equal stay in
+     their image list order. Sort the changed images the same way,
+     and break ties by that order when merging them. */
+
+  [added sortUsingComparator:^(id obj1, id obj2)
     {
-      _filteredImageList = [array copy];
+      return [[image_indexes objectForKey:obj1]
+	      compare:[image_indexes objectForKey:obj2]];
+    }];
 
-      [[NSNotificationCenter defaultCenter]
-       postNotificationName:PDImageListDidChange object:self];
+  NSArray *sorted = [PDImage sortedImages:added usingKey:_imageSortKey
+		     reversed:_imageSortReversed];
 
-      [self setSelectedImages:selected_images primary:primary_image];
-    }
+  /* Merge the two sorted lists, binary searching for the position of
+     each changed image. */
+
+  NSMutableArray *new_list
+    = [NSMutableArray arrayWithCapacity:rest.count + sorted.count];
+  NSMutableIndexSet *inserted = [NSMutableIndexSet indexSet];
+  NSMutableIndexSet *removed = [NSMutableIndexSet indexSet];
+  NSMutableDictionary *moved = [NSMutableDictionary dictionary];
+
+  [PDImage callWithImageComparator:_imageSortKey reversed:_imageSortReversed
+   block:^(NSComparator cmp)
+    {
+      NSInteger start = 0, count = rest.count;
+
+      for (PDImage *image in sorted)
+	{
+	  NSInteger lo = start, hi = count;
+	  while (lo < hi)
+	    {
+	      NSInteger mid = (lo + hi) / 2;
+	      NSComparisonResult ret = cmp(rest[mid], image);
+	      if (ret == NSOrderedSame)
+		{
+		  ret = [[image_indexes objectForKey:rest[mid]]
+			 compare:[image_indexes objectForKey:image]];
+		}
+	      if (ret == NSOrderedDescending)
+		hi = mid;
+	      else
+		lo = mid + 1;
+	    }
+
+	  [new_list addObjectsFromArray:
+	   [rest subarrayWithRange:NSMakeRange(start, lo - start)]];
+	  start = lo;
+
+	  NSInteger new_idx = new_list.count;
+	  [new_list addObject:image];
+
+	  NSNumber *old_idx = [old_indexes objectForKey:image];
+	  if (old_idx != nil)
+	    {
+	      if ([old_idx integerValue] != new_idx)
+		moved[old_idx] = @(new_idx);
+	      [old_indexes removeObjectForKey:image];
+	    }
+	  else
+	    [inserted addIndex:new_idx];
+	}
+
+      [new_list addObjectsFromArray:
+       [rest subarrayWithRange:NSMakeRange(start, count - start)]];
+    }];
+
+  for (PDImage *image in old_indexes)
+    [removed addIndex:[[old_indexes objectForKey:image] integerValue]];
+
+  if (inserted.count == 0 && removed.count == 0 && moved.count == 0)
+    return;
+
+  _filteredImageList = [new_list copy];
+
+  [[NSNotificationCenter defaultCenter]
+   postNotificationName:PDImageListDidChange object:self
+   userInfo:@{PDImageListRemovedIndexes: removed,
+	      PDImageListInsertedIndexes: inserted,
+	      PDImageListMovedIndexes: moved}];
+
+  [self setSelectedImages:selected_images primary:primary_image];
 }
 
 - (void)rebuildImageListIfPreserving
@@ -1351,15 +1663,28 @@ static const int rotate_right_map[8] = {6, 7, 8, 5, 2, 3, 4, 1};
    performVoidSelector:_cmd withObject:sender];
 }
 
+static NSPredicate *
+deleted_images_predicate(void)
+{
+  static NSPredicate *pred;
+  static dispatch_once_t once;
+
+  dispatch_once(&once, ^
+    {
+      pred = [NSPredicate predicateWithFormat:@"%K == YES", PDImage_Deleted];
+    });
+
+  return pred;
+}
+
 - (IBAction)emptyTrashAction:(id)sender
 {
   NSMutableArray *images = [NSMutableArray array];
 
-  [self foreachImage:^
-    (PDImage *image, BOOL *stop)
+  [self.imageIndex foreachImageMatchingPredicate:deleted_images_predicate()
+   usingBlock:^(PDImage *image, BOOL *stop)
     {
-      if (image.deleted)
-	[images addObject:image];
+      [images addObject:image];
     }];
 
   if (images.count != 0)
@@ -1377,9 +1702,9 @@ static const int rotate_right_map[8] = {6, 7, 8, 5, 2, 3, 4, 1};
 
 - (BOOL)isTrashEmpty
 {
-  return [self foreachImage:^(PDImage *image, BOOL *stop) {
-    if (image.deleted)
-      *stop = YES;
+  return [self.imageIndex foreachImageMatchingPredicate:
+	  deleted_images_predicate() usingBlock:^(PDImage *image, BOOL *stop) {
+    *stop = YES;
   }];
 }
 